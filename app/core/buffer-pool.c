@@ -0,0 +1,134 @@
+//
+// Created by dingjing on 8/26/22.
+//
+
+#include "buffer-pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+struct _BufferPool
+{
+    char*                   base;
+    size_t                  mapSize;
+    size_t                  bufSize;
+    size_t                  nBufs;
+    size_t                  nFree;
+    void**                  freeList;               // 空闲缓冲区的栈, 最近归还的先取出, 还在缓存里
+    pthread_mutex_t         mutex;
+};
+
+BufferPool* buffer_pool_create (size_t bufSize, size_t nBufs)
+{
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    BufferPool* pool;
+    size_t i;
+    int ret;
+
+    if (bufSize == 0 || nBufs == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pool = (BufferPool*) malloc(sizeof (BufferPool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->bufSize = (bufSize + pageSize - 1) / pageSize * pageSize;
+    pool->nBufs = nBufs;
+    pool->nFree = nBufs;
+    pool->mapSize = pool->bufSize * nBufs;
+    pool->freeList = (void**) malloc(nBufs * sizeof (void*));
+    if (pool->freeList) {
+        pool->base = (char*) mmap(NULL, pool->mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool->base != MAP_FAILED) {
+            ret = pthread_mutex_init(&pool->mutex, NULL);
+            if (ret == 0) {
+                for (i = 0; i < nBufs; i++) {
+                    pool->freeList[i] = pool->base + (nBufs - 1 - i) * pool->bufSize;
+                }
+
+                return pool;
+            }
+
+            errno = ret;
+            munmap(pool->base, pool->mapSize);
+        }
+
+        free(pool->freeList);
+    }
+
+    free(pool);
+
+    return NULL;
+}
+
+void buffer_pool_destroy (BufferPool* pool)
+{
+    pthread_mutex_destroy(&pool->mutex);
+    munmap(pool->base, pool->mapSize);
+    free(pool->freeList);
+    free(pool);
+}
+
+void* buffer_pool_get (BufferPool* pool)
+{
+    void* buf = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->nFree > 0) {
+        buf = pool->freeList[--pool->nFree];
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!buf) {
+        errno = ENOBUFS;
+    }
+
+    return buf;
+}
+
+void buffer_pool_put (void* buf, BufferPool* pool)
+{
+    size_t off = (char*) buf - pool->base;
+
+    if ((char*) buf < pool->base || off >= pool->mapSize || off % pool->bufSize != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->nFree < pool->nBufs) {
+        pool->freeList[pool->nFree++] = buf;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void* buffer_pool_base (BufferPool* pool)
+{
+    return pool->base;
+}
+
+size_t buffer_pool_buf_size (BufferPool* pool)
+{
+    return pool->bufSize;
+}
+
+size_t buffer_pool_count (BufferPool* pool)
+{
+    return pool->nBufs;
+}
+
+size_t buffer_pool_free_count (BufferPool* pool)
+{
+    size_t n;
+
+    pthread_mutex_lock(&pool->mutex);
+    n = pool->nFree;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return n;
+}
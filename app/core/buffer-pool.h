@@ -0,0 +1,35 @@
+//
+// Created by dingjing on 8/26/22.
+//
+
+#ifndef JARVIS_BUFFER_POOL_H
+#define JARVIS_BUFFER_POOL_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _BufferPool          BufferPool;
+
+/**
+ * @brief
+ *  页对齐的定长缓冲区池, 给 O_DIRECT 读写用. 所有缓冲区在一块连续内存里,
+ *  可以整体注册给 IOService 作为 io_uring 的固定缓冲区. 取空时不等待, 返回 NULL 且 errno 为 ENOBUFS.
+ */
+BufferPool* buffer_pool_create (size_t bufSize, size_t nBufs);     // bufSize 向上对齐到页大小
+void buffer_pool_destroy (BufferPool* pool);
+
+void* buffer_pool_get (BufferPool* pool);
+void buffer_pool_put (void* buf, BufferPool* pool);                 // 不是池里的缓冲区时忽略
+
+void* buffer_pool_base (BufferPool* pool);
+size_t buffer_pool_buf_size (BufferPool* pool);
+size_t buffer_pool_count (BufferPool* pool);
+size_t buffer_pool_free_count (BufferPool* pool);
+
+#ifdef __cplusplus
+};
+#endif
+#endif //JARVIS_BUFFER_POOL_H
@@ -1,6 +1,9 @@
 //
 // Created by dingjing on 8/11/22.
 //
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 
 #include "c-poll.h"
 
@@ -11,25 +14,153 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sched.h>
 #include <pthread.h>
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
 #include <sys/timerfd.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <linux/errqueue.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#  define C_POLL_URING                  1
+# endif
+#endif
 
 #include "c-list.h"
 #include "c-poll.h"
 #include "rb-tree.h"
+#include "slab.h"
+#include "timer-wheel.h"
 #include "../common/c-log.h"
 
 #define C_POLL_BUF_SIZE			    (256 * 1024)
 #define C_POLL_EVENTS_MAX		     256
 
+#define C_POLL_WAKE                 ((CPollNode*)1)             // 管道中的唤醒标记, 不对应任何节点
+
+#define C_POLL_GAP_MAX              1000000                     // 事件间隔按微秒计, 超过 1 秒按 1 秒算
+#define C_POLL_COUNT(x)             __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+
 typedef struct _CPollNode           CPollNode;
 
+/* MSG_ZEROCOPY 直接用 sendmsg() 发送, 和 io_uring 无关, 只看头文件是否支持 */
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+# define C_POLL_ZEROCOPY             1
+#endif
+
+#ifdef C_POLL_URING
+#define C_POLL_URING_SQ_ENTRIES      4096
+#define C_POLL_URING_CQ_ENTRIES      16384
+#define C_POLL_URING_BUF_COUNT       256                        // 必须是 2 的幂
+#define C_POLL_URING_BUF_SIZE        (16 * 1024)
+#define C_POLL_URING_BUF_GROUP       0
+
+/**
+ * user_data 布局:
+ *  [0, 32)  fd
+ *  [32, 56) 代数(generation), 每次取消 fd 上的请求都会递增, 用来丢弃过期的 CQE
+ *  [56, 62) PD_OP_*
+ *  [62, 64) 类型
+ */
+#define URING_UD_FD_MASK            0xffffffffULL
+#define URING_UD_GEN_SHIFT          32
+#define URING_UD_GEN_MASK           0xffffffU
+#define URING_UD_OP_SHIFT           56
+#define URING_UD_OP_MASK            0x3fU
+#define URING_UD_KIND_MASK          (3ULL << 62)
+#define URING_UD_NODE               (0ULL << 62)                // fd 上的 multishot 请求
+#define URING_UD_TIMEOUT            (1ULL << 62)                // 链接在请求后的 IORING_OP_LINK_TIMEOUT
+#define URING_UD_CARRY              (2ULL << 62)                // 投递暂存数据的 NOP
+#define URING_UD_INTERNAL           (3ULL << 62)                // 管道, timerfd, 取消请求等
+
+#define URING_INTERNAL_IGNORE       0
+#define URING_INTERNAL_PIPE         1
+#define URING_INTERNAL_TIMER        2
+
+typedef struct _CPollUring          CPollUring;
+typedef struct _CPollUringGen       CPollUringGen;
+typedef struct _CPollUringCarry     CPollUringCarry;
+typedef struct _CPollUringBacklog   CPollUringBacklog;
+
+struct _CPollUringGen
+{
+    unsigned                    gen;                        // 当前代数
+    unsigned                    delGen;                     // 小于此代数的请求属于已删除的注册
+    int                         op;                         // 当前请求的 PD_OP_*
+};
+
+/**
+ * @brief
+ *  poll_mod 取消 multishot recv 时, 内核可能已经把数据收进了缓冲区,
+ *  这些数据暂存在这里, 等 fd 再次注册为读时投递, 避免丢失
+ */
+struct _CPollUringCarry
+{
+    struct list_head            list;
+    int                         fd;
+    size_t                      size;
+    char                        data[0];
+};
+
+/**
+ * @brief
+ *  SQ 满时, 非 poll 线程提交的 sqe 暂存于此, 由 poll 线程按序搬入 SQ
+ */
+struct _CPollUringBacklog
+{
+    struct io_uring_sqe         sqe;
+    struct __kernel_timespec    ts;
+};
+
+struct _CPollUring
+{
+    unsigned*                   sqHead;
+    unsigned*                   sqTail;
+    unsigned*                   sqMask;
+    unsigned*                   sqArray;
+    unsigned                    sqEntries;
+    struct io_uring_sqe*        sqes;
+
+    unsigned*                   cqHead;
+    unsigned*                   cqTail;
+    unsigned*                   cqMask;
+    struct io_uring_cqe*        cqes;
+
+    void*                       sqRing;
+    size_t                      sqRingSize;
+    void*                       cqRing;
+    size_t                      cqRingSize;
+    size_t                      sqesSize;
+
+    unsigned                    toSubmit;                   // 已写入 SQ 但尚未提交的 sqe 数
+    int                         wakePending;                // 已向管道写入唤醒标记
+    struct __kernel_timespec*   ts;                         // 与 sqe 一一对应, 内核在提交时读取
+
+    CPollUringBacklog*          backlog;
+    unsigned                    backlogSize;
+    unsigned                    backlogMax;
+
+    struct io_uring_buf_ring*   bufRing;                    // multishot recv 使用的 provided buffers
+    size_t                      bufRingSize;
+    char*                       bufs;
+    unsigned short              bufTail;
+
+    CPollUringGen*              gens;
+    struct list_head            carryList;
+};
+#endif
+
 struct _CPollNode
 {
     int                     state;
@@ -39,10 +170,16 @@ struct _CPollNode
     union {
         struct list_head    list;
         RBNode              rb;
+        TimerWheelNode      wheel;
     };
 #pragma pack()
     char                    inRBTree;
+    char                    inWheel;
     char                    removed;
+    char                    timeoutLinked;              // io_uring: 超时由链接的 IORING_OP_LINK_TIMEOUT 负责
+    char                    zerocopy;                   // 0 未设置, 1 已打开 SO_ZEROCOPY, -1 连接不支持
+    unsigned int            zerocopyPending;            // 已发出还没收到完成通知的 MSG_ZEROCOPY 发送
+    int                     zerocopyError;              // 发送出错时还有完成通知没到, 先记下 errno, 通知到齐再回调
     int                     event;
     struct timespec         timeout;                    // 超时返回,
     CPollNode*              res;
@@ -64,27 +201,573 @@ struct _CPoll
     int                     pipeWr;                     // 管道 写
 
     int                     stopped;                    // 启动/停止标志
+    int                     engine;                     // CPOLL_ENGINE_*
+    int                     cpu;                        // poll 线程绑定的核, -1 不绑定
 
-    RBRoot                  timeoutTree;
+    int                     spinBudget;                 // 见 CPollSpin, 其它线程可以随时修改
+    int                     sockBusyPoll;
+    size_t                  zerocopyThreshold;          // 见 poll_set_zerocopy(), 其它线程可以随时修改
+    long                    eventGap;                   // 最近有事件的两次等待之间的平均间隔 (微秒)
+    struct timespec         lastEvent;
+    CPollStats              stats;                      // 只有 poll 线程写
+
+    RBRoot                  timeoutTree;                // 定时器 (poll_add_timer), 按精确时间
     RBNode*                 treeFirst;
     RBNode*                 treeLast;
 
-    struct list_head        timeoutList;
+    TimerWheel              timeoutWheel;               // fd 超时, 毫秒精度
+    struct timespec         timerArmed;                 // timerfd 当前设置的时间, 0 表示未设置或已触发
+
     struct list_head        noTimeoutList;
 
     CPollNode**             nodes;                      //
     pthread_mutex_t         mutex;                      // 操作任何 CPoll 结构体成员都该上锁
 
+#ifdef C_POLL_URING
+    CPollUring              uring;
+#endif
+
     char                    buf[C_POLL_BUF_SIZE];       // CPollNode，用于管道
 };
 
-static inline int _poll_create_pfd()
+static Slab _poll_node_slab = SLAB_INITIALIZER("poll node", sizeof (CPollNode));
+
+#ifdef C_POLL_URING
+static inline int _poll_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int _poll_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static inline int _poll_uring_register(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static inline unsigned long long _poll_uring_user_data(int fd, unsigned gen, int op)
+{
+    return ((unsigned long long)(op & URING_UD_OP_MASK) << URING_UD_OP_SHIFT)
+           | ((unsigned long long)(gen & URING_UD_GEN_MASK) << URING_UD_GEN_SHIFT)
+           | (unsigned int)fd;
+}
+
+static inline int _poll_uring_is_recv(const CPollNode *node)
+{
+    return node->data.operation == PD_OP_READ && !node->data.ssl;
+}
+
+/**
+ * @brief
+ *  只有 poll 线程调用 io_uring_enter (IORING_SETUP_SINGLE_ISSUER), 其它线程只写 SQ,
+ *  然后通过管道唤醒 poll 线程提交
+ */
+static inline int _poll_uring_in_loop(CPoll *poll)
+{
+    return !poll->stopped && pthread_equal(pthread_self(), poll->tid);
+}
+
+static inline unsigned _poll_uring_sq_space(CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+
+    return ring->sqEntries - (*ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE));
+}
+
+static inline void _poll_uring_set_ts(struct io_uring_sqe *sqe, struct __kernel_timespec *ts)
+{
+    if (sqe->opcode == IORING_OP_LINK_TIMEOUT)
+        sqe->addr = (unsigned long long)ts;
+    else if (sqe->opcode == IORING_OP_TIMEOUT_REMOVE)
+        sqe->addr2 = (unsigned long long)ts;
+}
+
+static struct io_uring_sqe *_poll_uring_sq_push(const struct io_uring_sqe *src, const struct __kernel_timespec *ts, CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    *sqe = *src;
+    if (ts) {
+        ring->ts[index] = *ts;
+        _poll_uring_set_ts(sqe, &ring->ts[index]);
+    }
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+
+    return sqe;
+}
+
+/* poll 线程调用 */
+static int _poll_uring_submit(CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    int ret;
+
+    while (ring->toSubmit > 0) {
+        ret = _poll_uring_enter(poll->pfd, ring->toSubmit, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            loge("io_uring_enter error: %d", errno);
+            return -1;
+        }
+
+        ring->toSubmit -= ret;
+        if (ret == 0)
+            break;
+    }
+
+    return 0;
+}
+
+/* poll 线程调用, 按序把积压的 sqe 搬进 SQ, 链接的两个 sqe 不拆开 */
+static int _poll_uring_drain_backlog(CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    CPollUringBacklog *entry;
+    unsigned need;
+    unsigned i;
+
+    for (i = 0; i < ring->backlogSize; i++) {
+        entry = &ring->backlog[i];
+        need = (entry->sqe.flags & IOSQE_IO_LINK) ? 2 : 1;
+        if (_poll_uring_sq_space(poll) < need) {
+            if (_poll_uring_submit(poll) < 0 || _poll_uring_sq_space(poll) < need)
+                break;
+        }
+
+        _poll_uring_sq_push(&entry->sqe, &entry->ts, poll);
+        if (need == 2) {
+            i++;
+            _poll_uring_sq_push(&ring->backlog[i].sqe, &ring->backlog[i].ts, poll);
+        }
+    }
+
+    if (i > 0) {
+        memmove(ring->backlog, ring->backlog + i, (ring->backlogSize - i) * sizeof (CPollUringBacklog));
+        ring->backlogSize -= i;
+    }
+
+    return -!!ring->backlogSize;
+}
+
+/**
+ * @brief
+ *  预留 n 个连续的 sqe, 之后的 n 次 _poll_uring_queue 要么都进 SQ, 要么都进积压队列
+ */
+static int _poll_uring_reserve(unsigned n, int *toBacklog, CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    CPollUringBacklog *backlog;
+    unsigned max;
+
+    if (_poll_uring_in_loop(poll)) {
+        if (ring->backlogSize > 0)
+            _poll_uring_drain_backlog(poll);
+
+        if (ring->backlogSize == 0 && _poll_uring_sq_space(poll) < n)
+            _poll_uring_submit(poll);
+    }
+
+    if (ring->backlogSize == 0 && _poll_uring_sq_space(poll) >= n) {
+        *toBacklog = 0;
+        return 0;
+    }
+
+    if (ring->backlogSize + n > ring->backlogMax) {
+        max = 2 * ring->backlogMax + n;
+        backlog = (CPollUringBacklog*) realloc (ring->backlog, max * sizeof (CPollUringBacklog));
+        if (!backlog)
+            return -1;
+
+        ring->backlog = backlog;
+        ring->backlogMax = max;
+    }
+
+    *toBacklog = 1;
+    return 0;
+}
+
+static void _poll_uring_queue(const struct io_uring_sqe *sqe, const struct __kernel_timespec *ts, int toBacklog, CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    CPollUringBacklog *entry;
+
+    if (!toBacklog) {
+        _poll_uring_sq_push(sqe, ts, poll);
+        return;
+    }
+
+    entry = &ring->backlog[ring->backlogSize++];
+    entry->sqe = *sqe;
+    if (ts)
+        entry->ts = *ts;
+}
+
+/* 非 poll 线程写入 sqe 后唤醒 poll 线程, 一轮循环内只唤醒一次 */
+static void _poll_uring_wake(CPoll *poll)
+{
+    CPollNode *wake = C_POLL_WAKE;
+
+    if (poll->stopped || poll->uring.wakePending || _poll_uring_in_loop(poll))
+        return;
+
+    poll->uring.wakePending = 1;
+    write(poll->pipeWr, &wake, sizeof (void *));
+}
+
+static int _poll_uring_has_carry(int fd, CPoll *poll)
+{
+    CPollUringCarry *carry;
+    struct list_head *pos;
+
+    list_for_each(pos, &poll->uring.carryList) {
+        carry = list_entry(pos, CPollUringCarry, list);
+        if (carry->fd == fd)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void _poll_uring_drop_carry(int fd, CPoll *poll)
+{
+    CPollUringCarry *carry;
+    struct list_head *pos, *tmp;
+
+    list_for_each_safe(pos, tmp, &poll->uring.carryList) {
+        carry = list_entry(pos, CPollUringCarry, list);
+        if (carry->fd == fd) {
+            list_del(pos);
+            free(carry);
+        }
+    }
+}
+
+/**
+ * @brief
+ *  在 fd 上挂 multishot 请求: PD_OP_LISTEN 用 multishot accept,
+ *  非 SSL 的 PD_OP_READ 用 multishot recv + provided buffers, 其它操作用 multishot poll.
+ *  节点带超时时, 在请求后链接一个绝对时间的 IORING_OP_LINK_TIMEOUT
+ */
+static int _poll_uring_arm(int fd, int event, CPollNode *node, CPoll *poll)
+{
+    CPollUringGen *gen = &poll->uring.gens[fd];
+    struct __kernel_timespec ts;
+    struct io_uring_sqe sqe;
+    unsigned long long data;
+    int carry = 0;
+    int toBacklog;
+
+    if (_poll_uring_is_recv(node))
+        carry = _poll_uring_has_carry(fd, poll);
+
+    if (_poll_uring_reserve(1 + carry + node->timeoutLinked, &toBacklog, poll) < 0)
+        return -1;
+
+    gen->op = node->data.operation;
+    data = _poll_uring_user_data(fd, gen->gen, node->data.operation);
+    if (carry) {
+        memset(&sqe, 0, sizeof (sqe));
+        sqe.opcode = IORING_OP_NOP;
+        sqe.fd = -1;
+        sqe.user_data = URING_UD_CARRY | data;
+        _poll_uring_queue(&sqe, NULL, toBacklog, poll);
+    }
+
+    memset(&sqe, 0, sizeof (sqe));
+    sqe.fd = fd;
+    sqe.user_data = URING_UD_NODE | data;
+    if (_poll_uring_is_recv(node)) {
+        sqe.opcode = IORING_OP_RECV;
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = C_POLL_URING_BUF_GROUP;
+    } else if (node->data.operation == PD_OP_LISTEN) {
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+    } else {
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.len = IORING_POLL_ADD_MULTI;
+        sqe.poll32_events = (unsigned)event & ~EPOLLET;
+    }
+
+    if (!node->timeoutLinked) {
+        _poll_uring_queue(&sqe, NULL, toBacklog, poll);
+        return 0;
+    }
+
+    sqe.flags |= IOSQE_IO_LINK;
+    _poll_uring_queue(&sqe, NULL, toBacklog, poll);
+
+    ts.tv_sec = node->timeout.tv_sec;
+    ts.tv_nsec = node->timeout.tv_nsec;
+    memset(&sqe, 0, sizeof (sqe));
+    sqe.opcode = IORING_OP_LINK_TIMEOUT;
+    sqe.fd = -1;
+    sqe.len = 1;
+    sqe.timeout_flags = IORING_TIMEOUT_ABS;
+    sqe.user_data = URING_UD_TIMEOUT | data;
+    _poll_uring_queue(&sqe, &ts, toBacklog, poll);
+
+    return 0;
+}
+
+/* 取消 fd 上当前代数的请求, 之后到达的旧 CQE 都会因代数不符被丢弃 */
+static int _poll_uring_cancel(int fd, CPoll *poll)
+{
+    CPollUringGen *gen = &poll->uring.gens[fd];
+    struct io_uring_sqe sqe;
+    int toBacklog;
+
+    if (_poll_uring_reserve(1, &toBacklog, poll) < 0)
+        return -1;
+
+    memset(&sqe, 0, sizeof (sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe.addr = URING_UD_NODE | _poll_uring_user_data(fd, gen->gen, gen->op);
+    sqe.user_data = URING_UD_INTERNAL | URING_INTERNAL_IGNORE;
+    _poll_uring_queue(&sqe, NULL, toBacklog, poll);
+    gen->gen++;
+
+    return 0;
+}
+
+/* 管道与 timerfd */
+static int _poll_uring_add_internal(int fd, unsigned type, CPoll *poll)
+{
+    struct io_uring_sqe sqe;
+    int toBacklog;
+
+    if (_poll_uring_reserve(1, &toBacklog, poll) < 0)
+        return -1;
+
+    memset(&sqe, 0, sizeof (sqe));
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = fd;
+    sqe.len = IORING_POLL_ADD_MULTI;
+    sqe.poll32_events = POLLIN;
+    sqe.user_data = URING_UD_INTERNAL | type;
+    _poll_uring_queue(&sqe, NULL, toBacklog, poll);
+
+    return 0;
+}
+
+/* poll_set_timeout: 更新链接的超时 */
+static int _poll_uring_update_timeout(int fd, CPollNode *node, CPoll *poll)
+{
+    CPollUringGen *gen = &poll->uring.gens[fd];
+    struct __kernel_timespec ts;
+    struct io_uring_sqe sqe;
+    int toBacklog;
+
+    if (_poll_uring_reserve(1, &toBacklog, poll) < 0)
+        return -1;
+
+    ts.tv_sec = node->timeout.tv_sec;
+    ts.tv_nsec = node->timeout.tv_nsec;
+    memset(&sqe, 0, sizeof (sqe));
+    sqe.opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe.fd = -1;
+    sqe.flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe.addr = URING_UD_TIMEOUT | _poll_uring_user_data(fd, gen->gen, gen->op);
+    sqe.timeout_flags = IORING_TIMEOUT_UPDATE | IORING_LINK_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+    sqe.user_data = URING_UD_INTERNAL | URING_INTERNAL_IGNORE;
+    _poll_uring_queue(&sqe, &ts, toBacklog, poll);
+
+    return 0;
+}
+
+static inline void _poll_uring_recycle(unsigned short bid, CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (C_POLL_URING_BUF_COUNT - 1)];
+
+    // 不能整体赋值, bufs[0].resv 与 tail 重叠
+    buf->addr = (unsigned long long)(ring->bufs + (size_t)bid * C_POLL_URING_BUF_SIZE);
+    buf->len = C_POLL_URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+static void _poll_uring_unmap(CPollUring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+
+    if (ring->cqRing && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+
+    if (ring->sqRing)
+        munmap(ring->sqRing, ring->sqRingSize);
+
+    if (ring->bufRing)
+        munmap(ring->bufRing, ring->bufRingSize);
+
+    free(ring->bufs);
+    free(ring->ts);
+    free(ring->gens);
+    free(ring->backlog);
+}
+
+/**
+ * @brief
+ *  创建 io_uring, 需要 SINGLE_ISSUER 与 DEFER_TASKRUN (Linux 6.1+),
+ *  这也保证了 multishot accept/recv 与 provided buffer ring 可用.
+ *  ring 以禁用状态创建, 由 poll 线程启用, 之后只有 poll 线程提交与收割.
+ */
+static int _poll_uring_create(CPoll *poll)
+{
+    CPollUring *ring = &poll->uring;
+    struct io_uring_buf_reg reg;
+    struct io_uring_params p;
+    char *ptr;
+    int fd;
+
+    memset(ring, 0, sizeof (CPollUring));
+    memset(&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = C_POLL_URING_CQ_ENTRIES;
+    fd = _poll_uring_setup(C_POLL_URING_SQ_ENTRIES, &p);
+    if (fd < 0)
+        return -1;
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            goto err;
+        }
+    }
+
+    ring->sqesSize = p.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    ptr = (char*) ring->sqRing;
+    ring->sqHead = (unsigned*) (ptr + p.sq_off.head);
+    ring->sqTail = (unsigned*) (ptr + p.sq_off.tail);
+    ring->sqMask = (unsigned*) (ptr + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (ptr + p.sq_off.array);
+    ring->sqEntries = p.sq_entries;
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ring->sqArray[i] = i;
+
+    ptr = (char*) ring->cqRing;
+    ring->cqHead = (unsigned*) (ptr + p.cq_off.head);
+    ring->cqTail = (unsigned*) (ptr + p.cq_off.tail);
+    ring->cqMask = (unsigned*) (ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (ptr + p.cq_off.cqes);
+
+    ring->ts = (struct __kernel_timespec*) calloc (p.sq_entries, sizeof (struct __kernel_timespec));
+    ring->gens = (CPollUringGen*) calloc (poll->maxOpenFiles, sizeof (CPollUringGen));
+    ring->bufs = (char*) malloc ((size_t)C_POLL_URING_BUF_COUNT * C_POLL_URING_BUF_SIZE);
+    if (!ring->ts || !ring->gens || !ring->bufs)
+        goto err;
+
+    ring->bufRingSize = C_POLL_URING_BUF_COUNT * sizeof (struct io_uring_buf);
+    ring->bufRing = (struct io_uring_buf_ring*) mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufRing == MAP_FAILED) {
+        ring->bufRing = NULL;
+        goto err;
+    }
+
+    memset(&reg, 0, sizeof (reg));
+    reg.ring_addr = (unsigned long long)ring->bufRing;
+    reg.ring_entries = C_POLL_URING_BUF_COUNT;
+    reg.bgid = C_POLL_URING_BUF_GROUP;
+    if (_poll_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto err;
+
+    for (unsigned short i = 0; i < C_POLL_URING_BUF_COUNT; i++)
+        _poll_uring_recycle(i, poll);
+
+    INIT_LIST_HEAD(&ring->carryList);
+
+    return fd;
+
+err:
+    _poll_uring_unmap(ring);
+    close(fd);
+    return -1;
+}
+
+static void _poll_uring_destroy(CPoll *poll)
+{
+    CPollUringCarry *carry;
+    struct list_head *pos, *tmp;
+
+    list_for_each_safe(pos, tmp, &poll->uring.carryList) {
+        carry = list_entry(pos, CPollUringCarry, list);
+        list_del(pos);
+        free(carry);
+    }
+
+    _poll_uring_unmap(&poll->uring);
+}
+#endif
+
+static inline int _poll_create_pfd(CPoll *poll)
 {
+#ifdef C_POLL_URING
+    if (poll->engine == CPOLL_ENGINE_URING) {
+        int fd = _poll_uring_create(poll);
+        if (fd >= 0)
+            return fd;
+
+        logd("io_uring unavailable: %d, fallback to epoll", errno);
+    }
+#endif
+
+    poll->engine = CPOLL_ENGINE_EPOLL;
     return epoll_create(1);
 }
 
 static inline int _poll_add_fd(int fd, int event, void *data, CPoll *poll)
 {
+#ifdef C_POLL_URING
+    if (poll->engine == CPOLL_ENGINE_URING) {
+        int ret;
+        if (data == (void*)1)
+            ret = _poll_uring_add_internal(fd, URING_INTERNAL_PIPE, poll);
+        else
+            ret = _poll_uring_arm(fd, event, (CPollNode*)data, poll);
+
+        _poll_uring_wake(poll);
+        return ret;
+    }
+#endif
+
     struct epoll_event ev = {
             .events		=	event,
             .data		=	{
@@ -97,11 +780,32 @@ static inline int _poll_add_fd(int fd, int event, void *data, CPoll *poll)
 
 static inline int _poll_del_fd(int fd, int event, CPoll *poll)
 {
+#ifdef C_POLL_URING
+    if (poll->engine == CPOLL_ENGINE_URING) {
+        int ret = _poll_uring_cancel(fd, poll);
+        poll->uring.gens[fd].delGen = poll->uring.gens[fd].gen;
+        _poll_uring_drop_carry(fd, poll);
+        _poll_uring_wake(poll);
+        return ret;
+    }
+#endif
+
     return epoll_ctl(poll->pfd, EPOLL_CTL_DEL, fd, NULL);
 }
 
 static inline int _poll_mod_fd(int fd, int oldEvent, int newEvent, void *data, CPoll *poll)
 {
+#ifdef C_POLL_URING
+    if (poll->engine == CPOLL_ENGINE_URING) {
+        int ret = _poll_uring_cancel(fd, poll);
+        if (ret >= 0)
+            ret = _poll_uring_arm(fd, newEvent, (CPollNode*)data, poll);
+
+        _poll_uring_wake(poll);
+        return ret;
+    }
+#endif
+
     struct epoll_event ev = {
             .events		=	newEvent,
             .data		=	{
@@ -126,6 +830,11 @@ static inline int _poll_create_timerfd()
 
 static inline int _poll_add_timerfd(int fd, CPoll *poll)
 {
+#ifdef C_POLL_URING
+    if (poll->engine == CPOLL_ENGINE_URING)
+        return _poll_uring_add_internal(fd, URING_INTERNAL_TIMER, poll);
+#endif
+
     struct epoll_event ev = {
             .events		=	EPOLLIN | EPOLLET,
             .data		=	{
@@ -147,9 +856,9 @@ static inline int _poll_set_timer_fd(int fd, const struct timespec *absTime, CPo
 
 typedef struct epoll_event _poll_event_t;
 
-static inline int _poll_wait(_poll_event_t *events, int maxEvents, CPoll *poll)
+static inline int _poll_wait(_poll_event_t *events, int maxEvents, int timeout, CPoll *poll)
 {
-    return epoll_wait(poll->pfd, events, maxEvents, -1);
+    return epoll_wait(poll->pfd, events, maxEvents, timeout);
 }
 
 static inline void* _poll_event_data(const _poll_event_t *event)
@@ -213,6 +922,18 @@ static inline void _poll_tree_erase(CPollNode *node, CPoll *poll)
     node->inRBTree = 0;
 }
 
+static inline void _poll_unlink_node(CPollNode *node, CPoll *poll)
+{
+    if (node->inRBTree) {
+        _poll_tree_erase(node, poll);
+    } else if (node->inWheel) {
+        timer_wheel_del(&node->wheel, &poll->timeoutWheel);
+        node->inWheel = 0;
+    } else {
+        list_del(&node->list);
+    }
+}
+
 static int _poll_remove_node(CPollNode *node, CPoll *poll)
 {
     int removed;
@@ -222,11 +943,7 @@ static int _poll_remove_node(CPollNode *node, CPoll *poll)
     if (!removed)
     {
         poll->nodes[node->data.fd] = NULL;
-
-        if (node->inRBTree)
-            _poll_tree_erase(node, poll);
-        else
-            list_del(&node->list);
+        _poll_unlink_node(node, poll);
 
         _poll_del_fd(node->data.fd, node->event, poll);
     }
@@ -242,14 +959,14 @@ static int _poll_append_message(const void *buf, size_t *n, CPollNode *node, CPo
     int ret;
 
     if (!msg) {
-        res = (CPollNode*) malloc (sizeof(CPollNode));
+        res = (CPollNode*) slab_alloc(&_poll_node_slab);
         if (!res) {
             return -1;
         }
 
         msg = poll->createMessage(node->data.context);
         if (!msg) {
-            free(res);
+            slab_free(res);
             return -1;
         }
 
@@ -273,6 +990,23 @@ static int _poll_append_message(const void *buf, size_t *n, CPollNode *node, CPo
     return ret;
 }
 
+static ssize_t _poll_append_buffer(const char *p, ssize_t nLeft, CPollNode *node, CPoll *poll)
+{
+    size_t n;
+
+    do {
+        n = nLeft;
+        if (_poll_append_message(p, &n, node, poll) >= 0) {
+            nLeft -= n;
+            p += n;
+        } else {
+            nLeft = -1;
+        }
+    } while (nLeft > 0);
+
+    return nLeft;
+}
+
 static int _poll_handle_ssl_error(CPollNode *node, int ret, CPoll *poll)
 {
     int error = SSL_get_error(node->data.ssl, ret);
@@ -313,12 +1047,13 @@ static int _poll_handle_ssl_error(CPollNode *node, int ret, CPoll *poll)
 static void _poll_handle_read(CPollNode *node, CPoll *poll)
 {
     ssize_t nLeft;
-    size_t n;
     char* p = NULL;
+    int ktls;
 
     while (1) {
         p = poll->buf;
-        if (!node->data.ssl) {
+        ktls = node->data.ssl && poll_ssl_ktls_recv(node->data.ssl);
+        if (!node->data.ssl || ktls) {
             nLeft = read(node->data.fd, p, C_POLL_BUF_SIZE);
             if (nLeft < 0) {
                 if (errno == EAGAIN) {
@@ -326,7 +1061,9 @@ static void _poll_handle_read(CPollNode *node, CPoll *poll)
                 }
             }
         }
-        else {
+
+        // kTLS 下 read() 遇到非应用数据的记录 (alert, TLS 1.3 的 ticket) 返回 EIO, 交给 OpenSSL 处理
+        if (node->data.ssl && (!ktls || (nLeft < 0 && errno == EIO))) {
             nLeft = SSL_read(node->data.ssl, p, C_POLL_BUF_SIZE);
             if (nLeft < 0) {
                 if (_poll_handle_ssl_error(node, nLeft, poll) >= 0) {
@@ -339,16 +1076,7 @@ static void _poll_handle_read(CPollNode *node, CPoll *poll)
             break;
         }
 
-        do {
-            n = nLeft;
-            if (_poll_append_message(p, &n, node, poll) >= 0) {
-                nLeft -= n;
-                p += n;
-            } else {
-                nLeft = -1;
-            }
-        } while (nLeft > 0);
-
+        nLeft = _poll_append_buffer(p, nLeft, node, poll);
         if (nLeft < 0) {
             break;
         }
@@ -366,7 +1094,7 @@ static void _poll_handle_read(CPollNode *node, CPoll *poll)
         node->state = PR_ST_ERROR;
     }
 
-    free(node->res);
+    slab_free(node->res);
     poll->cb((CPollResult *)node, poll->ctx);
 }
 
@@ -378,63 +1106,251 @@ static void _poll_handle_read(CPollNode *node, CPoll *poll)
 # endif
 #endif
 
-static void _poll_handle_write(CPollNode *node, CPoll *poll)
+ssize_t poll_writev(int fd, const struct iovec *iov, int iovcnt)
 {
-    struct iovec *iov = node->data.writeIov;
-    size_t count = 0;
-    ssize_t nleft;
-    int iovcnt;
-    int ret;
+    const CPollFileSegment *seg;
+    size_t left;
+    off_t off;
+    ssize_t n;
+    int i;
 
-    while (node->data.iovec > 0)
+    if (iov->iov_len & CPOLL_IOV_FILE)
     {
-        if (!node->data.ssl)
+        seg = (const CPollFileSegment *)iov->iov_base;
+        left = CPOLL_IOV_LEN(iov);
+        off = seg->offset + (off_t)(seg->size - left);
+        n = sendfile(fd, seg->fd, &off, left);
+        if (n == 0 && left > 0)
         {
-            iovcnt = node->data.iovec;
-            if (iovcnt > IOV_MAX)
-                iovcnt = IOV_MAX;
-
-            nleft = writev(node->data.fd, iov, iovcnt);
-            if (nleft < 0)
-            {
-                ret = errno == EAGAIN ? 0 : -1;
-                break;
-            }
+            errno = EIO;
+            return -1;
         }
-        else if (iov->iov_len > 0)
-        {
-            nleft = SSL_write(node->data.ssl, iov->iov_base, iov->iov_len);
-            if (nleft <= 0)
-            {
-                ret = _poll_handle_ssl_error(node, nleft, poll);
-                break;
+
+        return n;
+    }
+
+    for (i = 1; i < iovcnt && i < IOV_MAX && !(iov[i].iov_len & CPOLL_IOV_FILE); i++);
+
+    return writev(fd, iov, i);
+}
+
+ssize_t poll_read_file(const struct iovec *iov, void *buf, size_t size)
+{
+    const CPollFileSegment *seg = (const CPollFileSegment *)iov->iov_base;
+    size_t left = CPOLL_IOV_LEN(iov);
+    ssize_t n;
+
+    if (size > left)
+        size = left;
+
+    n = pread(seg->fd, buf, size, seg->offset + (off_t)(seg->size - left));
+    if (n == 0 && size > 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return n;
+}
+
+int poll_iov_advance(struct iovec *iov, int iovcnt, size_t n)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        len = CPOLL_IOV_LEN(&iov[i]);
+        if (n < len)
+        {
+            if (iov[i].iov_len & CPOLL_IOV_FILE)
+                iov[i].iov_len -= n;
+            else
+            {
+                iov[i].iov_base = (char *)iov[i].iov_base + n;
+                iov[i].iov_len -= n;
             }
+
+            break;
         }
-        else
-            nleft = 0;
 
-        count += nleft;
-        do
+        n -= len;
+    }
+
+    return i;
+}
+
+#ifdef C_POLL_ZEROCOPY
+/* 连续内存段够大时用 MSG_ZEROCOPY 发送, 否则和 poll_writev() 相同 */
+static ssize_t _poll_writev_zerocopy(CPollNode *node, const struct iovec *iov, int iovcnt, CPoll *poll)
+{
+    size_t threshold = __atomic_load_n(&poll->zerocopyThreshold, __ATOMIC_RELAXED);
+    struct msghdr msg;
+    size_t size = 0;
+    int on = 1;
+    ssize_t n;
+    int i;
+
+    if (threshold == 0 || node->zerocopy < 0 || (iov->iov_len & CPOLL_IOV_FILE))
+        return poll_writev(node->data.fd, iov, iovcnt);
+
+    for (i = 0; i < iovcnt && i < IOV_MAX && !(iov[i].iov_len & CPOLL_IOV_FILE); i++)
+        size += iov[i].iov_len;
+
+    if (size < threshold)
+        return poll_writev(node->data.fd, iov, iovcnt);
+
+    if (node->zerocopy == 0)
+    {
+        if (setsockopt(node->data.fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof (int)) < 0)
         {
-            if (nleft >= iov->iov_len)
+            node->zerocopy = -1;
+            return poll_writev(node->data.fd, iov, iovcnt);
+        }
+
+        node->zerocopy = 1;
+    }
+
+    memset(&msg, 0, sizeof (struct msghdr));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = i;
+    n = sendmsg(node->data.fd, &msg, MSG_ZEROCOPY);
+    if (n > 0)
+    {
+        node->zerocopyPending++;
+        C_POLL_COUNT(poll->stats.zerocopySends);
+    }
+    else if (n < 0 && errno == ENOBUFS)
+    {
+        // 未完成的通知超过了 optmem 限制, 这次拷贝发送
+        return writev(node->data.fd, iov, i);
+    }
+
+    return n;
+}
+
+/* 取出错误队列里的完成通知, 一条通知可能覆盖连续多次发送 */
+static int _poll_reap_zerocopy(CPollNode *node, CPoll *poll)
+{
+    char control[CMSG_SPACE(sizeof (struct sock_extended_err) + sizeof (struct sockaddr_in6))];
+    struct sock_extended_err *err;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    unsigned int n;
+
+    while (node->zerocopyPending > 0)
+    {
+        memset(&msg, 0, sizeof (struct msghdr));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+        if (recvmsg(node->data.fd, &msg, MSG_ERRQUEUE) < 0)
+            return errno == EAGAIN ? 0 : -1;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                continue;
+
+            n = err->ee_data - err->ee_info + 1;
+            node->zerocopyPending -= n < node->zerocopyPending ? n : node->zerocopyPending;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                C_POLL_COUNT(poll->stats.zerocopyCopied);
+        }
+    }
+
+    return 0;
+}
+#else
+# define _poll_writev_zerocopy(node, iov, iovcnt, poll)     poll_writev((node)->data.fd, iov, iovcnt)
+# define _poll_reap_zerocopy(node, poll)                    0
+#endif
+
+#define C_POLL_SSL_FILE_BUF         16384
+
+static void _poll_handle_write(CPollNode *node, CPoll *poll)
+{
+    struct iovec *iov = node->data.writeIov;
+    char buf[C_POLL_SSL_FILE_BUF];
+    int ktls = node->data.ssl && poll_ssl_ktls_send(node->data.ssl);
+    size_t count = 0;
+    ssize_t nleft;
+    int ret = 0;
+    int n;
+
+    while (node->data.iovec > 0 && !node->zerocopyError)
+    {
+        if (!node->data.ssl || ktls)
+        {
+            // kTLS 不支持 MSG_ZEROCOPY, 文件段照样用 sendfile, 由内核加密
+            if (ktls)
+                nleft = poll_writev(node->data.fd, iov, node->data.iovec);
+            else
+                nleft = _poll_writev_zerocopy(node, iov, node->data.iovec, poll);
+            if (nleft < 0)
             {
-                nleft -= iov->iov_len;
-                iov->iov_base = (char *)iov->iov_base + iov->iov_len;
-                iov->iov_len = 0;
-                iov++;
-                node->data.iovec--;
+                ret = errno == EAGAIN ? 0 : -1;
+                break;
             }
-            else
+        }
+        else if (iov->iov_len & CPOLL_IOV_FILE)
+        {
+            // 文件段每次重新读出, 重试时缓冲区地址可能不同
+            nleft = CPOLL_IOV_LEN(iov) > 0 ? poll_read_file(iov, buf, sizeof (buf)) : 0;
+            if (nleft < 0)
+            {
+                ret = -1;
+                break;
+            }
+
+            if (nleft > 0)
             {
-                iov->iov_base = (char *)iov->iov_base + nleft;
-                iov->iov_len -= nleft;
+                SSL_set_mode(node->data.ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+                nleft = SSL_write(node->data.ssl, buf, (int)nleft);
+                if (nleft <= 0)
+                {
+                    ret = _poll_handle_ssl_error(node, nleft, poll);
+                    break;
+                }
+            }
+        }
+        else if (iov->iov_len > 0)
+        {
+            nleft = SSL_write(node->data.ssl, iov->iov_base, iov->iov_len);
+            if (nleft <= 0)
+            {
+                ret = _poll_handle_ssl_error(node, nleft, poll);
                 break;
             }
-        } while (node->data.iovec > 0);
+        }
+        else
+            nleft = 0;
+
+        count += nleft;
+        n = poll_iov_advance(iov, node->data.iovec, nleft);
+        iov += n;
+        node->data.iovec -= n;
     }
 
     node->data.writeIov = iov;
-    if (node->data.iovec > 0 && ret >= 0) {
+    if (node->zerocopyError)
+        ret = -1;
+
+    if (node->zerocopyPending > 0 && ret >= 0)
+        ret = _poll_reap_zerocopy(node, poll);
+    else if (node->zerocopyPending > 0)
+    {
+        // 出错时内核可能还引用着 iovec 的内存, 节点留在 poll 里, 完成通知到齐 (EPOLLERR) 再回调.
+        // 写超时仍然照常回调, 这时不再等通知
+        if (!node->zerocopyError)
+            node->zerocopyError = errno;
+
+        if (_poll_reap_zerocopy(node, poll) >= 0 && node->zerocopyPending > 0)
+            return;
+    }
+
+    // 数据都发出后还要等 MSG_ZEROCOPY 的完成通知, 通知到达时 fd 上有 EPOLLERR
+    if ((node->data.iovec > 0 || node->zerocopyPending > 0) && ret >= 0) {
         if (count == 0)
             return;
 
@@ -445,17 +1361,40 @@ static void _poll_handle_write(CPollNode *node, CPoll *poll)
     if (_poll_remove_node(node, poll))
         return;
 
-    if (node->data.iovec == 0) {
+    if (node->data.iovec == 0 && ret >= 0) {
         node->error = 0;
         node->state = PR_ST_FINISHED;
     } else {
-        node->error = errno;
+        node->error = node->zerocopyError ? node->zerocopyError : errno;
         node->state = PR_ST_ERROR;
     }
 
     poll->cb((CPollResult *)node, poll->ctx);
 }
 
+/* 超过 net.core.busy_read 的值需要 CAP_NET_ADMIN, 设置失败时沿用系统设置 */
+static void _poll_set_busy_poll(int fd, CPoll *poll)
+{
+    int busyPoll = __atomic_load_n(&poll->sockBusyPoll, __ATOMIC_RELAXED);
+    int on = 1;
+
+    if (busyPoll <= 0) {
+        return;
+    }
+
+#ifdef SO_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof (int)) < 0) {
+        logd("setsockopt SO_BUSY_POLL error: %d", errno);
+    }
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof (int)) < 0) {
+        logd("setsockopt SO_PREFER_BUSY_POLL error: %d", errno);
+    }
+#endif
+    (void) on;
+}
+
 static void _poll_handle_listen(CPollNode *node, CPoll *poll)
 {
     logv("");
@@ -482,6 +1421,7 @@ static void _poll_handle_listen(CPollNode *node, CPoll *poll)
             }
         }
 
+        _poll_set_busy_poll(sockFd, poll);
         p = node->data.accept((const struct sockaddr *)&ss, len, sockFd, node->data.context);
         if (!p) {
             logd("node->data.accept error!");
@@ -494,7 +1434,7 @@ static void _poll_handle_listen(CPollNode *node, CPoll *poll)
         res->state = PR_ST_SUCCESS;
         poll->cb((CPollResult *)res, poll->ctx);
 
-        res = (CPollNode *)malloc(sizeof (CPollNode));
+        res = (CPollNode*) slab_alloc(&_poll_node_slab);
         node->res = res;
         if (!res) {
             logd("malloc CPollNode error!");
@@ -507,7 +1447,7 @@ static void _poll_handle_listen(CPollNode *node, CPoll *poll)
 
     node->error = errno;
     node->state = PR_ST_ERROR;
-    free(node->res);
+    slab_free(node->res);
     poll->cb((CPollResult *)node, poll->ctx);
 }
 
@@ -606,20 +1546,22 @@ static void _poll_handle_ssl_shutdown(CPollNode *node, CPoll *poll)
     poll->cb((CPollResult *)node, poll->ctx);
 }
 
+/**
+ * @brief
+ *  eventfd 的计数只是唤醒, 一直调用 event() 到它返回 NULL 为止.
+ *  计数清零在前, 之后新的完成一定会再次触发
+ */
 static void _poll_handle_event(CPollNode *node, CPoll *poll)
 {
     logv("");
     CPollNode *res = node->res;
-    unsigned long long cnt = 0;
     unsigned long long value;
     ssize_t ret;
     void *p;
 
     while (1) {
         ret = read(node->data.fd, &value, sizeof (unsigned long long));
-        if (ret == sizeof (unsigned long long))
-            cnt += value;
-        else {
+        if (ret != sizeof (unsigned long long)) {
             if (ret >= 0)
                 errno = EINVAL;
             break;
@@ -628,11 +1570,44 @@ static void _poll_handle_event(CPollNode *node, CPoll *poll)
 
     if (errno == EAGAIN) {
         while (1) {
-            if (cnt == 0)
+            p = node->data.event(node->data.context);
+            if (!p)
                 return;
 
-            cnt--;
-            p = node->data.event(node->data.context);
+            res->data = node->data;
+            res->data.result = p;
+            res->error = 0;
+            res->state = PR_ST_SUCCESS;
+            poll->cb((CPollResult *)res, poll->ctx);
+
+            res = (CPollNode*) slab_alloc(&_poll_node_slab);
+            node->res = res;
+            if (!res)
+                break;
+        }
+    }
+
+    if (_poll_remove_node(node, poll))
+        return;
+
+    node->error = errno;
+    node->state = PR_ST_ERROR;
+    slab_free(node->res);
+    poll->cb((CPollResult *)node, poll->ctx);
+}
+
+static void _poll_handle_notify(CPollNode *node, CPoll *poll)
+{
+    logv("");
+    CPollNode *res = node->res;
+    ssize_t ret;
+    void *p;
+
+    while (1) {
+        ret = read(node->data.fd, &p, sizeof (void *));
+        if (ret == sizeof (void *))
+        {
+            p = node->data.notify(p, node->data.context);
             if (!p)
                 break;
 
@@ -642,241 +1617,650 @@ static void _poll_handle_event(CPollNode *node, CPoll *poll)
             res->state = PR_ST_SUCCESS;
             poll->cb((CPollResult *)res, poll->ctx);
 
-            res = (CPollNode *)malloc(sizeof (CPollNode));
+            res = (CPollNode*) slab_alloc(&_poll_node_slab);
             node->res = res;
             if (!res)
                 break;
         }
+        else if (ret < 0 && errno == EAGAIN)
+            return;
+        else
+        {
+            if (ret > 0)
+                errno = EINVAL;
+            break;
+        }
+    }
+
+    if (_poll_remove_node(node, poll))
+        return;
+
+    if (ret == 0)
+    {
+        node->error = 0;
+        node->state = PR_ST_FINISHED;
+    }
+    else
+    {
+        node->error = errno;
+        node->state = PR_ST_ERROR;
+    }
+
+    slab_free(node->res);
+    poll->cb((CPollResult *)node, poll->ctx);
+}
+
+static int _poll_handle_pipe(CPoll *poll)
+{
+    CPollNode **node = (CPollNode**)poll->buf;
+    int stop = 0;
+    ssize_t ret;
+
+    do {
+        ret = read(poll->pipeRd, node, C_POLL_BUF_SIZE);
+        if (ret < 0) {
+            break;
+        }
+
+        unsigned long n = ret / sizeof (void*);
+        for (int i = 0; i < n; i++) {
+            if (node[i] == C_POLL_WAKE) {
+                continue;
+            } else if (node[i]) {
+                slab_free(node[i]->res);
+                poll->cb((CPollResult*) node[i], poll->ctx);
+            } else {
+                stop = 1;
+            }
+        }
+        // io_uring 的 multishot poll 是边沿触发, 要读空管道
+    } while (poll->engine == CPOLL_ENGINE_URING && ret == C_POLL_BUF_SIZE);
+
+    return stop;
+}
+
+static void _poll_handle_timeout(const CPollNode* timeNode, CPoll *poll)
+{
+    CPollNode*                      node;
+    struct list_head                *pos;
+
+    LIST_HEAD(timeList);
+
+    pthread_mutex_lock(&poll->mutex);
+    if ((poll->timerArmed.tv_sec || poll->timerArmed.tv_nsec)
+        && (poll->timerArmed.tv_sec < timeNode->timeout.tv_sec
+            || (poll->timerArmed.tv_sec == timeNode->timeout.tv_sec && poll->timerArmed.tv_nsec <= timeNode->timeout.tv_nsec))) {
+        poll->timerArmed.tv_sec = 0;
+        poll->timerArmed.tv_nsec = 0;
+    }
+
+    // wheel.list 与 list 在联合体中位置相同
+    timer_wheel_advance(timer_wheel_tick_floor(&timeNode->timeout), &timeList, &poll->timeoutWheel);
+    list_for_each(pos, &timeList) {
+        node = list_entry(pos, CPollNode, list);
+        node->inWheel = 0;
+        if (node->data.fd >= 0) {
+            poll->nodes[node->data.fd] = NULL;
+            _poll_del_fd(node->data.fd, node->event, poll);
+        }
+    }
+
+    if (poll->treeFirst) {
+        while (1) {
+            node = RB_ENTRY(poll->treeFirst, CPollNode, rb);
+            if (__timeout_cmp(node, timeNode) < 0) {
+                if (node->data.fd >= 0) {
+                    poll->nodes[node->data.fd] = NULL;
+                    _poll_del_fd(node->data.fd, node->event, poll);
+                }
+
+                poll->treeFirst = rb_next(poll->treeFirst);
+                rb_erase(&node->rb, &poll->timeoutTree);
+                list_add_tail(&node->list, &timeList);
+                if (poll->treeFirst) {
+                    continue;
+                }
+
+                poll->treeLast = NULL;
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&poll->mutex);
+    while (!list_empty(&timeList)) {
+        node = list_entry(timeList.next, CPollNode, list);
+        list_del(&node->list);
+
+        node->error = ETIMEDOUT;
+        node->state = PR_ST_ERROR;
+        slab_free(node->res);
+        poll->cb((CPollResult *)node, poll->ctx);
+    }
+}
+
+static inline long _poll_elapsed_us(const struct timespec *begin, const struct timespec *end)
+{
+    return (end->tv_sec - begin->tv_sec) * 1000000L + (end->tv_nsec - begin->tv_nsec) / 1000;
+}
+
+/**
+ * @brief
+ *  最近事件的平均间隔小于空转预算才空转, 返回 1 并给出空转的截止时间
+ */
+static int _poll_spin_deadline(struct timespec *deadline, CPoll *poll)
+{
+    int budget = __atomic_load_n(&poll->spinBudget, __ATOMIC_RELAXED);
+
+    if (budget <= 0 || poll->eventGap >= budget) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_nsec += budget * 1000L;
+    deadline->tv_sec += deadline->tv_nsec / 1000000000L;
+    deadline->tv_nsec %= 1000000000L;
+
+    return 1;
+}
+
+static inline int _poll_spin_expired(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return _poll_elapsed_us(deadline, &now) >= 0;
+}
+
+/* 有事件时更新平均间隔, 新间隔占 1/8. 空转落空后的间隔一定不小于预算, 事件变稀疏时平均值很快超过预算 */
+static void _poll_spin_update(const struct timespec *now, int nEvents, CPoll *poll)
+{
+    long gap;
+
+    if (nEvents <= 0 || __atomic_load_n(&poll->spinBudget, __ATOMIC_RELAXED) <= 0) {
+        return;
+    }
+
+    gap = _poll_elapsed_us(&poll->lastEvent, now);
+    if (gap > C_POLL_GAP_MAX) {
+        gap = C_POLL_GAP_MAX;
+    }
+
+    poll->eventGap += (gap - poll->eventGap) / 8;
+    poll->lastEvent = *now;
+}
+
+static int _poll_spin(_poll_event_t *events, int maxEvents, CPoll *poll)
+{
+    struct timespec deadline;
+    int n;
+
+    if (!_poll_spin_deadline(&deadline, poll)) {
+        return 0;
+    }
+
+    do {
+        n = _poll_wait(events, maxEvents, 0, poll);
+        if (n > 0) {
+            C_POLL_COUNT(poll->stats.spinHits);
+            return n;
+        }
+    } while (!_poll_spin_expired(&deadline));
+
+    C_POLL_COUNT(poll->stats.spinMisses);
+
+    return 0;
+}
+
+/**
+ * @brief
+ *  时间轮下一次要推进的时间与定时器树中最早的时间取最小值, 与 timerfd 当前的设置相同时不再重复设置
+ */
+static void _poll_set_timer(CPoll *poll)
+{
+    CPollNode* first;
+    struct timespec absTime;
+    unsigned long long tick;
+    int hasTime = 0;
+
+    pthread_mutex_lock(&poll->mutex);
+    if (timer_wheel_next(&tick, &poll->timeoutWheel)) {
+        timer_wheel_tick_to_timespec(tick, &absTime);
+        hasTime = 1;
+    }
+
+    if (poll->treeFirst) {
+        first = RB_ENTRY(poll->treeFirst, CPollNode, rb);
+        if (!hasTime || first->timeout.tv_sec < absTime.tv_sec
+            || (first->timeout.tv_sec == absTime.tv_sec && first->timeout.tv_nsec < absTime.tv_nsec)) {
+            absTime = first->timeout;
+            hasTime = 1;
+        }
+    }
+
+    if (!hasTime) {
+        absTime.tv_sec = 0;
+        absTime.tv_nsec = 0;
+    }
+
+    if (absTime.tv_sec != poll->timerArmed.tv_sec || absTime.tv_nsec != poll->timerArmed.tv_nsec) {
+        _poll_set_timer_fd (poll->timerFd, &absTime, poll);
+        poll->timerArmed = absTime;
+    }
+
+    pthread_mutex_unlock (&poll->mutex);
+}
+
+static void _poll_handle_node(CPollNode *node, CPoll *poll)
+{
+    switch (node->data.operation) {
+        case PD_OP_READ: {
+            _poll_handle_read(node, poll);
+            break;
+        }
+        case PD_OP_WRITE: {
+            _poll_handle_write(node, poll);
+            break;
+        }
+        case PD_OP_LISTEN: {
+            _poll_handle_listen(node, poll);
+            break;
+        }
+        case PD_OP_CONNECT: {
+            _poll_handle_connect(node, poll);
+            break;
+        }
+        case PD_OP_SSL_ACCEPT: {
+            _poll_handle_ssl_accept(node, poll);
+            break;
+        }
+        case PD_OP_SSL_CONNECT: {
+            _poll_handle_ssl_connect(node, poll);
+            break;
+        }
+        case PD_OP_SSL_SHUTDOWN: {
+            _poll_handle_ssl_shutdown(node, poll);
+            break;
+        }
+        case PD_OP_EVENT: {
+            _poll_handle_event(node, poll);
+            break;
+        }
+        case PD_OP_NOTIFY: {
+            _poll_handle_notify(node, poll);
+            break;
+        }
+    }
+}
+
+static void _poll_thread_cleanup()
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    # ifdef CRYPTO_LOCK_ECDH
+	ERR_remove_thread_state(NULL);
+# else
+	ERR_remove_state(0);
+# endif
+#endif
+}
+
+static void* _poll_handle_read_routine(void *arg)
+{
+    int                 nEvents;
+    int                 hasPipeEvent;
+    CPoll*              poll = (CPoll*)arg;
+    _poll_event_t       events[C_POLL_EVENTS_MAX];          // epoll_event_t
+    CPollNode           timeNode;
+    CPollNode*          node;
+
+    while (1) {
+        _poll_set_timer(poll);
+        nEvents = _poll_spin(events, C_POLL_EVENTS_MAX, poll);
+        if (nEvents <= 0) {
+            nEvents = _poll_wait(events, C_POLL_EVENTS_MAX, -1, poll);
+            C_POLL_COUNT(poll->stats.waits);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &timeNode.timeout);
+        _poll_spin_update(&timeNode.timeout, nEvents, poll);
+        hasPipeEvent = 0;
+        for (int i = 0; i < nEvents; ++i) {
+            node = (CPollNode*)_poll_event_data(&events[i]);
+            if (node > (CPollNode*)1) {
+                _poll_handle_node(node, poll);
+            }
+            else if (node == (CPollNode*)1) {
+                hasPipeEvent = 1;
+            }
+        }
+
+        if (hasPipeEvent) {
+            if (_poll_handle_pipe(poll)) {
+                break;
+            }
+        }
+        _poll_handle_timeout(&timeNode, poll);
     }
 
-    if (cnt != 0)
-        write(node->data.fd, &cnt, sizeof (unsigned long long));
+    _poll_thread_cleanup();
+
+    return NULL;
+}
 
+#ifdef C_POLL_URING
+static void _poll_uring_node_error(CPollNode *node, int error, CPoll *poll)
+{
     if (_poll_remove_node(node, poll))
         return;
 
-    node->error = errno;
+    node->error = error;
     node->state = PR_ST_ERROR;
-    free(node->res);
+    slab_free(node->res);
     poll->cb((CPollResult *)node, poll->ctx);
 }
 
-static void _poll_handle_notify(CPollNode *node, CPoll *poll)
+/* multishot 请求结束 (没有 IORING_CQE_F_MORE) 但节点仍然有效时重新挂上 */
+static void _poll_uring_rearm(int fd, unsigned gen, CPollNode *node, CPoll *poll)
 {
-    logv("");
-    CPollNode *res = node->res;
-    ssize_t ret;
-    void *p;
+    pthread_mutex_lock(&poll->mutex);
+    if ((poll->uring.gens[fd].gen & URING_UD_GEN_MASK) == gen && poll->nodes[fd] == node)
+        _poll_uring_arm(fd, node->event, node, poll);
 
-    while (1) {
-        ret = read(node->data.fd, &p, sizeof (void *));
-        if (ret == sizeof (void *))
-        {
-            p = node->data.notify(p, node->data.context);
-            if (!p)
-                break;
+    pthread_mutex_unlock(&poll->mutex);
+}
 
-            res->data = node->data;
-            res->data.result = p;
-            res->error = 0;
-            res->state = PR_ST_SUCCESS;
-            poll->cb((CPollResult *)res, poll->ctx);
+static void _poll_uring_handle_carry(int fd, CPollNode *node, CPoll *poll)
+{
+    CPollUringCarry *carry;
+    struct list_head *pos, *tmp;
+    ssize_t nLeft = 0;
 
-            res = (CPollNode *)malloc(sizeof (CPollNode));
-            node->res = res;
-            if (!res)
-                break;
-        }
-        else if (ret < 0 && errno == EAGAIN)
-            return;
-        else
-        {
-            if (ret > 0)
-                errno = EINVAL;
-            break;
-        }
+    LIST_HEAD(carryList);
+
+    pthread_mutex_lock(&poll->mutex);
+    list_for_each_safe(pos, tmp, &poll->uring.carryList) {
+        carry = list_entry(pos, CPollUringCarry, list);
+        if (carry->fd == fd)
+            list_move_tail(pos, &carryList);
     }
 
-    if (_poll_remove_node(node, poll))
+    pthread_mutex_unlock(&poll->mutex);
+    list_for_each_safe(pos, tmp, &carryList) {
+        carry = list_entry(pos, CPollUringCarry, list);
+        if (nLeft >= 0)
+            nLeft = _poll_append_buffer(carry->data, carry->size, node, poll);
+
+        list_del(pos);
+        free(carry);
+    }
+
+    if (nLeft < 0)
+        _poll_uring_node_error(node, errno, poll);
+}
+
+static void _poll_uring_handle_recv(int fd, unsigned gen, const struct io_uring_cqe *cqe, CPollNode *node, CPoll *poll)
+{
+    unsigned short bid;
+    ssize_t nLeft;
+
+    if (cqe->res > 0) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        nLeft = _poll_append_buffer(poll->uring.bufs + (size_t)bid * C_POLL_URING_BUF_SIZE, cqe->res, node, poll);
+        _poll_uring_recycle(bid, poll);
+        if (nLeft >= 0) {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                _poll_uring_rearm(fd, gen, node, poll);
+            return;
+        }
+    } else if (cqe->res == -ENOBUFS) {
+        _poll_uring_rearm(fd, gen, node, poll);
         return;
+    } else if (cqe->res == 0) {
+        if (_poll_remove_node(node, poll))
+            return;
 
-    if (ret == 0)
-    {
         node->error = 0;
         node->state = PR_ST_FINISHED;
-    }
-    else
-    {
-        node->error = errno;
-        node->state = PR_ST_ERROR;
+        slab_free(node->res);
+        poll->cb((CPollResult *)node, poll->ctx);
+        return;
+    } else {
+        // 自己取消的请求代数已经改变, 代数相符的 ECANCELED 只会来自链接的超时
+        errno = cqe->res == -ECANCELED ? ETIMEDOUT : -cqe->res;
     }
 
-    free(node->res);
-    poll->cb((CPollResult *)node, poll->ctx);
+    _poll_uring_node_error(node, errno, poll);
 }
 
-static int _poll_handle_pipe(CPoll *poll)
+static void _poll_uring_handle_accept(int fd, unsigned gen, const struct io_uring_cqe *cqe, CPollNode *node, CPoll *poll)
 {
-    CPollNode **node = (CPollNode**)poll->buf;
-    int stop = 0;
+    struct sockaddr_storage     ss;
+    socklen_t                   len = sizeof (struct sockaddr_storage);
+    CPollNode*                  res = node->res;
+    void*                       p;
 
-    unsigned long n = read(poll->pipeRd, node, C_POLL_BUF_SIZE) / sizeof (void*);
-    for (int i = 0; i < n; i++) {
-        if (node[i]) {
-            free(node[i]->res);
-            poll->cb((CPollResult*) node[i], poll->ctx);
+    if (cqe->res >= 0) {
+        // multishot accept 不能带地址参数
+        if (getpeername(cqe->res, (struct sockaddr *)&ss, &len) < 0) {
+            logd("getpeername error: %d", errno);
+            close(cqe->res);
         } else {
-            stop = 1;
+            _poll_set_busy_poll(cqe->res, poll);
+            p = node->data.accept((const struct sockaddr *)&ss, len, cqe->res, node->data.context);
+            if (!p) {
+                logd("node->data.accept error!");
+                _poll_uring_node_error(node, errno, poll);
+                return;
+            }
+
+            res->data = node->data;
+            res->data.result = p;
+            res->error = 0;
+            res->state = PR_ST_SUCCESS;
+            poll->cb((CPollResult *)res, poll->ctx);
+
+            res = (CPollNode*) slab_alloc(&_poll_node_slab);
+            node->res = res;
+            if (!res) {
+                logd("malloc CPollNode error!");
+                _poll_uring_node_error(node, errno, poll);
+                return;
+            }
         }
+    } else if (cqe->res == -ECANCELED) {
+        _poll_uring_node_error(node, ETIMEDOUT, poll);
+        return;
+    } else if (cqe->res != -EAGAIN && cqe->res != -EMFILE && cqe->res != -ENFILE
+               && cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+        logd("accept return error: %d", -cqe->res);
+        _poll_uring_node_error(node, -cqe->res, poll);
+        return;
     }
 
-    return stop;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        _poll_uring_rearm(fd, gen, node, poll);
 }
 
-static void _poll_handle_timeout(const CPollNode* timeNode, CPoll *poll)
+static void _poll_uring_handle_poll(int fd, unsigned gen, const struct io_uring_cqe *cqe, CPollNode *node, CPoll *poll)
 {
-    CPollNode*                      node;
-    struct list_head                *pos, *tmp;
+    if (cqe->res < 0) {
+        _poll_uring_node_error(node, cqe->res == -ECANCELED ? ETIMEDOUT : -cqe->res, poll);
+        return;
+    }
 
-    LIST_HEAD(timeList);
+    _poll_handle_node(node, poll);
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        _poll_uring_rearm(fd, gen, node, poll);
+}
 
-    pthread_mutex_lock(&poll->mutex);
-    list_for_each_safe(pos, tmp, &poll->timeoutList) {
-        node = list_entry(pos, CPollNode, list);
-        if (__timeout_cmp(node, timeNode) <= 0) {
-            if (node->data.fd >= 0) {
-                poll->nodes[node->data.fd] = NULL;
-                _poll_del_fd(node->data.fd, node->event, poll);
+/* 代数过期的 CQE: 回收缓冲区, 必要时暂存数据或关闭多收的连接 */
+static void _poll_uring_handle_stale(int fd, unsigned gen, int op, const struct io_uring_cqe *cqe, CPoll *poll)
+{
+    CPollUringGen *g = &poll->uring.gens[fd];
+    CPollUringCarry *carry;
+    unsigned short bid;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && poll->nodes[fd]
+            && ((gen - g->delGen) & URING_UD_GEN_MASK) < ((g->gen - g->delGen) & URING_UD_GEN_MASK)) {
+            // fd 仍在注册中, 只是被 poll_mod 换成了其它操作
+            carry = (CPollUringCarry*) malloc (sizeof (CPollUringCarry) + cqe->res);
+            if (carry) {
+                carry->fd = fd;
+                carry->size = cqe->res;
+                memcpy(carry->data, poll->uring.bufs + (size_t)bid * C_POLL_URING_BUF_SIZE, cqe->res);
+                list_add_tail(&carry->list, &poll->uring.carryList);
             }
-
-            list_move_tail(pos, &timeList);
-        } else {
-            break;
         }
+
+        _poll_uring_recycle(bid, poll);
+    } else if (op == PD_OP_LISTEN && cqe->res >= 0) {
+        close(cqe->res);
     }
+}
 
-    if (poll->treeFirst) {
-        while (1) {
-            node = RB_ENTRY(poll->treeFirst, CPollNode, rb);
-            if (__timeout_cmp(node, timeNode) < 0) {
-                if (node->data.fd >= 0) {
-                    poll->nodes[node->data.fd] = NULL;
-                    _poll_del_fd(node->data.fd, node->event, poll);
-                }
+static void _poll_uring_handle_cqe(const struct io_uring_cqe *cqe, CPoll *poll)
+{
+    unsigned long long data = cqe->user_data;
+    int fd = (int)(data & URING_UD_FD_MASK);
+    unsigned gen = (data >> URING_UD_GEN_SHIFT) & URING_UD_GEN_MASK;
+    int op = (int)((data >> URING_UD_OP_SHIFT) & URING_UD_OP_MASK);
+    CPollNode *node = NULL;
 
-                poll->treeFirst = rb_next(poll->treeFirst);
-                rb_erase(&node->rb, &poll->timeoutTree);
-                list_add_tail(&node->list, &timeList);
-                if (poll->treeFirst) {
-                    continue;
-                }
+    pthread_mutex_lock(&poll->mutex);
+    if ((poll->uring.gens[fd].gen & URING_UD_GEN_MASK) == gen)
+        node = poll->nodes[fd];
 
-                poll->treeLast = NULL;
-            }
-            break;
-        }
-    }
+    if (!node)
+        _poll_uring_handle_stale(fd, gen, op, cqe, poll);
 
     pthread_mutex_unlock(&poll->mutex);
-    while (!list_empty(&timeList)) {
-        node = list_entry(timeList.next, CPollNode, list);
-        list_del(&node->list);
+    if (!node)
+        return;
 
-        node->error = ETIMEDOUT;
-        node->state = PR_ST_ERROR;
-        free(node->res);
-        poll->cb((CPollResult *)node, poll->ctx);
-    }
+    if ((data & URING_UD_KIND_MASK) == URING_UD_CARRY)
+        _poll_uring_handle_carry(fd, node, poll);
+    else if (_poll_uring_is_recv(node))
+        _poll_uring_handle_recv(fd, gen, cqe, node, poll);
+    else if (node->data.operation == PD_OP_LISTEN)
+        _poll_uring_handle_accept(fd, gen, cqe, node, poll);
+    else
+        _poll_uring_handle_poll(fd, gen, cqe, node, poll);
 }
 
-static void _poll_set_timer(CPoll *poll)
+/* 提交积压的 sqe 并等待, 一次 io_uring_enter 完成提交与等待. block 为 0 时只收割已完成的请求 */
+static int _poll_uring_wait(struct io_uring_cqe *cqes, int maxEvents, int block, CPoll *poll)
 {
-    CPollNode* node = NULL;
-    CPollNode* first = NULL;
-    struct timespec absTime;
+    CPollUring *ring = &poll->uring;
+    unsigned head = *ring->cqHead;
+    unsigned toSubmit;
+    int n = 0;
+    int ret;
 
     pthread_mutex_lock(&poll->mutex);
-    if (!list_empty(&poll->timeoutList)) {
-        node = list_entry(poll->timeoutList.next, CPollNode, list);
-    }
+    ring->wakePending = 0;
+    if (ring->backlogSize > 0)
+        _poll_uring_drain_backlog(poll);
 
-    if (poll->treeFirst) {
-        first = RB_ENTRY(poll->treeFirst, CPollNode, rb);
-        if (!node || __timeout_cmp(first, node) < 0) {
-            // first时间 < node时间 或 node == NULL
-            node = first;
+    toSubmit = ring->toSubmit;
+    pthread_mutex_unlock(&poll->mutex);
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) || toSubmit > 0) {
+        ret = _poll_uring_enter(poll->pfd, toSubmit, block, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+            loge("io_uring_enter error: %d", errno);
+
+        if (ret > 0) {
+            pthread_mutex_lock(&poll->mutex);
+            ring->toSubmit -= ret;
+            pthread_mutex_unlock(&poll->mutex);
         }
     }
 
-    if (node) {
-        absTime = node->timeout;
-    } else {
-        absTime.tv_sec = 0;
-        absTime.tv_nsec = 0;
+    while (n < maxEvents && head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        cqes[n++] = ring->cqes[head & *ring->cqMask];
+        head++;
     }
 
-    _poll_set_timer_fd (poll->timerFd, &absTime, poll);
-    pthread_mutex_unlock (&poll->mutex);
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return n;
 }
 
-static void* _poll_handle_read_routine(void *arg)
+static int _poll_uring_spin(struct io_uring_cqe *cqes, int maxEvents, CPoll *poll)
 {
-    int                 nEvents;
-    int                 hasPipeEvent;
-    CPoll*              poll = (CPoll*)arg;
-    _poll_event_t       events[C_POLL_EVENTS_MAX];          // epoll_event_t
-    CPollNode           timeNode;
-    CPollNode*          node;
+    struct timespec deadline;
+    int n;
+
+    if (!_poll_spin_deadline(&deadline, poll)) {
+        return 0;
+    }
+
+    // DEFER_TASKRUN 下完成事件只在 io_uring_enter 里产生, 所以空转也要进内核, 只是不等待
+    do {
+        n = _poll_uring_wait(cqes, maxEvents, 0, poll);
+        if (n > 0) {
+            C_POLL_COUNT(poll->stats.spinHits);
+            return n;
+        }
+    } while (!_poll_spin_expired(&deadline));
+
+    C_POLL_COUNT(poll->stats.spinMisses);
+
+    return 0;
+}
+
+static void* _poll_uring_routine(void *arg)
+{
+    int                     nEvents;
+    int                     hasPipeEvent;
+    CPoll*                  poll = (CPoll*)arg;
+    struct io_uring_cqe     cqes[C_POLL_EVENTS_MAX];
+    CPollNode               timeNode;
+    unsigned long long      data;
+
+    if (_poll_uring_register(poll->pfd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+        loge("enable io_uring error: %d", errno);
+        return NULL;
+    }
 
     while (1) {
         _poll_set_timer(poll);
-        nEvents = _poll_wait(events, C_POLL_EVENTS_MAX, poll);
+        nEvents = _poll_uring_spin(cqes, C_POLL_EVENTS_MAX, poll);
+        if (nEvents <= 0) {
+            nEvents = _poll_uring_wait(cqes, C_POLL_EVENTS_MAX, 1, poll);
+            C_POLL_COUNT(poll->stats.waits);
+        }
+
         clock_gettime(CLOCK_MONOTONIC, &timeNode.timeout);
+        _poll_spin_update(&timeNode.timeout, nEvents, poll);
         hasPipeEvent = 0;
         for (int i = 0; i < nEvents; ++i) {
-            node = (CPollNode*)_poll_event_data(&events[i]);
-            if (node > (CPollNode*)1) {
-                switch (node->data.operation) {
-                    case PD_OP_READ: {
-                        _poll_handle_read(node, poll);
-                        break;
-                    }
-                    case PD_OP_WRITE: {
-                        _poll_handle_write(node, poll);
-                        break;
-                    }
-                    case PD_OP_LISTEN: {
-                        _poll_handle_listen(node, poll);
-                        break;
-                    }
-                    case PD_OP_CONNECT: {
-                        _poll_handle_connect(node, poll);
-                        break;
-                    }
-                    case PD_OP_SSL_ACCEPT: {
-                        _poll_handle_ssl_accept(node, poll);
-                        break;
-                    }
-                    case PD_OP_SSL_CONNECT: {
-                        _poll_handle_ssl_connect(node, poll);
-                        break;
-                    }
-                    case PD_OP_SSL_SHUTDOWN: {
-                        _poll_handle_ssl_shutdown(node, poll);
-                        break;
-                    }
-                    case PD_OP_EVENT: {
-                        _poll_handle_event(node, poll);
-                        break;
-                    }
-                    case PD_OP_NOTIFY: {
-                        _poll_handle_notify(node, poll);
-                        break;
+            data = cqes[i].user_data;
+            switch (data & URING_UD_KIND_MASK) {
+                case URING_UD_INTERNAL: {
+                    if ((data & URING_UD_FD_MASK) == URING_INTERNAL_PIPE)
+                        hasPipeEvent = 1;
+
+                    if ((data & URING_UD_FD_MASK) != URING_INTERNAL_IGNORE && !(cqes[i].flags & IORING_CQE_F_MORE)) {
+                        pthread_mutex_lock(&poll->mutex);
+                        if ((data & URING_UD_FD_MASK) == URING_INTERNAL_PIPE)
+                            _poll_uring_add_internal(poll->pipeRd, URING_INTERNAL_PIPE, poll);
+                        else
+                            _poll_uring_add_internal(poll->timerFd, URING_INTERNAL_TIMER, poll);
+                        pthread_mutex_unlock(&poll->mutex);
                     }
+                    break;
+                }
+                case URING_UD_TIMEOUT: {
+                    break;
+                }
+                default: {
+                    _poll_uring_handle_cqe(&cqes[i], poll);
+                    break;
                 }
-            }
-            else if (node == (CPollNode*)1) {
-                hasPipeEvent = 1;
             }
         }
 
@@ -888,15 +2272,11 @@ static void* _poll_handle_read_routine(void *arg)
         _poll_handle_timeout(&timeNode, poll);
     }
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    # ifdef CRYPTO_LOCK_ECDH
-	ERR_remove_thread_state(NULL);
-# else
-	ERR_remove_state(0);
-# endif
-#endif
+    _poll_thread_cleanup();
+
     return NULL;
 }
+#endif
 
 static int _poll_open_pipe(CPoll *poll)
 {
@@ -904,6 +2284,10 @@ static int _poll_open_pipe(CPoll *poll)
 
     // pipe() 返回 pipeFd[0] 用于读, pipeFd[1] 用于写，实现进程通信
     if (pipe(pipeFd) >= 0) {
+        // io_uring 的 CQE 可能滞后于管道状态, 读端不能阻塞
+        if (poll->engine == CPOLL_ENGINE_URING)
+            fcntl(pipeFd[0], F_SETFL, O_NONBLOCK);
+
         if (_poll_add_fd(pipeFd[0], EPOLLIN, (void*)1, poll) >= 0) {
             poll->pipeRd = pipeFd[0];
             poll->pipeWr = pipeFd[1];
@@ -933,7 +2317,7 @@ static int _poll_create_timer(CPoll *poll)
     return -1;
 }
 
-CPoll* _poll_create(void** nodesBuf, const CPollParams *params)
+static CPoll* _poll_create_local(void** nodesBuf, const CPollParams *params)
 {
     CPoll *poll = (CPoll*) malloc (sizeof (CPoll));
     if (!poll) {
@@ -941,13 +2325,16 @@ CPoll* _poll_create(void** nodesBuf, const CPollParams *params)
     }
 
     int ret;
-    poll->pfd = _poll_create_pfd();
+    struct timespec now;
+    poll->maxOpenFiles = params->maxOpenFiles;
+    poll->engine = params->engine;
+    poll->stopped = 1;
+    poll->pfd = _poll_create_pfd(poll);
     if (poll->pfd >= 0) {
         if (_poll_create_timer(poll) >= 0) {
             ret = pthread_mutex_init(&poll->mutex, NULL);
             if (ret == 0) {
                 poll->nodes = (CPollNode**) nodesBuf;
-                poll->maxOpenFiles = params->maxOpenFiles;
                 poll->createMessage = params->createMessage;
                 poll->partialWritten = params->partialWritten;
                 poll->cb = params->callback;
@@ -956,10 +2343,18 @@ CPoll* _poll_create(void** nodesBuf, const CPollParams *params)
                 poll->timeoutTree.rbNode = NULL;
                 poll->treeFirst = NULL;
                 poll->treeLast = NULL;
-                INIT_LIST_HEAD(&poll->timeoutList);
+                poll->timerArmed.tv_sec = 0;
+                poll->timerArmed.tv_nsec = 0;
                 INIT_LIST_HEAD(&poll->noTimeoutList);
 
-                poll->stopped = 1;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                poll->spinBudget = 0;
+                poll->sockBusyPoll = 0;
+                poll->zerocopyThreshold = 0;
+                poll->eventGap = C_POLL_GAP_MAX;
+                poll->lastEvent = now;
+                memset(&poll->stats, 0, sizeof (CPollStats));
+                timer_wheel_init(timer_wheel_tick_floor(&now), &poll->timeoutWheel);
 
                 return poll;
             }
@@ -967,6 +2362,10 @@ CPoll* _poll_create(void** nodesBuf, const CPollParams *params)
             errno = ret;
             close(poll->timerFd);
         }
+#ifdef C_POLL_URING
+        if (poll->engine == CPOLL_ENGINE_URING)
+            _poll_uring_destroy(poll);
+#endif
         close(poll->pfd);
     }
 
@@ -975,13 +2374,42 @@ CPoll* _poll_create(void** nodesBuf, const CPollParams *params)
     return NULL;
 }
 
+/**
+ * @brief
+ *  创建时临时把当前线程绑到 poll 线程的核上, epoll/io_uring 的内核对象和新映射的内存 (first-touch)
+ *  都分配在 poll 线程所在的 NUMA 节点
+ */
+CPoll* _poll_create(void** nodesBuf, const CPollParams *params, int cpu)
+{
+    cpu_set_t old, set;
+    int bound = 0;
+    CPoll* poll;
+
+    if (cpu >= 0 && pthread_getaffinity_np(pthread_self(), sizeof (cpu_set_t), &old) == 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        bound = pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), &set) == 0;
+    }
+
+    poll = _poll_create_local(nodesBuf, params);
+    if (bound) {
+        pthread_setaffinity_np(pthread_self(), sizeof (cpu_set_t), &old);
+    }
+
+    if (poll) {
+        poll->cpu = cpu;
+    }
+
+    return poll;
+}
+
 CPoll* poll_create(const CPollParams *params)
 {
     CPoll* poll = NULL;
     void** nodesBuf = (void**) calloc (params->maxOpenFiles, sizeof(void*));
 
     if (nodesBuf) {
-        poll = _poll_create(nodesBuf, params);
+        poll = _poll_create(nodesBuf, params, params->cpus && params->nCpus ? params->cpus[0] : -1);
         if (poll) {
             return poll;
         }
@@ -997,6 +2425,10 @@ void _poll_destroy(CPoll *poll)
     logv("");
     pthread_mutex_destroy(&poll->mutex);
     close(poll->timerFd);
+#ifdef C_POLL_URING
+    if (poll->engine == CPOLL_ENGINE_URING)
+        _poll_uring_destroy(poll);
+#endif
     close(poll->pfd);
     free(poll);
 }
@@ -1007,14 +2439,38 @@ void poll_destroy(CPoll *poll)
     _poll_destroy(poll);
 }
 
+int poll_get_engine(const CPoll *poll)
+{
+    return poll->engine;
+}
+
 int poll_start (CPoll *poll)
 {
     int                 ret;
     pthread_t           tid;
+    pthread_attr_t      attr;
+    cpu_set_t           set;
 
     pthread_mutex_lock(&poll->mutex);
     if (_poll_open_pipe(poll) >= 0) {
-        ret = pthread_create(&tid, NULL, _poll_handle_read_routine, poll);
+        void* (*routine)(void*) = _poll_handle_read_routine;
+#ifdef C_POLL_URING
+        if (poll->engine == CPOLL_ENGINE_URING)
+            routine = _poll_uring_routine;
+#endif
+        ret = pthread_attr_init(&attr);
+        if (ret == 0) {
+            // 线程一开始就在绑定的核上运行, 栈和线程内分配的内存也在本地节点
+            if (poll->cpu >= 0) {
+                CPU_ZERO(&set);
+                CPU_SET(poll->cpu, &set);
+                pthread_attr_setaffinity_np(&attr, sizeof (cpu_set_t), &set);
+            }
+
+            ret = pthread_create(&tid, &attr, routine, poll);
+            pthread_attr_destroy(&attr);
+        }
+
         if (ret == 0) {
             poll->tid = tid;
             poll->stopped = 0;
@@ -1030,28 +2486,30 @@ int poll_start (CPoll *poll)
     return -poll->stopped;
 }
 
+/**
+ * @brief
+ *  fd 超时放入时间轮 (向上取整到毫秒), 定时器保持精确时间放入红黑树.
+ *  只有比 timerfd 当前设置更早时才立即设置, 其余的由 poll 线程在下一轮统一设置.
+ */
 static void _poll_insert_node(CPollNode *node, CPoll *poll)
 {
-    logv("");
-    CPollNode *end;
-
-    end = list_entry(poll->timeoutList.prev, CPollNode, list);
-    if (list_empty(&poll->timeoutList)) {
-        list_add(&node->list, &poll->timeoutList);
-        end = RB_ENTRY(poll->treeFirst, CPollNode, rb);
-    } else if (__timeout_cmp(node, end) >= 0) {
-        list_add_tail(&node->list, &poll->timeoutList);
-        return;
-    } else {
-        _poll_tree_insert(node, poll);
-        if (&node->rb != poll->treeFirst)
-            return;
+    CPollNode timeNode;
+    CPollNode armed;
 
-        end = list_entry(poll->timeoutList.next, CPollNode, list);
+    if (node->data.operation == PD_OP_TIMER) {
+        _poll_tree_insert(node, poll);
+        timeNode.timeout = node->timeout;
+    } else {
+        node->wheel.expire = timer_wheel_tick_ceil(&node->timeout);
+        timer_wheel_add(&node->wheel, &poll->timeoutWheel);
+        node->inWheel = 1;
+        timer_wheel_tick_to_timespec(node->wheel.expire, &timeNode.timeout);
     }
 
-    if (!poll->treeFirst || __timeout_cmp(node, end) < 0) {
-        _poll_set_timer_fd(poll->timerFd, &node->timeout, poll);
+    armed.timeout = poll->timerArmed;
+    if ((!armed.timeout.tv_sec && !armed.timeout.tv_nsec) || __timeout_cmp(&timeNode, &armed) < 0) {
+        _poll_set_timer_fd(poll->timerFd, &timeNode.timeout, poll);
+        poll->timerArmed = timeNode.timeout;
     }
 }
 
@@ -1119,18 +2577,23 @@ int poll_add (const CPollData *data, int timeout, CPoll *poll)
     }
 
     if (needRes) {
-        res = (CPollNode *)malloc(sizeof (CPollNode));
+        res = (CPollNode*) slab_alloc(&_poll_node_slab);
         if (!res) {
             return -1;
         }
     }
 
-    node = (CPollNode *)malloc(sizeof (CPollNode));
+    node = (CPollNode*) slab_alloc(&_poll_node_slab);
     if (node) {
         node->data = *data;
         node->event = event;
         node->inRBTree = 0;
+        node->inWheel = 0;
         node->removed = 0;
+        node->timeoutLinked = poll->engine == CPOLL_ENGINE_URING && timeout >= 0;
+        node->zerocopy = 0;
+        node->zerocopyPending = 0;
+        node->zerocopyError = 0;
         node->res = res;
         if (timeout >= 0) {
             _poll_node_set_timeout(timeout, node);
@@ -1139,7 +2602,7 @@ int poll_add (const CPollData *data, int timeout, CPoll *poll)
         pthread_mutex_lock(&poll->mutex);
         if (!poll->nodes[data->fd]) {
             if (_poll_add_fd(data->fd, event, node, poll) >= 0) {
-                if (timeout >= 0) {
+                if (timeout >= 0 && !node->timeoutLinked) {
                     _poll_insert_node(node, poll);
                 } else {
                     list_add_tail(&node->list, &poll->noTimeoutList);
@@ -1155,10 +2618,10 @@ int poll_add (const CPollData *data, int timeout, CPoll *poll)
             return 0;
         }
 
-        free(node);
+        slab_free(node);
     }
 
-    free(res);
+    slab_free(res);
     return -1;
 }
 
@@ -1175,19 +2638,13 @@ int poll_del(int fd, CPoll *poll)
     node = poll->nodes[fd];
     if (node) {
         poll->nodes[fd] = NULL;
-
-        if (node->inRBTree) {
-            _poll_tree_erase(node, poll);
-        } else {
-            list_del(&node->list);
-        }
-
+        _poll_unlink_node(node, poll);
         _poll_del_fd(fd, node->event, poll);
 
         node->error = 0;
         node->state = PR_ST_DELETED;
         if (poll->stopped) {
-            free(node->res);
+            slab_free(node->res);
             poll->cb((CPollResult *)node, poll->ctx);
         } else {
             node->removed = 1;
@@ -1219,17 +2676,22 @@ int poll_mod(const CPollData *data, int timeout, CPoll *poll)
         return -1;
 
     if (need_res) {
-        res = (CPollNode *)malloc(sizeof (CPollNode));
+        res = (CPollNode*) slab_alloc(&_poll_node_slab);
         if (!res)
             return -1;
     }
 
-    node = (CPollNode *)malloc(sizeof (CPollNode));
+    node = (CPollNode*) slab_alloc(&_poll_node_slab);
     if (node) {
         node->data = *data;
         node->event = event;
         node->inRBTree = 0;
+        node->inWheel = 0;
         node->removed = 0;
+        node->timeoutLinked = poll->engine == CPOLL_ENGINE_URING && timeout >= 0;
+        node->zerocopy = 0;
+        node->zerocopyPending = 0;
+        node->zerocopyError = 0;
         node->res = res;
         if (timeout >= 0) {
             _poll_node_set_timeout(timeout, node);
@@ -1239,22 +2701,19 @@ int poll_mod(const CPollData *data, int timeout, CPoll *poll)
         old = poll->nodes[data->fd];
         if (old) {
             if (_poll_mod_fd(data->fd, old->event, event, node, poll) >= 0) {
-                if (old->inRBTree)
-                    _poll_tree_erase(old, poll);
-                else
-                    list_del(&old->list);
+                _poll_unlink_node(old, poll);
 
                 old->error = 0;
                 old->state = PR_ST_MODIFIED;
                 if (poll->stopped) {
-                    free(old->res);
+                    slab_free(old->res);
                     poll->cb((CPollResult *)old, poll->ctx);
                 } else {
                     old->removed = 1;
                     write(poll->pipeWr, &old, sizeof (void *));
                 }
 
-                if (timeout >= 0)
+                if (timeout >= 0 && !node->timeoutLinked)
                     _poll_insert_node(node, poll);
                 else
                     list_add_tail(&node->list, &poll->noTimeoutList);
@@ -1270,10 +2729,10 @@ int poll_mod(const CPollData *data, int timeout, CPoll *poll)
         if (node == NULL)
             return 0;
 
-        free(node);
+        slab_free(node);
     }
 
-    free(res);
+    slab_free(res);
     return -1;
 }
 
@@ -1293,14 +2752,25 @@ int poll_set_timeout(int fd, int timeout, CPoll *poll)
 
     pthread_mutex_lock(&poll->mutex);
     node = poll->nodes[fd];
-    if (node) {
-        if (node->inRBTree) {
-            _poll_tree_erase(node, poll);
-        }
-        else {
-            list_del(&node->list);
+#ifdef C_POLL_URING
+    if (node && node->timeoutLinked) {
+        // 没有超时的链接超时推迟到很远的将来
+        if (timeout >= 0) {
+            node->timeout = time_node.timeout;
+        } else {
+            node->timeout.tv_sec = INT_MAX;
+            node->timeout.tv_nsec = 0;
         }
 
+        _poll_uring_update_timeout(fd, node, poll);
+        _poll_uring_wake(poll);
+        pthread_mutex_unlock(&poll->mutex);
+        return 0;
+    }
+#endif
+
+    if (node) {
+        _poll_unlink_node(node, poll);
         if (timeout >= 0) {
             node->timeout = time_node.timeout;
             _poll_insert_node(node, poll);
@@ -1317,16 +2787,26 @@ int poll_set_timeout(int fd, int timeout, CPoll *poll)
     return -!node;
 }
 
+void poll_free_result(CPollResult *res)
+{
+    slab_free(res);
+}
+
 int poll_add_timer(const struct timespec *value, void *context, CPoll *poll)
 {
-    CPollNode *node = (CPollNode *)malloc(sizeof (CPollNode));
+    CPollNode *node = (CPollNode*) slab_alloc(&_poll_node_slab);
     if (node) {
         memset(&node->data, 0, sizeof (CPollData));
         node->data.operation = PD_OP_TIMER;
         node->data.fd = -1;
         node->data.context = context;
         node->inRBTree = 0;
+        node->inWheel = 0;
         node->removed = 0;
+        node->timeoutLinked = 0;
+        node->zerocopy = 0;
+        node->zerocopyPending = 0;
+        node->zerocopyError = 0;
         node->res = NULL;
 
         clock_gettime(CLOCK_MONOTONIC, &node->timeout);
@@ -1347,12 +2827,50 @@ int poll_add_timer(const struct timespec *value, void *context, CPoll *poll)
     return -1;
 }
 
+int poll_set_spin(const CPollSpin *spin, CPoll *poll)
+{
+    if (spin->spinBudget < 0 || spin->sockBusyPoll < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&poll->spinBudget, spin->spinBudget, __ATOMIC_RELAXED);
+    __atomic_store_n(&poll->sockBusyPoll, spin->sockBusyPoll, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void poll_get_stats(CPollStats *stats, CPoll *poll)
+{
+    stats->spinHits = __atomic_load_n(&poll->stats.spinHits, __ATOMIC_RELAXED);
+    stats->spinMisses = __atomic_load_n(&poll->stats.spinMisses, __ATOMIC_RELAXED);
+    stats->waits = __atomic_load_n(&poll->stats.waits, __ATOMIC_RELAXED);
+    stats->zerocopySends = __atomic_load_n(&poll->stats.zerocopySends, __ATOMIC_RELAXED);
+    stats->zerocopyCopied = __atomic_load_n(&poll->stats.zerocopyCopied, __ATOMIC_RELAXED);
+}
+
+int poll_set_zerocopy(size_t threshold, CPoll *poll)
+{
+#ifdef C_POLL_ZEROCOPY
+    __atomic_store_n(&poll->zerocopyThreshold, threshold, __ATOMIC_RELAXED);
+    return 0;
+#else
+    if (threshold == 0)
+        return 0;
+
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 void poll_stop (CPoll *poll)
 {
     CPollNode *node;
     struct list_head *pos, *tmp;
     void *p = NULL;
 
+    LIST_HEAD(nodeList);
+
     write(poll->pipeWr, &p, sizeof (void *));
     pthread_join(poll->tid, NULL);
     poll->stopped = 1;
@@ -1369,11 +2887,12 @@ void poll_stop (CPoll *poll)
     while (poll->timeoutTree.rbNode) {
         node = RB_ENTRY(poll->timeoutTree.rbNode, CPollNode, rb);
         rb_erase(&node->rb, &poll->timeoutTree);
-        list_add(&node->list, &poll->timeoutList);
+        list_add(&node->list, &nodeList);
     }
 
-    list_splice_init(&poll->noTimeoutList, &poll->timeoutList);
-    list_for_each_safe(pos, tmp, &poll->timeoutList) {
+    timer_wheel_splice(&nodeList, &poll->timeoutWheel);
+    list_splice_init(&poll->noTimeoutList, &nodeList);
+    list_for_each_safe(pos, tmp, &nodeList) {
         node = list_entry(pos, CPollNode, list);
         list_del(&node->list);
         if (node->data.fd >= 0) {
@@ -1383,7 +2902,7 @@ void poll_stop (CPoll *poll)
 
         node->error = 0;
         node->state = PR_ST_STOPPED;
-        free(node->res);
+        slab_free(node->res);
         poll->cb((CPollResult*)node, poll->ctx);
     }
 
@@ -6,6 +6,7 @@
 #define JARVIS_C_POLL_H
 
 #include <time.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <openssl/ssl.h>
@@ -19,7 +20,10 @@ typedef struct _CPoll           CPoll;
 typedef struct _CPollData       CPollData;
 typedef struct _CPollResult     CPollResult;
 typedef struct _CPollParams     CPollParams;
+typedef struct _CPollSpin       CPollSpin;
+typedef struct _CPollStats      CPollStats;
 typedef struct _CPollMessage    CPollMessage;
+typedef struct _CPollFileSegment    CPollFileSegment;
 
 struct _CPollMessage
 {
@@ -27,6 +31,21 @@ struct _CPollMessage
     char data[0];
 };
 
+/**
+ * @brief
+ *  要发送的一段文件. PD_OP_WRITE 的 iovec 的 iov_len 带 CPOLL_IOV_FILE 时, iov_base 指向文件段,
+ *  iov_len 的其余位是还没发送的字节数. 普通连接用 sendfile 发送, 数据不经过用户态; SSL 连接读出后加密发送.
+ */
+struct _CPollFileSegment
+{
+    int                         fd;
+    off_t                       offset;
+    size_t                      size;
+};
+
+#define CPOLL_IOV_FILE          ((size_t) 1 << (sizeof (size_t) * 8 - 1))
+#define CPOLL_IOV_LEN(iov)      ((iov)->iov_len & ~CPOLL_IOV_FILE)
+
 struct _CPollData
 {
 #define PD_OP_READ              1
@@ -48,7 +67,7 @@ struct _CPollData
     union {
         SSL*   ssl;
         void* (*accept)(const struct sockaddr*, socklen_t, int, void*);
-        void* (*event) (void*);
+        void* (*event) (void*);                         // PD_OP_EVENT: fd 可读后反复调用, 直到返回 NULL
         void* (*notify)(void*, void*);
     };
 
@@ -77,11 +96,38 @@ struct _CPollResult
 
 struct _CPollParams
 {
+#define CPOLL_ENGINE_EPOLL      0
+#define CPOLL_ENGINE_URING      1
+
     size_t                      maxOpenFiles;
     CPollMessage* (*createMessage) (void*);
     int (*partialWritten) (size_t, void *);
     void (*callback) (CPollResult*, void *);
     void* context;
+    int                         engine;                 // CPOLL_ENGINE_*, 内核不支持 io_uring 时回退到 epoll
+    const int*                  cpus;                   // 非空时第 i 个 poll 线程绑定到 cpus[i % nCpus]
+    size_t                      nCpus;
+};
+
+/**
+ * @brief
+ *  自适应忙轮询. 最近事件的平均间隔小于 spinBudget 时, poll 线程先不阻塞地空转等待最多 spinBudget 微秒,
+ *  空转期间没有事件再阻塞等待. 事件稀疏时自动退回阻塞等待, 不额外占用 CPU.
+ *  默认关闭: 事件密集时每个空转的 poll 线程会一直占满一个核, 只在核有富余、在意延迟时打开.
+ */
+struct _CPollSpin
+{
+    int                         spinBudget;             // 每次空转最多多少微秒, 0 关闭
+    int                         sockBusyPoll;           // 大于 0 时给 accept 到的连接设置 SO_BUSY_POLL (微秒) 和 SO_PREFER_BUSY_POLL
+};
+
+struct _CPollStats
+{
+    unsigned long               spinHits;               // 空转期间等到了事件
+    unsigned long               spinMisses;             // 空转用完预算, 转为阻塞等待
+    unsigned long               waits;                  // 阻塞等待次数
+    unsigned long               zerocopySends;          // 用 MSG_ZEROCOPY 发出的次数
+    unsigned long               zerocopyCopied;         // 内核仍然拷贝了数据的完成通知 (如回环连接)
 };
 
 /**
@@ -89,15 +135,66 @@ struct _CPollParams
  *  根据 struct CPollParams* 创建 CPoll, 在 CPoll 中包含有 CPollParams 所有元素
  */
 CPoll*  poll_create         (const CPollParams* params);
+int     poll_get_engine     (const CPoll* poll);
 int     poll_start          (CPoll* poll);
 int     poll_add            (const CPollData* data, int timeout, CPoll* poll);
 int     poll_del            (int fd, CPoll* poll);
 int     poll_mod            (const CPollData* data, int timeout, CPoll* poll);
 int     poll_set_timeout    (int fd, int timeout, CPoll* poll);
 int     poll_add_timer      (const struct timespec* val, void* context, CPoll* poll);
+int     poll_set_spin       (const CPollSpin* spin, CPoll* poll);     // 运行中也可以修改, 参数为负时 EINVAL
+void    poll_get_stats      (CPollStats* stats, CPoll* poll);
+
+/**
+ * @brief
+ *  PD_OP_WRITE 中连续的内存段不少于 threshold 字节时用 MSG_ZEROCOPY 发送, 内核直接引用这些内存.
+ *  全部发完后还要等内核的完成通知 (socket 的错误队列) 都到齐才回调 PR_ST_FINISHED, 之前不能释放 iovec 指向的内存.
+ *  发送出错时同样等通知到齐才回调 PR_ST_ERROR, 只有写超时不等.
+ *  threshold 为 0 时关闭, 不支持 SO_ZEROCOPY 的连接 (SSL, unix socket) 照常拷贝发送
+ */
+int     poll_set_zerocopy   (size_t threshold, CPoll* poll);
 void    poll_stop           (CPoll* poll);
 void    poll_destroy        (CPoll* poll);
 
+/**
+ * @brief
+ *  释放回调中拿到的 CPollResult, 节点来自 slab, 不能直用 free()
+ */
+void    poll_free_result    (CPollResult* res);
+
+/**
+ * @brief
+ *  发送可能带文件段的 iovec. 文件段之前的内存段合并成一次 writev, 文件段单独一次 sendfile.
+ *  返回发出的字节数, 交给 poll_iov_advance() 去掉已发送的部分
+ */
+ssize_t poll_writev         (int fd, const struct iovec* iov, int iovcnt);
+ssize_t poll_read_file      (const struct iovec* iov, void* buf, size_t size);  // 读出文件段还没发送的开头部分, 文件变短时 EIO
+int     poll_iov_advance    (struct iovec* iov, int iovcnt, size_t n);         // 返回已发送完的 iovec 个数
+
+/**
+ * @brief
+ *  SSL_CTX 设置了 SSL_OP_ENABLE_KTLS 且内核支持时, 握手后记录层交给内核 kTLS, 之后收发可以直接用 read/writev/sendfile.
+ *  内核没有 tls 模块或算法不支持时 OpenSSL 仍在用户态加解密, 这里返回 0
+ */
+static inline int poll_ssl_ktls_send(SSL* ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return 0;
+#endif
+}
+
+/* OpenSSL 里还有没取走的数据时也返回 0 */
+static inline int poll_ssl_ktls_recv(SSL* ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl);
+#else
+    return 0;
+#endif
+}
+
 
 #ifdef __cplusplus
 };
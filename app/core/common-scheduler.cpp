@@ -4,9 +4,12 @@
 
 #include "common-scheduler.h"
 
+#include <math.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <utility>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -30,6 +33,33 @@ static struct timespec *__get_abstime(int timeout, struct timespec *ts)
     return ts;
 }
 
+static inline int64_t __get_monotonic()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* xorshift, 每个线程一份, 不用加锁 */
+static inline uint32_t __sched_rand()
+{
+    static thread_local uint64_t seed;
+    uint64_t x = seed;
+
+    if (x == 0)
+        x = ((uint64_t)(uintptr_t)&seed ^ (uint64_t)__get_monotonic()) | 1;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    seed = x;
+    return (uint32_t)(x >> 32);
+}
+
+/* 峰值 EWMA 的衰减时间, 纳秒. 耗时突增时立刻跟上, 恢复后约在这个时间内降下来 */
+#define SCHED_EWMA_DECAY		10000000000.0
+
 int CommSchedTarget::init(const struct sockaddr *addr, socklen_t addrlen, int connect_timeout, int response_timeout, size_t max_connections)
 {
     int ret;
@@ -48,6 +78,8 @@ int CommSchedTarget::init(const struct sockaddr *addr, socklen_t addrlen, int co
                 mCurLoad = 0;
                 mWaitCnt = 0;
                 mGroup = NULL;
+                mEwma = 0;
+                mEwmaTime = 0;
                 return 0;
             }
 
@@ -74,7 +106,7 @@ CommTarget *CommSchedTarget::acquire(int wait_timeout)
     int ret;
 
     pthread_mutex_lock(mutex);
-    if (mGroup)
+    if (mGroup && mGroup->mPolicy == COMM_SCHED_LEAST_LOAD)
     {
         mutex = &mGroup->mMutex;
         pthread_mutex_lock(mutex);
@@ -101,11 +133,13 @@ CommTarget *CommSchedTarget::acquire(int wait_timeout)
 
     if (mCurLoad < mMaxLoad)
     {
-        mCurLoad++;
+        /* 组不用堆时, 别的线程不加锁读负载 */
+        __atomic_store_n(&mCurLoad, mCurLoad + 1, __ATOMIC_RELAXED);
         if (mGroup)
         {
-            mGroup->mCurLoad++;
-            mGroup->heapify(mIndex);
+            __atomic_add_fetch(&mGroup->mCurLoad, 1, __ATOMIC_SEQ_CST);
+            if (mGroup->mPolicy == COMM_SCHED_LEAST_LOAD)
+                mGroup->heapify(mIndex);
         }
 
         ret = 0;
@@ -121,11 +155,38 @@ CommTarget *CommSchedTarget::acquire(int wait_timeout)
     return this;
 }
 
-void CommSchedTarget::release(int keep_alive)
+void CommSchedTarget::release(int keep_alive, long long latency)
 {
     pthread_mutex_t *mutex = &mMutex;
+    int64_t now = latency >= 0 ? __get_monotonic() : 0;
+    CommSchedGroup *group;
+    int waiting;
 
     pthread_mutex_lock(mutex);
+    if (latency >= 0)
+        this->updateEwma(latency, now);
+
+    group = mGroup;
+    if (group && group->mPolicy != COMM_SCHED_LEAST_LOAD)
+    {
+        /* 不碰组锁, 只在组里有等待时才去唤醒 */
+        __atomic_store_n(&mCurLoad, mCurLoad - 1, __ATOMIC_RELAXED);
+        waiting = mWaitCnt;
+        if (waiting > 0)
+            pthread_cond_signal(&mCond);
+
+        __atomic_sub_fetch(&group->mCurLoad, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(mutex);
+        if (waiting == 0 && __atomic_load_n(&group->mWaitCnt, __ATOMIC_SEQ_CST) > 0)
+        {
+            pthread_mutex_lock(&group->mMutex);
+            pthread_cond_signal(&group->mCond);
+            pthread_mutex_unlock(&group->mMutex);
+        }
+
+        return;
+    }
+
     if (mGroup)
     {
         mutex = &mGroup->mMutex;
@@ -149,6 +210,59 @@ void CommSchedTarget::release(int keep_alive)
     pthread_mutex_unlock(mutex);
 }
 
+/* 新的耗时比当前值大时直接取新值, 否则按离上次更新的时间加权 */
+void CommSchedTarget::updateEwma(long long latency, int64_t now)
+{
+    double ewma = mEwma;
+    double w;
+
+    if (mEwmaTime == 0 || latency > ewma)
+        ewma = latency;
+    else
+    {
+        w = exp((mEwmaTime - now) / SCHED_EWMA_DECAY);
+        ewma = ewma * w + latency * (1 - w);
+    }
+
+    __atomic_store(&mEwma, &ewma, __ATOMIC_RELAXED);
+    __atomic_store_n(&mEwmaTime, now, __ATOMIC_RELAXED);
+}
+
+/* 不加锁读. 一直没有新的耗时时按 0 衰减, 慢的 target 过一会儿还会被试到 */
+double CommSchedTarget::decayedEwma(int64_t now)
+{
+    int64_t time = __atomic_load_n(&mEwmaTime, __ATOMIC_RELAXED);
+    double ewma;
+
+    __atomic_load(&mEwma, &ewma, __ATOMIC_RELAXED);
+    if (now > time)
+        ewma *= exp((time - now) / SCHED_EWMA_DECAY);
+
+    return ewma;
+}
+
+double CommSchedTarget::ewmaCost(int64_t now)
+{
+    size_t load = __atomic_load_n(&mCurLoad, __ATOMIC_RELAXED);
+
+    return (this->decayedEwma(now) + 1) * (load + 1) / mMaxLoad;
+}
+
+double CommSchedTarget::getLatency()
+{
+    return this->decayedEwma(__get_monotonic());
+}
+
+void CommSchedTarget::resetLatency()
+{
+    double ewma = 0;
+
+    pthread_mutex_lock(&mMutex);
+    __atomic_store(&mEwma, &ewma, __ATOMIC_RELAXED);
+    __atomic_store_n(&mEwmaTime, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mMutex);
+}
+
 int CommSchedGroup::target_cmp(CommSchedTarget *target1,
                                CommSchedTarget *target2)
 {
@@ -248,17 +362,31 @@ int CommSchedGroup::heap_insert(CommSchedTarget *target)
     if (mHeapSize == mHeapBufSize)
     {
         int new_size = 2 * mHeapBufSize;
-        void *new_base = realloc(mTgHeap, new_size * sizeof (void *));
+        void *new_base;
 
-        if (new_base)
+        if (mPolicy == COMM_SCHED_LEAST_LOAD)
         {
-            mTgHeap = (CommSchedTarget **)new_base;
-            mHeapBufSize = new_size;
+            new_base = realloc(mTgHeap, new_size * sizeof (void *));
+            if (new_base)
+                mTgHeap = (CommSchedTarget **)new_base;
         }
+        else
+            new_base = this->array_grow(new_size);
+
+        if (new_base)
+            mHeapBufSize = new_size;
         else
             return -1;
     }
 
+    if (mPolicy != COMM_SCHED_LEAST_LOAD)
+    {
+        __atomic_store_n(&mTgHeap[mHeapSize], target, __ATOMIC_RELAXED);
+        target->mIndex = mHeapSize;
+        __atomic_store_n(&mHeapSize, mHeapSize + 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
     mTgHeap[mHeapSize] = target;
     target->mIndex = mHeapSize;
     this->heap_adjust(mHeapSize, 0);
@@ -270,6 +398,20 @@ void CommSchedGroup::heap_remove(int index)
 {
     CommSchedTarget *target;
 
+    if (mPolicy != COMM_SCHED_LEAST_LOAD)
+    {
+        /* 不加锁的读者最多读到重复的或刚移出的 target, tryAcquire() 会检查 */
+        if (index != mHeapSize - 1)
+        {
+            target = mTgHeap[mHeapSize - 1];
+            __atomic_store_n(&mTgHeap[index], target, __ATOMIC_RELAXED);
+            target->mIndex = index;
+        }
+
+        __atomic_store_n(&mHeapSize, mHeapSize - 1, __ATOMIC_RELEASE);
+        return;
+    }
+
     mHeapSize--;
     if (index != mHeapSize)
     {
@@ -281,6 +423,27 @@ void CommSchedGroup::heap_remove(int index)
     }
 }
 
+/* 不加组锁选择 target 的线程可能还在读旧数组, 旧数组留到 deInit() 再释放 */
+void *CommSchedGroup::array_grow(int new_size)
+{
+    void **retired = (void **)realloc(mRetired, (mRetiredCnt + 1) * sizeof (void *));
+    void *new_base;
+
+    if (!retired)
+        return NULL;
+
+    mRetired = retired;
+    new_base = malloc(new_size * sizeof (void *));
+    if (new_base)
+    {
+        memcpy(new_base, mTgHeap, mHeapSize * sizeof (void *));
+        mRetired[mRetiredCnt++] = mTgHeap;
+        __atomic_store_n(&mTgHeap, (CommSchedTarget **)new_base, __ATOMIC_RELEASE);
+    }
+
+    return new_base;
+}
+
 #define COMMGROUP_INIT_SIZE		4
 
 int CommSchedGroup::init()
@@ -302,6 +465,9 @@ int CommSchedGroup::init()
                 mMaxLoad = 0;
                 mCurLoad = 0;
                 mWaitCnt = 0;
+                mPolicy = COMM_SCHED_LEAST_LOAD;
+                mRetired = NULL;
+                mRetiredCnt = 0;
                 return 0;
             }
 
@@ -319,9 +485,36 @@ void CommSchedGroup::deInit()
 {
     pthread_cond_destroy(&mCond);
     pthread_mutex_destroy(&mMutex);
+    while (mRetiredCnt > 0)
+        free(mRetired[--mRetiredCnt]);
+
+    free(mRetired);
     free(mTgHeap);
 }
 
+int CommSchedGroup::setPolicy(int policy)
+{
+    int ret = -1;
+
+    if (policy < COMM_SCHED_LEAST_LOAD || policy > COMM_SCHED_PEAK_EWMA)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&mMutex);
+    if (mHeapSize == 0)
+    {
+        mPolicy = policy;
+        ret = 0;
+    }
+    else
+        errno = EBUSY;
+
+    pthread_mutex_unlock(&mMutex);
+    return ret;
+}
+
 int CommSchedGroup::add(CommSchedTarget *target)
 {
     int ret = -1;
@@ -334,7 +527,7 @@ int CommSchedGroup::add(CommSchedTarget *target)
         {
             target->mGroup = this;
             mMaxLoad += target->mMaxLoad;
-            mCurLoad += target->mCurLoad;
+            __atomic_add_fetch(&mCurLoad, target->mCurLoad, __ATOMIC_SEQ_CST);
             if (mWaitCnt > 0 && mCurLoad < mMaxLoad)
                 pthread_cond_signal(&mCond);
 
@@ -363,7 +556,7 @@ int CommSchedGroup::remove(CommSchedTarget *target)
     {
         this->heap_remove(target->mIndex);
         mMaxLoad -= target->mMaxLoad;
-        mCurLoad -= target->mCurLoad;
+        __atomic_sub_fetch(&mCurLoad, target->mCurLoad, __ATOMIC_SEQ_CST);
         target->mGroup = NULL;
         ret = 0;
     }
@@ -383,6 +576,9 @@ CommTarget *CommSchedGroup::acquire(int wait_timeout)
     CommSchedTarget *target;
     int ret;
 
+    if (mPolicy != COMM_SCHED_LEAST_LOAD)
+        return this->acquireTwo(wait_timeout);
+
     pthread_mutex_lock(mutex);
     if (mCurLoad >= mMaxLoad)
     {
@@ -420,3 +616,115 @@ CommTarget *CommSchedGroup::acquire(int wait_timeout)
 
     return target;
 }
+
+/* 成功时占用 target. target 可能刚被移出组或者已满 */
+int CommSchedGroup::tryAcquire(CommSchedTarget *target)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&target->mMutex);
+    if (target->mGroup == this && target->mCurLoad < target->mMaxLoad)
+    {
+        __atomic_store_n(&target->mCurLoad, target->mCurLoad + 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mCurLoad, 1, __ATOMIC_SEQ_CST);
+        ret = 1;
+    }
+
+    pthread_mutex_unlock(&target->mMutex);
+    return ret;
+}
+
+/* 不加锁随机取两个 target, 返回更好的, 另一个放在 other */
+CommSchedTarget *CommSchedGroup::pickTwo(CommSchedTarget **other)
+{
+    int n = __atomic_load_n(&mHeapSize, __ATOMIC_ACQUIRE);
+    CommSchedTarget **array = __atomic_load_n(&mTgHeap, __ATOMIC_ACQUIRE);
+    CommSchedTarget *target1;
+    CommSchedTarget *target2;
+    int64_t now;
+    int i, j;
+
+    *other = NULL;
+    if (n <= 1)
+        return n == 1 ? __atomic_load_n(&array[0], __ATOMIC_RELAXED) : NULL;
+
+    i = __sched_rand() % n;
+    j = __sched_rand() % (n - 1);
+    if (j >= i)
+        j++;
+
+    target1 = __atomic_load_n(&array[i], __ATOMIC_RELAXED);
+    target2 = __atomic_load_n(&array[j], __ATOMIC_RELAXED);
+    if (mPolicy == COMM_SCHED_P2C)
+    {
+        size_t load1 = __atomic_load_n(&target1->mCurLoad, __ATOMIC_RELAXED) * target2->mMaxLoad;
+        size_t load2 = __atomic_load_n(&target2->mCurLoad, __ATOMIC_RELAXED) * target1->mMaxLoad;
+
+        if (load2 < load1)
+            std::swap(target1, target2);
+    }
+    else
+    {
+        now = __get_monotonic();
+        if (target2->ewmaCost(now) < target1->ewmaCost(now))
+            std::swap(target1, target2);
+    }
+
+    *other = target2;
+    return target1;
+}
+
+CommTarget *CommSchedGroup::acquireTwo(int wait_timeout)
+{
+    struct timespec ts;
+    struct timespec *abstime = NULL;
+    CommSchedTarget **array;
+    CommSchedTarget *target;
+    CommSchedTarget *other;
+    int ret = 0;
+    int i, k, n;
+
+    while (1)
+    {
+        target = this->pickTwo(&other);
+        if (target && this->tryAcquire(target))
+            return target;
+
+        if (other && this->tryAcquire(other))
+            return other;
+
+        /* 两个都满了, 依次试其余的 */
+        n = __atomic_load_n(&mHeapSize, __ATOMIC_ACQUIRE);
+        array = __atomic_load_n(&mTgHeap, __ATOMIC_ACQUIRE);
+        k = n > 0 ? __sched_rand() % n : 0;
+        for (i = 0; i < n; i++)
+        {
+            target = __atomic_load_n(&array[(k + i) % n], __ATOMIC_RELAXED);
+            if (this->tryAcquire(target))
+                return target;
+        }
+
+        if (wait_timeout == 0)
+        {
+            ret = EAGAIN;
+            break;
+        }
+
+        if (!abstime)
+            abstime = __get_abstime(wait_timeout, &ts);
+
+        /* release() 先减负载再看 mWaitCnt, 这里反过来, 不会漏掉唤醒 */
+        pthread_mutex_lock(&mMutex);
+        __atomic_add_fetch(&mWaitCnt, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&mCurLoad, __ATOMIC_SEQ_CST) >= mMaxLoad && ret == 0)
+            ret = PTHREAD_COND_TIMEDWAIT(&mCond, &mMutex, abstime);
+
+        __atomic_sub_fetch(&mWaitCnt, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&mMutex);
+        if (ret)
+            break;
+    }
+
+    errno = ret;
+    return NULL;
+}
@@ -5,6 +5,7 @@
 #ifndef JARVIS_COMMON_SCHEDULER_H
 #define JARVIS_COMMON_SCHEDULER_H
 
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,6 +14,11 @@
 #include "communicator.h"
 #include "../common/c-log.h"
 
+/* CommSchedGroup 选择 target 的方式 */
+#define COMM_SCHED_LEAST_LOAD           0       /* 负载 (进行中的请求 / 上限) 最小的, 用堆维护, 每次都要加组锁 */
+#define COMM_SCHED_P2C                  1       /* 随机取两个, 选负载小的 */
+#define COMM_SCHED_PEAK_EWMA            2       /* 随机取两个, 选 回复耗时的峰值 EWMA x (进行中的请求 + 1) 小的 */
+
 class CommSchedGroup;
 
 class CommSchedObject
@@ -37,6 +43,7 @@ public:
 class CommSchedTarget : public CommSchedObject, public CommTarget
 {
     friend class CommSchedGroup;
+    friend class CommSchedTest;
 public:
     int init(const struct sockaddr *addr, socklen_t addrLen,int connectTimeout, int responseTimeout, size_t maxConnections);
     void deInit();
@@ -53,27 +60,46 @@ public:
         return ret;
     }
 
+    /* 回复耗时的峰值 EWMA, 微秒 */
+    double getLatency();
+
+    /* 丢掉以前的耗时, 如熔断恢复后出错时记下的超时 */
+    void resetLatency();
+
 private:
-    virtual void release(int keepAlive); /* final */
+    virtual void release(int keepAlive, long long latency); /* final */
     virtual CommTarget* acquire(int waitTimeout); /* final */
 
+private:
+    void updateEwma(long long latency, int64_t now);
+    double decayedEwma(int64_t now);
+    double ewmaCost(int64_t now);
+
 private:
     CommSchedGroup*                 mGroup;
     int                             mIndex;
     int                             mWaitCnt;
     pthread_mutex_t                 mMutex;
     pthread_cond_t                  mCond;
+
+private:
+    double                          mEwma;          /* 回复耗时的峰值 EWMA, 微秒 */
+    int64_t                         mEwmaTime;      /* 上次更新 mEwma 的时间, 纳秒 */
 };
 
 class CommSchedGroup : public CommSchedObject
 {
     friend class CommSchedTarget;
+    friend class CommSchedTest;
 public:
     int init();
     void deInit();
     int add(CommSchedTarget *target);
     int remove(CommSchedTarget *target);
 
+    /* 只能在 add() 之前设置, 默认 COMM_SCHED_LEAST_LOAD */
+    int setPolicy(int policy);
+
 private:
     virtual CommTarget *acquire(int waitTimeout); /* final */
 
@@ -86,6 +112,17 @@ private:
     pthread_cond_t                      mCond;
 
 private:
+    /* 非 COMM_SCHED_LEAST_LOAD 时 mTgHeap 只是数组, 选择 target 不加组锁, 扩容换下的数组留到 deInit() 再释放 */
+    int                                 mPolicy;
+    void**                              mRetired;
+    int                                 mRetiredCnt;
+
+private:
+    void *array_grow(int newSize);
+    CommTarget *acquireTwo(int waitTimeout);
+    CommSchedTarget *pickTwo(CommSchedTarget **other);
+    int tryAcquire(CommSchedTarget *target);
+
     void heapify(int top);
     void heap_remove(int index);
     int heap_insert(CommSchedTarget *target);
@@ -101,6 +138,21 @@ public:
         return this->mCommon.init(pollThreads, handlerThreads);
     }
 
+    int init(size_t pollThreads, size_t handlerThreads, int pollEngine)
+    {
+        return this->mCommon.init(pollThreads, handlerThreads, pollEngine);
+    }
+
+    int init(size_t pollThreads, size_t handlerThreads, int pollEngine, const CpuAffinity* affinity)
+    {
+        return this->mCommon.init(pollThreads, handlerThreads, pollEngine, affinity);
+    }
+
+    int init(size_t pollThreads, size_t handlerThreads, int pollEngine, const CpuAffinity* affinity, int handlerMode)
+    {
+        return this->mCommon.init(pollThreads, handlerThreads, pollEngine, affinity, handlerMode);
+    }
+
     void deInit()
     {
         this->mCommon.deInit();
@@ -115,7 +167,7 @@ public:
         if (*target) {
             ret = this->mCommon.request(session, *target);
             if (ret < 0) {
-                (*target)->release(0);
+                (*target)->release(0, -1);
             }
         }
 
@@ -167,6 +219,41 @@ public:
         return this->mCommon.isHandlerThread();
     }
 
+    int setHandlerElastic(size_t maxThreads, int waitTarget, int idleTimeout)
+    {
+        return this->mCommon.setHandlerElastic(maxThreads, waitTarget, idleTimeout);
+    }
+
+    void getHandlerStats(ThreadPoolStats* stats)
+    {
+        this->mCommon.getHandlerStats(stats);
+    }
+
+    [[nodiscard]] unsigned long getHandlerOverflows() const
+    {
+        return this->mCommon.getHandlerOverflows();
+    }
+
+    int setPollSpin(int spinBudget, int sockBusyPoll)
+    {
+        return this->mCommon.setPollSpin(spinBudget, sockBusyPoll);
+    }
+
+    void getPollStats(CPollStats* stats)
+    {
+        this->mCommon.getPollStats(stats);
+    }
+
+    int setZeroCopy(size_t threshold)
+    {
+        return this->mCommon.setZeroCopy(threshold);
+    }
+
+    void getSSLStats(CommSSLStats* stats)
+    {
+        this->mCommon.getSSLStats(stats);
+    }
+
     int increaseHandlerThread()
     {
         return this->mCommon.increaseHandlerThread();
@@ -16,9 +16,13 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <openssl/ssl.h>
 #include <openssl/bio.h>
 
+#include "slab.h"
 #include "c-poll.h"
 #include "m-poll.h"
 #include "c-list.h"
@@ -50,8 +54,26 @@ public:
     CommTarget*                     target;
     CommService*                    service;
     MPoll*                          poll;
-    /* Connection entry's mutex is for client session only. */
+    CommMux*                        mux;            // 多路复用时不为空, 连接上的消息都交给它
+    int                             muxFd;          // sockFd 的 dup, poller 里一个 fd 只能有一个节点, 异步写用它
+    int                             muxProbe;       // 明文服务连接已经和多路复用的开头对上的字节数, -1 不再检查
+    /* Connection entry's mutex is for client session and multiplexed connection only. */
     pthread_mutex_t                 mutex;
+    /* 以下只用于客户端 pipelining, 由 target 的锁和连接的锁保护 */
+    struct list_head                pipeList;       // 在 target->mPipeList 里时 piped 为 1
+    struct list_head                pipeline;       // 排在 session 后面等回复的会话
+    int                             pipeCnt;
+    int                             unsent;         // pipeline 里连接建立后才发出的会话数
+    int                             piped;
+};
+
+struct _CommHandlerGroup
+{
+    MsgQueue*                       queue;
+    ThreadPool*                     pool;
+    Communicator*                   comm;
+    size_t                          nHandlers;              // 初始 handler 线程数, 积压达到这个数算忙不过来
+    unsigned long                   overflows;
 };
 
 static inline int _set_fd_nonblock(int fd)
@@ -89,6 +111,53 @@ static int _bind_and_listen(int sockFd, const struct sockaddr *addr, socklen_t a
     return listen(sockFd, SOMAXCONN);
 }
 
+/**
+ * @brief
+ *  MPoll 按 fd % n 选择 poll 线程, 把 fd 换成 fd % n == index 的编号, 使每个分片落在不同的 poll 线程上
+ */
+static int _shard_fd(int fd, unsigned int index, unsigned int n)
+{
+    int newFd;
+
+    if ((unsigned int)fd % n == index)
+        return fd;
+
+    for (int target = fd - (int)((unsigned int)fd % n) + (int)index; ; target += (int)n) {
+        newFd = fcntl(fd, F_DUPFD_CLOEXEC, target);
+        if (newFd < 0)
+            break;
+
+        if ((unsigned int)newFd % n == index) {
+            close(fd);
+            return newFd;
+        }
+
+        close(newFd);
+    }
+
+    close(fd);
+    return -1;
+}
+
+/**
+ * @brief
+ *  reuseport 组中按当前 CPU 选择第 cpu % n 个监听 fd
+ */
+static int _attach_reuseport_cbpf(int sockFd, unsigned int n)
+{
+    struct sock_filter code[] = {
+            { BPF_LD  | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU) },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+            .len = sizeof (code) / sizeof (code[0]),
+            .filter = code,
+    };
+
+    return setsockopt(sockFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof (prog));
+}
+
 static int _create_ssl(SSL_CTX* sslCtx, CommConnEntry *entry)
 {
     logv("");
@@ -118,10 +187,19 @@ static int _ssl_writev(SSL *ssl, const struct iovec vectors[], int cnt)
     size_t n;
     int i;
 
+    if (vectors[0].iov_len & CPOLL_IOV_FILE) {
+        n = poll_read_file(vectors, buf, SSL_WRITE_BUFSIZE);
+        if ((ssize_t)n < 0)
+            return -1;
+
+        SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        return SSL_write(ssl, buf, (int)n);
+    }
+
     if (vectors[0].iov_len >= SSL_WRITE_BUFSIZE || cnt == 1)
         return SSL_write(ssl, vectors[0].iov_base, vectors[0].iov_len);
 
-    for (i = 0; i < cnt; i++) {
+    for (i = 0; i < cnt && !(vectors[i].iov_len & CPOLL_IOV_FILE); i++) {
         if (vectors[i].iov_len <= nLeft)
             n = vectors[i].iov_len;
         else
@@ -154,6 +232,17 @@ int CommTarget::init(const struct sockaddr *addr, socklen_t addrLen, int connect
 
             mSSLCtx = NULL;
             mSSLConnectTimeout = 0;
+            mSSLSession = NULL;
+
+            mMinIdle = 0;
+            mMaxIdle = 0;
+            mValidateIdle = false;
+            mWarmPaused = false;
+            memset(&mPoolStats, 0, sizeof (CommPoolStats));
+
+            mPipelineDepth = 0;
+            INIT_LIST_HEAD(&mPipeList);
+            INIT_LIST_HEAD(&mMuxList);
             return 0;
         }
 
@@ -167,16 +256,114 @@ int CommTarget::init(const struct sockaddr *addr, socklen_t addrLen, int connect
 void CommTarget::deInit()
 {
     logv("");
+    if (mSSLSession)
+        SSL_SESSION_free(mSSLSession);
+
     pthread_mutex_destroy(&mMutex);
     free(mAddr);
 }
 
+static int _ssl_target_index()
+{
+    static int index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+    return index;
+}
+
+int CommTarget::initSSLSessionCache(SSL_CTX *sslCtx)
+{
+    if (_ssl_target_index() < 0)
+        return -1;
+
+    // 会话只存在各自的 CommTarget 里, 不用 OpenSSL 内部的缓存
+    SSL_CTX_set_session_cache_mode(sslCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(sslCtx, CommTarget::newSSLSession);
+    return 0;
+}
+
+/**
+ * 连接和缓存不共用 SSL_SESSION: 连接没有 SSL_shutdown() 就释放时, OpenSSL 会把它正在用的会话标成不能恢复.
+ * 连接断开是常事, 不能因此让目标上缓存的会话失效
+ */
+void CommTarget::resumeSSL(SSL *ssl)
+{
+    SSL_SESSION *session = NULL;
+
+    SSL_set_ex_data(ssl, _ssl_target_index(), this);
+    pthread_mutex_lock(&mMutex);
+    if (mSSLSession)
+        session = SSL_SESSION_dup(mSSLSession);
+
+    pthread_mutex_unlock(&mMutex);
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+}
+
+/* 握手失败时不再用缓存的会话 */
+void CommTarget::dropSSLSession()
+{
+    SSL_SESSION *session;
+
+    pthread_mutex_lock(&mMutex);
+    session = mSSLSession;
+    mSSLSession = NULL;
+    pthread_mutex_unlock(&mMutex);
+    if (session)
+        SSL_SESSION_free(session);
+}
+
+/* 握手完成或收到 TLS 1.3 的 ticket 时由 OpenSSL 调用 */
+int CommTarget::newSSLSession(SSL *ssl, SSL_SESSION *session)
+{
+    auto *target = (CommTarget *)SSL_get_ex_data(ssl, _ssl_target_index());
+    SSL_SESSION *old;
+
+    if (!target || !(session = SSL_SESSION_dup(session)))
+        return 0;
+
+    pthread_mutex_lock(&target->mMutex);
+    old = target->mSSLSession;
+    target->mSSLSession = session;
+    pthread_mutex_unlock(&target->mMutex);
+    if (old)
+        SSL_SESSION_free(old);
+
+    return 0;
+}
+
+void CommTarget::setPoolPolicy(size_t minIdle, size_t maxIdle, bool validateIdle)
+{
+    if (maxIdle > 0 && minIdle > maxIdle)
+        minIdle = maxIdle;
+
+    mMinIdle = minIdle;
+    mMaxIdle = maxIdle;
+    mValidateIdle = validateIdle;
+}
+
+void CommTarget::getPoolStats(CommPoolStats *stats)
+{
+    pthread_mutex_lock(&mMutex);
+    *stats = mPoolStats;
+    pthread_mutex_unlock(&mMutex);
+    stats->reused = __atomic_load_n(&mPoolStats.reused, __ATOMIC_RELAXED);
+    stats->invalid = __atomic_load_n(&mPoolStats.invalid, __ATOMIC_RELAXED);
+    stats->pipelined = __atomic_load_n(&mPoolStats.pipelined, __ATOMIC_RELAXED);
+    stats->replayed = __atomic_load_n(&mPoolStats.replayed, __ATOMIC_RELAXED);
+}
+
 int CommMessageIn::feedback(const void *buf, size_t size)
 {
     logv("");
     CommConnEntry *entry = mEntry;
     int ret;
 
+    /* 多路复用的连接不能直接写, 由 CommMux 自己回复 */
+    if (entry->mux)
+        return size;
+
     if (!entry->ssl)
         return write(entry->sockFd, buf, size);
 
@@ -199,6 +386,9 @@ void CommMessageIn::reNew()
 {
     logv("");
     CommSession *session = mEntry->session;
+    if (mEntry->mux)
+        return;
+
     session->mTimeout = -1;
     session->mBeginTime.tv_nsec = -1;
 }
@@ -220,6 +410,13 @@ int CommService::init(const struct sockaddr* bindAddr, socklen_t addrLen, int li
 
             mSSLCtx = nullptr;
             mSSLAcceptTimeout = 0;
+            mReusePort = false;
+            mReusePortCBPF = false;
+            mMux = false;
+            mMuxPreface = nullptr;
+            mMuxPrefaceLen = 0;
+            mShardFds = nullptr;
+            mShardCount = 0;
 
             return 0;
         }
@@ -235,6 +432,7 @@ void CommService::deInit()
 {
     logv("");
     pthread_mutex_destroy(&mMutex);
+    free(mShardFds);
     free(mBindAddr);
 }
 
@@ -327,7 +525,9 @@ CommSession::~CommSession()
         return;
 
     target = mTarget;
-    if (mPassive == 1) {
+    if (mPassive == 1 && mMux)
+        Communicator::cancelMux(this);
+    else if (mPassive == 1) {
         pthread_mutex_lock(&target->mMutex);
         if (!list_empty(&target->mIdleList)) {
             pos = target->mIdleList.next;
@@ -342,6 +542,207 @@ CommSession::~CommSession()
     ((CommServiceTarget *)target)->decref();
 }
 
+#define MUX_BUF_SIZE_MIN        16384
+
+CommMux::CommMux()
+{
+    mActive = 0;
+    mReceiving = 0;
+    mBuf = NULL;
+    mBufSize = 0;
+    mBufLen = 0;
+    mBufOff = 0;
+    mPlain = NULL;
+    mPlainSize = 0;
+    mPlainLen = 0;
+    mWriteBuf = NULL;
+    mWriting = 0;
+    mClosed = 0;
+    mKeepAlive = 0;
+    mAvailable = 0;
+    mSSL = NULL;
+    INIT_LIST_HEAD(&mDoneList);
+    INIT_LIST_HEAD(&mReplayList);
+}
+
+CommMux::~CommMux()
+{
+    free(mWriteBuf);
+    free(mPlain);
+    free(mBuf);
+}
+
+int CommMux::append(const void *buf, size_t *size)
+{
+    errno = EBADMSG;
+    return -1;
+}
+
+static int _mux_buf_append(char **buf, size_t *size, size_t *len, const void *data, size_t n)
+{
+    size_t newSize = *size;
+    char *p;
+
+    if (*len + n > newSize) {
+        if (newSize == 0)
+            newSize = MUX_BUF_SIZE_MIN;
+
+        while (newSize < *len + n)
+            newSize *= 2;
+
+        p = (char *)realloc(*buf, newSize);
+        if (!p)
+            return -1;
+
+        *buf = p;
+        *size = newSize;
+    }
+
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+int CommMux::output(const void *buf, size_t size)
+{
+    if (mSSL)
+        return _mux_buf_append(&mPlain, &mPlainSize, &mPlainLen, buf, size);
+
+    return _mux_buf_append(&mBuf, &mBufSize, &mBufLen, buf, size);
+}
+
+size_t CommMux::pending() const
+{
+    return mBufLen - mBufOff + mPlainLen;
+}
+
+/* 明文加密后放进发送缓冲. 连接的 BIO 是内存 BIO, SSL_write() 不会阻塞 */
+int CommMux::encrypt()
+{
+    BIO *wbio = SSL_get_wbio(mSSL);
+    size_t off = 0;
+    char *data;
+    long len;
+    int ret;
+
+    while (off < mPlainLen) {
+        len = mPlainLen - off;
+        if (len > MUX_BUF_SIZE_MIN)
+            len = MUX_BUF_SIZE_MIN;
+
+        ret = SSL_write(mSSL, mPlain + off, len);
+        if (ret <= 0) {
+            ret = SSL_get_error(mSSL, ret);
+            if (ret != SSL_ERROR_SYSCALL)
+                errno = -ret;
+
+            return -1;
+        }
+
+        off += ret;
+    }
+
+    mPlainLen = 0;
+    len = BIO_get_mem_data(wbio, &data);
+    if (len > 0) {
+        if (_mux_buf_append(&mBuf, &mBufSize, &mBufLen, data, len) < 0)
+            return -1;
+
+        (void)BIO_reset(wbio);
+    }
+
+    return 0;
+}
+
+int CommMux::decrypt(const void *buf, size_t size)
+{
+    char plain[MUX_BUF_SIZE_MIN];
+    int ret;
+
+    if (BIO_write(SSL_get_rbio(mSSL), buf, size) != (int)size)
+        return -1;
+
+    while ((ret = SSL_read(mSSL, plain, sizeof plain)) > 0) {
+        if (this->input(plain, ret) < 0)
+            return -1;
+    }
+
+    ret = SSL_get_error(mSSL, ret);
+    if (ret == SSL_ERROR_WANT_READ)
+        return 0;
+
+    if (ret == SSL_ERROR_ZERO_RETURN)
+        errno = ECONNRESET;
+    else if (ret != SSL_ERROR_SYSCALL)
+        errno = -ret;
+
+    return -1;
+}
+
+CommSession *CommMux::newSession()
+{
+    CommConnEntry *entry = mEntry;
+    CommTarget *target = entry->target;
+    CommSession *session;
+
+    session = entry->service->newSession(entry->seq, entry->conn);
+    if (!session)
+        return NULL;
+
+    session->mPassive = 1;
+    session->mMux = this;
+    session->mTarget = target;
+    session->mConn = entry->conn;
+    session->mSeq = entry->seq++;
+    session->mOut = NULL;
+    __sync_add_and_fetch(&entry->ref, 1);
+    ((CommServiceTarget *)target)->incref();
+
+    session->mIn = session->messageIn();
+    if (!session->mIn) {
+        this->done(session, CS_STATE_ERROR, errno);
+        return NULL;
+    }
+
+    session->mIn->mEntry = entry;
+    session->mIn->mSession = session;
+    return session;
+}
+
+int CommMux::appendMessage(const void *buf, size_t *size, CommSession *session)
+{
+    return session->mIn->append(buf, size);
+}
+
+int CommMux::encodeMessage(struct iovec vectors[], int max, CommSession *session)
+{
+    return session->mOut->encode(vectors, max);
+}
+
+void CommMux::done(CommSession *session, int state, int error)
+{
+    session->mMuxState = state;
+    session->mMuxError = error;
+    if (state == CS_STATE_SUCCESS)
+        mKeepAlive = session->keepAliveTimeout();
+
+    list_add_tail(&session->mPipeList, &mDoneList);
+}
+
+void CommMux::replay(CommSession *session, int unprocessed)
+{
+    /* 只重发一次 */
+    if (session->mPipelined < 0) {
+        this->done(session, CS_STATE_ERROR, ECONNRESET);
+        return;
+    }
+
+    if (unprocessed)
+        session->mPipelined = 2;
+
+    list_add_tail(&session->mPipeList, &mReplayList);
+}
+
 inline int Communicator::firstTimeout(CommSession *session)
 {
     logv("");
@@ -399,9 +800,14 @@ void Communicator::releaseConn(CommConnEntry *entry)
 {
     logv("");
     delete entry->conn;
-    if (!entry->service)
+    if (!entry->service || entry->service->mMux)
         pthread_mutex_destroy(&entry->mutex);
 
+    if (entry->mux) {
+        delete entry->mux;
+        close(entry->muxFd);
+    }
+
     if (entry->ssl)
         SSL_free(entry->ssl);
 
@@ -409,10 +815,26 @@ void Communicator::releaseConn(CommConnEntry *entry)
     free(entry);
 }
 
-void Communicator::shutdownService(CommService *service)
+/* 会话结束, 带上耗时放开 target. 出错的至少按回复超时算, 停止的不算 */
+void Communicator::releaseTarget(CommTarget *target, CommSession *session, int state, int keepAlive)
+{
+    struct timespec now;
+    long long latency = -1;
+
+    if (state != CS_STATE_STOPPED) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        latency = 1000000LL * (now.tv_sec - session->mRequestTime.tv_sec) + (now.tv_nsec - session->mRequestTime.tv_nsec) / 1000;
+        if (state != CS_STATE_SUCCESS && latency < 1000LL * target->mResponseTimeout)
+            latency = 1000LL * target->mResponseTimeout;
+    }
+
+    target->release(keepAlive, latency);
+}
+
+void Communicator::shutdownService(CommService *service, int listenFd)
 {
     logv("");
-    close(service->mListenFd);
+    close(listenFd);
     service->mListenFd = -1;
     service->drain(-1);
     service->decref();
@@ -436,11 +858,11 @@ int Communicator::sendMessageSync(struct iovec vectors[], int cnt, CommConnEntry
     int i;
 
     while (cnt > 0) {
-        if (!entry->ssl) {
-            n = writev(entry->sockFd, vectors, cnt <= IOV_MAX ? cnt : IOV_MAX);
+        if (!entry->ssl || poll_ssl_ktls_send(entry->ssl)) {
+            n = poll_writev(entry->sockFd, vectors, cnt);
             if (n < 0)
                 return errno == EAGAIN ? cnt : -1;
-        } else if (vectors->iov_len > 0) {
+        } else if (CPOLL_IOV_LEN(vectors) > 0) {
             n = _ssl_writev(entry->ssl, vectors, cnt);
             if (n <= 0)
                 return cnt;
@@ -448,16 +870,7 @@ int Communicator::sendMessageSync(struct iovec vectors[], int cnt, CommConnEntry
             n = 0;
         }
 
-        for (i = 0; i < cnt; i++) {
-            if ((size_t)n >= vectors[i].iov_len) {
-                n -= vectors[i].iov_len;
-            } else {
-                vectors[i].iov_base = (char *)vectors[i].iov_base + n;
-                vectors[i].iov_len -= n;
-                break;
-            }
-        }
-
+        i = poll_iov_advance(vectors, cnt, n);
         vectors += i;
         cnt -= i;
     }
@@ -549,6 +962,19 @@ int Communicator::sendMessageAsync(struct iovec vectors[], int cnt, CommConnEntr
 
 #define ENCODE_IOV_MAX		8192
 
+static size_t _iov_mem_size(const struct iovec vectors[], int cnt)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < cnt; i++) {
+        if (!(vectors[i].iov_len & CPOLL_IOV_FILE))
+            size += vectors[i].iov_len;
+    }
+
+    return size;
+}
+
 int Communicator::sendMessage(CommConnEntry *entry)
 {
     logv("");
@@ -564,6 +990,10 @@ int Communicator::sendMessage(CommConnEntry *entry)
     }
 
     end = vectors + cnt;
+    // 大消息不在这里拷贝发送, 交给 poller 用 MSG_ZEROCOPY 发送并等完成通知
+    if (mZeroCopyThreshold > 0 && !entry->ssl && _iov_mem_size(vectors, cnt) >= mZeroCopyThreshold)
+        return this->sendMessageAsync(vectors, cnt, entry);
+
     cnt = sendMessageSync(vectors, cnt, entry);
     if (cnt <= 0)
         return cnt;
@@ -651,19 +1081,39 @@ void Communicator::handleIncomingReply(CPollResult* res)
     CommConnEntry *entry = (CommConnEntry*)res->data.context;
     CommTarget *target = entry->target;
     CommSession *session = NULL;
+    CommConnEntry *lru;
     pthread_mutex_t *mutex;
+    struct list_head sessions;
+    int warm = 0;
     int state;
 
+    INIT_LIST_HEAD(&sessions);
     switch (res->state) {
         case PR_ST_SUCCESS:
-            session = entry->session;
+            /* pipelining 时连接上可能已经换成了下一个会话, 这个回复属于收它的会话 */
+            session = ((CommMessageIn *)res->data.message)->mSession;
             state = CS_STATE_SUCCESS;
             pthread_mutex_lock(&target->mMutex);
-            if (entry->state == CONN_STATE_SUCCESS) {
+            target->mWarmPaused = false;
+            if (entry->state == CONN_STATE_SUCCESS && entry->session == session) {
+                if (entry->piped) {
+                    list_del(&entry->pipeList);
+                    entry->piped = 0;
+                }
+
                 __sync_add_and_fetch(&entry->ref, 1);
                 if (session->mTimeout != 0) {
                     entry->state = CONN_STATE_IDLE;
                     list_add(&entry->list, &target->mIdleList);
+                    if (++target->mPoolStats.idle > target->mMaxIdle && target->mMaxIdle > 0) {
+                        /* 关掉最久未用的空闲连接, poller 删除后在本函数里释放 */
+                        lru = list_entry(target->mIdleList.prev, CommConnEntry, list);
+                        list_del(&lru->list);
+                        lru->state = CONN_STATE_CLOSING;
+                        target->mPoolStats.idle--;
+                        target->mPoolStats.evictions++;
+                        m_poll_del(lru->sockFd, mPoll);
+                    }
                 } else {
                     entry->state = CONN_STATE_CLOSING;
                 }
@@ -685,9 +1135,13 @@ void Communicator::handleIncomingReply(CPollResult* res)
             mutex = &entry->mutex;
             pthread_mutex_lock(&target->mMutex);
             pthread_mutex_lock(mutex);
+            unpipeConn(entry, &sessions);
             switch (entry->state) {
                 case CONN_STATE_IDLE:
                     list_del(&entry->list);
+                    target->mPoolStats.idle--;
+                    /* 只为用过的连接补充, 一直没用过就被关掉的预热连接不补, 免得对端一连上就关时反复重连 */
+                    warm = target->mMinIdle > 0 && entry->seq > 0 && state != CS_STATE_STOPPED;
                     break;
 
                 case CONN_STATE_ERROR:
@@ -695,6 +1149,12 @@ void Communicator::handleIncomingReply(CPollResult* res)
                     state = CS_STATE_ERROR;
                 case CONN_STATE_RECEIVING:
                     session = entry->session;
+                    /* 排在别的请求后面发出, 还没收到回复, 和排队的会话一起重发 */
+                    if (session->mPipelined > 0 && !session->mIn) {
+                        list_add(&session->mPipeList, &sessions);
+                        session = NULL;
+                    }
+
                     break;
 
                 case CONN_STATE_SUCCESS:
@@ -711,13 +1171,17 @@ void Communicator::handleIncomingReply(CPollResult* res)
 
     if (entry) {
         if (session) {
-            target->release(entry->state == CONN_STATE_IDLE);
+            Communicator::releaseTarget(target, session, state, entry->state == CONN_STATE_IDLE);
             session->handle(state, res->error);
         }
 
         if (__sync_sub_and_fetch(&entry->ref, 1) == 0)
             releaseConn(entry);
     }
+
+    replayPipelined(&sessions, target);
+    if (warm && !mStopFlag)
+        warmTarget(target);
 }
 
 void Communicator::handleReadResult(CPollResult* res)
@@ -726,7 +1190,9 @@ void Communicator::handleReadResult(CPollResult* res)
     CommConnEntry *entry = (CommConnEntry *)res->data.context;
 
     if (res->state != PR_ST_MODIFIED) {
-        if (entry->service) {
+        if (entry->mux) {
+            handleMuxResult(res);
+        } else if (entry->service) {
             handleIncomingRequest(res);
         } else {
             handleIncomingReply(res);
@@ -793,12 +1259,18 @@ void Communicator::handleRequestResult(CPollResult* res)
     logv("");
     CommConnEntry *entry = (CommConnEntry *)res->data.context;
     CommSession *session = entry->session;
+    CommTarget *target = entry->target;
+    struct list_head sessions;
     int timeout;
     int state;
 
+    INIT_LIST_HEAD(&sessions);
     switch (res->state) {
         case PR_ST_FINISHED: {
             entry->state = CONN_STATE_RECEIVING;
+            if (entry->piped)
+                flushPipelined(entry);
+
             res->data.operation = PD_OP_READ;
             res->data.message = NULL;
             timeout = session->firstTimeout();
@@ -824,7 +1296,15 @@ void Communicator::handleRequestResult(CPollResult* res)
                 case PR_ST_STOPPED:
                     state = CS_STATE_STOPPED;
 
-            entry->target->release(0);
+            if (entry->piped) {
+                pthread_mutex_lock(&target->mMutex);
+                pthread_mutex_lock(&entry->mutex);
+                unpipeConn(entry, &sessions);
+                pthread_mutex_unlock(&entry->mutex);
+                pthread_mutex_unlock(&target->mMutex);
+            }
+
+            Communicator::releaseTarget(target, session, state, 0);
             session->handle(state, res->error);
             pthread_mutex_lock(&entry->mutex);
             /* do nothing */
@@ -832,6 +1312,7 @@ void Communicator::handleRequestResult(CPollResult* res)
             if (__sync_sub_and_fetch(&entry->ref, 1) == 0)
                 this->releaseConn(entry);
 
+            replayPipelined(&sessions, target);
             break;
         }
     }
@@ -842,6 +1323,11 @@ void Communicator::handleWriteResult(CPollResult* res)
     logv("");
     CommConnEntry *entry = (CommConnEntry *)res->data.context;
 
+    if (entry->mux) {
+        handleMuxResult(res);
+        return;
+    }
+
     free(entry->writeIov);
     if (entry->service)
         handleReplyResult(res);
@@ -854,22 +1340,43 @@ CommConnEntry* Communicator::acceptConn(CommServiceTarget *target, CommService *
     logv("");
     CommConnEntry* entry;
     size_t size;
+    int ret;
 
     if (_set_fd_nonblock(target->sockFd) >= 0){
-        size = offsetof(CommConnEntry, mutex);
+        /* 多路复用的连接要用连接的锁 */
+        if (service->mMux)
+            size = sizeof (CommConnEntry);
+        else
+            size = offsetof(CommConnEntry, mutex);
+
         entry = (CommConnEntry *)malloc(size);
         if (entry) {
-            entry->conn = service->newConnection(target->sockFd);
-            if (entry->conn) {
-                entry->seq = 0;
-                entry->poll = mPoll;
-                entry->service = service;
-                entry->target = target;
-                entry->ssl = NULL;
-                entry->sockFd = target->sockFd;
-                entry->state = CONN_STATE_CONNECTED;
-                entry->ref = 1;
-                return entry;
+            ret = service->mMux ? pthread_mutex_init(&entry->mutex, NULL) : 0;
+            if (ret == 0) {
+                entry->conn = service->newConnection(target->sockFd);
+                if (entry->conn) {
+                    entry->seq = 0;
+                    entry->poll = mPoll;
+                    entry->service = service;
+                    entry->target = target;
+                    entry->ssl = NULL;
+                    entry->mux = NULL;
+                    entry->muxFd = -1;
+                    if (service->mMux && !service->mSSLCtx && service->mMuxPrefaceLen > 0)
+                        entry->muxProbe = 0;
+                    else
+                        entry->muxProbe = -1;
+
+                    entry->sockFd = target->sockFd;
+                    entry->state = CONN_STATE_CONNECTED;
+                    entry->ref = 1;
+                    return entry;
+                }
+
+                if (service->mMux)
+                    pthread_mutex_destroy(&entry->mutex);
+            } else {
+                errno = ret;
             }
 
             free(entry);
@@ -890,7 +1397,11 @@ void Communicator::handleListenResult(CPollResult* res)
     switch (res->state) {
         case PR_ST_SUCCESS:
             target = (CommServiceTarget *)res->data.result;
-            entry = acceptConn(target, service);
+            /* 分片监听时把连接换成和监听 fd 同余的编号, 留在接受它的 poll 线程上 */
+            if (service->mReusePort && mPoll->nThreads > 1)
+                target->sockFd = _shard_fd(target->sockFd, (unsigned int)res->data.fd % mPoll->nThreads, mPoll->nThreads);
+
+            entry = target->sockFd >= 0 ? acceptConn(target, service) : NULL;
             if (entry) {
                 if (service->mSSLCtx) {
                     if (_create_ssl(service->mSSLCtx, entry) >= 0 && service->initSSL(entry->ssl) >= 0) {
@@ -915,14 +1426,14 @@ void Communicator::handleListenResult(CPollResult* res)
                 }
 
                 releaseConn(entry);
-            } else
+            } else if (target->sockFd >= 0)
                 close(target->sockFd);
 
             target->decref();
             break;
 
         case PR_ST_DELETED:
-            shutdownService(service);
+            shutdownService(service, res->data.fd);
             break;
 
         case PR_ST_ERROR:
@@ -938,22 +1449,65 @@ void Communicator::handleConnectResult(CPollResult* res)
     CommConnEntry *entry = (CommConnEntry *)res->data.context;
     CommSession *session = entry->session;
     CommTarget *target = entry->target;
+    struct list_head sessions;
+    CommMux *mux;
     int timeout;
+    int piped;
     int state;
     int ret;
 
+    if (!session) {
+        handleWarmConnectResult(res);
+        return;
+    }
+
     switch (res->state) {
         case PR_ST_FINISHED:
+            if (res->data.operation == PD_OP_SSL_CONNECT) {
+                __atomic_add_fetch(&mSSLStats.clientHandshakes, 1, __ATOMIC_RELAXED);
+                if (SSL_session_reused(entry->ssl))
+                    __atomic_add_fetch(&mSSLStats.clientResumed, 1, __ATOMIC_RELAXED);
+                if (poll_ssl_ktls_send(entry->ssl))
+                    __atomic_add_fetch(&mSSLStats.ktls, 1, __ATOMIC_RELAXED);
+            }
+
             if (target->mSSLCtx && !entry->ssl) {
                 if (_create_ssl(target->mSSLCtx, entry) >= 0 && target->initSSL(entry->ssl) >= 0) {
+                    target->resumeSSL(entry->ssl);
                     ret = 0;
                     res->data.operation = PD_OP_SSL_CONNECT;
                     res->data.ssl = entry->ssl;
                     timeout = target->mSSLConnectTimeout;
                 } else
                     ret = -1;
+            } else if ((mux = target->newMux(entry->ssl)) != NULL) {
+                ret = -1;
+                if (!session->multiplexable()) {
+                    delete mux;
+                    errno = EPROTO;
+                } else if (attachMux(mux, entry) >= 0 && startMux(session, entry) >= 0) {
+                    /* 连接建立期间排进来的请求改为多路复用 */
+                    INIT_LIST_HEAD(&sessions);
+                    if (entry->piped) {
+                        pthread_mutex_lock(&target->mMutex);
+                        pthread_mutex_lock(&entry->mutex);
+                        unpipeConn(entry, &sessions);
+                        pthread_mutex_unlock(&entry->mutex);
+                        pthread_mutex_unlock(&target->mMutex);
+                    }
+
+                    replayPipelined(&sessions, target);
+                    break;
+                }
             } else if ((session->mOut = session->messageOut()) != NULL) {
+                /* 和 requestIdleConn() 一样在连接的锁里发, requestPipeConn() 看到的 state 和发送一致 */
+                pthread_mutex_lock(&entry->mutex);
                 ret = this->sendMessage(entry);
+                piped = entry->piped;
+                pthread_mutex_unlock(&entry->mutex);
+                if (ret == 0 && piped)
+                    flushPipelined(entry);
+
                 if (ret == 0) {
                     res->data.operation = PD_OP_READ;
                     res->data.message = NULL;
@@ -986,37 +1540,160 @@ void Communicator::handleConnectResult(CPollResult* res)
                 case PR_ST_STOPPED:
                     state = CS_STATE_STOPPED;
 
-            target->release(0);
+            if (res->state == PR_ST_ERROR && res->data.operation == PD_OP_SSL_CONNECT)
+                target->dropSSLSession();
+
+            INIT_LIST_HEAD(&sessions);
+            if (entry->piped) {
+                pthread_mutex_lock(&target->mMutex);
+                pthread_mutex_lock(&entry->mutex);
+                unpipeConn(entry, &sessions);
+                pthread_mutex_unlock(&entry->mutex);
+                pthread_mutex_unlock(&target->mMutex);
+            }
+
+            Communicator::releaseTarget(target, session, state, 0);
             session->handle(state, res->error);
             releaseConn(entry);
+            replayPipelined(&sessions, target);
             break;
     }
 }
 
-void Communicator::handleSSLAcceptResult(CPollResult *res)
+void Communicator::handleWarmConnectResult(CPollResult* res)
 {
     logv("");
     CommConnEntry *entry = (CommConnEntry *)res->data.context;
     CommTarget *target = entry->target;
-    int timeout;
+    CommMux *mux;
+    int ret;
 
     switch (res->state) {
         case PR_ST_FINISHED:
-            res->data.operation = PD_OP_READ;
-            res->data.message = NULL;
-            timeout = target->mResponseTimeout;
-            if (m_poll_add(reinterpret_cast<const CPollData *>(&res->data), timeout, mPoll) >= 0) {
-                if (mStopFlag)
-                    m_poll_del(res->data.fd, mPoll);
-                break;
+            if (res->data.operation == PD_OP_SSL_CONNECT) {
+                __atomic_add_fetch(&mSSLStats.clientHandshakes, 1, __ATOMIC_RELAXED);
+                if (SSL_session_reused(entry->ssl))
+                    __atomic_add_fetch(&mSSLStats.clientResumed, 1, __ATOMIC_RELAXED);
+                if (poll_ssl_ktls_send(entry->ssl))
+                    __atomic_add_fetch(&mSSLStats.ktls, 1, __ATOMIC_RELAXED);
             }
 
-        case PR_ST_DELETED:
-        case PR_ST_ERROR:
-        case PR_ST_STOPPED:
-            releaseConn(entry);
-            ((CommServiceTarget *)target)->decref();
-            break;
+            if (target->mSSLCtx && !entry->ssl) {
+                if (_create_ssl(target->mSSLCtx, entry) >= 0 && target->initSSL(entry->ssl) >= 0) {
+                    target->resumeSSL(entry->ssl);
+                    res->data.operation = PD_OP_SSL_CONNECT;
+                    res->data.ssl = entry->ssl;
+                    ret = m_poll_add(reinterpret_cast<const CPollData *>(&res->data), target->mSSLConnectTimeout, mPoll);
+                } else
+                    ret = -1;
+            } else if ((mux = target->newMux(entry->ssl)) != NULL) {
+                /* 多路复用的目标上请求共用连接, 不需要预热 */
+                delete mux;
+                pthread_mutex_lock(&target->mMutex);
+                target->mPoolStats.warming--;
+                target->mWarmPaused = true;
+                pthread_mutex_unlock(&target->mMutex);
+                releaseConn(entry);
+                break;
+            } else {
+                /* 连接好了, 放进空闲连接等请求来用. 持锁加入 poller, 连接在进空闲列表前不会被取走或被释放 */
+                res->data.operation = PD_OP_READ;
+                res->data.message = NULL;
+                pthread_mutex_lock(&target->mMutex);
+                if (target->mMaxIdle > 0 && target->mPoolStats.idle >= target->mMaxIdle) {
+                    /* 预热期间归还的连接已经够多了 */
+                    target->mPoolStats.warming--;
+                    pthread_mutex_unlock(&target->mMutex);
+                    releaseConn(entry);
+                    break;
+                }
+
+                entry->state = CONN_STATE_IDLE;
+                ret = m_poll_add(reinterpret_cast<const CPollData *>(&res->data), -1, mPoll);
+                if (ret >= 0) {
+                    list_add(&entry->list, &target->mIdleList);
+                    target->mPoolStats.idle++;
+                    target->mPoolStats.warming--;
+                    target->mPoolStats.warmConnects++;
+                }
+
+                pthread_mutex_unlock(&target->mMutex);
+            }
+
+            if (ret >= 0) {
+                if (mStopFlag)
+                    m_poll_del(res->data.fd, mPoll);
+                break;
+            }
+
+        case PR_ST_ERROR:
+        case PR_ST_DELETED:
+        case PR_ST_STOPPED:
+            if (res->state == PR_ST_ERROR && res->data.operation == PD_OP_SSL_CONNECT)
+                target->dropSSLSession();
+
+            /* 预热失败后暂停预热, 直到这个目标上再有请求成功 */
+            pthread_mutex_lock(&target->mMutex);
+            target->mPoolStats.warming--;
+            target->mPoolStats.warmFailures++;
+            target->mWarmPaused = true;
+            pthread_mutex_unlock(&target->mMutex);
+            releaseConn(entry);
+            break;
+    }
+}
+
+void Communicator::handleSSLAcceptResult(CPollResult *res)
+{
+    logv("");
+    CommConnEntry *entry = (CommConnEntry *)res->data.context;
+    CommService *service = entry->service;
+    CommTarget *target = entry->target;
+    CommMux *mux;
+    int timeout;
+    int ret;
+
+    switch (res->state) {
+        case PR_ST_FINISHED:
+            __atomic_add_fetch(&mSSLStats.serverHandshakes, 1, __ATOMIC_RELAXED);
+            if (SSL_session_reused(entry->ssl))
+                __atomic_add_fetch(&mSSLStats.serverResumed, 1, __ATOMIC_RELAXED);
+            if (poll_ssl_ktls_send(entry->ssl))
+                __atomic_add_fetch(&mSSLStats.ktls, 1, __ATOMIC_RELAXED);
+
+            res->data.operation = PD_OP_READ;
+            res->data.message = NULL;
+            timeout = target->mResponseTimeout;
+            if (service->mMux && (mux = service->newMux(entry->ssl)) != NULL) {
+                /* 多路复用时 poller 读密文, 由 mux 解密 */
+                ret = attachMux(mux, entry);
+                if (ret >= 0) {
+                    res->data.ssl = NULL;
+                    entry->state = CONN_STATE_RECEIVING;
+                    pthread_mutex_lock(&entry->mutex);
+                    ret = m_poll_add(reinterpret_cast<const CPollData *>(&res->data), timeout, mPoll);
+                    if (ret >= 0) {
+                        if (mux->open() < 0 || Communicator::flushMux(entry) < 0 || mStopFlag)
+                            m_poll_del(res->data.fd, mPoll);
+                    }
+
+                    pthread_mutex_unlock(&entry->mutex);
+                }
+
+                if (ret >= 0)
+                    break;
+            } else if (m_poll_add(reinterpret_cast<const CPollData *>(&res->data), timeout, mPoll) >= 0) {
+                if (mStopFlag)
+                    m_poll_del(res->data.fd, mPoll);
+                break;
+            }
+
+        case PR_ST_DELETED:
+        case PR_ST_ERROR:
+        case PR_ST_STOPPED:
+            releaseConn(entry);
+            ((CommServiceTarget *)target)->decref();
+            break;
     }
 }
 
@@ -1075,10 +1752,11 @@ void Communicator::handleAioResult(CPollResult *res)
 void Communicator::handlerThreadRoutine(void *context)
 {
     logv("");
-    Communicator *comm = (Communicator*)context;
+    CommHandlerGroup *group = (CommHandlerGroup*)context;
+    Communicator *comm = group->comm;
     CPollResult* res;
 
-    while ((res = (CPollResult*)msg_queue_get(comm->mQueue)) != nullptr) {
+    while ((res = (CPollResult*)thread_pool_elastic_get(group->queue, group->pool)) != nullptr) {
         switch (res->data.operation) {
             case PD_OP_READ: {
                 logv("handle READ");
@@ -1119,7 +1797,7 @@ void Communicator::handlerThreadRoutine(void *context)
             }
         }
 
-        free(res);
+        poll_free_result(res);
     }
 }
 
@@ -1132,18 +1810,54 @@ int Communicator::append(const void *buf, size_t *size, CPollMessage* msg)
     int timeout;
     int ret;
 
+    if (entry->mux)
+        return Communicator::appendMux(buf, *size, entry);
+
+    if (entry->muxProbe >= 0) {
+        ret = Communicator::probeMux(buf, size, entry);
+        if (ret != 0 || entry->muxProbe >= 0)
+            return ret;
+    }
+
     ret = in->append(buf, size);
     if (ret > 0) {
-        entry->state = CONN_STATE_SUCCESS;
-        if (entry->service)
+        if (entry->service) {
+            entry->state = CONN_STATE_SUCCESS;
             timeout = -1;
-        else {
+        } else {
             timeout = session->keepAliveTimeout();
             session->mTimeout = timeout; /* Reuse session's timeout field. */
             if (timeout == 0) {
+                entry->state = CONN_STATE_SUCCESS;
                 m_poll_del(entry->sockFd, entry->poll);
                 return ret;
             }
+
+            if (entry->target->mPipelineDepth <= 1)
+                entry->state = CONN_STATE_SUCCESS;
+            else {
+                /* state 和 session 在连接的锁里一起换, requestPipeConn() 看不到中间状态 */
+                pthread_mutex_lock(&entry->mutex);
+                entry->state = CONN_STATE_SUCCESS;
+                if (!list_empty(&entry->pipeline)) {
+                    /* 下一个回复属于排在后面的会话. 这个回复的结果持有连接的一个引用 */
+                    session = list_entry(entry->pipeline.next, CommSession, mPipeList);
+                    list_del(&session->mPipeList);
+                    entry->pipeCnt--;
+                    entry->session = session;
+                    entry->state = CONN_STATE_RECEIVING;
+                    __sync_add_and_fetch(&entry->ref, 1);
+                    timeout = session->firstTimeout();
+                    if (timeout == 0)
+                        timeout = Communicator::firstTimeoutRecv(session);
+                    else {
+                        session->mTimeout = -1;
+                        session->mBeginTime.tv_nsec = -1;
+                    }
+                }
+
+                pthread_mutex_unlock(&entry->mutex);
+            }
         }
     } else if (ret == 0 && session->mTimeout != 0) {
         if (session->mBeginTime.tv_nsec == -1)
@@ -1206,6 +1920,9 @@ CPollMessage* Communicator::createMessage(void *context)
     CommConnEntry *entry = (CommConnEntry *)context;
     CommSession *session;
 
+    if (entry->mux)
+        return entry->mux;
+
     if (entry->state == CONN_STATE_IDLE) {
         pthread_mutex_t *mutex;
 
@@ -1232,6 +1949,7 @@ CPollMessage* Communicator::createMessage(void *context)
     if (session->mIn) {
         session->mIn->CPollMessage::append = Communicator::append;
         session->mIn->mEntry = entry;
+        session->mIn->mSession = session;
     }
 
     return session->mIn;
@@ -1244,6 +1962,11 @@ int Communicator::partialWritten(size_t n, void *context)
     CommSession *session = entry->session;
     int timeout;
 
+    if (entry->mux) {
+        m_poll_set_timeout(entry->muxFd, entry->target->mResponseTimeout, entry->poll);
+        return 0;
+    }
+
     timeout = Communicator::nextTimeout(session);
     m_poll_set_timeout(entry->sockFd, timeout, entry->poll);
 
@@ -1254,8 +1977,48 @@ void Communicator::callback(CPollResult* res, void *context)
 {
     logv("");
     Communicator *comm = (Communicator *)context;
+    CommHandlerGroup *group = comm->mGroups;
+
+    if (comm->mGroupCnt > 1)
+        group = comm->selectHandlerGroup(res);
+
+    // 结果里带着会话, 不能丢也没法向 poller 报错, 只能等有内存再放
+    while (msg_queue_put(res, group->queue) < 0) {
+        loge("handler queue put error: %d", errno);
+        usleep(1000);
+    }
+
+    thread_pool_elastic_check(group->queue, group->pool);
+}
+
+/**
+ * @brief
+ *  和 MPoll 一样按 fd 取模, 连接的结果总在产生它的 poller 对应的组里处理.
+ *  本组积压达到线程数时交给积压最少且没有忙不过来的组.
+ */
+CommHandlerGroup *Communicator::selectHandlerGroup(CPollResult* res)
+{
+    CommHandlerGroup *group = &mGroups[(unsigned int)res->data.fd % mGroupCnt];
+    CommHandlerGroup *target = group;
+    size_t backlog = msg_queue_size(group->queue);
+    size_t n;
+    int i;
+
+    if (backlog < group->nHandlers)
+        return group;
+
+    for (i = 0; i < mGroupCnt; i++) {
+        n = msg_queue_size(mGroups[i].queue);
+        if (n < mGroups[i].nHandlers && n < backlog) {
+            target = &mGroups[i];
+            backlog = n;
+        }
+    }
 
-    msg_queue_put(res, comm->mQueue);
+    if (target != group)
+        __atomic_add_fetch(&group->overflows, 1, __ATOMIC_RELAXED);
+
+    return target;
 }
 
 void *Communicator::accept(const struct sockaddr *addr, socklen_t addrLen, int sockFd, void *context)
@@ -1281,35 +2044,91 @@ void *Communicator::accept(const struct sockaddr *addr, socklen_t addrLen, int s
     return NULL;
 }
 
-int Communicator::createHandlerThreads(size_t handlerThreads)
+int Communicator::createHandlerThreads(CommHandlerGroup *group, const cpu_set_t *cpus)
 {
-    logv("handle thread number: %d", handlerThreads);
+    logv("handle thread number: %d", group->nHandlers);
     ThreadPoolTask task = {
             .routine	=	Communicator::handlerThreadRoutine,
-            .context	=	this
+            .context	=	group
     };
     size_t i;
 
-    mThreadPool = thread_pool_create(handlerThreads, 0);
-    if (mThreadPool) {
-        for (i = 0; i < handlerThreads; i++) {
-            if (thread_pool_schedule(&task, mThreadPool) < 0) {
+    group->pool = thread_pool_create_affinity(group->nHandlers, 0, THREAD_POOL_SHARED_QUEUE, cpus);
+    if (group->pool) {
+        for (i = 0; i < group->nHandlers; i++) {
+            if (thread_pool_schedule(&task, group->pool) < 0) {
                 break;
             }
         }
 
-        if (i == handlerThreads) {
+        if (i == group->nHandlers) {
             return 0;
         }
 
-        msg_queue_set_nonblock(mQueue);
-        thread_pool_destroy(NULL, mThreadPool);
+        msg_queue_set_nonblock(group->queue);
+        thread_pool_destroy(NULL, group->pool);
+    }
+
+    return -1;
+}
+
+int Communicator::createHandlerGroups(size_t groupCnt, size_t handlerThreads, const CpuAffinity* affinity)
+{
+    CommHandlerGroup *group;
+    cpu_set_t cpus;
+    size_t i;
+
+    mGroups = new CommHandlerGroup[groupCnt];
+    for (i = 0; i < groupCnt; i++) {
+        group = &mGroups[i];
+        group->comm = this;
+        group->overflows = 0;
+        group->nHandlers = handlerThreads / groupCnt + (i < handlerThreads % groupCnt);
+        if (group->nHandlers == 0)
+            group->nHandlers = 1;
+
+        if (affinity) {
+            if (groupCnt > 1)
+                cpu_affinity_poller_group(affinity, (int)i, &cpus);
+            else
+                cpus = affinity->handlerCpus;
+        }
+
+        group->queue = msg_queue_create(4096);
+        if (!group->queue)
+            break;
+
+        if (createHandlerThreads(group, affinity ? &cpus : NULL) < 0) {
+            msg_queue_destroy(group->queue);
+            break;
+        }
+    }
+
+    if (i == groupCnt) {
+        mGroupCnt = (int)groupCnt;
+        return 0;
     }
 
+    destroyHandlerGroups((int)i);
     return -1;
 }
 
-int Communicator::createPoll(size_t pollThreads)
+void Communicator::destroyHandlerGroups(int groupCnt)
+{
+    int i;
+
+    for (i = 0; i < groupCnt; i++) {
+        msg_queue_set_nonblock(mGroups[i].queue);
+        thread_pool_destroy(NULL, mGroups[i].pool);
+    }
+
+    for (i = 0; i < groupCnt; i++)
+        msg_queue_destroy(mGroups[i].queue);
+
+    delete []mGroups;
+}
+
+int Communicator::createPoll(size_t pollThreads, int pollEngine, const CpuAffinity* affinity)
 {
     logv("");
     CPollParams params = {
@@ -1317,31 +2136,30 @@ int Communicator::createPoll(size_t pollThreads)
             .createMessage      =	Communicator::createMessage,
             .partialWritten     =	Communicator::partialWritten,
             .callback			=	Communicator::callback,
-            .context			=	this
+            .context			=	this,
+            .engine             =   pollEngine,
+            .cpus               =   affinity ? affinity->pollerCpus : NULL,
+            .nCpus              =   affinity ? (size_t)affinity->nPollers : 0
     };
 
     if ((ssize_t)params.maxOpenFiles < 0) {
         return -1;
     }
 
-    mQueue = msg_queue_create(4096, sizeof (CPollResult));
-    if (mQueue) {
-        mPoll = m_poll_create(&params, pollThreads);
-        if (mPoll) {
-            if (m_poll_start(mPoll) >= 0) {
-                return 0;
-            }
-
-            m_poll_destroy(mPoll);
+    mPoll = m_poll_create(&params, pollThreads);
+    if (mPoll) {
+        if (m_poll_start(mPoll) >= 0) {
+            return 0;
         }
 
-        msg_queue_destroy(mQueue);
+        m_poll_destroy(mPoll);
     }
 
     return -1;
 }
 
-int Communicator::init(size_t poller_threads, size_t handler_threads)
+int Communicator::init(size_t poller_threads, size_t handler_threads, int pollEngine,
+                       const CpuAffinity* affinity, int handlerMode)
 {
     logv("");
     if (poller_threads == 0) {
@@ -1349,15 +2167,17 @@ int Communicator::init(size_t poller_threads, size_t handler_threads)
         return -1;
     }
 
-    if (this->createPoll(poller_threads) >= 0) {
-        if (createHandlerThreads(handler_threads) >= 0) {
+    // 先有结果队列和 handler 线程, poller 启动后才有地方放结果
+    size_t groupCnt = handlerMode == COMM_HANDLER_PER_POLLER ? poller_threads : 1;
+    if (createHandlerGroups(groupCnt, handler_threads, affinity) >= 0) {
+        if (this->createPoll(poller_threads, pollEngine, affinity) >= 0) {
             mStopFlag = 0;
+            mZeroCopyThreshold = 0;
+            memset(&mSSLStats, 0, sizeof (CommSSLStats));
             return 0;
         }
 
-        m_poll_stop(mPoll);
-        m_poll_destroy(mPoll);
-        msg_queue_destroy(mQueue);
+        destroyHandlerGroups(mGroupCnt);
     }
 
     return -1;
@@ -1368,10 +2188,8 @@ void Communicator::deInit()
     logv("");
     mStopFlag = 1;
     m_poll_stop(mPoll);
-    msg_queue_set_nonblock(mQueue);
-    thread_pool_destroy(NULL, mThreadPool);
+    destroyHandlerGroups(mGroupCnt);
     m_poll_destroy(mPoll);
-    msg_queue_destroy(mQueue);
 }
 
 int Communicator::nonblockConnect(CommTarget *target)
@@ -1413,9 +2231,16 @@ CommConnEntry *Communicator::launchConn(CommSession *session, CommTarget *target
                     entry->target = target;
                     entry->session = session;
                     entry->ssl = NULL;
+                    entry->mux = NULL;
+                    entry->muxFd = -1;
+                    entry->muxProbe = -1;
                     entry->sockFd = sockfd;
                     entry->state = CONN_STATE_CONNECTING;
                     entry->ref = 1;
+                    INIT_LIST_HEAD(&entry->pipeline);
+                    entry->pipeCnt = 0;
+                    entry->unsent = 0;
+                    entry->piped = 0;
                     return entry;
                 }
                 pthread_mutex_destroy(&entry->mutex);
@@ -1430,19 +2255,87 @@ CommConnEntry *Communicator::launchConn(CommSession *session, CommTarget *target
     return NULL;
 }
 
+int Communicator::warmConn(CommTarget *target)
+{
+    logv("");
+    CommConnEntry *entry;
+    CPollData data;
+
+    entry = launchConn(NULL, target);
+    if (entry) {
+        data.operation = PD_OP_CONNECT;
+        data.fd = entry->sockFd;
+        data.ssl = NULL;
+        data.context = entry;
+        if (m_poll_add(&data, target->mConnectTimeout, mPoll) >= 0)
+            return 0;
+
+        releaseConn(entry);
+    }
+
+    return -1;
+}
+
+/* 空闲连接加上正在预热的连接不足 minIdle 时在后台补足 */
+void Communicator::warmTarget(CommTarget *target)
+{
+    logv("");
+    size_t n = 0;
+    int errno_bak = errno;
+
+    pthread_mutex_lock(&target->mMutex);
+    if (!target->mWarmPaused && target->mPoolStats.idle + target->mPoolStats.warming < target->mMinIdle) {
+        n = target->mMinIdle - target->mPoolStats.idle - target->mPoolStats.warming;
+        target->mPoolStats.warming += n;
+    }
+
+    pthread_mutex_unlock(&target->mMutex);
+    for (; n > 0; n--) {
+        if (mStopFlag || warmConn(target) < 0) {
+            pthread_mutex_lock(&target->mMutex);
+            target->mPoolStats.warming--;
+            target->mPoolStats.warmFailures++;
+            pthread_mutex_unlock(&target->mMutex);
+        }
+    }
+
+    errno = errno_bak;
+}
+
+/* 空闲连接上不该有数据, 读到 EOF 或错误说明对端已经关闭. SSL 连接上可能有 TLS 1.3 的 ticket, 有数据不算失效 */
+static int _idle_conn_alive(CommConnEntry *entry)
+{
+    char c;
+    ssize_t n;
+
+    n = recv(entry->sockFd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+
+    return n > 0 && entry->ssl;
+}
+
 int Communicator::requestIdleConn(CommSession *session, CommTarget *target)
 {
     logv("");
     CommConnEntry *entry;
     struct list_head *pos;
+    int pipe;
     int ret = -1;
 
+    pipe = target->mPipelineDepth > 1 && !target->mSSLCtx && session->mPipelined >= 0 && session->pipelinable();
     while (1) {
         pthread_mutex_lock(&target->mMutex);
         if (!list_empty(&target->mIdleList)) {
             pos = target->mIdleList.next;
             entry = list_entry(pos, CommConnEntry, list);
             list_del(pos);
+            target->mPoolStats.idle--;
+            if (pipe) {
+                list_add_tail(&entry->pipeList, &target->mPipeList);
+                entry->piped = 1;
+            }
+
             pthread_mutex_lock(&entry->mutex);
         }
         else
@@ -1454,7 +2347,11 @@ int Communicator::requestIdleConn(CommSession *session, CommTarget *target)
             return -1;
         }
 
-        if (m_poll_set_timeout(entry->sockFd, -1, mPoll) >= 0) {
+        if (target->mValidateIdle && !_idle_conn_alive(entry)) {
+            __atomic_add_fetch(&target->mPoolStats.invalid, 1, __ATOMIC_RELAXED);
+            m_poll_del(entry->sockFd, mPoll);
+        } else if (m_poll_set_timeout(entry->sockFd, -1, mPoll) >= 0) {
+            __atomic_add_fetch(&target->mPoolStats.reused, 1, __ATOMIC_RELAXED);
             break;
         }
 
@@ -1498,71 +2395,922 @@ int Communicator::requestNewConn(CommSession *session, CommTarget *target)
         data.ssl = NULL;
         data.context = entry;
         timeout = session->mTarget->mConnectTimeout;
+        /* 请求发出之后 (状态为 RECEIVING) 别的请求才能排在后面 */
+        if (target->mPipelineDepth > 1 && !target->mSSLCtx && session->mPipelined >= 0 && session->pipelinable()) {
+            pthread_mutex_lock(&target->mMutex);
+            list_add_tail(&entry->pipeList, &target->mPipeList);
+            entry->piped = 1;
+            pthread_mutex_unlock(&target->mMutex);
+        }
+
         if (m_poll_add(&data, timeout, mPoll) >= 0) {
             return 0;
         }
+
+        if (entry->piped) {
+            pthread_mutex_lock(&target->mMutex);
+            list_del(&entry->pipeList);
+            pthread_mutex_unlock(&target->mMutex);
+        }
+
         releaseConn(entry);
     }
 
     return -1;
 }
 
-int Communicator::request(CommSession *session, CommTarget *target)
+/* 找一个正在建立或请求已经发出、还在等回复的连接, 把请求排在后面 */
+int Communicator::requestPipeConn(CommSession *session, CommTarget *target)
 {
     logv("");
-    int errno_bak;
+    CommConnEntry *entry = NULL;
+    struct list_head *pos;
+    int ret = -1;
 
-    if (session->mPassive) {
-        errno = EINVAL;
+    if (target->mPipelineDepth <= 1 || session->mPipelined < 0 || !session->pipelinable()) {
+        errno = ENOENT;
         return -1;
     }
 
-    errno_bak = errno;
-    session->mTarget = target;
-    session->mOut = NULL;
-    session->mIn = NULL;
-    if (requestIdleConn(session, target) < 0) {
-        if (requestNewConn(session, target) < 0) {
-            session->mConn = NULL;
-            session->mSeq = 0;
-            return -1;
-        }
+    pthread_mutex_lock(&target->mMutex);
+    list_for_each(pos, &target->mPipeList) {
+        entry = list_entry(pos, CommConnEntry, pipeList);
+        pthread_mutex_lock(&entry->mutex);
+        if ((entry->state == CONN_STATE_CONNECTING || entry->state == CONN_STATE_RECEIVING) &&
+            entry->pipeCnt + 1 < target->mPipelineDepth)
+            break;
+
+        pthread_mutex_unlock(&entry->mutex);
+        entry = NULL;
     }
 
-    errno = errno_bak;
+    pthread_mutex_unlock(&target->mMutex);
+    if (!entry) {
+        errno = ENOENT;
+        return -1;
+    }
 
-    return 0;
-}
+    /* 持有连接的锁直到会话进入队列, 回复不会先于会话到达 */
+    session->mConn = entry->conn;
+    session->mSeq = entry->seq++;
+    if (entry->state == CONN_STATE_CONNECTING || entry->unsent > 0) {
+        /* 连接的第一个请求还没发出, 发出后由 flushPipelined() 按顺序发 */
+        session->mPipelined = 2;
+        entry->unsent++;
+        ret = 0;
+    } else {
+        session->mOut = session->messageOut();
+        if (session->mOut)
+            ret = sendPipelined(session, entry);
 
-int Communicator::nonblockListen(CommService *service)
-{
-    logv("");
-    int socketFd = service->createListenFd();
+        if (ret >= 0)
+            session->mPipelined = 1;
+    }
 
-    if (socketFd >= 0) {
-        if (_set_fd_nonblock(socketFd) >= 0) {
-            if (_bind_and_listen(socketFd, service->mBindAddr, service->mAddrLen) >= 0) {
-                return socketFd;
-            }
-        }
-        close(socketFd);
+    if (ret >= 0) {
+        list_add_tail(&session->mPipeList, &entry->pipeline);
+        entry->pipeCnt++;
+        __atomic_add_fetch(&target->mPoolStats.pipelined, 1, __ATOMIC_RELAXED);
     }
 
-    return -1;
+    pthread_mutex_unlock(&entry->mutex);
+    return ret;
 }
 
-int Communicator::bind(CommService *service)
+/**
+ * 一次写完排在后面的请求, 不能交给 poller 异步写: 连接正在读前面请求的回复.
+ * 一个字节也没写进去时返回 -1, 由调用者换别的连接; 只写进一部分时连接不能再用, 关掉后由出错处理重发
+ */
+int Communicator::sendPipelined(CommSession *session, CommConnEntry *entry)
 {
     logv("");
-    CPollData data;
-    int socketFd = -1;
+    struct iovec vectors[ENCODE_IOV_MAX];
+    struct iovec *iov = vectors;
+    size_t sent = 0;
+    ssize_t n;
+    int cnt;
+    int i;
 
-    socketFd = nonblockListen(service);
-    if (socketFd >= 0) {
-        service->mListenFd = socketFd;
-        service->mRef = 1;
-        data.operation = PD_OP_LISTEN;
-        data.fd = socketFd;
+    cnt = session->mOut->encode(vectors, ENCODE_IOV_MAX);
+    if ((unsigned int)cnt > ENCODE_IOV_MAX) {
+        if (cnt > ENCODE_IOV_MAX)
+            errno = EOVERFLOW;
+        return -1;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        if (vectors[i].iov_len & CPOLL_IOV_FILE) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    while (cnt > 0) {
+        n = poll_writev(entry->sockFd, iov, cnt);
+        if (n < 0) {
+            if (sent == 0)
+                return -1;
+
+            shutdown(entry->sockFd, SHUT_RDWR);
+            break;
+        }
+
+        sent += n;
+        i = poll_iov_advance(iov, cnt, n);
+        iov += i;
+        cnt -= i;
+    }
+
+    return 0;
+}
+
+/* 连接的第一个请求发出后, 发出在连接建立期间排进来的请求. 发不出去的换连接重发 */
+void Communicator::flushPipelined(CommConnEntry *entry)
+{
+    logv("");
+    struct list_head *pos, *tmp;
+    struct list_head sessions;
+    CommSession *session;
+
+    INIT_LIST_HEAD(&sessions);
+    pthread_mutex_lock(&entry->mutex);
+    list_for_each_safe(pos, tmp, &entry->pipeline) {
+        session = list_entry(pos, CommSession, mPipeList);
+        if (session->mPipelined != 2)
+            continue;
+
+        session->mOut = session->messageOut();
+        if (session->mOut && sendPipelined(session, entry) >= 0)
+            session->mPipelined = 1;
+        else {
+            list_move_tail(pos, &sessions);
+            entry->pipeCnt--;
+        }
+    }
+
+    entry->unsent = 0;
+    pthread_mutex_unlock(&entry->mutex);
+    replayPipelined(&sessions, entry->target);
+}
+
+/* 连接不能再用: 不再接受 pipelining, 取下排队的会话. 调用时持有 target 和连接的锁 */
+void Communicator::unpipeConn(CommConnEntry *entry, struct list_head *sessions)
+{
+    if (entry->piped) {
+        list_del(&entry->pipeList);
+        entry->piped = 0;
+    }
+
+    list_splice_init(&entry->pipeline, sessions);
+    entry->pipeCnt = 0;
+    entry->unsent = 0;
+}
+
+/* 还没发出的和可以重发的会话换连接重发一次, 其它的以连接断开结束 */
+void Communicator::replayPipelined(struct list_head *sessions, CommTarget *target)
+{
+    CommSession *session;
+    int state;
+
+    while (!list_empty(sessions)) {
+        session = list_entry(sessions->next, CommSession, mPipeList);
+        list_del(&session->mPipeList);
+        if (!mStopFlag && (session->mPipelined == 2 || session->replayable())) {
+            session->mPipelined = -1;
+            if (this->issueRequest(session, target) >= 0) {
+                __atomic_add_fetch(&target->mPoolStats.replayed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+        }
+
+        state = mStopFlag ? CS_STATE_STOPPED : CS_STATE_ERROR;
+        Communicator::releaseTarget(target, session, state, 0);
+        session->handle(state, ECONNRESET);
+    }
+}
+
+/* 连接确定多路复用: 之后连接上的数据都交给 mux. SSL 连接换成内存 BIO, 由 mux 自己加解密 */
+int Communicator::attachMux(CommMux *mux, CommConnEntry *entry)
+{
+    logv("");
+    BIO *rbio, *wbio;
+    int nodelay = 1;
+    int ret = 0;
+
+    /* 多个流的小帧交错发送, 不能等 Nagle 合并 */
+    setsockopt(entry->sockFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (int));
+    entry->muxFd = dup(entry->sockFd);
+    if (entry->muxFd >= 0) {
+        if (entry->ssl) {
+            rbio = BIO_new(BIO_s_mem());
+            wbio = BIO_new(BIO_s_mem());
+            if (rbio && wbio) {
+                SSL_set_bio(entry->ssl, rbio, wbio);
+                mux->mSSL = entry->ssl;
+            } else {
+                BIO_free(rbio);
+                BIO_free(wbio);
+                ret = -1;
+            }
+        }
+
+        if (ret >= 0) {
+            mux->CPollMessage::append = Communicator::append;
+            mux->mEntry = entry;
+            mux->mSession = NULL;
+            if (entry->service)
+                mux->mKeepAlive = entry->target->mResponseTimeout;
+
+            entry->mux = mux;
+            return 0;
+        }
+
+        close(entry->muxFd);
+        entry->muxFd = -1;
+    }
+
+    delete mux;
+    return -1;
+}
+
+/* 收到的数据交给 mux, 有结束的会话时返回 1, 由 handler 线程处理 */
+int Communicator::appendMux(const void *buf, size_t size, CommConnEntry *entry)
+{
+    logv("");
+    CommMux *mux = entry->mux;
+    int ret;
+
+    pthread_mutex_lock(&entry->mutex);
+    if (mux->mSSL)
+        ret = mux->decrypt(buf, size);
+    else
+        ret = mux->input(buf, size);
+
+    /* 出错时也要发出 mux 最后写的数据, 如 GOAWAY */
+    Communicator::flushMux(entry);
+    if (ret >= 0)
+        ret = !list_empty(&mux->mDoneList) || !list_empty(&mux->mReplayList);
+
+    pthread_mutex_unlock(&entry->mutex);
+    if (ret > 0)
+        __sync_add_and_fetch(&entry->ref, 1);
+
+    return ret;
+}
+
+/* 明文服务连接: 以多路复用的开头开始时换成 mux, 否则已经对上的字节还给原来的消息 */
+int Communicator::probeMux(const void *buf, size_t *size, CommConnEntry *entry)
+{
+    logv("");
+    CommService *service = entry->service;
+    CommSession *session = entry->session;
+    size_t n = service->mMuxPrefaceLen - entry->muxProbe;
+    CommMux *mux;
+    int ret;
+
+    if (n > *size)
+        n = *size;
+
+    if (memcmp(buf, service->mMuxPreface + entry->muxProbe, n) != 0) {
+        n = entry->muxProbe;
+        entry->muxProbe = -1;
+        if (n == 0)
+            return 0;
+
+        ret = Communicator::append(service->mMuxPreface, &n, session->mIn);
+        if (ret != 0)
+            *size = 0;
+
+        return ret;
+    }
+
+    entry->muxProbe += n;
+    *size = n;
+    if ((size_t)entry->muxProbe < service->mMuxPrefaceLen)
+        return 0;
+
+    entry->muxProbe = -1;
+    mux = service->newMux(NULL);
+    if (!mux || Communicator::attachMux(mux, entry) < 0)
+        return -1;
+
+    /* 已经创建的会话没有收到请求, 结束掉 */
+    pthread_mutex_lock(&entry->mutex);
+    entry->session = NULL;
+    entry->state = CONN_STATE_RECEIVING;
+    mux->done(session, CS_STATE_STOPPED, 0);
+    ret = mux->open();
+    if (ret >= 0)
+        ret = mux->input(service->mMuxPreface, service->mMuxPrefaceLen);
+
+    Communicator::flushMux(entry);
+    pthread_mutex_unlock(&entry->mutex);
+    __sync_add_and_fetch(&entry->ref, 1);
+    return ret < 0 ? ret : 1;
+}
+
+/**
+ * 发送缓冲里的数据尽量直接写出, 写不完的交给 poller. 之后按会话的情况设置连接的超时:
+ * 有会话在接收时用 responseTimeout, 有会话在处理时不超时, 空闲时用最后一个会话的 keepAliveTimeout.
+ * 服务端空闲的连接放进 mAliveList, 可以被 drain() 关掉
+ */
+int Communicator::flushMux(CommConnEntry *entry)
+{
+    logv("");
+    CommService *service = entry->service;
+    CommTarget *target = entry->target;
+    CommMux *mux = entry->mux;
+    CPollData data;
+    int timeout;
+    int avail;
+    int idle;
+    ssize_t n;
+    int ret = 0;
+
+    if (mux->mClosed)
+        return -1;
+
+    while (!mux->mWriting) {
+        if (mux->mBufOff == mux->mBufLen) {
+            mux->mBufOff = 0;
+            mux->mBufLen = 0;
+            mux->pull();
+            if (mux->mSSL && mux->encrypt() < 0) {
+                ret = -1;
+                break;
+            }
+
+            if (mux->mBufLen == 0)
+                break;
+        }
+
+        n = write(entry->sockFd, mux->mBuf + mux->mBufOff, mux->mBufLen - mux->mBufOff);
+        if (n >= 0) {
+            mux->mBufOff += n;
+            continue;
+        }
+
+        if (errno != EAGAIN) {
+            ret = -1;
+            break;
+        }
+
+        /* 剩下的交给 poller 异步写, 之后的数据放进新的发送缓冲 */
+        mux->mWriteBuf = mux->mBuf;
+        mux->mWriteIov.iov_base = mux->mBuf + mux->mBufOff;
+        mux->mWriteIov.iov_len = mux->mBufLen - mux->mBufOff;
+        mux->mBuf = NULL;
+        mux->mBufSize = 0;
+        mux->mBufLen = 0;
+        mux->mBufOff = 0;
+
+        data.operation = PD_OP_WRITE;
+        data.fd = entry->muxFd;
+        data.ssl = NULL;
+        data.context = entry;
+        data.writeIov = &mux->mWriteIov;
+        data.iovec = 1;
+        __sync_add_and_fetch(&entry->ref, 1);
+        if (m_poll_add(&data, target->mResponseTimeout, entry->poll) < 0) {
+            __sync_sub_and_fetch(&entry->ref, 1);
+            free(mux->mWriteBuf);
+            mux->mWriteBuf = NULL;
+            ret = -1;
+            break;
+        }
+
+        mux->mWriting = 1;
+    }
+
+    /* 写出错时关掉读的一端, 由读的结果结束所有的会话 */
+    if (ret < 0)
+        shutdown(entry->sockFd, SHUT_RDWR);
+
+    idle = (mux->mActive == 0 && !mux->mWriting);
+    if (service) {
+        if (idle != (entry->state == CONN_STATE_KEEPALIVE) && entry->state != CONN_STATE_CLOSING) {
+            pthread_mutex_lock(&service->mMutex);
+            if (entry->state == CONN_STATE_KEEPALIVE) {
+                list_del(&entry->list);
+                entry->state = CONN_STATE_RECEIVING;
+            } else if (entry->state != CONN_STATE_CLOSING) {
+                if (service->mListenFd >= 0 && mux->mKeepAlive != 0) {
+                    entry->state = CONN_STATE_KEEPALIVE;
+                    list_add_tail(&entry->list, &service->mAliveList);
+                } else {
+                    m_poll_del(entry->sockFd, entry->poll);
+                    entry->state = CONN_STATE_CLOSING;
+                }
+            }
+
+            pthread_mutex_unlock(&service->mMutex);
+        }
+    } else if (entry->state != CONN_STATE_CLOSING) {
+        avail = !idle || mux->mKeepAlive != 0;
+        if (avail)
+            avail = mux->available();
+
+        if (avail != mux->mAvailable || (idle && mux->mKeepAlive == 0)) {
+            pthread_mutex_lock(&target->mMutex);
+            mux->mAvailable = avail;
+            if (idle && mux->mKeepAlive == 0) {
+                list_del(&entry->list);
+                m_poll_del(entry->sockFd, entry->poll);
+                entry->state = CONN_STATE_CLOSING;
+            }
+
+            pthread_mutex_unlock(&target->mMutex);
+        }
+    }
+
+    if (mux->mReceiving > 0)
+        timeout = target->mResponseTimeout;
+    else if (mux->mActive > 0)
+        timeout = -1;
+    else
+        timeout = mux->mKeepAlive;
+
+    if (entry->state != CONN_STATE_CLOSING)
+        m_poll_set_timeout(entry->sockFd, timeout, entry->poll);
+
+    return ret;
+}
+
+/* 客户端: 会话的请求交给 mux 发出, 每个发出的会话持有连接的一个引用 */
+int Communicator::sendMuxRequest(CommSession *session, CommConnEntry *entry)
+{
+    logv("");
+    CommMux *mux = entry->mux;
+
+    session->mOut = session->messageOut();
+    session->mIn = session->messageIn();
+    if (!session->mOut || !session->mIn)
+        return -1;
+
+    session->mIn->mEntry = entry;
+    session->mIn->mSession = session;
+    session->mMux = mux;
+    if (mux->request(session) < 0) {
+        session->mMux = NULL;
+        return -1;
+    }
+
+    __sync_add_and_fetch(&entry->ref, 1);
+    return 0;
+}
+
+/* 服务端: 会话没有回复就被删除 */
+void Communicator::cancelMux(CommSession *session)
+{
+    logv("");
+    CommMux *mux = session->mMux;
+    CommConnEntry *entry = mux->mEntry;
+    int errno_bak = errno;
+
+    pthread_mutex_lock(&entry->mutex);
+    if (!mux->mClosed) {
+        mux->cancel(session);
+        Communicator::flushMux(entry);
+    }
+
+    pthread_mutex_unlock(&entry->mutex);
+    Communicator::unrefMuxConn(entry);
+    errno = errno_bak;
+}
+
+void Communicator::unrefMuxConn(CommConnEntry *entry)
+{
+    logv("");
+    CommService *service = entry->service;
+    CommTarget *target = entry->target;
+
+    if (__sync_sub_and_fetch(&entry->ref, 1) == 0) {
+        releaseConn(entry);
+        if (service)
+            ((CommServiceTarget *)target)->decref();
+    }
+}
+
+/* 客户端连接建立后开始多路复用, 第一个会话的请求随连接的开头发出 */
+int Communicator::startMux(CommSession *session, CommConnEntry *entry)
+{
+    logv("");
+    CommTarget *target = entry->target;
+    CommMux *mux = entry->mux;
+    CPollData data;
+    int ret;
+
+    data.operation = PD_OP_READ;
+    data.fd = entry->sockFd;
+    data.ssl = NULL;
+    data.context = entry;
+    data.message = NULL;
+    pthread_mutex_lock(&entry->mutex);
+    ret = m_poll_add(&data, target->mResponseTimeout, mPoll);
+    if (ret >= 0) {
+        entry->session = NULL;
+        if (mux->open() >= 0 && sendMuxRequest(session, entry) >= 0) {
+            /* 连接的锁在 target 的锁之前: SSL 的会话回调在连接的锁里取 target 的锁 */
+            entry->state = CONN_STATE_RECEIVING;
+            pthread_mutex_lock(&target->mMutex);
+            list_add_tail(&entry->list, &target->mMuxList);
+            pthread_mutex_unlock(&target->mMutex);
+            Communicator::flushMux(entry);
+        } else {
+            /* 连接已经在 poller 里, 会话随连接的关闭结束 */
+            __sync_add_and_fetch(&entry->ref, 1);
+            mux->done(session, CS_STATE_ERROR, errno);
+            entry->state = CONN_STATE_CLOSING;
+            m_poll_del(entry->sockFd, mPoll);
+        }
+
+        if (mStopFlag)
+            m_poll_del(entry->sockFd, mPoll);
+    }
+
+    pthread_mutex_unlock(&entry->mutex);
+    return ret;
+}
+
+/* 找一个还能发出请求的多路复用连接 */
+int Communicator::requestMuxConn(CommSession *session, CommTarget *target)
+{
+    logv("");
+    CommConnEntry *entry = NULL;
+    struct list_head *pos;
+    CommMux *mux;
+    int ret = -1;
+
+    if (!session->multiplexable() || list_empty(&target->mMuxList)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    pthread_mutex_lock(&target->mMutex);
+    list_for_each(pos, &target->mMuxList) {
+        entry = list_entry(pos, CommConnEntry, list);
+        if (entry->mux->mAvailable) {
+            __sync_add_and_fetch(&entry->ref, 1);
+            break;
+        }
+
+        entry = NULL;
+    }
+
+    pthread_mutex_unlock(&target->mMutex);
+    if (!entry) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    mux = entry->mux;
+    pthread_mutex_lock(&entry->mutex);
+    if (!mux->mClosed && entry->state != CONN_STATE_CLOSING && mux->available()) {
+        session->mConn = entry->conn;
+        session->mSeq = entry->seq++;
+        ret = sendMuxRequest(session, entry);
+        if (ret >= 0)
+            Communicator::flushMux(entry);
+    } else {
+        errno = ENOENT;
+    }
+
+    pthread_mutex_unlock(&entry->mutex);
+    Communicator::unrefMuxConn(entry);
+    return ret;
+}
+
+int Communicator::replyMux(CommSession *session)
+{
+    logv("");
+    CommMux *mux = session->mMux;
+    CommConnEntry *entry = mux->mEntry;
+    int ret = -1;
+
+    pthread_mutex_lock(&entry->mutex);
+    if (!mux->mClosed) {
+        session->mOut = session->messageOut();
+        session->mMuxState = -1;
+        if (session->mOut)
+            ret = mux->reply(session);
+
+        if (ret >= 0) {
+            Communicator::flushMux(entry);
+            /* 回复一次就发完了, 和 replyIdleConn() 一样直接结束会话 */
+            if (session->mMuxState != -1) {
+                list_del(&session->mPipeList);
+                ret = 1;
+            }
+        }
+    } else {
+        errno = ECONNRESET;
+    }
+
+    pthread_mutex_unlock(&entry->mutex);
+    if (ret < 0) {
+        Communicator::unrefMuxConn(entry);
+        return -1;
+    }
+
+    if (ret > 0) {
+        session->handle(session->mMuxState, session->mMuxError);
+        this->drainMux(entry);
+        Communicator::unrefMuxConn(entry);
+    }
+
+    return 0;
+}
+
+/* 在 handler 线程里结束 mux 交出的会话, 需要重发的换连接重发 */
+void Communicator::drainMux(CommConnEntry *entry)
+{
+    logv("");
+    CommTarget *target = entry->target;
+    CommMux *mux = entry->mux;
+    struct list_head sessions;
+    struct list_head replays;
+    struct list_head *pos;
+    CommSession *session;
+    int passive;
+    int state;
+
+    INIT_LIST_HEAD(&sessions);
+    INIT_LIST_HEAD(&replays);
+    pthread_mutex_lock(&entry->mutex);
+    list_splice_init(&mux->mDoneList, &sessions);
+    list_splice_init(&mux->mReplayList, &replays);
+    pthread_mutex_unlock(&entry->mutex);
+
+    while (!list_empty(&sessions)) {
+        session = list_entry(sessions.next, CommSession, mPipeList);
+        list_del(&session->mPipeList);
+        state = session->mMuxState;
+        if (entry->service) {
+            /* 没有回复的会话在析构时放开连接 */
+            passive = session->mPassive;
+            session->handle(state, session->mMuxError);
+            if (state != CS_STATE_TOREPLY && passive == 2)
+                Communicator::unrefMuxConn(entry);
+        } else {
+            Communicator::releaseTarget(target, session, state, state == CS_STATE_SUCCESS);
+            session->handle(state, session->mMuxError);
+            Communicator::unrefMuxConn(entry);
+        }
+    }
+
+    if (!list_empty(&replays)) {
+        list_for_each(pos, &replays)
+            Communicator::unrefMuxConn(entry);
+
+        replayPipelined(&replays, target);
+    }
+}
+
+void Communicator::handleMuxResult(CPollResult *res)
+{
+    logv("");
+    CommConnEntry *entry = (CommConnEntry *)res->data.context;
+    CommService *service = entry->service;
+    CommTarget *target = entry->target;
+    CommMux *mux = entry->mux;
+    int state;
+
+    if (res->data.operation == PD_OP_WRITE) {
+        pthread_mutex_lock(&entry->mutex);
+        free(mux->mWriteBuf);
+        mux->mWriteBuf = NULL;
+        mux->mWriting = 0;
+        if (res->state == PR_ST_FINISHED)
+            Communicator::flushMux(entry);
+        else if (!mux->mClosed)
+            shutdown(entry->sockFd, SHUT_RDWR);
+
+        pthread_mutex_unlock(&entry->mutex);
+    } else {
+        switch (res->state) {
+            case PR_ST_FINISHED:
+                res->error = ECONNRESET;
+                if (1)
+                    case PR_ST_ERROR:
+                        state = CS_STATE_ERROR;
+                else
+                    case PR_ST_DELETED:
+                    case PR_ST_STOPPED:
+                        state = CS_STATE_STOPPED;
+
+                pthread_mutex_lock(&entry->mutex);
+                mux->mClosed = 1;
+                mux->abort(state, res->error);
+                if (mux->mWriting)
+                    m_poll_del(entry->muxFd, mPoll);
+
+                pthread_mutex_unlock(&entry->mutex);
+                if (service) {
+                    pthread_mutex_lock(&service->mMutex);
+                    if (entry->state == CONN_STATE_KEEPALIVE)
+                        list_del(&entry->list);
+
+                    entry->state = CONN_STATE_CLOSING;
+                    pthread_mutex_unlock(&service->mMutex);
+                } else {
+                    pthread_mutex_lock(&target->mMutex);
+                    if (entry->state != CONN_STATE_CLOSING)
+                        list_del(&entry->list);
+
+                    entry->state = CONN_STATE_CLOSING;
+                    pthread_mutex_unlock(&target->mMutex);
+                }
+
+                break;
+        }
+    }
+
+    this->drainMux(entry);
+    Communicator::unrefMuxConn(entry);
+}
+
+int Communicator::request(CommSession *session, CommTarget *target)
+{
+    logv("");
+    if (session->mPassive) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* 重定向和重试是新的请求, 上一次的 pipelining 状态不带过去 */
+    session->mPipelined = 0;
+    return this->issueRequest(session, target);
+}
+
+/* 重发的会话 mPipelined 为 -1, 不走这里清零 */
+int Communicator::issueRequest(CommSession *session, CommTarget *target)
+{
+    logv("");
+    int errno_bak;
+
+    errno_bak = errno;
+    clock_gettime(CLOCK_MONOTONIC, &session->mRequestTime);
+    session->mTarget = target;
+    session->mOut = NULL;
+    session->mIn = NULL;
+    session->mMux = NULL;
+
+    if (requestMuxConn(session, target) >= 0) {
+        errno = errno_bak;
+        return 0;
+    }
+
+    if (requestIdleConn(session, target) < 0 && requestPipeConn(session, target) < 0) {
+        if (requestNewConn(session, target) < 0) {
+            session->mConn = NULL;
+            session->mSeq = 0;
+            return -1;
+        }
+    }
+
+    if (target->mMinIdle > 0)
+        warmTarget(target);
+
+    errno = errno_bak;
+
+    return 0;
+}
+
+int Communicator::nonblockListen(CommService *service)
+{
+    logv("");
+    int socketFd = service->createListenFd();
+
+    if (socketFd >= 0) {
+        if (_set_fd_nonblock(socketFd) >= 0) {
+            if (_bind_and_listen(socketFd, service->mBindAddr, service->mAddrLen) >= 0) {
+                return socketFd;
+            }
+        }
+        close(socketFd);
+    }
+
+    return -1;
+}
+
+/**
+ * @brief
+ *  每个分片都由 createListenFd() 新建 socket (SO_REUSEPORT 组里的 socket 不能 dup).
+ *  index < 0 时是第一个分片, fd 保持不变; 其余分片使 fd % shards == index
+ */
+int Communicator::nonblockListen(CommService *service, int index, unsigned int shards)
+{
+    logv("");
+    int reuse = 1;
+    int socketFd;
+
+    socketFd = service->createListenFd();
+    if (socketFd >= 0 && index >= 0)
+        socketFd = _shard_fd(socketFd, (unsigned int)index, shards);
+
+    if (socketFd >= 0) {
+
+        setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (int));
+        if (setsockopt(socketFd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof (int)) >= 0) {
+            if (_set_fd_nonblock(socketFd) >= 0) {
+                if (_bind_and_listen(socketFd, service->mBindAddr, service->mAddrLen) >= 0) {
+                    return socketFd;
+                }
+            }
+        }
+        close(socketFd);
+    }
+
+    return -1;
+}
+
+/**
+ * @brief
+ *  每个 poll 线程一个 SO_REUSEPORT 监听 fd, 由内核分配新连接.
+ *  第一个分片之外的失败不影响启动, 只是少几个分片.
+ */
+int Communicator::bindShards(CommService *service)
+{
+    logv("");
+    unsigned int shards = mPoll->nThreads;
+    unsigned int n = 0;
+    CPollData data;
+    int* fds;
+    int fd;
+
+    fds = (int *)malloc(shards * sizeof (int));
+    if (!fds)
+        return -1;
+
+    for (unsigned int i = 0; i < shards; i++) {
+        fd = nonblockListen(service, i == 0 ? -1 : (int)(((unsigned int)fds[0] + i) % shards), shards);
+        if (fd < 0) {
+            if (i == 0)
+                break;
+
+            logw("listen shard %u failed: %d", i, errno);
+            continue;
+        }
+
+        fds[n++] = fd;
+    }
+
+    if (n > 0) {
+        if (service->mReusePortCBPF && n == shards) {
+            if (_attach_reuseport_cbpf(fds[0], shards) < 0)
+                logw("attach reuseport cbpf failed: %d", errno);
+        }
+
+        service->mListenFd = fds[0];
+        service->mRef = (int)n;
+        data.operation = PD_OP_LISTEN;
+        data.accept = Communicator::accept;
+        data.context = service;
+        data.result = NULL;
+
+        // 已经加入 poll 的分片只能异步删除, 所以之后的失败也不回退, 只减去对应的引用
+        unsigned int added = 0;
+        for (unsigned int i = 0; i < n; i++) {
+            data.fd = fds[i];
+            if (m_poll_add(&data, service->mListenTimeout, mPoll) >= 0) {
+                fds[added++] = fds[i];
+                continue;
+            }
+
+            close(fds[i]);
+            __sync_sub_and_fetch(&service->mRef, 1);
+        }
+
+        if (added > 0) {
+            service->mListenFd = fds[0];
+            service->mShardFds = fds;
+            service->mShardCount = (int)added;
+            logv("service listen on %u shards", added);
+            return 0;
+        }
+    }
+
+    free(fds);
+    logd("service listen shards add poll failed!");
+
+    return -1;
+}
+
+int Communicator::bind(CommService *service)
+{
+    logv("");
+    CPollData data;
+    int socketFd = -1;
+
+    if (service->mReusePort && mPoll->nThreads > 1)
+        return bindShards(service);
+
+    socketFd = nonblockListen(service);
+    if (socketFd >= 0) {
+        service->mListenFd = socketFd;
+        service->mRef = 1;
+        data.operation = PD_OP_LISTEN;
+        data.fd = socketFd;
         data.accept = Communicator::accept;
         data.context = service;
         data.result = NULL;
@@ -1583,8 +3331,21 @@ void Communicator::unbind(CommService *service)
     logv("");
     int errno_bak = errno;
 
+    if (service->mShardFds) {
+        for (int i = 0; i < service->mShardCount; i++) {
+            if (m_poll_del(service->mShardFds[i], mPoll) < 0)
+                shutdownService(service, service->mShardFds[i]);
+        }
+
+        free(service->mShardFds);
+        service->mShardFds = nullptr;
+        service->mShardCount = 0;
+        errno = errno_bak;
+        return;
+    }
+
     if (m_poll_del(service->mListenFd, mPoll) < 0) {
-        shutdownService(service);
+        shutdownService(service, service->mListenFd);
         errno = errno_bak;
     }
 }
@@ -1635,6 +3396,14 @@ int Communicator::reply(CommSession *session)
 
     errno_bak = errno;
     session->mPassive = 2;
+    if (session->mMux) {
+        if (this->replyMux(session) < 0)
+            return -1;
+
+        errno = errno_bak;
+        return 0;
+    }
+
     target = session->mTarget;
     ret = this->replyIdleConn(session, target);
     if (ret < 0)
@@ -1709,30 +3478,147 @@ int Communicator::sleep(SleepSession *session)
 int Communicator::isHandlerThread() const
 {
     logv("");
-    return thread_pool_in_pool(mThreadPool);
+    int i;
+
+    for (i = 0; i < mGroupCnt; i++) {
+        if (thread_pool_in_pool(mGroups[i].pool))
+            return 1;
+    }
+
+    return 0;
 }
 
-extern "C" void _thread_pool_schedule(ThreadPoolTask*, void *,ThreadPool*);
+extern "C" void* _thread_pool_alloc_entry(void);
+extern "C" int _thread_pool_schedule(ThreadPoolTask*, void *,ThreadPool*);
 
 int Communicator::increaseHandlerThread()
 {
     logv("");
-    void *buf = malloc(4 * sizeof (void *));
+    CommHandlerGroup *group = mGroups;
+    void *buf = _thread_pool_alloc_entry();
+    int i;
+
+    // 加到调用线程所在的组
+    for (i = 1; i < mGroupCnt; i++) {
+        if (thread_pool_in_pool(mGroups[i].pool)) {
+            group = &mGroups[i];
+            break;
+        }
+    }
 
     if (buf) {
-        if (thread_pool_increase(mThreadPool) >= 0) {
+        if (thread_pool_increase(group->pool) >= 0) {
             ThreadPoolTask task = {
                     .routine	=	Communicator::handlerThreadRoutine,
-                    .context	=	this
+                    .context	=	group
             };
-            _thread_pool_schedule(&task, buf, mThreadPool);
-            return 0;
+            if (_thread_pool_schedule(&task, buf, group->pool) >= 0)
+                return 0;
         }
-        free(buf);
+        slab_free(buf);
     }
     return -1;
 }
 
+/* maxThreads 是所有组的总数, 多出的线程平均分给各组 */
+int Communicator::setHandlerElastic(size_t maxThreads, int waitTarget, int idleTimeout)
+{
+    ThreadPoolStats stats;
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < mGroupCnt; i++)
+        total += mGroups[i].nHandlers;
+
+    if (maxThreads < total)
+        maxThreads = total;
+
+    for (i = 0; i < mGroupCnt; i++) {
+        ThreadPoolElastic elastic = {
+                .minThreads     =   0,
+                .maxThreads     =   mGroups[i].nHandlers + (maxThreads - total) / mGroupCnt,
+                .waitTarget     =   waitTarget,
+                .idleTimeout    =   idleTimeout,
+                .task           =   {
+                        .routine	=	Communicator::handlerThreadRoutine,
+                        .context	=	&mGroups[i]
+                }
+        };
+
+        thread_pool_get_stats(&stats, mGroups[i].pool);
+        elastic.minThreads = stats.nThreads;
+        if (elastic.maxThreads < elastic.minThreads)
+            elastic.maxThreads = elastic.minThreads;
+
+        if (thread_pool_set_elastic(&elastic, mGroups[i].pool) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* 所有组的合计 */
+void Communicator::getHandlerStats(ThreadPoolStats* stats)
+{
+    ThreadPoolStats group;
+    int i;
+
+    memset(stats, 0, sizeof (ThreadPoolStats));
+    for (i = 0; i < mGroupCnt; i++) {
+        thread_pool_get_stats(&group, mGroups[i].pool);
+        stats->nThreads += group.nThreads;
+        stats->peakThreads += group.peakThreads;
+        stats->minThreads += group.minThreads;
+        stats->maxThreads += group.maxThreads;
+        stats->grows += group.grows;
+        stats->shrinks += group.shrinks;
+    }
+}
+
+unsigned long Communicator::getHandlerOverflows() const
+{
+    unsigned long n = 0;
+    int i;
+
+    for (i = 0; i < mGroupCnt; i++)
+        n += __atomic_load_n(&mGroups[i].overflows, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+int Communicator::setPollSpin(int spinBudget, int sockBusyPoll)
+{
+    CPollSpin spin = {
+            .spinBudget     =   spinBudget,
+            .sockBusyPoll   =   sockBusyPoll
+    };
+
+    return m_poll_set_spin(&spin, mPoll);
+}
+
+void Communicator::getPollStats(CPollStats* stats)
+{
+    m_poll_get_stats(stats, mPoll);
+}
+
+int Communicator::setZeroCopy(size_t threshold)
+{
+    if (m_poll_set_zerocopy(threshold, mPoll) < 0)
+        return -1;
+
+    mZeroCopyThreshold = threshold;
+    return 0;
+}
+
+void Communicator::getSSLStats(CommSSLStats* stats)
+{
+    stats->clientHandshakes = __atomic_load_n(&mSSLStats.clientHandshakes, __ATOMIC_RELAXED);
+    stats->clientResumed = __atomic_load_n(&mSSLStats.clientResumed, __ATOMIC_RELAXED);
+    stats->serverHandshakes = __atomic_load_n(&mSSLStats.serverHandshakes, __ATOMIC_RELAXED);
+    stats->serverResumed = __atomic_load_n(&mSSLStats.serverResumed, __ATOMIC_RELAXED);
+    stats->ktls = __atomic_load_n(&mSSLStats.ktls, __ATOMIC_RELAXED);
+}
+
 void Communicator::shutdownIOService(IOService *service)
 {
     logv("");
@@ -1749,7 +3635,7 @@ int Communicator::ioBind(IOService *service)
     CPollData data;
     int eventFd = service->createEventFd();
     if (eventFd >= 0) {
-        if (_set_fd_nonblock(eventFd) >= 0) {
+        if (_set_fd_nonblock(eventFd) >= 0 && service->registerEventFd(eventFd) >= 0) {
             service->mRef = 1;
             data.operation = PD_OP_EVENT;
             data.fd = eventFd;
@@ -17,6 +17,33 @@
 #include "c-poll.h"
 
 typedef struct _CommConnEntry           CommConnEntry;
+typedef struct _CommHandlerGroup        CommHandlerGroup;
+typedef struct _CommSSLStats            CommSSLStats;
+typedef struct _CommPoolStats           CommPoolStats;
+
+/* 恢复率 = resumed / handshakes */
+struct _CommSSLStats
+{
+    unsigned long                       clientHandshakes;
+    unsigned long                       clientResumed;
+    unsigned long                       serverHandshakes;
+    unsigned long                       serverResumed;
+    unsigned long                       ktls;           // 握手后发送交给了内核 kTLS 的连接
+};
+
+/* 一个 CommTarget 的客户端连接池 */
+struct _CommPoolStats
+{
+    size_t                              idle;           // 当前空闲连接
+    size_t                              warming;        // 正在后台建立的预热连接
+    unsigned long                       reused;         // 复用空闲连接的请求
+    unsigned long                       warmConnects;   // 建立成功的预热连接
+    unsigned long                       warmFailures;
+    unsigned long                       evictions;      // 空闲连接超过 maxIdle 时关掉的最久未用的连接
+    unsigned long                       invalid;        // 复用前检查发现对端已关闭的空闲连接
+    unsigned long                       pipelined;      // 排在同一连接上还没收到回复的请求后面发出的请求
+    unsigned long                       replayed;       // 连接断开时还没收到回复, 换连接重发的 pipelining 请求
+};
 
 class CommConnection
 {
@@ -50,6 +77,36 @@ protected:
 
     SSL_CTX* getSSLCtx() const { return this->mSSLCtx; }
 
+public:
+    /**
+     * @brief
+     *  打开客户端 SSL_CTX 的会话缓存: 每个 CommTarget 保存这个目标最近的会话 (TLS 1.3 为服务端发来的 ticket),
+     *  之后到这个目标的新连接用它恢复会话, 不用再做完整握手. 对一个 SSL_CTX 调用一次即可
+     */
+    static int initSSLSessionCache(SSL_CTX* sslCtx);
+
+    /**
+     * @brief
+     *  客户端连接池策略.
+     *  minIdle: 保持的空闲连接数, 不够时在后台建立 (第一次请求这个目标时开始);
+     *  maxIdle: 空闲连接的上限, 超过时关掉最久未用的, 0 不限制;
+     *  validateIdle: 复用空闲连接前检查对端是否已经关闭
+     */
+    void setPoolPolicy(size_t minIdle, size_t maxIdle, bool validateIdle);
+    void getPoolStats(CommPoolStats* stats);
+
+    /**
+     * @brief
+     *  HTTP/1.1 pipelining: 一个连接上最多 depth 个请求同时在等回复, 回复按发出的顺序对应. 0 和 1 不使用.
+     *  只有 pipelinable() 的会话会排到别的请求后面; 不支持 SSL 连接, OpenSSL 不能一边在 poller 里读一边在别的线程里写
+     */
+    void setPipelineDepth(int depth) { mPipelineDepth = depth; }
+
+private:
+    void resumeSSL(SSL* ssl);
+    void dropSSLSession();
+    static int newSSLSession(SSL* ssl, SSL_SESSION* session);
+
 private:
     virtual int createConnectFd()
     {
@@ -63,8 +120,12 @@ private:
 
     virtual int initSSL (SSL* ssl) { return 0; }
 
+    /* 连接建立 (SSL 连接在握手之后) 时调用, 返回非空时这个连接多路复用, 如 ALPN 协商出了 h2 */
+    virtual class CommMux* newMux(SSL* ssl) { return NULL; }
+
 public:
-    virtual void release(int keep_alive) { }
+    /* latency: 从发起请求到结束的微秒数, 出错时至少按回复超时算, -1 没有 */
+    virtual void release(int keep_alive, long long latency) { }
 
 public:
     int                                 mResponseTimeout;
@@ -78,14 +139,30 @@ private:
 private:
     pthread_mutex_t                     mMutex;
     struct list_head                    mIdleList;
+    SSL_SESSION*                        mSSLSession;
+
+    size_t                              mMinIdle;
+    size_t                              mMaxIdle;
+    bool                                mValidateIdle;
+    bool                                mWarmPaused;
+    CommPoolStats                       mPoolStats;
+
+    int                                 mPipelineDepth;
+    struct list_head                    mPipeList;      // 可以 pipelining 的客户端连接
+
+    struct list_head                    mMuxList;       // 多路复用的客户端连接
 
 public:
     virtual ~CommTarget() { }
 };
 
+class CommSession;
+
 class CommMessageOut
 {
+    friend class CommMux;
 private:
+    /* vectors 中可以有文件段 (见 CPollFileSegment), 在消息发送完之前文件段要保持有效 */
     virtual int encode(struct iovec vectors[], int max) = 0;
 
 public:
@@ -96,6 +173,7 @@ public:
 class CommMessageIn : private CPollMessage
 {
     friend class Communicator;
+    friend class CommMux;
 private:
     virtual int append(const void *buf, size_t *size) = 0;
 
@@ -108,6 +186,7 @@ protected:
 
 private:
     CommConnEntry*                  mEntry;
+    CommSession*                    mSession;
 
 public:
     virtual ~CommMessageIn() { }
@@ -122,6 +201,7 @@ class CommSession
 {
     friend class Communicator;
     friend class CommMessageIn;
+    friend class CommMux;
 private:
     virtual CommMessageOut* messageOut() = 0;
     virtual CommMessageIn* messageIn() = 0;
@@ -129,6 +209,9 @@ private:
     virtual int receiveTimeout() { return -1; }
     virtual int keepAliveTimeout() { return 0; }
     virtual int firstTimeout() { return 0; }	/* for client session only. */
+    virtual int pipelinable() { return 0; }		/* for client session only. 可以排在别的请求后面发出 */
+    virtual int replayable() { return 0; }		/* for client session only. 还没收到回复时连接断开可以重发 */
+    virtual int multiplexable() { return 0; }	/* for client session only. 可以和别的请求共用一个多路复用的连接 */
     virtual void handle(int state, int error) = 0;
 
 protected:
@@ -147,18 +230,116 @@ private:
 
 private:
     struct timespec                 mBeginTime;
+    struct timespec                 mRequestTime;   /* 客户端会话 request() 的时间, 算 release() 的耗时 */
     int                             mTimeout;
     int                             mPassive;
+    int                             mPipelined;     /* 1: 排在别的请求后面发出; 2: 排着等连接建立; -1: 重发过, 不再 pipelining */
+    struct list_head                mPipeList;
+
+private:
+    class CommMux*                  mMux;           /* 所在的多路复用连接, 以下由连接的锁保护 */
+    int                             mStreamId;
+    int                             mMuxState;
+    int                             mMuxError;
 
 public:
-    CommSession() { mPassive = 0; }
+    CommSession() { mPassive = 0; mPipelined = 0; mMux = NULL; mStreamId = 0; }
     virtual ~CommSession();
 };
 
+/**
+ * @brief
+ *  多路复用的连接 (如 HTTP/2): 一个连接上同时进行多个会话, 各会话的消息仍由自己的 messageIn()/messageOut() 编解码.
+ *  连接收到的数据都交给 input(), 要发送的数据用 output() 写入连接的发送缓冲, SSL 连接由 Communicator 加解密.
+ *  除构造和析构外都在连接的锁里调用, 不能在其中调用会话的 handle()
+ */
+class CommMux : public CommMessageIn
+{
+    friend class Communicator;
+private:
+    /* 出错返回 -1, 连接将被关闭 */
+    virtual int input(const void* buf, size_t size) = 0;
+
+    /* 连接确定多路复用后调用一次, 发出连接的开头 */
+    virtual int open() = 0;
+
+    /* 客户端: 发出会话的请求, 回复收完后 done() */
+    virtual int request(CommSession* session) = 0;
+
+    /* 服务端: 发出会话的回复, 发完后 done() */
+    virtual int reply(CommSession* session) = 0;
+
+    /* 服务端: 会话没有回复就被删除 */
+    virtual void cancel(CommSession* session) = 0;
+
+    /* 连接已断开, 还有的会话都要 done() 或 replay() */
+    virtual void abort(int state, int error) = 0;
+
+    /* 客户端: 还能再发出一个请求 */
+    virtual int available() = 0;
+
+    /* 发送缓冲发完时调用, 可以继续发送受发送缓冲大小限制的数据 */
+    virtual void pull() { }
+
+    /* 收到的数据由 Communicator 经 input() 交给连接, 不会调用 */
+    int append(const void* buf, size_t* size) final;
+
+protected:
+    int output(const void* buf, size_t size);
+    size_t pending() const;
+
+    /* 服务端: 收到新请求时创建会话 */
+    CommSession* newSession();
+
+    int appendMessage(const void* buf, size_t* size, CommSession* session);
+    int encodeMessage(struct iovec vectors[], int max, CommSession* session);
+
+    /* 结束一个会话, 回到 handler 线程后调用它的 handle(state, error) */
+    void done(CommSession* session, int state, int error);
+
+    /* 客户端: 请求没有被对端处理, unprocessed 为真时不论是否幂等都可以换连接重发 */
+    void replay(CommSession* session, int unprocessed);
+
+    /* 会话在连接上的编号, 没有时为 0 */
+    static int getStreamId(const CommSession* session) { return session->mStreamId; }
+    static void setStreamId(CommSession* session, int id) { session->mStreamId = id; }
+
+protected:
+    int                             mActive;        // 进行中的会话数, 决定连接的超时
+    int                             mReceiving;     // 正在接收消息的会话数
+
+private:
+    char*                           mBuf;           // 待发送的数据, SSL 连接为密文
+    size_t                          mBufSize;
+    size_t                          mBufLen;
+    size_t                          mBufOff;
+    char*                           mPlain;         // SSL 连接待加密的明文
+    size_t                          mPlainSize;
+    size_t                          mPlainLen;
+    char*                           mWriteBuf;      // 交给 poller 异步发送中的数据
+    struct iovec                    mWriteIov;
+    int                             mWriting;
+    int                             mClosed;
+    int                             mKeepAlive;
+    int                             mAvailable;     // 客户端: 由 target 的锁保护, 选连接时用
+    SSL*                            mSSL;
+    struct list_head                mDoneList;
+    struct list_head                mReplayList;
+
+private:
+    int encrypt();
+    int decrypt(const void* buf, size_t size);
+
+public:
+    CommMux();
+    virtual ~CommMux();
+};
+
 class CommService
 {
     friend class Communicator;
     friend class CommServiceTarget;
+    friend class CommMux;
 public:
     int init(const struct sockaddr *bind_addr, socklen_t addrLen, int listenTimeout, int responseTimeout);
     void deInit();
@@ -181,6 +362,13 @@ protected:
 
     SSL_CTX *getSSLCtx() const { return mSSLCtx; }
 
+    /* shard 为真时每个 poll 线程一个 SO_REUSEPORT 监听 fd, cbpf 为真时由内核按 CPU 选择监听 fd */
+    void setReusePort (bool shard, bool cbpf)
+    {
+        mReusePort = shard;
+        mReusePortCBPF = cbpf;
+    }
+
 private:
     virtual CommSession *newSession(long long seq, CommConnection *conn) = 0;
     virtual void handleStop(int error) { }
@@ -199,6 +387,18 @@ private:
 
     virtual int initSSL (SSL *ssl) { return 0; }
 
+    /* 连接确定多路复用时调用: SSL 连接握手后 (如 ALPN 选择了 h2), 或明文连接以 setMux() 的开头开始 */
+    virtual CommMux* newMux(SSL *ssl) { return NULL; }
+
+protected:
+    /* 明文连接以 preface 开头时多路复用, 否则照常处理. SSL 连接不用设置 */
+    void setMux(const char *preface, size_t len)
+    {
+        mMuxPreface = preface;
+        mMuxPrefaceLen = len;
+        mMux = true;
+    }
+
 private:
     struct sockaddr*                mBindAddr;
     socklen_t                       mAddrLen;
@@ -206,6 +406,11 @@ private:
     int                             mResponseTimeout;
     int                             mSSLAcceptTimeout;
     SSL_CTX*                        mSSLCtx;
+    bool                            mReusePort;
+    bool                            mReusePortCBPF;
+    bool                            mMux;
+    const char*                     mMuxPreface;
+    size_t                          mMuxPrefaceLen;
 
 private:
     void incref();
@@ -213,6 +418,8 @@ private:
 
 private:
     int                             mListenFd;
+    int*                            mShardFds;              // 分片监听时所有的监听 fd, mShardFds[0] 即 mListenFd
+    int                             mShardCount;
     int                             mRef;
 
 private:
@@ -242,13 +449,35 @@ public:
 #include "msg-queue.h"
 #include "io-service.h"
 #include "thread-pool.h"
+#include "cpu-affinity.h"
+
+#define COMM_HANDLER_SHARED             0           // 所有 handler 线程共用一个结果队列
+#define COMM_HANDLER_PER_POLLER         1           // 每个 poller 一组 handler 线程和队列, 本组忙不过来才交给其它组
 
 class Communicator
 {
     friend class CommTarget;
     friend class CommSession;
 public:
-    int init(size_t pollThreads, size_t handlerThreads);
+    int init(size_t pollThreads, size_t handlerThreads)
+    {
+        return init(pollThreads, handlerThreads, CPOLL_ENGINE_EPOLL);
+    }
+
+    /* pollEngine: CPOLL_ENGINE_EPOLL 或 CPOLL_ENGINE_URING */
+    int init(size_t pollThreads, size_t handlerThreads, int pollEngine)
+    {
+        return init(pollThreads, handlerThreads, pollEngine, NULL);
+    }
+
+    /* affinity 非空时 poller 和 handler 线程按其中的方案绑核 */
+    int init(size_t pollThreads, size_t handlerThreads, int pollEngine, const CpuAffinity* affinity)
+    {
+        return init(pollThreads, handlerThreads, pollEngine, affinity, COMM_HANDLER_SHARED);
+    }
+
+    /* handlerMode: COMM_HANDLER_SHARED 或 COMM_HANDLER_PER_POLLER, 后者把 handlerThreads 平均分给各 poller */
+    int init(size_t pollThreads, size_t handlerThreads, int pollEngine, const CpuAffinity* affinity, int handlerMode);
     void deInit();
 
     int request(CommSession *session, CommTarget *target);
@@ -268,25 +497,51 @@ public:
     [[nodiscard]] int isHandlerThread() const;
     int increaseHandlerThread();
 
+    /* handler 线程数在 init 时的数目和 maxThreads 之间伸缩, 参数含义见 ThreadPoolElastic */
+    int setHandlerElastic(size_t maxThreads, int waitTarget, int idleTimeout);
+    void getHandlerStats(ThreadPoolStats* stats);
+    unsigned long getHandlerOverflows() const;              // 因所在组忙不过来交给其它组处理的结果数
+
+    /* poller 线程的自适应忙轮询, 参数含义见 CPollSpin */
+    int setPollSpin(int spinBudget, int sockBusyPoll);
+    void getPollStats(CPollStats* stats);
+
+    /* 不少于 threshold 字节的消息交给 poller 用 MSG_ZEROCOPY 发送, 0 关闭. 见 poll_set_zerocopy() */
+    int setZeroCopy(size_t threshold);
+
+    /* 客户端和服务端的 SSL 握手次数, 以及其中恢复了会话的次数 */
+    void getSSLStats(CommSSLStats* stats);
+
 private:
     MPoll*                          mPoll;
-    MsgQueue*                       mQueue;
-    ThreadPool*                     mThreadPool;
+    CommHandlerGroup*               mGroups;
+    int                             mGroupCnt;
     int                             mStopFlag;
+    size_t                          mZeroCopyThreshold;
+    CommSSLStats                    mSSLStats;
 
 private:
-    int createPoll (size_t pollThreads);
-    int createHandlerThreads(size_t handlerThreads);
+    int createPoll (size_t pollThreads, int pollEngine, const CpuAffinity* affinity);
+    int createHandlerThreads(CommHandlerGroup *group, const cpu_set_t *cpus);
+    int createHandlerGroups(size_t groupCnt, size_t handlerThreads, const CpuAffinity* affinity);
+    void destroyHandlerGroups(int groupCnt);
+    CommHandlerGroup *selectHandlerGroup(CPollResult* res);
 
     int nonblockConnect(CommTarget *target);
     int nonblockListen(CommService *service);
+    int nonblockListen(CommService *service, int index, unsigned int shards);
+
+    int bindShards(CommService *service);
 
     CommConnEntry *launchConn(CommSession *session, CommTarget *target);
+    int warmConn(CommTarget *target);
+    void warmTarget(CommTarget *target);
     CommConnEntry *acceptConn(class CommServiceTarget *target, CommService *service);
 
-    void releaseConn(CommConnEntry *entry);
+    static void releaseConn(CommConnEntry *entry);
+    static void releaseTarget(CommTarget *target, CommSession *session, int state, int keepAlive);
 
-    void shutdownService(CommService *service);
+    void shutdownService(CommService *service, int listenFd);
 
     void shutdownIOService(IOService *service);
 
@@ -297,8 +552,20 @@ private:
 
     int replyIdleConn(CommSession *session, CommTarget *target);
     int requestIdleConn(CommSession *session, CommTarget *target);
+    int requestPipeConn(CommSession *session, CommTarget *target);
+    int sendPipelined(CommSession *session, CommConnEntry *entry);
+    void flushPipelined(CommConnEntry *entry);
+    void unpipeConn(CommConnEntry *entry, struct list_head *sessions);
+    void replayPipelined(struct list_head *sessions, CommTarget *target);
 
     int requestNewConn(CommSession *session, CommTarget *target);
+    int issueRequest(CommSession *session, CommTarget *target);
+
+    int requestMuxConn(CommSession *session, CommTarget *target);
+    int startMux(CommSession *session, CommConnEntry *entry);
+    int replyMux(CommSession *session);
+    void drainMux(CommConnEntry *entry);
+    void handleMuxResult(CPollResult* res);
 
     void handleIncomingReply(CPollResult* res);
     void handleIncomingRequest(CPollResult* res);
@@ -311,6 +578,7 @@ private:
 
     void handleListenResult(CPollResult* res);
     void handleConnectResult(CPollResult* res);
+    void handleWarmConnectResult(CPollResult* res);
 
     void handleSleepResult(CPollResult* res);
     void handleSSLAcceptResult(CPollResult* res);
@@ -327,6 +595,14 @@ private:
     static int createServiceSession(CommConnEntry *entry);
     static int append(const void *buf, size_t *size, CPollMessage* msg);
 
+    static int attachMux(CommMux *mux, CommConnEntry *entry);
+    static int appendMux(const void *buf, size_t size, CommConnEntry *entry);
+    static int probeMux(const void *buf, size_t *size, CommConnEntry *entry);
+    static int flushMux(CommConnEntry *entry);
+    static int sendMuxRequest(CommSession *session, CommConnEntry *entry);
+    static void cancelMux(CommSession *session);
+    static void unrefMuxConn(CommConnEntry *entry);
+
     static CPollMessage* createMessage(void *context);
 
     static int partialWritten(size_t n, void *context);
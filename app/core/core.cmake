@@ -6,12 +6,24 @@ file(GLOB CORE_SRC
         ${CMAKE_SOURCE_DIR}/app/core/rb-tree.c
         ${CMAKE_SOURCE_DIR}/app/core/rb-tree.h
 
+        ${CMAKE_SOURCE_DIR}/app/core/timer-wheel.c
+        ${CMAKE_SOURCE_DIR}/app/core/timer-wheel.h
+
         ${CMAKE_SOURCE_DIR}/app/core/c-poll.c
         ${CMAKE_SOURCE_DIR}/app/core/c-poll.h
 
         ${CMAKE_SOURCE_DIR}/app/core/m-poll.h
         ${CMAKE_SOURCE_DIR}/app/core/m-poll.c
 
+        ${CMAKE_SOURCE_DIR}/app/core/slab.c
+        ${CMAKE_SOURCE_DIR}/app/core/slab.h
+
+        ${CMAKE_SOURCE_DIR}/app/core/buffer-pool.c
+        ${CMAKE_SOURCE_DIR}/app/core/buffer-pool.h
+
+        ${CMAKE_SOURCE_DIR}/app/core/cpu-affinity.c
+        ${CMAKE_SOURCE_DIR}/app/core/cpu-affinity.h
+
         ${CMAKE_SOURCE_DIR}/app/core/msg-queue.c
         ${CMAKE_SOURCE_DIR}/app/core/msg-queue.h
 
@@ -0,0 +1,244 @@
+//
+// Created by dingjing on 8/13/22.
+//
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "cpu-affinity.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CPU_AFFINITY_NODES_MAX          64
+#define CPU_AFFINITY_SYS_CPU            "/sys/devices/system/cpu"
+#define CPU_AFFINITY_SYS_NODE           "/sys/devices/system/node"
+
+static int _cpu_affinity_read_list(const char* path, cpu_set_t* set)
+{
+    char buf[4096];
+    FILE* fp = fopen(path, "r");
+    int ret = -1;
+
+    if (fp) {
+        if (fgets(buf, sizeof (buf), fp)) {
+            ret = cpu_affinity_parse(buf, set);
+        }
+
+        fclose(fp);
+    }
+
+    return ret;
+}
+
+/* 读取各节点的核, 返回节点数. 没有 NUMA 信息时只有节点 0, 包含所有核 */
+static int _cpu_affinity_nodes(cpu_set_t* nodes)
+{
+    char path[128];
+    int n = 0;
+    int i;
+
+    for (i = 0; i < CPU_AFFINITY_NODES_MAX; i++) {
+        snprintf(path, sizeof (path), CPU_AFFINITY_SYS_NODE "/node%d/cpulist", i);
+        if (_cpu_affinity_read_list(path, &nodes[i]) < 0) {
+            CPU_ZERO(&nodes[i]);
+        } else {
+            n = i + 1;
+        }
+    }
+
+    if (n == 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &nodes[0]);
+        }
+        n = 1;
+    }
+
+    return n;
+}
+
+/* 超线程的兄弟核中编号最小的算物理核 */
+static int _cpu_affinity_is_primary(int cpu)
+{
+    char path[128];
+    cpu_set_t siblings;
+    int i;
+
+    snprintf(path, sizeof (path), CPU_AFFINITY_SYS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+    if (_cpu_affinity_read_list(path, &siblings) < 0) {
+        return 1;
+    }
+
+    for (i = 0; i < cpu; i++) {
+        if (CPU_ISSET(i, &siblings)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int _cpu_affinity_key_cmp(const void* a, const void* b)
+{
+    long x = *(const long*) a;
+    long y = *(const long*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int cpu_affinity_parse(const char* list, cpu_set_t* set)
+{
+    const char* p = list;
+    char* end;
+    long first;
+    long last;
+
+    CPU_ZERO(set);
+    while (*p && *p != '\n') {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+
+        for (; first <= last; first++) {
+            CPU_SET(first, set);
+        }
+
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cpu_affinity_node(int cpu)
+{
+    cpu_set_t nodes[CPU_AFFINITY_NODES_MAX];
+    int n = _cpu_affinity_nodes(nodes);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (CPU_ISSET(cpu, &nodes[i])) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+void cpu_affinity_poller_group(const CpuAffinity* affinity, int poller, cpu_set_t* set)
+{
+    cpu_set_t nodes[CPU_AFFINITY_NODES_MAX];
+    int cpu = affinity->pollerCpus[poller % affinity->nPollers];
+    int n = _cpu_affinity_nodes(nodes);
+    int node;
+
+    for (node = 0; node < n && !CPU_ISSET(cpu, &nodes[node]); node++);
+    if (node == n) {
+        node = 0;
+    }
+
+    CPU_AND(set, &affinity->handlerCpus, &nodes[node]);
+    CPU_SET(cpu, set);
+}
+
+int cpu_affinity_plan(const char* cpuList, int nPollers, CpuAffinity* affinity)
+{
+    cpu_set_t nodes[CPU_AFFINITY_NODES_MAX];
+    int ranks[2][CPU_AFFINITY_NODES_MAX];
+    int hasPoller[CPU_AFFINITY_NODES_MAX];
+    int nodeOf[CPU_SETSIZE];
+    long order[CPU_SETSIZE];
+    cpu_set_t pollers;
+    cpu_set_t avail;
+    cpu_set_t list;
+    int nNodes;
+    int cpu, node;
+    int n = 0;
+    int i;
+
+    if (sched_getaffinity(0, sizeof (cpu_set_t), &avail) < 0) {
+        return -1;
+    }
+
+    if (cpuList) {
+        if (cpu_affinity_parse(cpuList, &list) < 0) {
+            return -1;
+        }
+        CPU_AND(&avail, &avail, &list);
+    }
+
+    if (CPU_COUNT(&avail) == 0 || nPollers <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // 排序键: 是否超线程, 节点内序号, 节点. 这样 poller 先占各节点的物理核, 节点间轮流
+    nNodes = _cpu_affinity_nodes(nodes);
+    memset(ranks, 0, sizeof (ranks));
+    memset(hasPoller, 0, sizeof (hasPoller));
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &avail)) {
+            continue;
+        }
+
+        for (node = 0; node < nNodes && !CPU_ISSET(cpu, &nodes[node]); node++);
+        if (node == nNodes) {
+            node = 0;
+        }
+
+        nodeOf[cpu] = node;
+        i = !_cpu_affinity_is_primary(cpu);
+        order[n++] = ((long) i << 40) | ((long) ranks[i][node]++ << 20) | ((long) node << 10) | cpu;
+    }
+
+    qsort(order, n, sizeof (long), _cpu_affinity_key_cmp);
+
+    affinity->nPollers = nPollers < CPU_AFFINITY_POLLERS_MAX ? nPollers : CPU_AFFINITY_POLLERS_MAX;
+    CPU_ZERO(&pollers);
+    for (i = 0; i < affinity->nPollers; i++) {
+        cpu = (int) (order[i % n] & 1023);
+        affinity->pollerCpus[i] = cpu;
+        hasPoller[nodeOf[cpu]] = 1;
+        CPU_SET(cpu, &pollers);
+    }
+
+    CPU_ZERO(&affinity->handlerCpus);
+    CPU_ZERO(&affinity->computeCpus);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &avail) && !CPU_ISSET(cpu, &pollers)) {
+            CPU_SET(cpu, &affinity->computeCpus);
+            if (hasPoller[nodeOf[cpu]]) {
+                CPU_SET(cpu, &affinity->handlerCpus);
+            }
+        }
+    }
+
+    if (CPU_COUNT(&affinity->computeCpus) == 0) {
+        affinity->computeCpus = avail;
+    }
+
+    if (CPU_COUNT(&affinity->handlerCpus) == 0) {
+        affinity->handlerCpus = affinity->computeCpus;
+    }
+
+    return 0;
+}
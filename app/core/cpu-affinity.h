@@ -0,0 +1,41 @@
+//
+// Created by dingjing on 8/13/22.
+//
+
+#ifndef JARVIS_CPU_AFFINITY_H
+#define JARVIS_CPU_AFFINITY_H
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+typedef struct _CpuAffinity         CpuAffinity;
+
+#define CPU_AFFINITY_NONE           0               // 不绑定, 由内核调度
+#define CPU_AFFINITY_PIN            1               // 每个 poller 绑一个核, handler 和 poller 在同一 NUMA 节点, 计算线程用剩下的核
+
+#define CPU_AFFINITY_POLLERS_MAX    256
+
+/**
+ * @brief
+ *  线程放置方案. poller 先占物理核 (超线程的兄弟核排在后面), 并在各 NUMA 节点间轮流分配;
+ *  handler 用 poller 所在节点上的其它核, 计算线程用 poller 以外的核. 没有可用的核时退回到全部可用的核.
+ */
+struct _CpuAffinity
+{
+    int                     nPollers;
+    int                     pollerCpus[CPU_AFFINITY_POLLERS_MAX];   // 第 i 个 poller 绑定的核, poller 多于此数时循环使用
+    cpu_set_t               handlerCpus;
+    cpu_set_t               computeCpus;
+};
+
+int cpu_affinity_parse (const char* list, cpu_set_t* set);          // "0-7,16-23", 和 /sys 下 cpulist 格式相同
+int cpu_affinity_node (int cpu);                                    // 没有 NUMA 信息时返回 0
+int cpu_affinity_plan (const char* cpuList, int nPollers, CpuAffinity* affinity);   // cpuList 为 NULL 时用进程当前可用的核
+void cpu_affinity_poller_group (const CpuAffinity* affinity, int poller, cpu_set_t* set);   // 第 poller 个 poller 的核加上同节点的 handler 核
+
+#ifdef __cplusplus
+};
+#endif
+#endif //JARVIS_CPU_AFFINITY_H
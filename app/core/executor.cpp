@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#include "slab.h"
 #include "c-list.h"
 #include "thread-pool.h"
 
@@ -19,7 +20,9 @@ struct _ExecTaskEntry
     ThreadPool*             threadPool;
 };
 
-extern "C" void _thread_pool_schedule(const ThreadPoolTask*, void*, ThreadPool*);
+extern "C" int _thread_pool_schedule(const ThreadPoolTask*, void*, ThreadPool*);
+
+static Slab _exec_entry_slab = SLAB_INITIALIZER("exec task", sizeof (ExecTaskEntry));
 
 int ExecQueue::init ()
 {
@@ -41,14 +44,14 @@ void ExecQueue::deInit ()
     pthread_mutex_destroy(&mMutex);
 }
 
-int Executor::init(size_t nthreads)
+int Executor::init(size_t nthreads, int mode, const cpu_set_t* cpus)
 {
     if (nthreads == 0) {
         errno = EINVAL;
         return -1;
     }
 
-    mThreadPool = thread_pool_create(nthreads, 0);
+    mThreadPool = thread_pool_create_affinity(nthreads, 0, mode, cpus);
     if (mThreadPool) {
         return 0;
     }
@@ -56,6 +59,30 @@ int Executor::init(size_t nthreads)
     return -1;
 }
 
+int Executor::setElastic(size_t minThreads, size_t maxThreads, int waitTarget, int idleTimeout)
+{
+    ThreadPoolStats stats;
+    ThreadPoolElastic elastic = {
+            .minThreads     =   minThreads,
+            .maxThreads     =   maxThreads,
+            .waitTarget     =   waitTarget,
+            .idleTimeout    =   idleTimeout,
+            .task           =   { NULL, NULL }
+    };
+
+    if (minThreads == 0) {
+        thread_pool_get_stats(&stats, mThreadPool);
+        elastic.minThreads = stats.nThreads;
+    }
+
+    return thread_pool_set_elastic(&elastic, mThreadPool);
+}
+
+void Executor::getStats(ThreadPoolStats* stats)
+{
+    thread_pool_get_stats(stats, mThreadPool);
+}
+
 void Executor::deInit ()
 {
     thread_pool_destroy(Executor::executor_cancel_tasks, mThreadPool);
@@ -66,24 +93,32 @@ void Executor::executor_thread_routine(void *context)
     ExecQueue *queue = (ExecQueue *)context;
     ExecTaskEntry *entry;
     ExecSession *session;
+    bool more;
 
-    pthread_mutex_lock(&queue->mMutex);
-    entry = list_entry(queue->mTaskList.next, ExecTaskEntry, list);
-    list_del(&entry->list);
-    session = entry->session;
-    if (!list_empty(&queue->mTaskList)) {
-        ThreadPoolTask task = {
-                .routine	=	Executor::executor_thread_routine,
-                .context	=	queue
-        };
-        _thread_pool_schedule(&task, entry, entry->threadPool);
-    } else {
-        free(entry);
-    }
+    // 后面的任务放不进线程池时由本线程接着执行
+    do {
+        pthread_mutex_lock(&queue->mMutex);
+        entry = list_entry(queue->mTaskList.next, ExecTaskEntry, list);
+        list_del(&entry->list);
+        session = entry->session;
+        more = false;
+        if (!list_empty(&queue->mTaskList)) {
+            ThreadPoolTask task = {
+                    .routine	=	Executor::executor_thread_routine,
+                    .context	=	queue
+            };
+            if (_thread_pool_schedule(&task, entry, entry->threadPool) < 0) {
+                slab_free(entry);
+                more = true;
+            }
+        } else {
+            slab_free(entry);
+        }
 
-    pthread_mutex_unlock(&queue->mMutex);
-    session->execute();
-    session->handle(ES_STATE_FINISHED, 0);
+        pthread_mutex_unlock(&queue->mMutex);
+        session->execute();
+        session->handle(ES_STATE_FINISHED, 0);
+    } while (more);
 }
 
 void Executor::executor_cancel_tasks(const ThreadPoolTask* task)
@@ -97,7 +132,7 @@ void Executor::executor_cancel_tasks(const ThreadPoolTask* task)
         entry = list_entry(pos, ExecTaskEntry, list);
         list_del(pos);
         session = entry->session;
-        free(entry);
+        slab_free(entry);
 
         session->handle(ES_STATE_CANCELED, 0);
     }
@@ -108,7 +143,7 @@ int Executor::request(ExecSession *session, ExecQueue *queue)
     ExecTaskEntry *entry;
 
     session->mQueue = queue;
-    entry = (ExecTaskEntry *)malloc(sizeof (ExecTaskEntry));
+    entry = (ExecTaskEntry *)slab_alloc(&_exec_entry_slab);
     if (entry) {
         entry->session = session;
         entry->threadPool = mThreadPool;
@@ -121,7 +156,7 @@ int Executor::request(ExecSession *session, ExecQueue *queue)
             };
             if (thread_pool_schedule(&task, mThreadPool) < 0) {
                 list_del(&entry->list);
-                free(entry);
+                slab_free(entry);
                 entry = NULL;
             }
         }
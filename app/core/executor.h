@@ -52,9 +52,25 @@ public:
 class Executor
 {
 public:
-    int init(size_t nThreads);
+    int init(size_t nThreads)
+    {
+        return init(nThreads, THREAD_POOL_SHARED_QUEUE);
+    }
+
+    /* mode: THREAD_POOL_SHARED_QUEUE 或 THREAD_POOL_WORK_STEALING */
+    int init(size_t nThreads, int mode)
+    {
+        return init(nThreads, mode, NULL);
+    }
+
+    /* cpus 非空时线程只在这些核上运行 */
+    int init(size_t nThreads, int mode, const cpu_set_t* cpus);
     void deInit();
 
+    /* 按积压伸缩线程数, 只支持 THREAD_POOL_SHARED_QUEUE. minThreads 为 0 时用 init 的线程数 */
+    int setElastic(size_t minThreads, size_t maxThreads, int waitTarget, int idleTimeout);
+    void getStats(ThreadPoolStats* stats);
+
     int request(ExecSession* session, ExecQueue* queue);
 
 private:
@@ -3,16 +3,37 @@
 //
 #include "io-service.h"
 
+#include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/uio.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <sys/mman.h>
+#  include <linux/io_uring.h>
+#  define IO_SERVICE_URING              1
+# endif
+#endif
+
 #include "c-list.h"
 
+#define IOS_OP_PREAD                    0
+#define IOS_OP_PWRITE                   1
+#define IOS_OP_FSYNC                    2
+#define IOS_OP_FDSYNC                   3
+#define IOS_OP_PREADV                   7
+#define IOS_OP_PWRITEV                  8
+#define IOS_OP_OPENAT                   16          // 以下 libaio 不支持, 退回 libaio 时同步执行
+#define IOS_OP_STATX                    17
+#define IOS_OP_CLOSE                    18
+
 /* Linux async I/O interface from libaio.h */
 
 typedef struct io_context *io_context_t;
@@ -163,73 +184,287 @@ static inline void io_set_eventfd(struct iocb *iocb, int eventfd)
     iocb->u.c.resfd = eventfd;
 }
 
-void IOSession::prepPRead(int fd, void *buf, size_t count, long long offset)
+
+#ifdef IO_SERVICE_URING
+struct _IOServiceUring
 {
-    struct iocb *iocb = (struct iocb *)mIoCbBuf;
+    int                         fd;
+    int                         eventFd;                    // 已注册的 eventfd, -1 未注册
+
+    unsigned*                   sqHead;
+    unsigned*                   sqTail;
+    unsigned*                   sqMask;
+    unsigned*                   sqArray;
+    unsigned                    sqEntries;
+    struct io_uring_sqe*        sqes;
+
+    unsigned*                   cqHead;
+    unsigned*                   cqTail;
+    unsigned*                   cqMask;
+    unsigned                    cqEntries;
+    struct io_uring_cqe*        cqes;
+
+    void*                       sqRing;
+    size_t                      sqRingSize;
+    void*                       cqRing;
+    size_t                      cqRingSize;
+    size_t                      sqesSize;
+
+    char*                       fixedBase;                  // 已注册的固定缓冲区
+    size_t                      fixedSize;
+    int                         fixedCount;
+
+    unsigned                    toSubmit;                   // 已写入 SQ 还没提交的请求数
+    unsigned                    inflight;                   // 已写入 SQ 还没收割的请求数, 不超过 CQ 大小
+    int                         submitting;                 // 有线程正在 io_uring_enter 提交
+};
 
-    memset(iocb, 0, sizeof(*iocb));
-    iocb->aio_fildes = fd;
-    iocb->aio_lio_opcode = IO_CMD_PREAD;
-    iocb->u.c.buf = buf;
-    iocb->u.c.nbytes = count;
-    iocb->u.c.offset = offset;
+static inline int _uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
 }
 
-void IOSession::prepPWrite(int fd, void *buf, size_t count, long long offset)
+static inline int _uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
 {
-    struct iocb *iocb = (struct iocb *)mIoCbBuf;
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
 
-    memset(iocb, 0, sizeof(*iocb));
-    iocb->aio_fildes = fd;
-    iocb->aio_lio_opcode = IO_CMD_PWRITE;
-    iocb->u.c.buf = buf;
-    iocb->u.c.nbytes = count;
-    iocb->u.c.offset = offset;
+static inline int _uring_register(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
 }
 
-void IOSession::prepPReadv(int fd, const struct iovec *iov, int iovcnt, long long offset)
+static void _uring_destroy(IOServiceUring *ring)
 {
-    struct iocb *iocb = (struct iocb *)mIoCbBuf;
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+
+    if (ring->cqRing && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+
+    if (ring->sqRing)
+        munmap(ring->sqRing, ring->sqRingSize);
 
-    memset(iocb, 0, sizeof(*iocb));
-    iocb->aio_fildes = fd;
-    iocb->aio_lio_opcode = IO_CMD_PREADV;
-    iocb->u.c.buf = (void *)iov;
-    iocb->u.c.nbytes = iovcnt;
-    iocb->u.c.offset = offset;
+    close(ring->fd);
+    free(ring);
 }
 
-void IOSession::prepPWritev(int fd, const struct iovec *iov, int iovcnt, long long offset)
+static IOServiceUring *_uring_create(unsigned entries)
 {
-    struct iocb *iocb = (struct iocb *)mIoCbBuf;
+    IOServiceUring *ring = (IOServiceUring *)calloc(1, sizeof (IOServiceUring));
+    struct io_uring_params p;
+    char *ptr;
+
+    if (!ring)
+        return NULL;
+
+    memset(&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = entries * 2;
+    ring->eventFd = -1;
+    ring->fd = _uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        goto err;
+    }
 
-    memset(iocb, 0, sizeof(*iocb));
-    iocb->aio_fildes = fd;
-    iocb->aio_lio_opcode = IO_CMD_PWRITEV;
-    iocb->u.c.buf = (void *)iov;
-    iocb->u.c.nbytes = iovcnt;
-    iocb->u.c.offset = offset;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            ring->cqRing = NULL;
+            goto err;
+        }
+    }
+
+    ring->sqesSize = p.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    ptr = (char *)ring->sqRing;
+    ring->sqHead = (unsigned *)(ptr + p.sq_off.head);
+    ring->sqTail = (unsigned *)(ptr + p.sq_off.tail);
+    ring->sqMask = (unsigned *)(ptr + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(ptr + p.sq_off.array);
+    ring->sqEntries = p.sq_entries;
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ring->sqArray[i] = i;
+
+    ptr = (char *)ring->cqRing;
+    ring->cqHead = (unsigned *)(ptr + p.cq_off.head);
+    ring->cqTail = (unsigned *)(ptr + p.cq_off.tail);
+    ring->cqMask = (unsigned *)(ptr + p.cq_off.ring_mask);
+    ring->cqEntries = p.cq_entries;
+    ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+    return ring;
+
+err:
+    _uring_destroy(ring);
+    return NULL;
 }
 
-void IOSession::prepFSync(int fd)
+/**
+ * @brief
+ *  调用时持有 mutex. 同一时刻只有一个线程在 io_uring_enter, 它进内核期间别的线程放进 SQ 的请求
+ *  由它在下一轮一起提交, 请求越密集每次提交的越多
+ */
+static void _uring_submit(IOServiceUring *ring, pthread_mutex_t *mutex)
 {
-    struct iocb *iocb = (struct iocb *)mIoCbBuf;
+    unsigned n;
+    int ret;
+
+    if (ring->submitting)
+        return;
+
+    ring->submitting = 1;
+    while ((n = ring->toSubmit) > 0) {
+        pthread_mutex_unlock(mutex);
+        ret = _uring_enter(ring->fd, n, 0, 0);
+        pthread_mutex_lock(mutex);
+        if (ret > 0)
+            ring->toSubmit -= ret;
+        else if (ret == 0 || errno != EINTR)
+            break;          // EAGAIN/EBUSY 等, 留到下次提交或收割时再试
+    }
 
-    memset(iocb, 0, sizeof(*iocb));
-    iocb->aio_fildes = fd;
-    iocb->aio_lio_opcode = IO_CMD_FSYNC;
+    ring->submitting = 0;
+}
+
+/* 调用时持有 mutex, wait 非 0 时等到有完成的请求 */
+static IOSession *_uring_reap(int wait, long *res, IOServiceUring *ring, pthread_mutex_t *mutex)
+{
+    struct io_uring_cqe *cqe;
+    IOSession *session;
+    unsigned head;
+
+    while (1) {
+        head = *ring->cqHead;
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+            break;
+
+        if (!wait)
+            return NULL;
+
+        pthread_mutex_unlock(mutex);
+        _uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        pthread_mutex_lock(mutex);
+    }
+
+    cqe = &ring->cqes[head & *ring->cqMask];
+    session = (IOSession *)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    ring->inflight--;
+    if (ring->toSubmit > 0)
+        _uring_submit(ring, mutex);
+
+    return session;
+}
+#endif
+
+
+void IOSession::prepPRead(int fd, void *buf, size_t count, long long offset)
+{
+    mOp = IOS_OP_PREAD;
+    mFd = fd;
+    mBuf = buf;
+    mCount = count;
+    mOffset = offset;
+}
+
+void IOSession::prepPWrite(int fd, void *buf, size_t count, long long offset)
+{
+    mOp = IOS_OP_PWRITE;
+    mFd = fd;
+    mBuf = buf;
+    mCount = count;
+    mOffset = offset;
+}
+
+void IOSession::prepPReadv(int fd, const struct iovec *iov, int iovcnt, long long offset)
+{
+    mOp = IOS_OP_PREADV;
+    mFd = fd;
+    mBuf = (void *)iov;
+    mCount = iovcnt;
+    mOffset = offset;
+}
+
+void IOSession::prepPWritev(int fd, const struct iovec *iov, int iovcnt, long long offset)
+{
+    mOp = IOS_OP_PWRITEV;
+    mFd = fd;
+    mBuf = (void *)iov;
+    mCount = iovcnt;
+    mOffset = offset;
+}
+
+void IOSession::prepFSync(int fd)
+{
+    mOp = IOS_OP_FSYNC;
+    mFd = fd;
+    mBuf = NULL;
+    mCount = 0;
+    mOffset = 0;
 }
 
 void IOSession::prepFdSync(int fd)
 {
-    struct iocb *iocb = (struct iocb *)mIoCbBuf;
+    mOp = IOS_OP_FDSYNC;
+    mFd = fd;
+    mBuf = NULL;
+    mCount = 0;
+    mOffset = 0;
+}
+
+void IOSession::prepOpenAt(int dirFd, const char *path, int flags, mode_t mode)
+{
+    mOp = IOS_OP_OPENAT;
+    mFd = dirFd;
+    mBuf = (void *)path;
+    mFlags = flags;
+    mMode = mode;
+}
 
-    memset(iocb, 0, sizeof(*iocb));
-    iocb->aio_fildes = fd;
-    iocb->aio_lio_opcode = IO_CMD_FDSYNC;
+void IOSession::prepStatx(int dirFd, const char *path, int flags, unsigned int mask, struct statx *buf)
+{
+    mOp = IOS_OP_STATX;
+    mFd = dirFd;
+    mBuf = (void *)path;
+    mFlags = flags;
+    mMode = mask;
+    mStatx = buf;
+}
+
+void IOSession::prepClose(int fd)
+{
+    mOp = IOS_OP_CLOSE;
+    mFd = fd;
+    mBuf = NULL;
+    mCount = 0;
+    mOffset = 0;
 }
 
-int IOService::init(int maxevents)
+int IOService::init(int maxevents, int engine)
 {
     int ret;
 
@@ -239,14 +474,26 @@ int IOService::init(int maxevents)
     }
 
     mIoCtx = NULL;
-    if (io_setup(maxevents, &mIoCtx) >= 0) {
+    mUring = NULL;
+#ifdef IO_SERVICE_URING
+    if (engine == IOS_ENGINE_URING)
+        mUring = _uring_create(maxevents > 0 ? maxevents : 1);
+#endif
+
+    if (mUring || io_setup(maxevents, &mIoCtx) >= 0) {
         ret = pthread_mutex_init(&mMutex, NULL);
         if (ret == 0) {
             INIT_LIST_HEAD(&mSessionList);
+            INIT_LIST_HEAD(&mDoneList);
             mEventFd = -1;
             return 0;
         }
         errno = ret;
+#ifdef IO_SERVICE_URING
+        if (mUring)
+            _uring_destroy(mUring);
+        else
+#endif
         io_destroy(mIoCtx);
     }
 
@@ -256,6 +503,12 @@ int IOService::init(int maxevents)
 void IOService::deInit()
 {
     pthread_mutex_destroy(&mMutex);
+#ifdef IO_SERVICE_URING
+    if (mUring) {
+        _uring_destroy(mUring);
+        return;
+    }
+#endif
     io_destroy(mIoCtx);
 }
 
@@ -264,18 +517,222 @@ inline void IOService::incref()
     __sync_add_and_fetch(&mRef, 1);
 }
 
+/* 完成通知由 io_uring 写入 eventfd, libaio 则由每个 iocb 各自指定 */
+int IOService::registerEventFd(int fd)
+{
+#ifdef IO_SERVICE_URING
+    if (mUring) {
+        if (mUring->eventFd >= 0)
+            _uring_register(mUring->fd, IORING_UNREGISTER_EVENTFD, NULL, 0);
+
+        mUring->eventFd = -1;
+        if (_uring_register(mUring->fd, IORING_REGISTER_EVENTFD, &fd, 1) < 0)
+            return -1;
+
+        mUring->eventFd = fd;
+    }
+#endif
+
+    return 0;
+}
+
+int IOService::registerBuffers(void *base, size_t bufSize, int n)
+{
+#ifdef IO_SERVICE_URING
+    struct iovec *iov;
+    int ret;
+
+    if (mUring) {
+        if (mUring->fixedCount > 0) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        if (n <= 0 || bufSize == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        iov = (struct iovec *)malloc(n * sizeof (struct iovec));
+        if (!iov)
+            return -1;
+
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = (char *)base + i * bufSize;
+            iov[i].iov_len = bufSize;
+        }
+
+        // 旧内核注册时要等在途请求完成, 不能持有 mMutex
+        ret = _uring_register(mUring->fd, IORING_REGISTER_BUFFERS, iov, n);
+        free(iov);
+        if (ret < 0)
+            return -1;
+
+        pthread_mutex_lock(&mMutex);
+        mUring->fixedBase = (char *)base;
+        mUring->fixedSize = bufSize;
+        mUring->fixedCount = n;
+        pthread_mutex_unlock(&mMutex);
+    }
+#endif
+
+    return 0;
+}
+
+/* 持有 mMutex 时调用 */
+int IOService::submit(IOSession *session)
+{
+    struct iocb iocb;
+    struct iocb *iocbp = &iocb;
+
+#ifdef IO_SERVICE_URING
+    if (mUring) {
+        IOServiceUring *ring = mUring;
+        struct io_uring_sqe *sqe;
+        unsigned tail = *ring->sqTail;
+
+        if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries
+            || ring->inflight >= ring->cqEntries) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        sqe = &ring->sqes[tail & *ring->sqMask];
+        memset(sqe, 0, sizeof (struct io_uring_sqe));
+        sqe->fd = session->mFd;
+        sqe->addr = (unsigned long)session->mBuf;
+        sqe->len = (unsigned)session->mCount;
+        sqe->off = session->mOffset;
+        sqe->user_data = (unsigned long)session;
+        switch (session->mOp) {
+            case IOS_OP_PREAD:
+            case IOS_OP_PWRITE:
+                sqe->opcode = session->mOp == IOS_OP_PREAD ? IORING_OP_READ : IORING_OP_WRITE;
+                if (ring->fixedCount > 0 && (char *)session->mBuf >= ring->fixedBase) {
+                    size_t off = (char *)session->mBuf - ring->fixedBase;
+                    size_t idx = off / ring->fixedSize;
+
+                    if (idx < (size_t)ring->fixedCount && off + session->mCount <= (idx + 1) * ring->fixedSize) {
+                        sqe->opcode = session->mOp == IOS_OP_PREAD ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                        sqe->buf_index = (unsigned short)idx;
+                    }
+                }
+                break;
+            case IOS_OP_PREADV:     sqe->opcode = IORING_OP_READV;      break;
+            case IOS_OP_PWRITEV:    sqe->opcode = IORING_OP_WRITEV;     break;
+            case IOS_OP_FSYNC:      sqe->opcode = IORING_OP_FSYNC;      break;
+            case IOS_OP_FDSYNC:
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                break;
+            case IOS_OP_OPENAT:
+                sqe->opcode = IORING_OP_OPENAT;
+                sqe->len = session->mMode;
+                sqe->off = 0;
+                sqe->open_flags = session->mFlags;
+                break;
+            case IOS_OP_STATX:
+                sqe->opcode = IORING_OP_STATX;
+                sqe->len = session->mMode;
+                sqe->off = (unsigned long)session->mStatx;
+                sqe->statx_flags = session->mFlags;
+                break;
+            case IOS_OP_CLOSE:
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->addr = 0;
+                sqe->len = 0;
+                sqe->off = 0;
+                break;
+            default:
+                errno = EINVAL;
+                return -1;
+        }
+
+        __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+        ring->toSubmit++;
+        ring->inflight++;
+        return 0;
+    }
+#endif
+
+    switch (session->mOp) {
+        case IOS_OP_OPENAT:
+            session->mRes = openat(session->mFd, (const char *)session->mBuf, session->mFlags, session->mMode);
+            break;
+        case IOS_OP_STATX:
+            session->mRes = statx(session->mFd, (const char *)session->mBuf, session->mFlags, session->mMode, session->mStatx);
+            break;
+        case IOS_OP_CLOSE:
+            session->mRes = close(session->mFd);
+            break;
+        default:
+            memset(&iocb, 0, sizeof (struct iocb));
+            iocb.aio_fildes = session->mFd;
+            iocb.aio_lio_opcode = session->mOp;
+            iocb.u.c.buf = session->mBuf;
+            iocb.u.c.nbytes = session->mCount;
+            iocb.u.c.offset = session->mOffset;
+            io_set_eventfd(&iocb, mEventFd);
+            iocb.data = session;
+            return io_submit(mIoCtx, 1, &iocbp) > 0 ? 0 : -1;
+    }
+
+    // 同步完成, 和异步完成的一样经 eventfd 交给 poller
+    if (session->mRes < 0)
+        session->mRes = -errno;
+
+    list_add_tail(&session->mList, &mDoneList);
+    eventfd_write(mEventFd, 1);
+    return 1;
+}
+
+/* 依次取同步完成的请求, io_uring 或 libaio 完成的请求 */
+IOSession *IOService::reap(int wait)
+{
+    struct timespec zero = {0, 0};
+    IOSession *session = NULL;
+    struct io_event event;
+
+    pthread_mutex_lock(&mMutex);
+    if (!list_empty(&mDoneList)) {
+        session = list_entry(mDoneList.next, IOSession, mList);
+        list_move_tail(&session->mList, &mSessionList);
+        pthread_mutex_unlock(&mMutex);
+        return session;
+    }
+
+#ifdef IO_SERVICE_URING
+    if (mUring) {
+        long res;
+
+        session = _uring_reap(wait, &res, mUring, &mMutex);
+        if (session)
+            session->mRes = res;
+
+        pthread_mutex_unlock(&mMutex);
+        return session;
+    }
+#endif
+
+    pthread_mutex_unlock(&mMutex);
+    if (io_getevents(mIoCtx, wait ? 1 : 0, 1, &event, wait ? NULL : &zero) > 0) {
+        session = (IOSession *)event.data;
+        session->mRes = event.res;
+    }
+
+    return session;
+}
+
 void IOService::decref()
 {
     IOSession *session;
-    struct io_event event;
     int state, error;
 
     if (__sync_sub_and_fetch(&mRef, 1) == 0) {
-        while (!list_empty(&mSessionList)) {
-            if (io_getevents(mIoCtx, 1, 1, &event, NULL) > 0) {
-                session = (IOSession *)event.data;
+        while (!list_empty(&mSessionList) || !list_empty(&mDoneList)) {
+            session = reap(1);
+            if (session) {
                 list_del(&session->mList);
-                session->mRes = event.res;
                 if (session->mRes >= 0) {
                     state = IOS_STATE_SUCCESS;
                     error = 0;
@@ -293,44 +750,41 @@ void IOService::decref()
 
 int IOService::request(IOSession *session)
 {
-    struct iocb *iocb = (struct iocb *)session->mIoCbBuf;
     int ret = -1;
 
     pthread_mutex_lock(&mMutex);
     if (mEventFd >= 0) {
         if (session->prepare() >= 0) {
-            io_set_eventfd(iocb, mEventFd);
-            iocb->data = session;
-            if (io_submit(mIoCtx, 1, &iocb) > 0) {
+            ret = submit(session);
+            if (ret == 0)
                 list_add_tail(&session->mList, &mSessionList);
-                ret = 0;
-            }
         }
     } else {
         errno = ENOENT;
     }
 
+#ifdef IO_SERVICE_URING
+    if (ret == 0 && mUring)
+        _uring_submit(mUring, &mMutex);
+#endif
+
     pthread_mutex_unlock(&mMutex);
     if (ret < 0) {
         session->mRes = -errno;
+        return -1;
     }
 
-    return ret;
+    return 0;
 }
 
+/* 每次取一个完成的请求, 没有时返回 NULL. eventfd 的计数只用来唤醒 poller, io_uring 一批完成只通知一次 */
 void *IOService::aio_finish(void *context)
 {
     IOService *service = (IOService *)context;
-    IOSession *session;
-    struct io_event event;
+    IOSession *session = service->reap(0);
 
-    if (io_getevents(service->mIoCtx, 1, 1, &event, NULL) > 0) {
+    if (session)
         service->incref();
-        session = (IOSession *)event.data;
-        session->mRes = event.res;
-        return session;
-    }
 
-    return NULL;
+    return session;
 }
-
@@ -8,6 +8,7 @@
 #include <stddef.h>
 #include <pthread.h>
 #include <sys/uio.h>
+#include <sys/types.h>
 #include <sys/eventfd.h>
 
 #include "c-list.h"
@@ -15,6 +16,13 @@
 #define IOS_STATE_SUCCESS	0
 #define IOS_STATE_ERROR		1
 
+#define IOS_ENGINE_AIO      0               // libaio, 只有 O_DIRECT 文件的读写是异步的
+#define IOS_ENGINE_URING    1               // io_uring, 内核不支持时退回 libaio
+
+typedef struct _IOServiceUring      IOServiceUring;
+
+struct statx;
+
 class IOSession
 {
     friend class IOService;
@@ -31,12 +39,22 @@ protected:
     void prepPWritev(int fd, const struct iovec *iov, int iovcnt, long long offset);
     void prepFSync(int fd);
     void prepFdSync(int fd);
+    void prepOpenAt(int dirFd, const char *path, int flags, mode_t mode);
+    void prepStatx(int dirFd, const char *path, int flags, unsigned int mask, struct statx *buf);
+    void prepClose(int fd);
 
 protected:
     long getRes() const { return this->mRes; }
 
 private:
-    char                mIoCbBuf[64];
+    int                 mOp;
+    int                 mFd;
+    void*               mBuf;               // 缓冲区, iovec 数组或路径
+    size_t              mCount;             // 字节数或 iovec 个数
+    long long           mOffset;
+    int                 mFlags;             // openat/statx 的 flags
+    unsigned int        mMode;              // openat 的 mode, statx 的 mask
+    struct statx*       mStatx;
     long                mRes;
 
 private:
@@ -51,10 +69,21 @@ class IOService
     friend class Communicator;
 public:
     void deInit();
-    int init(int maxEvents);
+    int init(int maxEvents)
+    {
+        return init(maxEvents, IOS_ENGINE_URING);
+    }
 
+    int init(int maxEvents, int engine);
+    int getEngine() const { return mUring ? IOS_ENGINE_URING : IOS_ENGINE_AIO; }
+
+    /* 并发的请求合并到一次 io_uring_enter 提交 */
     int request(IOSession *session);
 
+    /* 把 base 开始的 n 块 bufSize 大小的缓冲区注册为 io_uring 固定缓冲区, 落在某一块内的 pread/pwrite 省掉每次的页面映射.
+     * 只能注册一次; libaio 下什么也不做 */
+    int registerBuffers(void *base, size_t bufSize, int n);
+
 private:
     virtual void handleUnbound() = 0;
     virtual void handleStop(int error) { }
@@ -67,6 +96,12 @@ private:
 
 private:
     struct io_context*      mIoCtx;
+    IOServiceUring*         mUring;
+
+private:
+    int registerEventFd(int fd);
+    int submit(IOSession *session);
+    IOSession *reap(int wait);
 
 private:
     void decref();
@@ -78,6 +113,7 @@ private:
 
 private:
     struct list_head        mSessionList;
+    struct list_head        mDoneList;      // libaio 不支持的操作同步完成后在这里等 aio_finish 取走
     pthread_mutex_t         mMutex;
 
 private:
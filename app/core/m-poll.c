@@ -7,17 +7,19 @@
 #include <stdlib.h>
 #include "c-poll.h"
 
-extern CPoll* _poll_create(void **, const CPollParams*);
+extern CPoll* _poll_create(void **, const CPollParams*, int);
 extern void _poll_destroy(CPoll*);
 
 static int _m_poll_create(const CPollParams* params, MPoll* mPoll)
 {
     void **nodesBuf = (void **)calloc(params->maxOpenFiles, sizeof (void *));
     unsigned int i;
+    int cpu;
 
     if (nodesBuf) {
         for (i = 0; i < mPoll->nThreads; i++) {
-            mPoll->poll[i] = _poll_create(nodesBuf, params);
+            cpu = params->cpus && params->nCpus ? params->cpus[i % params->nCpus] : -1;
+            mPoll->poll[i] = _poll_create(nodesBuf, params, cpu);
             if (!mPoll->poll[i]) {
                 break;
             }
@@ -103,3 +105,49 @@ void m_poll_destroy(MPoll* poll)
     free(poll);
 }
 
+
+int m_poll_set_spin(const CPollSpin* spin, MPoll* poll)
+{
+    size_t i;
+
+    for (i = 0; i < poll->nThreads; i++) {
+        if (poll_set_spin(spin, poll->poll[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int m_poll_set_zerocopy(size_t threshold, MPoll* poll)
+{
+    size_t i;
+
+    for (i = 0; i < poll->nThreads; i++) {
+        if (poll_set_zerocopy(threshold, poll->poll[i]) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void m_poll_get_stats(CPollStats* stats, MPoll* poll)
+{
+    CPollStats one;
+    size_t i;
+
+    stats->spinHits = 0;
+    stats->spinMisses = 0;
+    stats->waits = 0;
+    stats->zerocopySends = 0;
+    stats->zerocopyCopied = 0;
+    for (i = 0; i < poll->nThreads; i++) {
+        poll_get_stats(&one, poll->poll[i]);
+        stats->spinHits += one.spinHits;
+        stats->spinMisses += one.spinMisses;
+        stats->waits += one.waits;
+        stats->zerocopySends += one.zerocopySends;
+        stats->zerocopyCopied += one.zerocopyCopied;
+    }
+}
@@ -23,6 +23,9 @@ int m_poll_start(MPoll* mPoll);
 void m_poll_stop(MPoll* mPoll);
 void m_poll_destroy(MPoll* mPoll);
 MPoll* m_poll_create (const CPollParams* params, size_t nthreads);
+int m_poll_set_spin(const CPollSpin* spin, MPoll* mPoll);              // 对所有 poll 线程生效
+int m_poll_set_zerocopy(size_t threshold, MPoll* mPoll);                // 对所有 poll 线程生效
+void m_poll_get_stats(CPollStats* stats, MPoll* mPoll);                 // 所有 poll 线程的计数之和
 
 
 static inline int m_poll_add(const CPollData* data, int timeout, MPoll* mPoll)
@@ -5,137 +5,433 @@
 #include "msg-queue.h"
 #include "../common/c-log.h"
 
+#include <time.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
-#include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/**
+ * @brief
+ *  无锁多生产者多消费者队列 (分段数组, 参考 crossbeam SegQueue).
+ *  head/tail 索引的最低位是标志位, 其余每 MSG_QUEUE_LAP 个位置一个段, 段的最后一个位置不用, 表示切换到下一段.
+ *  段由读完它的最后一个消费者释放 (或放到 spare 里复用), 不需要 hazard pointer.
+ *  空闲的消费者和被 msgMax 挡住的生产者在 futex 上等待.
+ */
+#define MSG_QUEUE_LAP               32
+#define MSG_QUEUE_BLOCK_CAP         (MSG_QUEUE_LAP - 1)
+#define MSG_QUEUE_SHIFT             1
+#define MSG_QUEUE_HAS_NEXT          1UL
+
+#define MSG_QUEUE_SLOT_WRITE        1
+#define MSG_QUEUE_SLOT_READ         2
+#define MSG_QUEUE_SLOT_DESTROY      4
+
+#define MSG_QUEUE_SPIN              64
+
+typedef struct _MsgQueueSlot        MsgQueueSlot;
+typedef struct _MsgQueueBlock       MsgQueueBlock;
+
+struct _MsgQueueSlot
+{
+    void*               msg;
+    int                 state;
+};
+
+struct _MsgQueueBlock
+{
+    MsgQueueBlock*      next;
+    MsgQueueSlot        slots[MSG_QUEUE_BLOCK_CAP];
+};
 
 struct _MsgQueue
 {
     size_t              msgMax;
-    size_t              msgCNT;
-    int                 linkOff;
     int                 nonBlock;                       // 非阻塞插入信号队列
-    void*               head1;
-    void*               head2;
-    void**              getHead;
-    void**              putHead;
-    void**              putTail;
-    pthread_mutex_t     getMutex;
-    pthread_mutex_t     putMutex;
-    pthread_cond_t      getCond;
-    pthread_cond_t      putCond;
+    MsgQueueBlock*      spare;                          // 缓存一个释放的段
+
+    unsigned long       head __attribute__((aligned(64)));
+    MsgQueueBlock*      headBlock;
+
+    unsigned long       tail __attribute__((aligned(64)));
+    MsgQueueBlock*      tailBlock;
+
+    long                msgCNT __attribute__((aligned(64)));
+
+    int                 getSeq __attribute__((aligned(64)));
+    int                 getWaiters;
+    int                 putSeq;
+    int                 putWaiters;
 };
 
+static inline void _msg_queue_futex_wait(int* addr, int val, const struct timespec* timeout)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static inline void _msg_queue_futex_wake(int* addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* 等待另一个线程完成一个很短的步骤, 单核上对方可能被抢占, 所以要让出 CPU */
+static inline void _msg_queue_backoff(int* step)
+{
+    if (++*step < MSG_QUEUE_SPIN) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+static MsgQueueBlock* _msg_queue_block_new(MsgQueue* queue)
+{
+    MsgQueueBlock* block = __atomic_exchange_n(&queue->spare, NULL, __ATOMIC_ACQUIRE);
+
+    if (!block) {
+        block = (MsgQueueBlock*) malloc(sizeof (MsgQueueBlock));
+        if (!block)
+            return NULL;
+    }
+
+    block->next = NULL;
+    for (int i = 0; i < MSG_QUEUE_BLOCK_CAP; i++)
+        block->slots[i].state = 0;
+
+    return block;
+}
+
+static void _msg_queue_block_free(MsgQueueBlock* block, MsgQueue* queue)
+{
+    MsgQueueBlock* expected = NULL;
+
+    if (!__atomic_compare_exchange_n(&queue->spare, &expected, block, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        free(block);
+}
+
+/**
+ * @brief
+ *  从 start 开始检查还有没有正在读的消费者, 有的话交给它继续释放
+ */
+static void _msg_queue_block_destroy(MsgQueueBlock* block, int start, MsgQueue* queue)
+{
+    MsgQueueSlot* slot;
+
+    for (int i = start; i < MSG_QUEUE_BLOCK_CAP - 1; i++) {
+        slot = &block->slots[i];
+        if (!(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) & MSG_QUEUE_SLOT_READ)
+            && !(__atomic_fetch_or(&slot->state, MSG_QUEUE_SLOT_DESTROY, __ATOMIC_ACQ_REL) & MSG_QUEUE_SLOT_READ))
+            return;
+    }
+
+    _msg_queue_block_free(block, queue);
+}
+
+static MsgQueueBlock* _msg_queue_block_wait_next(MsgQueueBlock* block)
+{
+    MsgQueueBlock* next;
+    int step = 0;
+
+    while (!(next = __atomic_load_n(&block->next, __ATOMIC_ACQUIRE)))
+        _msg_queue_backoff(&step);
+
+    return next;
+}
+
+static int _msg_queue_push(void* msg, MsgQueue* queue)
+{
+    unsigned long tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    MsgQueueBlock* block = __atomic_load_n(&queue->tailBlock, __ATOMIC_ACQUIRE);
+    MsgQueueBlock* next = NULL;
+    MsgQueueSlot* slot;
+    unsigned long offset;
+    int step = 0;
+
+    while (1) {
+        offset = (tail >> MSG_QUEUE_SHIFT) % MSG_QUEUE_LAP;
+
+        // 另一个生产者正在切换到下一段
+        if (offset == MSG_QUEUE_BLOCK_CAP) {
+            _msg_queue_backoff(&step);
+            tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+            block = __atomic_load_n(&queue->tailBlock, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        // 要写段的最后一个位置, 先准备好下一段
+        if (offset + 1 == MSG_QUEUE_BLOCK_CAP && !next) {
+            next = _msg_queue_block_new(queue);
+            if (!next)
+                return -1;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + (1 << MSG_QUEUE_SHIFT), 1, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            if (offset + 1 == MSG_QUEUE_BLOCK_CAP) {
+                __atomic_store_n(&queue->tailBlock, next, __ATOMIC_RELEASE);
+                __atomic_store_n(&queue->tail, tail + (2 << MSG_QUEUE_SHIFT), __ATOMIC_RELEASE);
+                __atomic_store_n(&block->next, next, __ATOMIC_RELEASE);
+                next = NULL;
+            }
+
+            slot = &block->slots[offset];
+            slot->msg = msg;
+            __atomic_fetch_or(&slot->state, MSG_QUEUE_SLOT_WRITE, __ATOMIC_RELEASE);
+            break;
+        }
+
+        block = __atomic_load_n(&queue->tailBlock, __ATOMIC_ACQUIRE);
+    }
+
+    if (next)
+        _msg_queue_block_free(next, queue);
+
+    return 0;
+}
+
+static void* _msg_queue_pop(MsgQueue* queue)
+{
+    unsigned long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    MsgQueueBlock* block = __atomic_load_n(&queue->headBlock, __ATOMIC_ACQUIRE);
+    unsigned long newHead;
+    unsigned long tail;
+    unsigned long offset;
+    MsgQueueBlock* next;
+    MsgQueueSlot* slot;
+    void* msg;
+    int step = 0;
+
+    while (1) {
+        offset = (head >> MSG_QUEUE_SHIFT) % MSG_QUEUE_LAP;
+
+        // 另一个消费者正在切换到下一段
+        if (offset == MSG_QUEUE_BLOCK_CAP) {
+            _msg_queue_backoff(&step);
+            head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+            block = __atomic_load_n(&queue->headBlock, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        newHead = head + (1 << MSG_QUEUE_SHIFT);
+        if (!(newHead & MSG_QUEUE_HAS_NEXT)) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+            // 队列为空
+            if (head >> MSG_QUEUE_SHIFT == tail >> MSG_QUEUE_SHIFT)
+                return NULL;
+
+            // head 与 tail 不在同一段, 之后不用再检查 tail
+            if ((head >> MSG_QUEUE_SHIFT) / MSG_QUEUE_LAP != (tail >> MSG_QUEUE_SHIFT) / MSG_QUEUE_LAP)
+                newHead |= MSG_QUEUE_HAS_NEXT;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->head, &head, newHead, 1, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            if (offset + 1 == MSG_QUEUE_BLOCK_CAP) {
+                next = _msg_queue_block_wait_next(block);
+                newHead = (newHead & ~MSG_QUEUE_HAS_NEXT) + (1 << MSG_QUEUE_SHIFT);
+                if (__atomic_load_n(&next->next, __ATOMIC_RELAXED))
+                    newHead |= MSG_QUEUE_HAS_NEXT;
+
+                __atomic_store_n(&queue->headBlock, next, __ATOMIC_RELEASE);
+                __atomic_store_n(&queue->head, newHead, __ATOMIC_RELEASE);
+            }
+
+            // 生产者已经占了位置, 等它写完
+            slot = &block->slots[offset];
+            step = 0;
+            while (!(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) & MSG_QUEUE_SLOT_WRITE))
+                _msg_queue_backoff(&step);
+
+            msg = slot->msg;
+            if (offset + 1 == MSG_QUEUE_BLOCK_CAP)
+                _msg_queue_block_destroy(block, 0, queue);
+            else if (__atomic_fetch_or(&slot->state, MSG_QUEUE_SLOT_READ, __ATOMIC_ACQ_REL) & MSG_QUEUE_SLOT_DESTROY)
+                _msg_queue_block_destroy(block, (int)offset + 1, queue);
+
+            return msg;
+        }
+
+        block = __atomic_load_n(&queue->headBlock, __ATOMIC_ACQUIRE);
+    }
+}
+
 void msg_queue_set_nonblock (MsgQueue* queue)
 {
-    queue->nonBlock = 1;
-    pthread_mutex_lock(&queue->putMutex);
-    pthread_cond_signal(&queue->getCond);
-    pthread_cond_broadcast(&queue->putCond);
-    pthread_mutex_unlock(&queue->putMutex);
+    __atomic_store_n(&queue->nonBlock, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->getSeq, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->putSeq, 1, __ATOMIC_SEQ_CST);
+    _msg_queue_futex_wake(&queue->getSeq, INT_MAX);
+    _msg_queue_futex_wake(&queue->putSeq, INT_MAX);
 }
 
 void msg_queue_set_block (MsgQueue* queue)
 {
-    queue->nonBlock = 0;
+    __atomic_store_n(&queue->nonBlock, 0, __ATOMIC_SEQ_CST);
+}
+
+/* 计数在放入之后才加、取出之后就减, 会短暂为负, 与 msgMax 比较时按 0 算 */
+static inline size_t _msg_queue_count(long cnt)
+{
+    return cnt > 0 ? (size_t) cnt : 0;
 }
 
-static size_t _msg_queue_swap (MsgQueue* queue)
+/**
+ * @brief
+ *  msgMax 是软上限, 同时放入的多个生产者可能略微超出.
+ *  只在分配新段失败时返回 -1 (errno 为 ENOMEM), 消息没有放入
+ */
+int msg_queue_put(void *msg, MsgQueue * queue)
 {
-    void **getHead = queue->getHead;
-    size_t cnt;
+    long cnt;
+    int seq;
 
-    queue->getHead = queue->putHead;
-    pthread_mutex_lock(&queue->putMutex);
-    while (queue->msgCNT == 0 && !queue->nonBlock) {
-        pthread_cond_wait(&queue->getCond, &queue->putMutex);
+    while (_msg_queue_count(__atomic_load_n(&queue->msgCNT, __ATOMIC_SEQ_CST)) > queue->msgMax - 1
+           && !__atomic_load_n(&queue->nonBlock, __ATOMIC_SEQ_CST)) {
+        seq = __atomic_load_n(&queue->putSeq, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&queue->putWaiters, 1, __ATOMIC_SEQ_CST);
+        if (_msg_queue_count(__atomic_load_n(&queue->msgCNT, __ATOMIC_SEQ_CST)) > queue->msgMax - 1
+            && !__atomic_load_n(&queue->nonBlock, __ATOMIC_SEQ_CST))
+            _msg_queue_futex_wait(&queue->putSeq, seq, NULL);
+
+        __atomic_fetch_sub(&queue->putWaiters, 1, __ATOMIC_SEQ_CST);
     }
 
-    cnt = queue->msgCNT;
-    if (cnt > queue->msgMax - 1) {
-        pthread_cond_broadcast(&queue->putCond);
+    if (_msg_queue_push(msg, queue) < 0) {
+        errno = ENOMEM;
+        return -1;
     }
 
-    queue->putHead = getHead;
-    queue->putTail = getHead;
-    queue->msgCNT = 0;
-    pthread_mutex_unlock(&queue->putMutex);
+    // 放入之后再计数, 计数由 0 变为 1 时才唤醒, 之后由取到消息的消费者在还有消息时唤醒下一个
+    cnt = __atomic_fetch_add(&queue->msgCNT, 1, __ATOMIC_SEQ_CST);
+    if (cnt == 0 && __atomic_load_n(&queue->getWaiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_fetch_add(&queue->getSeq, 1, __ATOMIC_SEQ_CST);
+        _msg_queue_futex_wake(&queue->getSeq, 1);
+    }
 
-    return cnt;
+    return 0;
 }
 
-void msg_queue_put(void *msg, MsgQueue * queue)
+/* 距离 deadline 还有多久, 已经过了返回 -1 */
+static int _msg_queue_remain(const struct timespec* deadline, struct timespec* remain)
 {
-    void** link = (void**)((char *)msg + queue->linkOff);
+    struct timespec now;
 
-    *link = NULL;
-    pthread_mutex_lock(&queue->putMutex);
-    while (queue->msgCNT > queue->msgMax - 1 && !queue->nonBlock) {
-        pthread_cond_wait(&queue->putCond, &queue->putMutex);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remain->tv_sec = deadline->tv_sec - now.tv_sec;
+    remain->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remain->tv_nsec < 0) {
+        remain->tv_nsec += 1000000000;
+        remain->tv_sec--;
     }
 
-    *queue->putTail = link;
-    queue->putTail = link;
-    ++queue->msgCNT;
-    pthread_mutex_unlock(&queue->putMutex);
-    pthread_cond_signal(&queue->getCond);
+    return remain->tv_sec < 0 ? -1 : 0;
 }
 
 void* msg_queue_get (MsgQueue* queue)
 {
+    return msg_queue_timed_get(queue, -1);
+}
+
+void* msg_queue_timed_get (MsgQueue* queue, int timeout)
+{
+    struct timespec deadline;
+    struct timespec remain;
     void *msg;
+    long cnt;
+    int seq;
 
-    pthread_mutex_lock(&queue->getMutex);
-    if (*queue->getHead || _msg_queue_swap(queue) > 0) {
-        msg = (char*)*queue->getHead - queue->linkOff;
-        *queue->getHead = *(void **)*queue->getHead;
-    } else {
-        msg = NULL;
-        errno = ENOENT;
+    if (timeout >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += timeout % 1000 * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            deadline.tv_sec++;
+        }
+    }
+
+    while (1) {
+        seq = __atomic_load_n(&queue->getSeq, __ATOMIC_SEQ_CST);
+        msg = _msg_queue_pop(queue);
+        if (msg)
+            break;
+
+        if (__atomic_load_n(&queue->nonBlock, __ATOMIC_SEQ_CST)) {
+            errno = ENOENT;
+            return NULL;
+        }
+
+        // 先登记再检查一次, 与 msg_queue_put 中先放入再检查等待者配对, 不会丢失唤醒
+        __atomic_fetch_add(&queue->getWaiters, 1, __ATOMIC_SEQ_CST);
+        msg = _msg_queue_pop(queue);
+        if (!msg && !__atomic_load_n(&queue->nonBlock, __ATOMIC_SEQ_CST)) {
+            if (timeout < 0) {
+                _msg_queue_futex_wait(&queue->getSeq, seq, NULL);
+            } else if (_msg_queue_remain(&deadline, &remain) == 0) {
+                _msg_queue_futex_wait(&queue->getSeq, seq, &remain);
+            } else {
+                __atomic_fetch_sub(&queue->getWaiters, 1, __ATOMIC_SEQ_CST);
+                errno = ETIMEDOUT;
+                return NULL;
+            }
+        }
+
+        __atomic_fetch_sub(&queue->getWaiters, 1, __ATOMIC_SEQ_CST);
+        if (msg)
+            break;
     }
 
-    pthread_mutex_unlock(&queue->getMutex);
+    cnt = __atomic_sub_fetch(&queue->msgCNT, 1, __ATOMIC_SEQ_CST);
+    if (cnt > 0 && __atomic_load_n(&queue->getWaiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_fetch_add(&queue->getSeq, 1, __ATOMIC_SEQ_CST);
+        _msg_queue_futex_wake(&queue->getSeq, 1);
+    }
+
+    // 降到一半以下才一起唤醒被挡住的生产者, 避免每取一条消息都切换一次线程
+    if (_msg_queue_count(cnt) <= queue->msgMax / 2 && __atomic_load_n(&queue->putWaiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_fetch_add(&queue->putSeq, 1, __ATOMIC_SEQ_CST);
+        _msg_queue_futex_wake(&queue->putSeq, INT_MAX);
+    }
 
     return msg;
 }
 
-MsgQueue* msg_queue_create(size_t maxLen, int linkOff)
+size_t msg_queue_size (MsgQueue* queue)
+{
+    return _msg_queue_count(__atomic_load_n(&queue->msgCNT, __ATOMIC_RELAXED));
+}
+
+MsgQueue* msg_queue_create(size_t maxLen)
 {
     logv("in");
-    MsgQueue* queue = (MsgQueue*)malloc(sizeof (MsgQueue));
-    int ret;
+    MsgQueue* queue;
 
-    if (!queue) {
+    if (posix_memalign((void **)&queue, 64, sizeof (MsgQueue)) != 0) {
+        errno = ENOMEM;
         return NULL;
     }
 
-    ret = pthread_mutex_init(&queue->getMutex, NULL);
-    if (ret == 0) {
-        ret = pthread_mutex_init(&queue->putMutex, NULL);
-        if (ret == 0) {
-            ret = pthread_cond_init(&queue->getCond, NULL);
-            if (ret == 0) {
-                ret = pthread_cond_init(&queue->putCond, NULL);
-                if (ret == 0) {
-                    queue->msgMax = maxLen;
-                    queue->linkOff = linkOff;
-                    queue->head1 = NULL;
-                    queue->head2 = NULL;
-                    queue->getHead = &queue->head1;
-                    queue->putHead = &queue->head2;
-                    queue->putTail = &queue->head2;
-                    queue->msgCNT = 0;
-                    queue->nonBlock = 0;
-                    return queue;
-                }
-                pthread_cond_destroy(&queue->getCond);
-            }
-            pthread_mutex_destroy(&queue->putMutex);
-        }
-        pthread_mutex_destroy(&queue->getMutex);
+    queue->msgMax = maxLen;
+    queue->nonBlock = 0;
+    queue->spare = NULL;
+    queue->msgCNT = 0;
+    queue->getSeq = 0;
+    queue->getWaiters = 0;
+    queue->putSeq = 0;
+    queue->putWaiters = 0;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->headBlock = _msg_queue_block_new(queue);
+    if (queue->headBlock) {
+        queue->tailBlock = queue->headBlock;
+        return queue;
     }
 
-    errno = ret;
     free (queue);
 
     return NULL;
@@ -143,10 +439,15 @@ MsgQueue* msg_queue_create(size_t maxLen, int linkOff)
 
 void msg_queue_destroy (MsgQueue* queue)
 {
-    pthread_cond_destroy(&queue->putCond);
-    pthread_cond_destroy(&queue->getCond);
-    pthread_mutex_destroy(&queue->putMutex);
-    pthread_mutex_destroy(&queue->getMutex);
+    MsgQueueBlock* block = queue->headBlock;
+    MsgQueueBlock* next;
+
+    while (block) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
 
+    free(queue->spare);
     free(queue);
 }
@@ -13,11 +13,13 @@ extern "C"
 typedef struct _MsgQueue            MsgQueue;
 
 void* msg_queue_get (MsgQueue* queue);
+void* msg_queue_timed_get (MsgQueue* queue, int timeout);      // timeout 毫秒, -1 一直等; 超时返回 NULL, errno 为 ETIMEDOUT
+size_t msg_queue_size (MsgQueue* queue);
 void msg_queue_destroy (MsgQueue* queue);
 void msg_queue_set_block (MsgQueue* queue);
 void msg_queue_set_nonblock (MsgQueue* queue);
-void msg_queue_put (void* msg, MsgQueue* queue);
-MsgQueue* msg_queue_create (size_t maxLen, int linkOff);
+int msg_queue_put (void* msg, MsgQueue* queue);                // 分配失败返回 -1, errno 为 ENOMEM
+MsgQueue* msg_queue_create (size_t maxLen);
 
 #ifdef __cplusplus
 };
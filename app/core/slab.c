@@ -0,0 +1,231 @@
+//
+// Created by dingjing on 8/12/22.
+//
+
+#include "slab.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define SLAB_CHUNK_SIZE             (16 * 1024)
+#define SLAB_CHUNK_MIN_OBJS         8
+
+#define SLAB_COUNT(x)               __atomic_store_n(&(x), (x) + 1, __ATOMIC_RELAXED)
+
+typedef struct _SlabHeader          SlabHeader;
+
+/* 每个对象前面的头, 16 字节保证对象和 malloc 一样对齐 */
+struct _SlabHeader
+{
+    SlabCache*              owner;
+    SlabHeader*             next;                   // 空闲时的链表
+};
+
+struct _SlabCache
+{
+    SlabHeader*             remote __attribute__((aligned(64)));
+    SlabHeader*             local __attribute__((aligned(64)));
+    char*                   bump;                   // 当前大块中还没分出去的部分
+    char*                   end;
+    Slab*                   slab;
+    SlabCache*              next;
+    SlabCache*              nextOrphan;
+    unsigned long           allocs;
+    unsigned long           reused;
+    unsigned long           remoteFrees;
+};
+
+static pthread_mutex_t _slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Slab* _slab_list;
+
+static inline size_t _slab_obj_size(const Slab* slab)
+{
+    return sizeof (SlabHeader) + ((slab->size + 15) & ~(size_t)15);
+}
+
+/* 线程退出, 缓存留给之后的线程 */
+static void _slab_cache_orphan(void* arg)
+{
+    SlabCache* cache = (SlabCache*) arg;
+    Slab* slab = cache->slab;
+
+    pthread_mutex_lock(&slab->mutex);
+    cache->nextOrphan = slab->orphans;
+    slab->orphans = cache;
+    pthread_mutex_unlock(&slab->mutex);
+}
+
+static int _slab_init(Slab* slab)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&_slab_mutex);
+    if (!slab->ready) {
+        ret = pthread_key_create(&slab->key, _slab_cache_orphan);
+        if (ret == 0) {
+            slab->next = _slab_list;
+            _slab_list = slab;
+            __atomic_store_n(&slab->ready, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&_slab_mutex);
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+static SlabCache* _slab_cache_get(Slab* slab)
+{
+    SlabCache* cache;
+
+    if (!__atomic_load_n(&slab->ready, __ATOMIC_ACQUIRE) && _slab_init(slab) < 0)
+        return NULL;
+
+    cache = (SlabCache*) pthread_getspecific(slab->key);
+    if (cache)
+        return cache;
+
+    pthread_mutex_lock(&slab->mutex);
+    cache = slab->orphans;
+    if (cache) {
+        slab->orphans = cache->nextOrphan;
+    } else if (posix_memalign((void**) &cache, 64, sizeof (SlabCache)) == 0) {
+        cache->remote = NULL;
+        cache->local = NULL;
+        cache->bump = NULL;
+        cache->end = NULL;
+        cache->slab = slab;
+        cache->allocs = 0;
+        cache->reused = 0;
+        cache->remoteFrees = 0;
+        cache->next = slab->caches;
+        slab->caches = cache;
+    } else {
+        cache = NULL;
+    }
+
+    pthread_mutex_unlock(&slab->mutex);
+    if (cache && pthread_setspecific(slab->key, cache) != 0) {
+        _slab_cache_orphan(cache);
+        cache = NULL;
+    }
+
+    return cache;
+}
+
+static int _slab_cache_refill(SlabCache* cache)
+{
+    Slab* slab = cache->slab;
+    size_t objSize = _slab_obj_size(slab);
+    size_t n = SLAB_CHUNK_SIZE / objSize;
+    char* chunk;
+
+    if (n < SLAB_CHUNK_MIN_OBJS)
+        n = SLAB_CHUNK_MIN_OBJS;
+
+    chunk = (char*) malloc(n * objSize);
+    if (!chunk)
+        return -1;
+
+    cache->bump = chunk;
+    cache->end = chunk + n * objSize;
+
+    pthread_mutex_lock(&slab->mutex);
+    slab->chunks++;
+    pthread_mutex_unlock(&slab->mutex);
+
+    return 0;
+}
+
+void* slab_alloc(Slab* slab)
+{
+    SlabCache* cache = _slab_cache_get(slab);
+    SlabHeader* hdr;
+    SlabHeader* p;
+
+    if (!cache)
+        return NULL;
+
+    hdr = cache->local;
+    if (!hdr && cache->remote) {
+        hdr = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+        for (p = hdr; p; p = p->next)
+            SLAB_COUNT(cache->remoteFrees);
+    }
+
+    if (hdr) {
+        cache->local = hdr->next;
+        SLAB_COUNT(cache->reused);
+    } else {
+        if (cache->bump == cache->end && _slab_cache_refill(cache) < 0)
+            return NULL;
+
+        hdr = (SlabHeader*) cache->bump;
+        hdr->owner = cache;
+        cache->bump += _slab_obj_size(slab);
+    }
+
+    SLAB_COUNT(cache->allocs);
+
+    return hdr + 1;
+}
+
+void slab_free(void* obj)
+{
+    SlabHeader* hdr;
+    SlabCache* cache;
+
+    if (!obj)
+        return;
+
+    hdr = (SlabHeader*) obj - 1;
+    cache = hdr->owner;
+    if (pthread_getspecific(cache->slab->key) == cache) {
+        hdr->next = cache->local;
+        cache->local = hdr;
+        return;
+    }
+
+    hdr->next = __atomic_load_n(&cache->remote, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&cache->remote, &hdr->next, hdr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void slab_get_stats(Slab* slab, SlabStats* stats)
+{
+    SlabCache* cache;
+
+    stats->name = slab->name;
+    stats->size = slab->size;
+    stats->allocs = 0;
+    stats->reused = 0;
+    stats->remoteFrees = 0;
+    stats->chunks = 0;
+
+    pthread_mutex_lock(&slab->mutex);
+    for (cache = slab->caches; cache; cache = cache->next) {
+        stats->allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+        stats->reused += __atomic_load_n(&cache->reused, __ATOMIC_RELAXED);
+        stats->remoteFrees += __atomic_load_n(&cache->remoteFrees, __ATOMIC_RELAXED);
+    }
+
+    stats->chunks = slab->chunks;
+    pthread_mutex_unlock(&slab->mutex);
+}
+
+size_t slab_get_all_stats(SlabStats* stats, size_t max)
+{
+    size_t n = 0;
+    Slab* slab;
+
+    pthread_mutex_lock(&_slab_mutex);
+    for (slab = _slab_list; slab && n < max; slab = slab->next)
+        slab_get_stats(slab, &stats[n++]);
+
+    pthread_mutex_unlock(&_slab_mutex);
+
+    return n;
+}
@@ -0,0 +1,58 @@
+//
+// Created by dingjing on 8/12/22.
+//
+
+#ifndef JARVIS_SLAB_H
+#define JARVIS_SLAB_H
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _Slab                Slab;
+typedef struct _SlabCache           SlabCache;
+typedef struct _SlabStats           SlabStats;
+
+/**
+ * @brief
+ *  定长小对象分配器. 每个线程一个缓存, 本线程释放的放回本地空闲链表,
+ *  其它线程释放的放到所属缓存的 remote 栈, 本地链表空了再整个取回. 线程退出后缓存留给新线程接手.
+ *  对象不还给系统, 适合 ThreadPoolTaskEntry、CPollNode 这类反复分配的控制块.
+ */
+struct _Slab
+{
+    const char*             name;
+    size_t                  size;
+    int                     ready;
+    pthread_key_t           key;
+    pthread_mutex_t         mutex;
+    SlabCache*              caches;                 // 所有线程缓存
+    SlabCache*              orphans;                // 线程退出后留下的缓存
+    unsigned long           chunks;
+    Slab*                   next;
+};
+
+struct _SlabStats
+{
+    const char*             name;
+    size_t                  size;
+    unsigned long           allocs;                 // 分配次数
+    unsigned long           reused;                 // 从空闲链表取得的次数, 即省掉的 malloc
+    unsigned long           remoteFrees;            // 由其它线程释放的次数
+    unsigned long           chunks;                 // 实际 malloc 的大块数
+};
+
+#define SLAB_INITIALIZER(name, size)    { name, size, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, NULL }
+
+void* slab_alloc (Slab* slab);
+void slab_free (void* obj);
+void slab_get_stats (Slab* slab, SlabStats* stats);
+size_t slab_get_all_stats (SlabStats* stats, size_t max);
+
+#ifdef __cplusplus
+};
+#endif
+#endif //JARVIS_SLAB_H
@@ -1,29 +1,68 @@
 //
 // Created by dingjing on 8/12/22.
 //
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <time.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
+#include "slab.h"
 #include "msg-queue.h"
 #include "thread-pool.h"
 #include "../common/c-log.h"
 
+/**
+ * @brief
+ *  work-stealing 模式:
+ *  池内线程提交的任务放到自己的双端队列底部, 自己从底部取 (LIFO), 其它线程从顶部窃取;
+ *  池外提交的任务放到全局队列. 每 THREAD_POOL_GLOBAL_TICK 次先看一次全局队列, 避免饿死.
+ */
+#define THREAD_POOL_WORKERS_MAX         1024
+#define THREAD_POOL_DEQUE_SIZE          256
+#define THREAD_POOL_GLOBAL_TICK         61
 
 typedef struct _ThreadPoolTaskEntry ThreadPoolTaskEntry;
+typedef struct _ThreadPoolDeque     ThreadPoolDeque;
+typedef struct _ThreadPoolWorker    ThreadPoolWorker;
 
-void _thread_pool_schedule(const ThreadPoolTask* task, void* buf, ThreadPool* pool);
+void* _thread_pool_alloc_entry(void);
+int _thread_pool_schedule(const ThreadPoolTask* task, void* buf, ThreadPool* pool);
 
 struct _ThreadPool
 {
     MsgQueue*               msgQueue;
     size_t                  nThreads;
     size_t                  stackSize;
+    cpu_set_t*              cpus;                   // 非空时线程绑定到这些核
     pthread_t               tid;
     pthread_mutex_t         mutex;
     pthread_key_t           key;
     pthread_cond_t*         terminate;
+
+    ThreadPoolWorker**      workers;                // 非空为 work-stealing 模式
+    int                     nWorkers;
+    int                     idle;                   // 正在休眠或准备休眠的线程数
+    int                     wakeSeq;
+
+    ThreadPoolElastic       elastic;
+    int                     isElastic;
+    int                     growing;
+    size_t                  leaving;                // 已决定退出还没退出的线程数
+    size_t                  peakThreads;
+    unsigned long           grows;
+    unsigned long           shrinks;
+    unsigned long           gets;                   // 已取走的消息数
+    unsigned long           backlogMark;            // gets 到这里时, 开始积压那一刻队列里的消息都已取走
+    long long               backlogSince;           // 开始积压的时间 (ns), 0 表示没有积压
 };
 
 struct _ThreadPoolTaskEntry
@@ -32,27 +71,291 @@ struct _ThreadPoolTaskEntry
     ThreadPoolTask          task;
 };
 
+struct _ThreadPoolDeque
+{
+    ThreadPoolDeque*        prev;                   // 扩容前的数组, 窃取者可能还在读, 销毁线程池时释放
+    long                    mask;
+    void*                   buf[];
+};
+
+struct _ThreadPoolWorker
+{
+    long                    top __attribute__((aligned(64)));
+    long                    bottom __attribute__((aligned(64)));
+    ThreadPoolDeque*        deque;
+    ThreadPool*             pool;
+    unsigned int            seed;
+    unsigned int            tick;
+};
+
 static pthread_t _zero_tid;
+static Slab _thread_pool_entry_slab = SLAB_INITIALIZER("thread pool task", sizeof (ThreadPoolTaskEntry));
+static __thread ThreadPoolWorker* _thread_pool_worker;
+static __thread ThreadPool* _thread_pool_leave;     // 当前任务结束后线程退出
+
+static inline void _thread_pool_futex_wait(int* addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void _thread_pool_futex_wake(int* addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static ThreadPoolDeque* _thread_pool_deque_new(long size)
+{
+    ThreadPoolDeque* deque = (ThreadPoolDeque*) malloc(sizeof (ThreadPoolDeque) + size * sizeof (void*));
+
+    if (deque) {
+        deque->prev = NULL;
+        deque->mask = size - 1;
+    }
+
+    return deque;
+}
+
+/**
+ * @brief
+ *  Chase-Lev 双端队列, 内存序参考 Lê et al. "Correct and Efficient Work-Stealing for Weak Memory Models".
+ *  push/pop 只由所属线程调用, steal 可由任意线程调用.
+ */
+static int _thread_pool_deque_push(void* entry, ThreadPoolWorker* worker)
+{
+    long b = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    ThreadPoolDeque* deque = worker->deque;
+    ThreadPoolDeque* bigger;
+    long i;
+
+    if (b - t > deque->mask) {
+        bigger = _thread_pool_deque_new(2 * (deque->mask + 1));
+        if (!bigger)
+            return -1;
+
+        for (i = t; i < b; i++)
+            bigger->buf[i & bigger->mask] = __atomic_load_n(&deque->buf[i & deque->mask], __ATOMIC_RELAXED);
+
+        bigger->prev = deque;
+        __atomic_store_n(&worker->deque, bigger, __ATOMIC_RELEASE);
+        deque = bigger;
+    }
+
+    __atomic_store_n(&deque->buf[b & deque->mask], entry, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker->bottom, b + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void* _thread_pool_deque_pop(ThreadPoolWorker* worker)
+{
+    long b = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    ThreadPoolDeque* deque = worker->deque;
+    void* entry = NULL;
+    long t;
+
+    __atomic_store_n(&worker->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+
+    if (t <= b) {
+        entry = __atomic_load_n(&deque->buf[b & deque->mask], __ATOMIC_RELAXED);
+        if (t == b) {
+            // 最后一个, 和窃取者竞争
+            if (!__atomic_compare_exchange_n(&worker->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                entry = NULL;
+            __atomic_store_n(&worker->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&worker->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return entry;
+}
+
+/**
+ * @brief
+ *  返回 NULL 并把 *retry 置 1 表示队列不空但被别人抢先了
+ */
+static void* _thread_pool_deque_steal(ThreadPoolWorker* worker, int* retry)
+{
+    long t = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    ThreadPoolDeque* deque;
+    void* entry;
+    long b;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+
+    deque = __atomic_load_n(&worker->deque, __ATOMIC_ACQUIRE);
+    entry = __atomic_load_n(&deque->buf[t & deque->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&worker->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *retry = 1;
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* 从随机的一个线程开始依次窃取 */
+static void* _thread_pool_steal(ThreadPoolWorker* self, ThreadPool* pool)
+{
+    int n = __atomic_load_n(&pool->nWorkers, __ATOMIC_ACQUIRE);
+    ThreadPoolWorker* victim;
+    unsigned int start = 0;
+    void* entry;
+    int retry;
+    int i;
+
+    if (self) {
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        start = self->seed;
+    }
+
+    do {
+        retry = 0;
+        for (i = 0; i < n; i++) {
+            victim = pool->workers[(start + i) % n];
+            if (victim != self && (entry = _thread_pool_deque_steal(victim, &retry)))
+                return entry;
+        }
+    } while (retry);
+
+    return NULL;
+}
+
+static void _thread_pool_wake(ThreadPool* pool)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&pool->wakeSeq, 1, __ATOMIC_SEQ_CST);
+        _thread_pool_futex_wake(&pool->wakeSeq, 1);
+    }
+}
+
+/**
+ * @brief
+ *  取下一个任务: 本地 -> 全局 -> 窃取, 都没有则休眠等待新任务或线程池退出
+ */
+static ThreadPoolTaskEntry* _thread_pool_next(ThreadPoolWorker* worker, ThreadPool* pool)
+{
+    void* entry = NULL;
+    int seq;
+
+    if (worker && ++worker->tick % THREAD_POOL_GLOBAL_TICK != 0)
+        entry = _thread_pool_deque_pop(worker);
+
+    while (!entry && !pool->terminate) {
+        entry = msg_queue_get(pool->msgQueue);
+        if (!entry && worker)
+            entry = _thread_pool_deque_pop(worker);
+        if (!entry)
+            entry = _thread_pool_steal(worker, pool);
+        if (entry)
+            break;
+
+        seq = __atomic_load_n(&pool->wakeSeq, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        entry = msg_queue_get(pool->msgQueue);
+        if (!entry)
+            entry = _thread_pool_steal(worker, pool);
+        if (!entry && !pool->terminate)
+            _thread_pool_futex_wait(&pool->wakeSeq, seq);
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return (ThreadPoolTaskEntry*) entry;
+}
+
+/* 分配失败时该线程没有本地队列, 只从全局队列取和窃取 */
+static ThreadPoolWorker* _thread_pool_worker_new(ThreadPool* pool)
+{
+    ThreadPoolWorker* worker;
+
+    if (posix_memalign((void**) &worker, 64, sizeof (ThreadPoolWorker)) != 0)
+        return NULL;
+
+    worker->deque = _thread_pool_deque_new(THREAD_POOL_DEQUE_SIZE);
+    if (worker->deque) {
+        worker->top = 0;
+        worker->bottom = 0;
+        worker->pool = pool;
+        worker->seed = (unsigned int) (unsigned long) worker | 1;
+        worker->tick = 0;
+
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->nWorkers < THREAD_POOL_WORKERS_MAX) {
+            pool->workers[pool->nWorkers] = worker;
+            __atomic_store_n(&pool->nWorkers, pool->nWorkers + 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&pool->mutex);
+            return worker;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+        free(worker->deque);
+    }
+
+    free(worker);
+    return NULL;
+}
+
+static void _thread_pool_worker_free(ThreadPoolWorker* worker)
+{
+    ThreadPoolDeque* deque = worker->deque;
+    ThreadPoolDeque* prev;
+
+    while (deque) {
+        prev = deque->prev;
+        free(deque);
+        deque = prev;
+    }
+
+    free(worker);
+}
 
 static void* _thread_pool_routine(void *arg)
 {
     ThreadPool* pool = (ThreadPool*) arg;
+    ThreadPoolWorker* worker = NULL;
     ThreadPoolTaskEntry* entry;
     void (*taskRoutine)(void*);
     void *taskContext;
     pthread_t tid;
 
     pthread_setspecific (pool->key, pool);
+    if (pool->workers) {
+        worker = _thread_pool_worker_new(pool);
+        _thread_pool_worker = worker;
+    }
+
     while (!pool->terminate) {
-        entry = (ThreadPoolTaskEntry*)msg_queue_get(pool->msgQueue);
-        if (!entry) {
-            loge("msg_queue_get nullptr");
-            break;
+        if (pool->workers) {
+            entry = _thread_pool_next(worker, pool);
+            if (!entry) {
+                break;
+            }
+        } else {
+            if (pool->isElastic && !pool->elastic.task.routine) {
+                entry = (ThreadPoolTaskEntry*) thread_pool_elastic_get(pool->msgQueue, pool);
+            } else {
+                entry = (ThreadPoolTaskEntry*) msg_queue_get(pool->msgQueue);
+            }
+
+            if (!entry) {
+                if (_thread_pool_leave != pool) {
+                    loge("msg_queue_get nullptr");
+                }
+                break;
+            }
         }
 
         taskRoutine = entry->task.routine;
         taskContext = entry->task.context;
-        free(entry);
+        slab_free(entry);
         taskRoutine(taskContext);
 
         if (pool->nThreads == 0) {
@@ -60,13 +363,23 @@ static void* _thread_pool_routine(void *arg)
             free(pool);
             return NULL;
         }
+
+        if (_thread_pool_leave == pool) {
+            break;
+        }
     }
 
     /* One thread joins another. Don't need to keep all thread IDs. */
     pthread_mutex_lock(&pool->mutex);
+    if (_thread_pool_leave == pool) {
+        _thread_pool_leave = NULL;
+        pool->leaving--;
+        pool->shrinks++;
+    }
+
     tid = pool->tid;
     pool->tid = pthread_self();
-    if (--pool->nThreads == 0) {
+    if (--pool->nThreads == 0 && pool->terminate) {
         pthread_cond_signal(pool->terminate);
     }
 
@@ -85,6 +398,10 @@ static void _thread_pool_terminate(int inPool, ThreadPool* pool)
     pthread_mutex_lock(&pool->mutex);
     msg_queue_set_nonblock(pool->msgQueue);
     pool->terminate = &term;
+    if (pool->workers) {
+        __atomic_add_fetch(&pool->wakeSeq, 1, __ATOMIC_SEQ_CST);
+        _thread_pool_futex_wake(&pool->wakeSeq, INT_MAX);
+    }
 
     if (inPool) {
         /* Thread pool destroyed in a pool thread is legal. */
@@ -114,6 +431,10 @@ static int _thread_pool_create_threads(size_t nthreads, ThreadPool* pool)
             pthread_attr_setstacksize(&attr, pool->stackSize);
         }
 
+        if (pool->cpus) {
+            pthread_attr_setaffinity_np(&attr, sizeof (cpu_set_t), pool->cpus);
+        }
+
         while (pool->nThreads < nthreads) {
             ret = pthread_create(&tid, &attr, _thread_pool_routine, pool);
             if (ret == 0) {
@@ -136,6 +457,16 @@ static int _thread_pool_create_threads(size_t nthreads, ThreadPool* pool)
 }
 
 ThreadPool* thread_pool_create(size_t nthreads, size_t stackSize)
+{
+    return thread_pool_create_ex(nthreads, stackSize, THREAD_POOL_SHARED_QUEUE);
+}
+
+ThreadPool* thread_pool_create_ex(size_t nthreads, size_t stackSize, int mode)
+{
+    return thread_pool_create_affinity(nthreads, stackSize, mode, NULL);
+}
+
+ThreadPool* thread_pool_create_affinity(size_t nthreads, size_t stackSize, int mode, const cpu_set_t* cpus)
 {
     int                     ret;
     ThreadPool*             pool;
@@ -145,8 +476,47 @@ ThreadPool* thread_pool_create(size_t nthreads, size_t stackSize)
         return NULL;
     }
 
-    pool->msgQueue = msg_queue_create((size_t) - 1, 0);
+    pool->cpus = NULL;
+    if (cpus) {
+        pool->cpus = (cpu_set_t*) malloc(sizeof (cpu_set_t));
+        if (!pool->cpus) {
+            free(pool);
+            return NULL;
+        }
+
+        *pool->cpus = *cpus;
+    }
+
+    pool->workers = NULL;
+    pool->nWorkers = 0;
+    pool->idle = 0;
+    pool->wakeSeq = 0;
+    memset(&pool->elastic, 0, sizeof (ThreadPoolElastic));
+    pool->isElastic = 0;
+    pool->growing = 0;
+    pool->leaving = 0;
+    pool->grows = 0;
+    pool->shrinks = 0;
+    pool->peakThreads = 0;
+    pool->gets = 0;
+    pool->backlogMark = 0;
+    pool->backlogSince = 0;
+    if (mode == THREAD_POOL_WORK_STEALING) {
+        pool->workers = (ThreadPoolWorker**) malloc(THREAD_POOL_WORKERS_MAX * sizeof (ThreadPoolWorker*));
+        if (!pool->workers) {
+            free(pool->cpus);
+            free(pool);
+            return NULL;
+        }
+    }
+
+    pool->msgQueue = msg_queue_create((size_t) - 1);
     if (pool->msgQueue) {
+        // work-stealing 模式下全局队列只做非阻塞读取, 线程在 wakeSeq 上休眠
+        if (pool->workers) {
+            msg_queue_set_nonblock(pool->msgQueue);
+        }
+
         ret = pthread_mutex_init(&pool->mutex, NULL);
         if (ret == 0) {
             // 创建一个线程特定的数据键，对于进程中的线程都是可见的，主要创建线程私有数据，
@@ -159,8 +529,13 @@ ThreadPool* thread_pool_create(size_t nthreads, size_t stackSize)
                 memset(&pool->tid, 0, sizeof (pthread_t));
                 pool->terminate = NULL;
                 if (_thread_pool_create_threads(nthreads, pool) >= 0) {
+                    pool->peakThreads = nthreads;
                     return pool;
                 }
+
+                while (pool->nWorkers > 0) {
+                    _thread_pool_worker_free(pool->workers[--pool->nWorkers]);
+                }
                 pthread_key_delete(pool->key);
             }
             pthread_mutex_destroy(&pool->mutex);
@@ -169,31 +544,66 @@ ThreadPool* thread_pool_create(size_t nthreads, size_t stackSize)
         msg_queue_destroy(pool->msgQueue);
     }
 
+    free(pool->workers);
+    free(pool->cpus);
     free(pool);
 
     return NULL;
 }
 
 
-void _thread_pool_schedule(const ThreadPoolTask* task, void *buf, ThreadPool* pool)
+/* 失败时 buf 仍归调用者 */
+int _thread_pool_schedule(const ThreadPoolTask* task, void *buf, ThreadPool* pool)
 {
+    ThreadPoolWorker* worker = _thread_pool_worker;
+
     ((ThreadPoolTaskEntry*)buf)->task = *task;
-    msg_queue_put(buf, pool->msgQueue);
+    if (pool->workers) {
+        // 池内线程提交的放到自己的队列里, 扩容失败再放全局队列
+        if (!worker || worker->pool != pool || _thread_pool_deque_push(buf, worker) < 0) {
+            if (msg_queue_put(buf, pool->msgQueue) < 0) {
+                return -1;
+            }
+        }
+
+        _thread_pool_wake(pool);
+        return 0;
+    }
+
+    if (msg_queue_put(buf, pool->msgQueue) < 0) {
+        return -1;
+    }
+
+    if (pool->isElastic && !pool->elastic.task.routine) {
+        thread_pool_elastic_check(pool->msgQueue, pool);
+    }
+
+    return 0;
+}
+
+/* buf 必须来自 slab (线程执行完任务后用 slab_free 释放), 可以比 ThreadPoolTaskEntry 大 */
+void* _thread_pool_alloc_entry(void)
+{
+    return slab_alloc(&_thread_pool_entry_slab);
 }
 
 int thread_pool_schedule(const ThreadPoolTask* task, ThreadPool* pool)
 {
-    void *buf = malloc(sizeof (ThreadPoolTaskEntry));
+    void *buf = _thread_pool_alloc_entry();
 
     if (buf) {
-        _thread_pool_schedule(task, buf, pool);
-        return 0;
+        if (_thread_pool_schedule(task, buf, pool) >= 0) {
+            return 0;
+        }
+
+        slab_free(buf);
     }
 
     return -1;
 }
 
-int thread_pool_increase (ThreadPool* pool)
+/* 调用者持有 pool->mutex */
+static int _thread_pool_increase(ThreadPool* pool)
 {
     pthread_attr_t attr;
     pthread_t tid;
@@ -205,13 +615,18 @@ int thread_pool_increase (ThreadPool* pool)
             pthread_attr_setstacksize(&attr, pool->stackSize);
         }
 
-        pthread_mutex_lock(&pool->mutex);
+        if (pool->cpus) {
+            pthread_attr_setaffinity_np(&attr, sizeof (cpu_set_t), pool->cpus);
+        }
+
         ret = pthread_create(&tid, &attr, _thread_pool_routine, pool);
         if (ret == 0) {
             pool->nThreads++;
+            if (pool->nThreads > pool->peakThreads) {
+                pool->peakThreads = pool->nThreads;
+            }
         }
 
-        pthread_mutex_unlock(&pool->mutex);
         pthread_attr_destroy(&attr);
         if (ret == 0) {
             return 0;
@@ -222,6 +637,164 @@ int thread_pool_increase (ThreadPool* pool)
     return -1;
 }
 
+int thread_pool_increase (ThreadPool* pool)
+{
+    int ret;
+
+    pthread_mutex_lock(&pool->mutex);
+    ret = _thread_pool_increase(pool);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ret;
+}
+
+static long long _thread_pool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 同一时间只有一个线程在加线程, 加完重新开始计算积压 */
+static void _thread_pool_elastic_grow(ThreadPool* pool)
+{
+    void* buf = NULL;
+
+    if (__atomic_exchange_n(&pool->growing, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    if (pool->elastic.task.routine) {
+        buf = _thread_pool_alloc_entry();
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->terminate && pool->nThreads - pool->leaving < pool->elastic.maxThreads
+        && (!pool->elastic.task.routine || buf) && _thread_pool_increase(pool) == 0) {
+        pool->grows++;
+        if (buf && _thread_pool_schedule(&pool->elastic.task, buf, pool) >= 0) {
+            buf = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    slab_free(buf);
+
+    __atomic_store_n(&pool->backlogSince, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->growing, 0, __ATOMIC_RELEASE);
+}
+
+/* 池内线程空闲超时, 线程数多于 minThreads 时让它退出 */
+static int _thread_pool_elastic_shrink(ThreadPool* pool)
+{
+    int ret = 0;
+
+    if (!thread_pool_in_pool(pool)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (!pool->terminate && pool->nThreads - pool->leaving > pool->elastic.minThreads) {
+        pool->leaving++;
+        _thread_pool_leave = pool;
+        ret = 1;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ret;
+}
+
+/**
+ * @brief
+ *  积压从队列非空开始计时, 并记下那时队列里最后一条消息的序号 (backlogMark);
+ *  取走的消息数到了 backlogMark 还没超时说明积压已经消化, 重新计时; 否则那条消息已等待超过 waitTarget, 加线程.
+ */
+void thread_pool_elastic_check (MsgQueue* queue, ThreadPool* pool)
+{
+    long long since;
+    long long now;
+    size_t n;
+
+    if (!pool->isElastic) {
+        return;
+    }
+
+    since = __atomic_load_n(&pool->backlogSince, __ATOMIC_RELAXED);
+    if (since && __atomic_load_n(&pool->gets, __ATOMIC_RELAXED) >= __atomic_load_n(&pool->backlogMark, __ATOMIC_RELAXED)) {
+        __atomic_compare_exchange_n(&pool->backlogSince, &since, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        since = 0;
+    }
+
+    if (since == 0) {
+        n = msg_queue_size(queue);
+        if (n > 0) {
+            __atomic_store_n(&pool->backlogMark, __atomic_load_n(&pool->gets, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+            __atomic_compare_exchange_n(&pool->backlogSince, &since, _thread_pool_now(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    now = _thread_pool_now();
+    if (now - since > pool->elastic.waitTarget * 1000LL) {
+        _thread_pool_elastic_grow(pool);
+    }
+}
+
+void* thread_pool_elastic_get (MsgQueue* queue, ThreadPool* pool)
+{
+    void* msg;
+
+    if (!pool->isElastic) {
+        return msg_queue_get(queue);
+    }
+
+    while (1) {
+        msg = msg_queue_timed_get(queue, pool->elastic.idleTimeout > 0 ? pool->elastic.idleTimeout : -1);
+        if (msg) {
+            break;
+        }
+
+        if (errno != ETIMEDOUT || _thread_pool_elastic_shrink(pool)) {
+            return NULL;
+        }
+    }
+
+    __atomic_add_fetch(&pool->gets, 1, __ATOMIC_RELAXED);
+    thread_pool_elastic_check(queue, pool);
+
+    return msg;
+}
+
+int thread_pool_set_elastic (const ThreadPoolElastic* elastic, ThreadPool* pool)
+{
+    if (pool->workers || elastic->minThreads == 0 || elastic->maxThreads < elastic->minThreads || elastic->waitTarget < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->elastic = *elastic;
+    __atomic_store_n(&pool->isElastic, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+void thread_pool_get_stats (ThreadPoolStats* stats, ThreadPool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    stats->nThreads = pool->nThreads;
+    stats->peakThreads = pool->peakThreads;
+    stats->minThreads = pool->isElastic ? pool->elastic.minThreads : pool->nThreads;
+    stats->maxThreads = pool->isElastic ? pool->elastic.maxThreads : pool->nThreads;
+    stats->grows = pool->grows;
+    stats->shrinks = pool->shrinks;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
 
 int thread_pool_in_pool (ThreadPool* pool)
 {
@@ -232,6 +805,7 @@ void thread_pool_destroy(void (*pending)(const ThreadPoolTask*), ThreadPool* poo
 {
     int in_pool = thread_pool_in_pool(pool);
     ThreadPoolTaskEntry* entry;
+    ThreadPoolWorker* worker;
 
     _thread_pool_terminate(in_pool, pool);
     while (1) {
@@ -244,9 +818,29 @@ void thread_pool_destroy(void (*pending)(const ThreadPoolTask*), ThreadPool* poo
             pending(&entry->task);
         }
 
-        free(entry);
+        slab_free(entry);
+    }
+
+    // 其它线程都已退出, 本地队列里剩下的任务也交给 pending
+    while (pool->nWorkers > 0) {
+        worker = pool->workers[--pool->nWorkers];
+        while ((entry = (ThreadPoolTaskEntry*) _thread_pool_deque_pop(worker)) != NULL) {
+            if (pending) {
+                pending(&entry->task);
+            }
+
+            slab_free(entry);
+        }
+
+        if (worker == _thread_pool_worker) {
+            _thread_pool_worker = NULL;
+        }
+
+        _thread_pool_worker_free(worker);
     }
 
+    free(pool->workers);
+    free(pool->cpus);
     pthread_key_delete(pool->key);
     pthread_mutex_destroy(&pool->mutex);
     msg_queue_destroy(pool->msgQueue);
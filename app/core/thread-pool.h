@@ -4,14 +4,19 @@
 
 #ifndef JARVIS_THREAD_POOL_H
 #define JARVIS_THREAD_POOL_H
+#include <sched.h>
 #include <stddef.h>
 
+#include "msg-queue.h"
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 typedef struct _ThreadPool              ThreadPool;
 typedef struct _ThreadPoolTask          ThreadPoolTask;
+typedef struct _ThreadPoolStats         ThreadPoolStats;
+typedef struct _ThreadPoolElastic       ThreadPoolElastic;
 
 struct _ThreadPoolTask
 {
@@ -19,12 +24,48 @@ struct _ThreadPoolTask
     void* context;
 };
 
+#define THREAD_POOL_SHARED_QUEUE        0           // 所有线程共用一个任务队列
+#define THREAD_POOL_WORK_STEALING       1           // 每个线程一个 Chase-Lev 双端队列, 空闲时随机窃取
+
+/**
+ * @brief
+ *  弹性线程数, 只支持 THREAD_POOL_SHARED_QUEUE:
+ *  队列里有消息等待超过 waitTarget 就加一个线程, 线程空闲超过 idleTimeout 就退出, 线程数保持在 [minThreads, maxThreads].
+ *  task 非空时每加一个线程就提交一次 task, 给从别的队列取消息的常驻任务用 (比如 Communicator 的 handler 线程),
+ *  这种任务用 thread_pool_elastic_get 取消息, 返回 NULL 后任务结束, 线程随之退出.
+ */
+struct _ThreadPoolElastic
+{
+    size_t                  minThreads;
+    size_t                  maxThreads;
+    int                     waitTarget;             // 微秒
+    int                     idleTimeout;            // 毫秒, <= 0 不收缩
+    ThreadPoolTask          task;
+};
+
+struct _ThreadPoolStats
+{
+    size_t                  nThreads;
+    size_t                  peakThreads;
+    size_t                  minThreads;
+    size_t                  maxThreads;
+    unsigned long           grows;                  // 因积压加线程的次数
+    unsigned long           shrinks;                // 因空闲退出的线程数
+};
+
 ThreadPool* thread_pool_create (size_t nThreads, size_t stackSize);
+ThreadPool* thread_pool_create_ex (size_t nThreads, size_t stackSize, int mode);
+ThreadPool* thread_pool_create_affinity (size_t nThreads, size_t stackSize, int mode, const cpu_set_t* cpus);   // 线程只在 cpus 上运行, 包括之后增加的线程
 int thread_pool_schedule (const ThreadPoolTask * task, ThreadPool *pool);
 int thread_pool_increase(ThreadPool *pool);
 int thread_pool_in_pool(ThreadPool *pool);
 void thread_pool_destroy(void (*pending)(const ThreadPoolTask *), ThreadPool *pool);
 
+int thread_pool_set_elastic (const ThreadPoolElastic* elastic, ThreadPool* pool);
+void thread_pool_get_stats (ThreadPoolStats* stats, ThreadPool* pool);
+void* thread_pool_elastic_get (MsgQueue* queue, ThreadPool* pool);         // 池内线程调用, 空闲该退出时返回 NULL, errno 为 ETIMEDOUT
+void thread_pool_elastic_check (MsgQueue* queue, ThreadPool* pool);        // 生产者 put 之后调用
+
 #ifdef __cplusplus
 };
 #endif
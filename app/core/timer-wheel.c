@@ -0,0 +1,205 @@
+//
+// Created by dingjing on 8/11/22.
+//
+
+#include "timer-wheel.h"
+
+#include <string.h>
+
+#define TIMER_WHEEL_SHIFT(level)    (TIMER_WHEEL_L0_BITS + TIMER_WHEEL_LN_BITS * ((level) - 1))
+#define TIMER_WHEEL_RANGE(level)    (1ULL << (TIMER_WHEEL_L0_BITS + TIMER_WHEEL_LN_BITS * (level)))
+
+/**
+ * @brief
+ *  在 nbits 位的环形位图中, 从 start 开始 (含) 向后找第一个置位的位, 返回距 start 的偏移, 没有返回 -1
+ */
+static int _timer_wheel_find_bit(const unsigned long long* bits, unsigned nbits, unsigned start)
+{
+    unsigned nwords = (nbits + 63) / 64;
+    unsigned pos = start;
+    unsigned long long word;
+
+    for (unsigned i = 0; i <= nwords; i++) {
+        word = bits[(pos % nbits) / 64];
+        word &= ~0ULL << (pos % 64);
+        if (word) {
+            unsigned found = (pos % nbits) / 64 * 64 + __builtin_ctzll(word);
+            return (int)((found + nbits - start % nbits) % nbits);
+        }
+
+        pos = (pos / 64 + 1) * 64;
+    }
+
+    return -1;
+}
+
+static void _timer_wheel_insert(TimerWheelNode* node, unsigned long long min, TimerWheel* wheel)
+{
+    unsigned long long expire = node->expire > min ? node->expire : min;
+    unsigned long long delta = expire - wheel->tick;
+    unsigned idx;
+    int level;
+
+    if (delta < TIMER_WHEEL_L0_SIZE) {
+        idx = expire & (TIMER_WHEEL_L0_SIZE - 1);
+        list_add_tail(&node->list, &wheel->l0[idx]);
+        wheel->l0Bits[idx / 64] |= 1ULL << (idx % 64);
+        return;
+    }
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < TIMER_WHEEL_RANGE(level))
+            break;
+    }
+
+    // 超出范围的放在最高层能表示的最远位置, 下沉时按真实到期时间重新插入
+    if (delta >= TIMER_WHEEL_RANGE(level))
+        expire = wheel->tick + TIMER_WHEEL_RANGE(level) - 1;
+
+    idx = (expire >> TIMER_WHEEL_SHIFT(level)) & (TIMER_WHEEL_LN_SIZE - 1);
+    list_add_tail(&node->list, &wheel->ln[level - 1][idx]);
+    wheel->lnBits[level - 1] |= 1ULL << idx;
+}
+
+static void _timer_wheel_cascade(int level, unsigned idx, TimerWheel* wheel)
+{
+    TimerWheelNode* node;
+
+    LIST_HEAD(list);
+
+    list_splice_init(&wheel->ln[level - 1][idx], &list);
+    wheel->lnBits[level - 1] &= ~(1ULL << idx);
+    while (!list_empty(&list)) {
+        node = list_entry(list.next, TimerWheelNode, list);
+        list_del(&node->list);
+        _timer_wheel_insert(node, wheel->tick, wheel);
+    }
+}
+
+static void _timer_wheel_step(struct list_head* expired, TimerWheel* wheel)
+{
+    unsigned long long t = ++wheel->tick;
+    unsigned idx = t & (TIMER_WHEEL_L0_SIZE - 1);
+    struct list_head* slot = &wheel->l0[idx];
+    TimerWheelNode* node;
+    unsigned i;
+
+    if (idx == 0) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            i = (t >> TIMER_WHEEL_SHIFT(level)) & (TIMER_WHEEL_LN_SIZE - 1);
+            _timer_wheel_cascade(level, i, wheel);
+            if (i != 0)
+                break;
+        }
+    }
+
+    wheel->l0Bits[idx / 64] &= ~(1ULL << (idx % 64));
+    while (!list_empty(slot)) {
+        node = list_entry(slot->next, TimerWheelNode, list);
+        if (node->expire <= t) {
+            list_move_tail(&node->list, expired);
+            wheel->count--;
+        } else {
+            list_del(&node->list);
+            _timer_wheel_insert(node, t + 1, wheel);
+        }
+    }
+}
+
+void timer_wheel_init(unsigned long long now, TimerWheel* wheel)
+{
+    wheel->tick = now;
+    wheel->count = 0;
+
+    for (int i = 0; i < TIMER_WHEEL_L0_SIZE; i++)
+        INIT_LIST_HEAD(&wheel->l0[i]);
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        for (int i = 0; i < TIMER_WHEEL_LN_SIZE; i++)
+            INIT_LIST_HEAD(&wheel->ln[level][i]);
+    }
+
+    memset(wheel->l0Bits, 0, sizeof (wheel->l0Bits));
+    memset(wheel->lnBits, 0, sizeof (wheel->lnBits));
+}
+
+void timer_wheel_add(TimerWheelNode* node, TimerWheel* wheel)
+{
+    _timer_wheel_insert(node, wheel->tick + 1, wheel);
+    wheel->count++;
+}
+
+void timer_wheel_del(TimerWheelNode* node, TimerWheel* wheel)
+{
+    list_del(&node->list);
+    wheel->count--;
+}
+
+bool timer_wheel_next(unsigned long long* next, TimerWheel* wheel)
+{
+    unsigned long long cur;
+    unsigned long long ret = 0;
+    int found = 0;
+    int k;
+
+    if (wheel->count == 0)
+        return false;
+
+    k = _timer_wheel_find_bit(wheel->l0Bits, TIMER_WHEEL_L0_SIZE, (wheel->tick + 1) & (TIMER_WHEEL_L0_SIZE - 1));
+    if (k >= 0) {
+        ret = wheel->tick + 1 + k;
+        found = 1;
+    }
+
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        cur = wheel->tick >> TIMER_WHEEL_SHIFT(level);
+        k = _timer_wheel_find_bit(&wheel->lnBits[level - 1], TIMER_WHEEL_LN_SIZE, (cur + 1) & (TIMER_WHEEL_LN_SIZE - 1));
+        if (k >= 0) {
+            cur = (cur + 1 + k) << TIMER_WHEEL_SHIFT(level);
+            if (!found || cur < ret) {
+                ret = cur;
+                found = 1;
+            }
+        }
+    }
+
+    // 位图是惰性清除的, 这里只是一个不晚于真实到期时间的下界
+    *next = found ? ret : wheel->tick + 1;
+    return true;
+}
+
+void timer_wheel_advance(unsigned long long now, struct list_head* expired, TimerWheel* wheel)
+{
+    unsigned long long next;
+
+    while (wheel->tick < now) {
+        if (!timer_wheel_next(&next, wheel)) {
+            wheel->tick = now;
+            break;
+        }
+
+        // 跳过中间没有事情要做的 tick
+        if (next > now) {
+            wheel->tick = now;
+            break;
+        }
+
+        wheel->tick = next - 1;
+        _timer_wheel_step(expired, wheel);
+    }
+}
+
+void timer_wheel_splice(struct list_head* list, TimerWheel* wheel)
+{
+    for (int i = 0; i < TIMER_WHEEL_L0_SIZE; i++)
+        list_splice_init(&wheel->l0[i], list->prev);
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        for (int i = 0; i < TIMER_WHEEL_LN_SIZE; i++)
+            list_splice_init(&wheel->ln[level][i], list->prev);
+    }
+
+    wheel->count = 0;
+    memset(wheel->l0Bits, 0, sizeof (wheel->l0Bits));
+    memset(wheel->lnBits, 0, sizeof (wheel->lnBits));
+}
@@ -0,0 +1,100 @@
+//
+// Created by dingjing on 8/11/22.
+//
+
+#ifndef JARVIS_TIMER_WHEEL_H
+#define JARVIS_TIMER_WHEEL_H
+
+#include <time.h>
+#include <stdbool.h>
+
+#include "c-list.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * @brief
+ *  分层时间轮, 1 毫秒一格.
+ *  第 0 层 256 格 (256ms), 之后每层 64 格, 共 5 层, 覆盖 2^32 毫秒 (约 49.7 天), 更远的到期时间按最大值处理后重新插入.
+ *  插入/删除 O(1), 推进时上层的格子整体下沉 (cascade) 到下层.
+ *  节点只会在到期格之后被取出, 不会提前到期.
+ */
+#define TIMER_WHEEL_LEVELS          5
+#define TIMER_WHEEL_L0_BITS         8
+#define TIMER_WHEEL_LN_BITS         6
+#define TIMER_WHEEL_L0_SIZE         (1 << TIMER_WHEEL_L0_BITS)
+#define TIMER_WHEEL_LN_SIZE         (1 << TIMER_WHEEL_LN_BITS)
+
+typedef struct _TimerWheel          TimerWheel;
+typedef struct _TimerWheelNode      TimerWheelNode;
+
+struct _TimerWheelNode
+{
+    struct list_head                list;
+    unsigned long long              expire;                 // 到期的 tick (毫秒)
+};
+
+struct _TimerWheel
+{
+    unsigned long long              tick;                   // 已经处理到的 tick
+    unsigned long                   count;                  // 轮中的节点数
+
+    struct list_head                l0[TIMER_WHEEL_L0_SIZE];
+    struct list_head                ln[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_LN_SIZE];
+
+    // 非空格子的位图, 删除节点时不清除, 扫描到空格子时再清除
+    unsigned long long              l0Bits[TIMER_WHEEL_L0_SIZE / 64];
+    unsigned long long              lnBits[TIMER_WHEEL_LEVELS - 1];
+};
+
+/* timespec 与 tick 的换算, 到期时间向上取整, 保证不提前 */
+static inline unsigned long long timer_wheel_tick_ceil(const struct timespec* ts)
+{
+    return (unsigned long long)ts->tv_sec * 1000 + (ts->tv_nsec + 999999) / 1000000;
+}
+
+static inline unsigned long long timer_wheel_tick_floor(const struct timespec* ts)
+{
+    return (unsigned long long)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+static inline void timer_wheel_tick_to_timespec(unsigned long long tick, struct timespec* ts)
+{
+    ts->tv_sec = (time_t)(tick / 1000);
+    ts->tv_nsec = (long)(tick % 1000) * 1000000;
+}
+
+void timer_wheel_init       (unsigned long long now, TimerWheel* wheel);
+
+/**
+ * @brief
+ *  插入前调用者设置 node->expire, 已经过期的节点在下一次推进时取出
+ */
+void timer_wheel_add        (TimerWheelNode* node, TimerWheel* wheel);
+void timer_wheel_del        (TimerWheelNode* node, TimerWheel* wheel);
+
+/**
+ * @brief
+ *  推进到 now, 到期的节点按到期顺序追加到 expired 链表
+ */
+void timer_wheel_advance    (unsigned long long now, struct list_head* expired, TimerWheel* wheel);
+
+/**
+ * @brief
+ *  下一次需要推进的 tick (最近的到期格或需要下沉的格), 轮为空时返回 false
+ */
+bool timer_wheel_next       (unsigned long long* next, TimerWheel* wheel);
+
+/**
+ * @brief
+ *  取出轮中所有节点, 追加到 list
+ */
+void timer_wheel_splice     (struct list_head* list, TimerWheel* wheel);
+
+#ifdef __cplusplus
+};
+#endif
+#endif //JARVIS_TIMER_WHEEL_H
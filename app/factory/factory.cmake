@@ -6,6 +6,9 @@ file(GLOB FACTORY_SRC
         ${CMAKE_SOURCE_DIR}/app/factory/http-task-impl.cpp
         ${CMAKE_SOURCE_DIR}/app/factory/file-task-impl.cpp
 
+        ${CMAKE_SOURCE_DIR}/app/factory/file-stream-task.h
+        ${CMAKE_SOURCE_DIR}/app/factory/file-stream-task.cpp
+
         ${CMAKE_SOURCE_DIR}/app/factory/graph-task.h
         ${CMAKE_SOURCE_DIR}/app/factory/graph-task.cpp
 
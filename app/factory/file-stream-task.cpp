@@ -0,0 +1,439 @@
+//
+// Created by dingjing on 8/26/22.
+//
+
+#include "file-stream-task.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "task-factory.h"
+#include "../manager/global.h"
+
+#define FILE_STREAM_CHUNK_FREE          0
+#define FILE_STREAM_CHUNK_BUSY          1       // 在读或在写
+#define FILE_STREAM_CHUNK_READY         2       // 读完, 等待交付
+#define FILE_STREAM_CHUNK_DELIVERING    3
+
+class FileStreamChunk : public IOSession
+{
+public:
+    FileStreamChunk(FileStreamTask* task) : mTask(task)
+    {
+        mBuf = NULL;
+        mCount = 0;
+        mOffset = 0;
+        mRes = 0;
+        mState = 0;
+        mError = 0;
+        mStatus = FILE_STREAM_CHUNK_FREE;
+    }
+
+    virtual ~FileStreamChunk()
+    {
+        free(mBuf);
+    }
+
+private:
+    virtual int prepare()
+    {
+        if (mTask->mWrite) {
+            prepPWrite(mTask->mFd, mBuf, mCount, mOffset);
+        } else {
+            prepPRead(mTask->mFd, mBuf, mCount, mOffset);
+        }
+
+        return 0;
+    }
+
+    virtual void handle(int state, int error)
+    {
+        mRes = getRes();
+        mTask->handleChunk(this, state, error);
+    }
+
+public:
+    FileStreamTask*             mTask;
+    char*                       mBuf;
+    size_t                      mCount;
+    off_t                       mOffset;
+    long                        mRes;
+    int                         mState;
+    int                         mError;
+    int                         mStatus;
+};
+
+FileStreamTask::FileStreamTask(int fd, bool ownFd, bool isWrite, off_t offset, size_t chunkSize, int depth, IOService *service, FileStreamCallback&& cb)
+    : mCallback(std::move(cb))
+{
+    mFd = fd;
+    mOwnFd = ownFd;
+    mWrite = isWrite;
+    mOffset = offset;
+    mEnd = offset;
+    mDeliverOffset = offset;
+    mChunkSize = (chunkSize + FILE_STREAM_ALIGN - 1) / FILE_STREAM_ALIGN * FILE_STREAM_ALIGN;
+    mBytes = 0;
+    mService = service;
+    mStopped = false;
+    mFinishing = false;
+    mDispatched = false;
+    mFinished = false;
+    mCurrent = NULL;
+    mDeliverRet = 0;
+    mQueue = NULL;
+    mExecutor = NULL;
+
+    if (fd < 0) {
+        mError = errno;
+        return;
+    }
+
+    if (mChunkSize == 0 || depth <= 0) {
+        mError = EINVAL;
+        return;
+    }
+
+    for (int i = 0; i < depth; ++i) {
+        FileStreamChunk* chunk = new FileStreamChunk(this);
+        mChunks.push_back(chunk);
+        if (posix_memalign((void**) &chunk->mBuf, FILE_STREAM_ALIGN, mChunkSize) != 0) {
+            chunk->mBuf = NULL;
+            mError = ENOMEM;
+            return;
+        }
+    }
+}
+
+FileStreamTask::~FileStreamTask()
+{
+    for (FileStreamChunk* chunk : mChunks) {
+        delete chunk;
+    }
+
+    if (mOwnFd && mFd >= 0) {
+        close(mFd);
+    }
+}
+
+int FileStreamTask::write(const void *buf, size_t size)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    const char* p = (const char*) buf;
+
+    if (!mWrite || mFinishing) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (size > 0) {
+        if (mError) {
+            errno = mError;
+            return -1;
+        }
+
+        if (!mCurrent) {
+            for (FileStreamChunk* chunk : mChunks) {
+                if (chunk->mStatus == FILE_STREAM_CHUNK_FREE) {
+                    mCurrent = chunk;
+                    chunk->mCount = 0;
+                    break;
+                }
+            }
+
+            // 所有块都在写, 等写完一块
+            if (!mCurrent) {
+                mCond.wait(lock);
+                continue;
+            }
+        }
+
+        size_t n = mChunkSize - mCurrent->mCount;
+        if (n > size) {
+            n = size;
+        }
+
+        memcpy(mCurrent->mBuf + mCurrent->mCount, p, n);
+        mCurrent->mCount += n;
+        p += n;
+        size -= n;
+        if (mCurrent->mCount == mChunkSize) {
+            submitWrite(mCurrent);
+            mCurrent = NULL;
+        }
+    }
+
+    return 0;
+}
+
+void FileStreamTask::finish()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (mCurrent && mCurrent->mCount > 0 && !mError) {
+        submitWrite(mCurrent);
+    }
+
+    mCurrent = NULL;
+    mFinishing = true;
+    checkDone(lock);
+}
+
+void FileStreamTask::stop()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mStopped = true;
+}
+
+/* 调用时持有锁 */
+void FileStreamTask::submitWrite(FileStreamChunk *chunk)
+{
+    chunk->mStatus = FILE_STREAM_CHUNK_BUSY;
+    chunk->mOffset = mOffset;
+    mOffset += chunk->mCount;
+    if (mService->request(chunk) < 0) {
+        chunk->mStatus = FILE_STREAM_CHUNK_FREE;
+        mError = errno;
+        mCond.notify_all();
+    }
+}
+
+void FileStreamTask::dispatch()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    struct stat st;
+
+    mDispatched = true;
+    if (!mError && !mWrite) {
+        if (fstat(mFd, &st) < 0) {
+            mError = errno;
+        } else {
+            mEnd = st.st_size;
+        }
+    }
+
+    if (mWrite || mError) {
+        checkDone(lock);
+    } else {
+        readNext(lock);
+    }
+}
+
+SubTask *FileStreamTask::done()
+{
+    SeriesWork *series = seriesOf(this);
+
+    if (mCallback) {
+        mCallback(this);
+    }
+
+    delete this;
+    return series->pop();
+}
+
+void FileStreamTask::handleChunk(FileStreamChunk *chunk, int state, int error)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    chunk->mState = state;
+    chunk->mError = error;
+    if (mWrite) {
+        if (state != IOS_STATE_SUCCESS) {
+            mError = error;
+        } else if (chunk->mRes != (long) chunk->mCount) {
+            mError = EIO;
+        } else {
+            mBytes += chunk->mRes;
+        }
+
+        chunk->mStatus = FILE_STREAM_CHUNK_FREE;
+        mCond.notify_all();
+        checkDone(lock);
+    } else {
+        chunk->mStatus = FILE_STREAM_CHUNK_READY;
+        readNext(lock);
+    }
+}
+
+/**
+ * @brief
+ *  发出读, 并按偏移顺序交付已读完的块. 同一时间只有一块在交付.
+ *  消费者直接调用时不持有锁, 交给 executor 时由 handle() 接着往下走.
+ */
+void FileStreamTask::readNext(std::unique_lock<std::mutex>& lock)
+{
+    FileStreamChunk* next;
+
+    while (true) {
+        for (FileStreamChunk* chunk : mChunks) {
+            if (mStopped || mError || mOffset >= mEnd) {
+                break;
+            }
+
+            if (chunk->mStatus == FILE_STREAM_CHUNK_FREE) {
+                chunk->mStatus = FILE_STREAM_CHUNK_BUSY;
+                chunk->mOffset = mOffset;
+                chunk->mCount = mEnd - mOffset < (off_t) mChunkSize ? mEnd - mOffset : mChunkSize;
+                mOffset += chunk->mCount;
+                if (mService->request(chunk) < 0) {
+                    chunk->mStatus = FILE_STREAM_CHUNK_FREE;
+                    mError = errno;
+                }
+            }
+        }
+
+        if (mCurrent) {
+            return;
+        }
+
+        next = NULL;
+        for (FileStreamChunk* chunk : mChunks) {
+            if (chunk->mStatus != FILE_STREAM_CHUNK_READY) {
+                continue;
+            }
+
+            // 文件变短后, 超出新结尾的块直接丢弃
+            if (mStopped || mError || chunk->mOffset >= mEnd) {
+                chunk->mStatus = FILE_STREAM_CHUNK_FREE;
+            } else if (chunk->mOffset == mDeliverOffset) {
+                next = chunk;
+            }
+        }
+
+        if (!next) {
+            break;
+        }
+
+        if (next->mState != IOS_STATE_SUCCESS) {
+            mError = next->mError;
+            next->mStatus = FILE_STREAM_CHUNK_FREE;
+            continue;
+        }
+
+        if (next->mRes < (long) next->mCount) {
+            mEnd = next->mOffset + next->mRes;
+            next->mCount = next->mRes;
+            if (next->mCount == 0) {
+                next->mStatus = FILE_STREAM_CHUNK_FREE;
+                continue;
+            }
+        }
+
+        mCurrent = next;
+        next->mStatus = FILE_STREAM_CHUNK_DELIVERING;
+        if (mExecutor) {
+            if (mExecutor->request(this, mQueue) >= 0) {
+                return;
+            }
+
+            mError = errno;
+            mDeliverRet = -1;
+        } else {
+            lock.unlock();
+            mDeliverRet = mConsumer ? mConsumer(this, next->mBuf, next->mCount, next->mOffset) : 0;
+            lock.lock();
+        }
+
+        deliverDone(mDeliverRet);
+    }
+
+    checkDone(lock);
+}
+
+/* 调用时持有锁 */
+void FileStreamTask::deliverDone(int ret)
+{
+    mBytes += mCurrent->mCount;
+    mDeliverOffset += mCurrent->mCount;
+    mCurrent->mStatus = FILE_STREAM_CHUNK_FREE;
+    mCurrent = NULL;
+    if (ret < 0) {
+        mStopped = true;
+    }
+}
+
+void FileStreamTask::execute()
+{
+    mDeliverRet = mConsumer ? mConsumer(this, mCurrent->mBuf, mCurrent->mCount, mCurrent->mOffset) : 0;
+}
+
+void FileStreamTask::handle(int state, int error)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (state != ES_STATE_FINISHED) {
+        mError = error ? error : ECANCELED;
+    }
+
+    deliverDone(mDeliverRet);
+    readNext(lock);
+}
+
+/**
+ * @brief
+ *  没有块在读写或交付, 且读到结尾/写流已 finish 时结束任务. 只有一个线程会走到 subTaskDone(),
+ *  其它线程已经在释放锁之后不再访问任务.
+ */
+void FileStreamTask::checkDone(std::unique_lock<std::mutex>& lock)
+{
+    if (mFinished || !mDispatched) {
+        return;
+    }
+
+    for (FileStreamChunk* chunk : mChunks) {
+        if (chunk->mStatus == FILE_STREAM_CHUNK_BUSY || chunk->mStatus == FILE_STREAM_CHUNK_DELIVERING) {
+            return;
+        }
+    }
+
+    if (mWrite ? !mFinishing : !(mStopped || mError || mDeliverOffset >= mEnd)) {
+        return;
+    }
+
+    mFinished = true;
+    mState = mError ? TASK_STATE_SYS_ERROR : TASK_STATE_SUCCESS;
+    lock.unlock();
+    subTaskDone();
+}
+
+/* Factory functions. */
+
+FileStreamTask *TaskFactory::createFileReadStream(int fd, off_t offset, size_t chunkSize, int depth, FileStreamConsumer consumer, FileStreamCallback callback)
+{
+    auto task = new FileStreamTask(fd, false, false, offset, chunkSize, depth, Global::getIoService(), std::move(callback));
+
+    task->setConsumer(std::move(consumer));
+    return task;
+}
+
+FileStreamTask *TaskFactory::createFileReadStream(const std::string& pathname, size_t chunkSize, int depth, FileStreamConsumer consumer, FileStreamCallback callback)
+{
+    auto task = new FileStreamTask(open(pathname.c_str(), O_RDONLY), true, false, 0, chunkSize, depth, Global::getIoService(), std::move(callback));
+
+    task->setConsumer(std::move(consumer));
+    return task;
+}
+
+FileStreamTask *TaskFactory::createFileReadStream(const std::string& pathname, size_t chunkSize, int depth, const std::string& queueName, FileStreamConsumer consumer, FileStreamCallback callback)
+{
+    auto task = createFileReadStream(pathname, chunkSize, depth, std::move(consumer), std::move(callback));
+
+    task->setConsumerQueue(Global::getExecQueue(queueName), Global::getComputeExecutor());
+    return task;
+}
+
+FileStreamTask *TaskFactory::createFileWriteStream(int fd, off_t offset, size_t chunkSize, int depth, FileStreamCallback callback)
+{
+    return new FileStreamTask(fd, false, true, offset, chunkSize, depth, Global::getIoService(), std::move(callback));
+}
+
+FileStreamTask *TaskFactory::createFileWriteStream(const std::string& pathname, size_t chunkSize, int depth, FileStreamCallback callback)
+{
+    int fd = open(pathname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    return new FileStreamTask(fd, true, true, 0, chunkSize, depth, Global::getIoService(), std::move(callback));
+}
@@ -0,0 +1,118 @@
+//
+// Created by dingjing on 8/26/22.
+//
+
+#ifndef JARVIS_FILE_STREAM_TASK_H
+#define JARVIS_FILE_STREAM_TASK_H
+
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <sys/types.h>
+#include <condition_variable>
+
+#include "task.h"
+#include "../core/executor.h"
+#include "../core/io-service.h"
+
+#define FILE_STREAM_ALIGN           4096
+
+class FileStreamTask;
+class FileStreamChunk;
+
+/* 返回值小于 0 时停止读取 */
+using FileStreamConsumer = std::function<int (FileStreamTask*, const void* buf, size_t size, off_t offset)>;
+using FileStreamCallback = std::function<void (FileStreamTask*)>;
+
+/**
+ * @brief
+ *  流式读写文件. 文件按 chunkSize (向上对齐到 FILE_STREAM_ALIGN) 分块, 最多 depth 块同时在用, 内存占用和文件大小无关.
+ *  读流: 预读 depth 块, 按偏移顺序逐块交给消费者, 消费者处理完一块才回收这块发出下一个读, 消费者跟不上时读自然停下.
+ *  写流: write() 把数据拷进块里, 写满就提交; depth 块都在写时 write() 阻塞, 直到有块写完.
+ */
+class FileStreamTask : public GenericTask, protected ExecSession
+{
+    friend class FileStreamChunk;
+public:
+    /* 写流: 不能在 handler 线程里调用, 否则可能等不到写完成 */
+    int write(const void* buf, size_t size);
+
+    /* 写流: 提交剩下的数据, 全部写完后任务结束. 之后不能再调用 write() */
+    void finish();
+
+    /* 读流: 不再发出新的读, 已交付的块之后任务结束 */
+    void stop();
+
+    /* 已交给消费者或已写入文件的字节数 */
+    long long getBytes() const
+    {
+        return mBytes;
+    }
+
+public:
+    void setCallback(FileStreamCallback cb)
+    {
+        mCallback = std::move(cb);
+    }
+
+    void setConsumer(FileStreamConsumer consumer)
+    {
+        mConsumer = std::move(consumer);
+    }
+
+    /* 消费者在 queue 里由 executor 的线程调用, 不设置时在 IO 完成的线程里直接调用 */
+    void setConsumerQueue(ExecQueue* queue, Executor* executor)
+    {
+        mQueue = queue;
+        mExecutor = executor;
+    }
+
+protected:
+    virtual void dispatch();
+    virtual SubTask *done();
+
+    virtual void execute();
+    virtual void handle(int state, int error);
+
+private:
+    void readNext(std::unique_lock<std::mutex>& lock);
+    void submitWrite(FileStreamChunk* chunk);
+    void checkDone(std::unique_lock<std::mutex>& lock);
+    void handleChunk(FileStreamChunk* chunk, int state, int error);
+    void deliverDone(int ret);
+
+public:
+    FileStreamTask(int fd, bool ownFd, bool isWrite, off_t offset, size_t chunkSize, int depth, IOService* service, FileStreamCallback&& cb);
+
+protected:
+    virtual ~FileStreamTask();
+
+protected:
+    int                                     mFd;
+    bool                                    mOwnFd;
+    bool                                    mWrite;
+    off_t                                   mOffset;        // 下一块的偏移
+    off_t                                   mEnd;           // 读流: 开始时的文件大小
+    off_t                                   mDeliverOffset; // 读流: 下一个要交付的偏移
+    size_t                                  mChunkSize;
+    long long                               mBytes;
+    IOService*                              mService;
+
+    bool                                    mStopped;
+    bool                                    mFinishing;
+    bool                                    mDispatched;
+    bool                                    mFinished;
+    FileStreamChunk*                        mCurrent;       // 写流: 正在填充的块; 读流: 正在交付的块
+    int                                     mDeliverRet;
+    std::vector<FileStreamChunk*>           mChunks;
+
+    std::mutex                              mMutex;
+    std::condition_variable                 mCond;
+
+    ExecQueue*                              mQueue;
+    Executor*                               mExecutor;
+    FileStreamConsumer                      mConsumer;
+    FileStreamCallback                      mCallback;
+};
+
+#endif //JARVIS_FILE_STREAM_TASK_H
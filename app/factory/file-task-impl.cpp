@@ -8,6 +8,36 @@
 
 #include "task-factory.h"
 #include "../manager/global.h"
+#include "../core/buffer-pool.h"
+
+/* O_DIRECT 打开失败 (如 tmpfs) 时退回普通打开 */
+static int __open_file(const char *pathname, int oflags, int flags)
+{
+    int fd;
+
+    if (flags & FILE_IO_DIRECT)
+    {
+        fd = open(pathname, oflags | O_DIRECT, 0644);
+        if (fd >= 0 || errno != EINVAL)
+            return fd;
+    }
+
+    return open(pathname, oflags, 0644);
+}
+
+/* 租用的缓冲区不够大时不交出去 */
+static void *__lease_buffer(size_t count)
+{
+    BufferPool *pool = Global::getBufferPool();
+
+    if (count > buffer_pool_buf_size(pool))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return buffer_pool_get(pool);
+}
 
 class FilePReadTask : public FileIOTask
 {
@@ -129,15 +159,17 @@ protected:
 class __FilePReadTask : public FilePReadTask
 {
 public:
-    __FilePReadTask(const std::string& path, void *buf, size_t count, off_t offset, IOService *service, FileIOCallback&& cb)
+    __FilePReadTask(const std::string& path, void *buf, size_t count, off_t offset, int flags, bool leased, IOService *service, FileIOCallback&& cb)
         : FilePReadTask(-1, buf, count, offset, service, std::move(cb)), pathname(path)
     {
+        this->flags = flags;
+        this->leased = leased;
     }
 
 protected:
     virtual int prepare()
     {
-        this->mArgs.fd = open(this->pathname.c_str(), O_RDONLY);
+        this->mArgs.fd = __open_file(this->pathname.c_str(), O_RDONLY, this->flags);
         if (this->mArgs.fd < 0)
             return -1;
 
@@ -155,22 +187,32 @@ protected:
         return FilePReadTask::done();
     }
 
+    virtual ~__FilePReadTask()
+    {
+        if (this->leased)
+            buffer_pool_put(this->mArgs.buf, Global::getBufferPool());
+    }
+
 protected:
     std::string pathname;
+    int flags;
+    bool leased;
 };
 
 class __FilePWriteTask : public FilePWriteTask
 {
 public:
-    __FilePWriteTask(const std::string& path, const void *buf, size_t count, off_t offset, IOService *service, FileIOCallback&& cb)
+    __FilePWriteTask(const std::string& path, const void *buf, size_t count, off_t offset, int flags, bool leased, IOService *service, FileIOCallback&& cb)
         : FilePWriteTask(-1, buf, count, offset, service, std::move(cb)), pathname(path)
     {
+        this->flags = flags;
+        this->leased = leased;
     }
 
 protected:
     virtual int prepare()
     {
-        this->mArgs.fd = open(this->pathname.c_str(), O_WRONLY | O_CREAT, 0644);
+        this->mArgs.fd = __open_file(this->pathname.c_str(), O_WRONLY | O_CREAT, this->flags);
         if (this->mArgs.fd < 0)
             return -1;
 
@@ -188,8 +230,16 @@ protected:
         return FilePWriteTask::done();
     }
 
+    virtual ~__FilePWriteTask()
+    {
+        if (this->leased)
+            buffer_pool_put(this->mArgs.buf, Global::getBufferPool());
+    }
+
 protected:
     std::string pathname;
+    int flags;
+    bool leased;
 };
 
 class __FilePReadVTask : public FilePReadVTask
@@ -295,12 +345,32 @@ FileSyncTask *TaskFactory::createFdSyncTask(int fd, FileSyncCallback callback)
 
 FileIOTask *TaskFactory::createPReadTask(const std::string& pathname, void *buf, size_t count, off_t offset, FileIOCallback callback)
 {
-    return new __FilePReadTask(pathname, buf, count, offset, Global::getIoService(), std::move(callback));
+    return createPReadTask(pathname, buf, count, offset, 0, std::move(callback));
 }
 
 FileIOTask *TaskFactory::createPWriteTask(const std::string& pathname, const void *buf, size_t count, off_t offset, FileIOCallback callback)
 {
-    return new __FilePWriteTask(pathname, buf, count, offset, Global::getIoService(), std::move(callback));
+    return createPWriteTask(pathname, buf, count, offset, 0, std::move(callback));
+}
+
+FileIOTask *TaskFactory::createPReadTask(const std::string& pathname, void *buf, size_t count, off_t offset, int flags, FileIOCallback callback)
+{
+    bool leased = !buf;
+
+    if (leased && !(buf = __lease_buffer(count)))
+        return NULL;
+
+    return new __FilePReadTask(pathname, buf, count, offset, flags, leased, Global::getIoService(), std::move(callback));
+}
+
+FileIOTask *TaskFactory::createPWriteTask(const std::string& pathname, const void *buf, size_t count, off_t offset, int flags, FileIOCallback callback)
+{
+    bool leased = !buf;
+
+    if (leased && !(buf = __lease_buffer(count)))
+        return NULL;
+
+    return new __FilePWriteTask(pathname, buf, count, offset, flags, leased, Global::getIoService(), std::move(callback));
 }
 
 FileVIOTask *TaskFactory::createPReadVTask(const std::string& pathname, const struct iovec *iovec, int iovcnt, off_t offset, FileVIOCallback callback)
@@ -40,6 +40,9 @@ protected:
     bool finishOnce() override ;
     bool initSuccess() override ;
     int keepAliveTimeout() override ;
+    int pipelinable() override ;
+    int replayable() override ;
+    int multiplexable() override ;
     CommMessageOut *messageOut() override;
     CommMessageIn *messageIn() override ;
 
@@ -140,7 +143,40 @@ CommMessageIn *ComplexHttpTask::messageIn()
 
 int ComplexHttpTask::keepAliveTimeout()
 {
-    return this->mResp.isKeepAlive() ? this->keepAliveTimeout() : 0;
+    return this->mResp.isKeepAlive() ? this->mKeepAliveTime : 0;
+}
+
+static bool __is_idempotent(const char *method)
+{
+    return strcmp(method, HTTP_METHOD_GET) == 0 || strcmp(method, HTTP_METHOD_HEAD) == 0 ||
+           strcmp(method, HTTP_METHOD_PUT) == 0 || strcmp(method, HTTP_METHOD_DELETE) == 0 ||
+           strcmp(method, HTTP_METHOD_OPTIONS) == 0 || strcmp(method, HTTP_METHOD_TRACE) == 0;
+}
+
+/* 只有幂等的 HTTP/1.1 keep-alive 请求排在别的请求后面发出 (RFC 7230 6.3.2) */
+int ComplexHttpTask::pipelinable()
+{
+    HttpRequest *req = this->getReq();
+    const char *version = req->getHttpVersion();
+    bool is_alive;
+
+    if (req->hasConnectionHeader())
+        is_alive = req->isKeepAlive();
+    else
+        is_alive = (this->mKeepAliveTime != 0);
+
+    return is_alive && version && strcmp(version, "HTTP/1.1") == 0 && __is_idempotent(req->getMethod());
+}
+
+int ComplexHttpTask::replayable()
+{
+    return __is_idempotent(this->getReq()->getMethod());
+}
+
+/* 连接协商出 h2 时请求作为一个流发出 */
+int ComplexHttpTask::multiplexable()
+{
+    return 1;
 }
 
 void ComplexHttpTask::setEmptyRequest()
@@ -381,6 +417,9 @@ protected:
     virtual bool initSuccess();
     virtual bool finishOnce();
 
+    /* CONNECT 之后的连接是隧道, 不能多路复用 */
+    virtual int multiplexable() { return 0; }
+
 protected:
     virtual Connection *getConnection() const
     {
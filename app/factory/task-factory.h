@@ -13,6 +13,7 @@
 #include "task.h"
 #include "workflow.h"
 #include "graph-task.h"
+#include "file-stream-task.h"
 #include "algorithm-task-factory.h"
 
 #include "../protocol/http/http-util.h"
@@ -27,6 +28,8 @@ typedef struct _FileSyncArgs            FileSyncArgs;
 
 // File IO tasks
 
+#define FILE_IO_DIRECT          0x1             // 以 O_DIRECT 打开, 文件系统不支持时退回普通 IO
+
 struct _FileIOArgs
 {
     int                     fd;
@@ -120,9 +123,24 @@ public:
     static FileIOTask* createPReadTask(const std::string& pathname, void *buf, size_t count, off_t offset, FileIOCallback callback);
     static FileIOTask* createPWriteTask(const std::string& pathname, const void *buf, size_t count, off_t offset, FileIOCallback callback);
 
+    /* flags 为 FILE_IO_DIRECT 时 buf、count、offset 都要按 4096 对齐.
+     * buf 为 NULL 时从 Global::getBufferPool() 租一块对齐的缓冲区, 任务销毁时归还; 取不到时返回 NULL, errno 为 ENOBUFS;
+     * 写任务在 start() 前向 getArgs()->buf 填入数据. count 不能超过 GlobalSettings::io_buffer_size */
+    static FileIOTask* createPReadTask(const std::string& pathname, void *buf, size_t count, off_t offset, int flags, FileIOCallback callback);
+    static FileIOTask* createPWriteTask(const std::string& pathname, const void *buf, size_t count, off_t offset, int flags, FileIOCallback callback);
+
     static FileVIOTask* createPReadVTask(const std::string& pathname, const struct iovec *iov, int iovCnt, off_t offset, FileVIOCallback callback);
     static FileVIOTask* createPWriteVTask(const std::string& pathname, const struct iovec *iov, int iovCnt, off_t offset, FileVIOCallback callback);
 
+    /* File stream tasks. 读流按顺序把每块交给 consumer, 最多预读 depth 块; 指定 queueName 时 consumer 在计算线程里调用 */
+    static FileStreamTask* createFileReadStream(int fd, off_t offset, size_t chunkSize, int depth, FileStreamConsumer consumer, FileStreamCallback callback);
+    static FileStreamTask* createFileReadStream(const std::string& pathname, size_t chunkSize, int depth, FileStreamConsumer consumer, FileStreamCallback callback);
+    static FileStreamTask* createFileReadStream(const std::string& pathname, size_t chunkSize, int depth, const std::string& queueName, FileStreamConsumer consumer, FileStreamCallback callback);
+
+    /* 写流用 write() 追加数据, finish() 后写完任务结束. 按路径创建时会清空原文件 */
+    static FileStreamTask* createFileWriteStream(int fd, off_t offset, size_t chunkSize, int depth, FileStreamCallback callback);
+    static FileStreamTask* createFileWriteStream(const std::string& pathname, size_t chunkSize, int depth, FileStreamCallback callback);
+
     static TimerTask* createTimerTask(unsigned int microseconds, TimerCallback callback);
 
     static TimerTask* createTimerTask(time_t seconds, long nanoseconds, TimerCallback callback);
@@ -388,14 +388,24 @@ void ComplexClientTask<REQ, RESP, CTX>::routerCallback(void *t)
 template<class REQ, class RESP, typename CTX>
 void ComplexClientTask<REQ, RESP, CTX>::dispatch()
 {
+    CommSchedObject *object;
+
     switch (this->mState) {
         case TASK_STATE_UNDEFINED: {
             if (this->checkRequest()) {
                 if (this->mRouteResult.mRequestObject) {
                     case TASK_STATE_SUCCESS:
-                        this->setRequestObject(mRouteResult.mRequestObject);
-                    this->ClientTask<REQ, RESP>::dispatch();
-                    return;
+                        object = RouteManager::select(mRouteResult);
+                        if (object) {
+                            this->setRequestObject(object);
+                            this->ClientTask<REQ, RESP>::dispatch();
+                            return;
+                        }
+
+                        /* 所有地址都熔断了, 直接失败, 不在 target 上排队等超时 */
+                        this->mState = TASK_STATE_TASK_ERROR;
+                        this->mError = TASK_ERROR_UPSTREAM_UNAVAILABLE;
+                        break;
                 }
 
                 mRouterTask = this->route();
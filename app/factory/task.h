@@ -270,6 +270,11 @@ public:
     {
         mReceiveTime = timeout;
     }
+    /* 客户端任务发完请求后等回复第一个字节的超时, 0 时用 target 的 responseTimeout. 长轮询时用 */
+    void setWatchTimeout(int timeout)
+    {
+        mWatchTime = timeout;
+    }
 
 public:
     /* noReply(), push() are for server tasks only. */
@@ -303,6 +308,10 @@ protected:
     {
         return mKeepAliveTime;
     }
+    int firstTimeout() override
+    {
+        return mWatchTime;
+    }
 
 
 protected:
@@ -312,6 +321,7 @@ protected:
         mError = 0;
         mSendTime = -1;
         mReceiveTime = -1;
+        mWatchTime = 0;
         mKeepAliveTime = 0;
         mTarget = NULL;
         mUserData = NULL;
@@ -329,6 +339,7 @@ public:
 protected:
     int                                                     mSendTime;
     int                                                     mReceiveTime;
+    int                                                     mWatchTime;
     int                                                     mKeepAliveTime;
     REQ                                                     mReq;
     RESP                                                    mResp;
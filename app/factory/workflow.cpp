@@ -55,8 +55,8 @@ ParallelWork::ParallelWork(SeriesWork *const *allSeries, size_t n, ParallelCallb
     mBufSize = (n > 4 ? n : 4);
     mAllSeries = (SeriesWork **)&mSubTasks[mBufSize];
     for (i = 0; i < n; i++) {
-        assert(!mAllSeries[i]->mInParallel);
-        mAllSeries[i]->mInParallel = true;
+        assert(!allSeries[i]->mInParallel);
+        allSeries[i]->mInParallel = true;
         mAllSeries[i] = allSeries[i];
         mSubTasks[i] = allSeries[i]->mFirst;
     }
@@ -7,10 +7,11 @@
 #include "common/area.h"
 #include "client-data.h"
 // #include "../utils/sqlite-utils.h"
-#include "../utils/file-read-write.h"
 
 #include <mutex>
+#include <fcntl.h>
 #include <unistd.h> // windows 在 windows.h
+#include <sys/stat.h>
 #include <utils/json-utils.h>
 
 static std::mutex locker;
@@ -42,7 +43,27 @@ bool HttpRouter::responseStaticResource(HttpTask *task)
 
     std::string f = requestStaticResource(*task);
     if (!f.empty()) {
-        task->getResp()->appendOutputBody(FileReadWrite::getFileContent(f));
+        // 文件交给响应, 发送时 sendfile, 发完关闭. 不是普通文件时 404, 其它错误 500
+        struct stat st;
+        int status = 0;
+        int fd = open(f.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            status = (errno == ENOENT || errno == ENOTDIR) ? 404 : 500;
+        } else if (fstat(fd, &st) < 0) {
+            status = 500;
+        } else if (!S_ISREG(st.st_mode)) {
+            status = 404;
+        } else if (!task->getResp()->appendOutputBodyFile(fd, 0, st.st_size, true)) {
+            status = 500;
+        }
+
+        if (status) {
+            loge("%s: %d", f.c_str(), status);
+            if (fd >= 0) {
+                close(fd);
+            }
+            protocol::HttpUtil::setResponseStatus(task->getResp(), status);
+        }
         return true;
     }
 
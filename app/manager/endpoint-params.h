@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 
+#include "../core/common-scheduler.h"
+
 typedef struct _EndpointParams              EndpointParams;
 
 enum TransportType
@@ -25,6 +27,13 @@ struct _EndpointParams
     int                     responseTimeout;
     int                     sslConnectTimeout;
     bool                    useTlsSni;
+    size_t                  minIdleConnections;     // 每个地址在后台保持的空闲连接数
+    size_t                  maxIdleConnections;     // 每个地址的空闲连接上限, 超过时关掉最久未用的, 0 不限制
+    bool                    validateIdle;           // 复用空闲连接前检查对端是否已经关闭
+    int                     pipelineDepth;          // 每个连接上同时等回复的请求数, 大于 1 时幂等的 HTTP/1.1 请求使用 pipelining
+    bool                    http2;                  // TLS 连接用 ALPN 协商 h2, 协商成功时请求多路复用一个连接
+    bool                    http2PriorKnowledge;    // 明文连接直接使用 h2c, 只用于确定支持的服务
+    int                     schedPolicy;            // 有多个地址时怎么选, COMM_SCHED_LEAST_LOAD/COMM_SCHED_P2C/COMM_SCHED_PEAK_EWMA
 };
 
 static constexpr EndpointParams ENDPOINT_PARAMS_DEFAULT =
@@ -34,7 +43,34 @@ static constexpr EndpointParams ENDPOINT_PARAMS_DEFAULT =
             .responseTimeout            = 10 * 1000,
             .sslConnectTimeout          = 10 * 1000,
             .useTlsSni                  = false,
+            .minIdleConnections         = 0,
+            .maxIdleConnections         = 0,
+            .validateIdle               = false,
+            .pipelineDepth              = 0,
+            .http2                      = false,
+            .http2PriorKnowledge        = false,
+            .schedPolicy                = COMM_SCHED_LEAST_LOAD,
         };
 
+/* 结构里有填充字节, 不能用 memcmp. 加字段时同时加到这里, 否则下面的 static_assert 不过 */
+static inline bool endpoint_params_equal(const EndpointParams* x, const EndpointParams* y)
+{
+    return x->maxConnections == y->maxConnections &&
+           x->connectTimeout == y->connectTimeout &&
+           x->responseTimeout == y->responseTimeout &&
+           x->sslConnectTimeout == y->sslConnectTimeout &&
+           x->useTlsSni == y->useTlsSni &&
+           x->minIdleConnections == y->minIdleConnections &&
+           x->maxIdleConnections == y->maxIdleConnections &&
+           x->validateIdle == y->validateIdle &&
+           x->pipelineDepth == y->pipelineDepth &&
+           x->http2 == y->http2 &&
+           x->http2PriorKnowledge == y->http2PriorKnowledge &&
+           x->schedPolicy == y->schedPolicy;
+}
+
+static_assert(sizeof (EndpointParams) == offsetof(EndpointParams, schedPolicy) + sizeof (int),
+              "schedPolicy must stay the last field compared by endpoint_params_equal()");
+
 
 #endif //JARVIS_ENDPOINT_PARAMS_H
@@ -18,9 +18,16 @@
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/crypto.h>
+#include <openssl/rand.h>
 #include <condition_variable>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include "../core/executor.h"
+#include "../core/buffer-pool.h"
 #include "../core/common-scheduler.h"
 
 #include "../factory/task-error.h"
@@ -157,6 +164,22 @@ static void ssl_locking_callback(int mode, int type, const char* file, int line)
 }
 #endif
 
+struct __TicketKey
+{
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    time_t created;
+};
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int __ssl_ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc);
+#else
+static int __ssl_ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc);
+#endif
+
 class __SSLManager
 {
 public:
@@ -167,7 +190,69 @@ public:
     }
 
     SSL_CTX *get_ssl_client_ctx() { return ssl_client_ctx_; }
-    SSL_CTX *new_ssl_server_ctx() { return SSL_CTX_new(SSLv23_server_method()); }
+
+    SSL_CTX *new_ssl_server_ctx()
+    {
+        const GlobalSettings *settings = Global::getGlobalSettings();
+        int lifetime = settings->ssl_ticket_key_lifetime;
+        SSL_CTX *ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+
+        if (ssl_ctx)
+        {
+            set_ktls(ssl_ctx);
+            // 会话多久内可以恢复与 ticket key 多久轮换一次无关, 分开设置
+            if (settings->ssl_session_timeout > 0)
+                SSL_CTX_set_timeout(ssl_ctx, settings->ssl_session_timeout);
+
+            if (lifetime > 0)
+            {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+                SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, __ssl_ticket_key_callback);
+#else
+                SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, __ssl_ticket_key_callback);
+#endif
+            }
+            else
+                SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+        }
+
+        return ssl_ctx;
+    }
+
+    // name 为 NULL 时取当前的 key; 返回 0 是当前的 key, 1 是上一个, -1 没有
+    int get_ticket_key(const unsigned char *name, __TicketKey *key)
+    {
+        std::lock_guard<std::mutex> lock(ticket_mutex_);
+        int lifetime = Global::getGlobalSettings()->ssl_ticket_key_lifetime;
+        time_t now = time(NULL);
+
+        if (ticket_key_count_ == 0 || now - ticket_keys_[0].created >= lifetime)
+        {
+            // 只在用到时轮换, 空闲了两个周期以上时上一个 key 也已经过期, 不再保留
+            if (ticket_key_count_ > 0 && now - ticket_keys_[0].created >= 2 * (time_t)lifetime)
+                ticket_key_count_ = 0;
+
+            if (rotate_ticket_key(now) < 0)
+                return -1;
+        }
+
+        if (!name)
+        {
+            *key = ticket_keys_[0];
+            return 0;
+        }
+
+        for (int i = 0; i < ticket_key_count_; i++)
+        {
+            if (memcmp(name, ticket_keys_[i].name, sizeof ticket_keys_[i].name) == 0)
+            {
+                *key = ticket_keys_[i];
+                return i;
+            }
+        }
+
+        return -1;
+    }
 
 private:
     __SSLManager()
@@ -184,6 +269,13 @@ private:
         ssl_client_ctx_ = SSL_CTX_new(SSLv23_client_method());
         if (ssl_client_ctx_ == NULL)
             abort();
+
+        if (CommTarget::initSSLSessionCache(ssl_client_ctx_) < 0)
+            abort();
+
+        set_ktls(ssl_client_ctx_);
+
+        ticket_key_count_ = 0;
     }
 
     ~__SSLManager()
@@ -214,10 +306,98 @@ private:
 #endif
     }
 
+private:
+    // 内核没有 tls 模块时 OpenSSL 自己退回用户态
+    static void set_ktls(SSL_CTX *ssl_ctx)
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        if (Global::getGlobalSettings()->ssl_ktls)
+            SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    }
+
+    // 上一个 key 再保留一个周期, 用它加密的 ticket 仍能恢复会话, 并换发新 ticket
+    int rotate_ticket_key(time_t now)
+    {
+        __TicketKey key;
+
+        if (RAND_bytes(key.name, sizeof key.name) != 1
+            || RAND_bytes(key.aes_key, sizeof key.aes_key) != 1
+            || RAND_bytes(key.hmac_key, sizeof key.hmac_key) != 1)
+            return -1;
+
+        key.created = now;
+        ticket_keys_[1] = ticket_keys_[0];
+        ticket_keys_[0] = key;
+        if (ticket_key_count_ < 2)
+            ticket_key_count_++;
+
+        return 0;
+    }
+
 private:
     SSL_CTX *ssl_client_ctx_;
+    std::mutex ticket_mutex_;
+    __TicketKey ticket_keys_[2];
+    int ticket_key_count_;
 };
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int __ssl_ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int __ssl_ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+    const EVP_CIPHER *cipher = EVP_aes_256_cbc();
+    __TicketKey key;
+    int ret;
+
+    if (enc)
+    {
+        if (__SSLManager::get_instance()->get_ticket_key(NULL, &key) < 0
+            || RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) != 1)
+            return -1;
+
+        memcpy(name, key.name, sizeof key.name);
+        ret = 1;
+    }
+    else
+    {
+        // 找不到 key 时做完整握手; 上一个 key 的 ticket 返回 2, 让 OpenSSL 换发新 ticket
+        ret = __SSLManager::get_instance()->get_ticket_key(name, &key);
+        if (ret < 0)
+            return 0;
+
+        ret = ret == 0 ? 1 : 2;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof key.hmac_key),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+            OSSL_PARAM_construct_end()
+    };
+
+    if (!EVP_MAC_CTX_set_params(hctx, params))
+        return -1;
+#else
+    if (!HMAC_Init_ex(hctx, key.hmac_key, sizeof key.hmac_key, EVP_sha256(), NULL))
+        return -1;
+#endif
+
+    if (enc)
+    {
+        if (!EVP_EncryptInit_ex(ctx, cipher, NULL, key.aes_key, iv))
+            return -1;
+    }
+    else if (!EVP_DecryptInit_ex(ctx, cipher, NULL, key.aes_key, iv))
+        return -1;
+
+    return ret;
+}
+
 class __FileIOService : public IOService
 {
 public:
@@ -270,6 +450,40 @@ private:
     bool flag_;
 };
 
+class __CpuAffinityManager
+{
+public:
+    static __CpuAffinityManager *get_instance()
+    {
+        static __CpuAffinityManager kInstance;
+        return &kInstance;
+    }
+
+    const CpuAffinity *get_affinity() const
+    {
+        return enabled_ ? &affinity_ : NULL;
+    }
+
+private:
+    __CpuAffinityManager():
+            enabled_(false)
+    {
+        const auto *settings = Global::getGlobalSettings();
+
+        if (settings->cpu_affinity == CPU_AFFINITY_PIN)
+        {
+            if (cpu_affinity_plan(settings->cpu_list, settings->poller_threads, &affinity_) < 0)
+                abort();
+
+            enabled_ = true;
+        }
+    }
+
+private:
+    CpuAffinity affinity_;
+    bool enabled_;
+};
+
 class __ThreadDnsManager
 {
 public:
@@ -290,7 +504,11 @@ public:
         if (ret < 0)
             abort();
 
-        ret = dns_executor_.init(Global::getGlobalSettings()->dns_threads);
+        const CpuAffinity *affinity = __CpuAffinityManager::get_instance()->get_affinity();
+
+        ret = dns_executor_.init(Global::getGlobalSettings()->dns_threads,
+                                 THREAD_POOL_SHARED_QUEUE,
+                                 affinity ? &affinity->computeCpus : NULL);
         if (ret < 0)
             abort();
     }
@@ -340,16 +558,70 @@ public:
         return fio_service_;
     }
 
+    BufferPool *get_buffer_pool()
+    {
+        if (!pool_flag_)
+        {
+            IOService *service = get_io_service();
+
+            fio_mutex_.lock();
+            if (!pool_flag_)
+            {
+                const auto *settings = Global::getGlobalSettings();
+
+                buffer_pool_ = buffer_pool_create(settings->io_buffer_size, settings->io_buffers);
+                if (!buffer_pool_)
+                    abort();
+
+                // 注册失败 (如 RLIMIT_MEMLOCK 不够) 时照常使用, 只是不走固定缓冲区
+                service->registerBuffers(buffer_pool_base(buffer_pool_),
+                                         buffer_pool_buf_size(buffer_pool_),
+                                         (int)buffer_pool_count(buffer_pool_));
+                pool_flag_ = true;
+            }
+
+            fio_mutex_.unlock();
+        }
+
+        return buffer_pool_;
+    }
+
 private:
     __CommManager():
             fio_service_(NULL),
-            fio_flag_(false)
+            fio_flag_(false),
+            buffer_pool_(NULL),
+            pool_flag_(false)
     {
         const auto *settings = Global::getGlobalSettings();
         if (scheduler_.init(settings->poller_threads,
-                            settings->handler_threads) < 0)
+                            settings->handler_threads,
+                            settings->poller_engine,
+                            __CpuAffinityManager::get_instance()->get_affinity(),
+                            settings->handler_mode) < 0)
             abort();
 
+        if (settings->handler_threads_max > settings->handler_threads)
+        {
+            if (scheduler_.setHandlerElastic(settings->handler_threads_max,
+                                             settings->elastic_wait_target,
+                                             settings->elastic_idle_timeout) < 0)
+                abort();
+        }
+
+        if (settings->poller_spin_budget > 0 || settings->poller_busy_poll > 0)
+        {
+            if (scheduler_.setPollSpin(settings->poller_spin_budget,
+                                       settings->poller_busy_poll) < 0)
+                abort();
+        }
+
+        if (settings->zerocopy_threshold > 0)
+        {
+            if (scheduler_.setZeroCopy(settings->zerocopy_threshold) < 0)
+                abort();
+        }
+
         signal(SIGPIPE, SIG_IGN);
     }
 
@@ -362,6 +634,9 @@ private:
             fio_service_->deInit();
             delete fio_service_;
         }
+
+        if (buffer_pool_)
+            buffer_pool_destroy(buffer_pool_);
     }
 
 private:
@@ -369,6 +644,8 @@ private:
     __FileIOService *fio_service_;
     volatile bool fio_flag_;
     std::mutex fio_mutex_;
+    BufferPool *buffer_pool_;
+    volatile bool pool_flag_;
 };
 
 class __ExecManager
@@ -423,13 +700,32 @@ private:
     __ExecManager():
             rwlock_(PTHREAD_RWLOCK_INITIALIZER)
     {
-        int compute_threads = Global::getGlobalSettings()->compute_threads;
+        const auto *settings = Global::getGlobalSettings();
+        const CpuAffinity *affinity = __CpuAffinityManager::get_instance()->get_affinity();
+        int compute_threads = settings->compute_threads;
+        int compute_mode = settings->compute_mode;
 
         if (compute_threads <= 0)
-            compute_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        {
+            if (affinity)
+                compute_threads = CPU_COUNT(&affinity->computeCpus);
+            else
+                compute_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
 
-        if (compute_executor_.init(compute_threads) < 0)
+        if (compute_executor_.init(compute_threads, compute_mode,
+                                   affinity ? &affinity->computeCpus : NULL) < 0)
             abort();
+
+        if (settings->compute_threads_max > compute_threads &&
+            compute_mode == THREAD_POOL_SHARED_QUEUE)
+        {
+            if (compute_executor_.setElastic(compute_threads,
+                                             settings->compute_threads_max,
+                                             settings->elastic_wait_target,
+                                             settings->elastic_idle_timeout) < 0)
+                abort();
+        }
     }
 
     ~__ExecManager()
@@ -646,6 +942,11 @@ IOService *Global::getIoService()
     return __CommManager::get_instance()->get_io_service();
 }
 
+BufferPool *Global::getBufferPool()
+{
+    return __CommManager::get_instance()->get_buffer_pool();
+}
+
 ExecQueue *Global::getDnsQueue()
 {
     return __ThreadDnsManager::get_instance()->get_dns_queue();
@@ -33,8 +33,26 @@ struct _GlobalSettings
     unsigned int dns_ttl_min;		///< in seconds, DNS TTL when network request fail
     int dns_threads;
     int poller_threads;
+    int poller_engine;              ///< CPOLL_ENGINE_EPOLL or CPOLL_ENGINE_URING, fallback to epoll if io_uring unavailable
+    int poller_spin_budget;         ///< in microseconds, pollers spin this long before blocking while events are frequent, each spinning poller keeps a core busy; 0 (default) to disable
+    int poller_busy_poll;           ///< in microseconds, SO_BUSY_POLL on accepted sockets; 0 to disable
+    size_t zerocopy_threshold;      ///< in bytes, messages at least this large are sent with MSG_ZEROCOPY; 0 (default) to disable. Only worth it for large sends (roughly 10KB and up), smaller ones are cheaper to copy than to pin and wait for
     int handler_threads;
+    int handler_mode;               ///< COMM_HANDLER_SHARED or COMM_HANDLER_PER_POLLER (handler_threads split among pollers)
     int compute_threads;			///< auto-set by system CPU number if value<=0
+    int compute_mode;               ///< THREAD_POOL_SHARED_QUEUE or THREAD_POOL_WORK_STEALING
+    int handler_threads_max;        ///< elastic handler threads if greater than handler_threads
+    int compute_threads_max;        ///< elastic compute threads if greater than compute_threads (shared queue mode only)
+    int elastic_wait_target;        ///< in microseconds, add a thread when a message waits longer
+    int elastic_idle_timeout;       ///< in milliseconds, an extra thread exits after idle this long
+    int cpu_affinity;               ///< CPU_AFFINITY_NONE or CPU_AFFINITY_PIN
+    const char *cpu_list;           ///< CPUs to place threads on, e.g. "0-15,32-47"; NULL for all allowed CPUs
+    size_t io_buffer_size;          ///< size of each aligned buffer leased to file tasks, rounded up to page size
+    int io_buffers;                 ///< number of aligned buffers, allocated on first use and registered to io_uring
+    int ssl_ticket_key_lifetime;    ///< in seconds, server session ticket keys rotate this often, tickets of the previous key still resume; 0 to disable tickets
+    int ssl_session_timeout;        ///< in seconds, how long a server session or ticket can be resumed, independent of key rotation; 0 for OpenSSL's default.
+                                    ///< a ticket also stops resuming once its key is dropped, at most two key lifetimes after the key was created
+    int ssl_ktls;                   ///< non-zero to hand the TLS record layer to kernel TLS after handshake, user space TLS if the kernel lacks it
     const char *resolv_conf_path;
     const char *hosts_path;
 };
@@ -47,8 +65,25 @@ static constexpr GlobalSettings GLOBAL_SETTINGS_DEFAULT =
                 .dns_ttl_min		=	180,
                 .dns_threads		=	4,
                 .poller_threads		=	4,
+                .poller_engine		=	CPOLL_ENGINE_EPOLL,
+                .poller_spin_budget	=	0,
+                .poller_busy_poll	=	0,
+                .zerocopy_threshold	=	0,
                 .handler_threads	=	20,
+                .handler_mode		=	COMM_HANDLER_SHARED,
                 .compute_threads	=	-1,
+                .compute_mode		=	THREAD_POOL_SHARED_QUEUE,
+                .handler_threads_max	=	-1,
+                .compute_threads_max	=	-1,
+                .elastic_wait_target	=	2000,
+                .elastic_idle_timeout	=	30000,
+                .cpu_affinity		=	CPU_AFFINITY_NONE,
+                .cpu_list			=	NULL,
+                .io_buffer_size		=	1024 * 1024,
+                .io_buffers			=	64,
+                .ssl_ticket_key_lifetime	=	3600,
+                .ssl_session_timeout	=	3600,
+                .ssl_ktls			=	0,
                 .resolv_conf_path	=	"/etc/resolv.conf",
                 .hosts_path			=	"/etc/hosts",
         };
@@ -80,6 +115,7 @@ public:
     static class ExecQueue* getExecQueue(const std::string& queueName);
     static class Executor* getComputeExecutor();
     static class IOService* getIoService();
+    static struct _BufferPool* getBufferPool();
     static class ExecQueue* getDnsQueue();
     static class Executor* getDnsExecutor();
     static class DnsClient* getDnsClient();
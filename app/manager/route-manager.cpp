@@ -23,17 +23,64 @@
 
 #include "global.h"
 #include "../core/c-list.h"
-#include "../core/rb-tree.h"
 #include "endpoint-params.h"
-#include "../utils/md5-util.h"
+#include "../protocol/http/http2-mux.h"
 #include "../utils/string-util.h"
 #include "../core/common-scheduler.h"
 
-#define GET_CURRENT_SECOND	std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
-#define MTTR_SECOND			30
+#define GET_CURRENT_MS		std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
+
+#define BREAKER_CLOSED			0
+#define BREAKER_OPEN			1		// 熔断, 到 openUntil 前不再分配请求
+#define BREAKER_HALF_OPEN		2		// 放一个探测请求过去, 成功恢复, 失败再熔断更久
+
+#define BREAKER_BUCKETS			10		// 滑动窗口的格数, 每格一秒
+#define BREAKER_MIN_REQUESTS	5		// 窗口里请求数不到这个时不熔断
+#define BREAKER_ERROR_PERCENT	50		// 窗口里错误率到这个时熔断
+#define BREAKER_EJECT_PERCENT	50		// 组里最多摘掉的 target 比例, 其余的熔断了也留在组里
+#define BREAKER_BASE_MS			10000	// 第一次熔断的时长, 之后每次翻倍
+#define BREAKER_MAX_MS			300000	// 熔断时长的上限, 恢复后这么久没再熔断时从头算
+#define BREAKER_PROBE_MS		10000	// 探测请求这么久没有结果时再放一个
+#define BREAKER_LATENCY_TIMES	5		// 耗时是组里中位数的这么多倍时摘掉
+#define BREAKER_LATENCY_MIN_US	100000	// 耗时低于这个不算慢
+
+#define ROUTE_CACHE_SHARD_BITS	6		// 按 key 哈希的高位分成 64 片
+#define ROUTE_CACHE_BUCKETS		16		// 每片初始的桶数, 项数超过桶数时翻倍
 
 using RouteTargetTCP = RouteManager::RouteTarget;
 
+int RouteManager::RouteTarget::initSSL(SSL *ssl)
+{
+    static const unsigned char protos[] = "\x02" HTTP2_ALPN_ID "\x08http/1.1";
+
+    if (!mHttp2)
+        return 0;
+
+    /* h2 的记录层由 CommMux 在用户态处理, 不能交给 kTLS */
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_clear_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+    return SSL_set_alpn_protos(ssl, protos, sizeof (protos) - 1) == 0 ? 0 : -1;
+}
+
+CommMux *RouteManager::RouteTarget::newMux(SSL *ssl)
+{
+    const unsigned char *alpn;
+    unsigned int len;
+
+    if (ssl) {
+        if (!mHttp2)
+            return NULL;
+
+        SSL_get0_alpn_selected(ssl, &alpn, &len);
+        if (len != strlen(HTTP2_ALPN_ID) || memcmp(alpn, HTTP2_ALPN_ID, len) != 0)
+            return NULL;
+    } else if (!mHttp2PriorKnowledge)
+        return NULL;
+
+    return new protocol::Http2Mux(false, ssl != NULL);
+}
+
 class RouteTargetUDP : public RouteManager::RouteTarget
 {
 private:
@@ -75,7 +122,7 @@ private:
     virtual int initSSL(SSL *ssl)
     {
         if (SSL_set_tlsext_host_name(ssl, mHostname.c_str()) > 0)
-            return 0;
+            return this->RouteTarget::initSSL(ssl);
         else
             return -1;
     }
@@ -96,14 +143,81 @@ struct RouteParams
 {
     TransportType                       transportType;
     const struct addrinfo*              addrInfo;
-    uint64_t                            md516;
+    uint64_t                            hash;
     SSL_CTX*                            sslCtx;
     int                                 connectTimeout;
     int                                 sslConnectTimeout;
     int                                 responseTimeout;
     size_t                              maxConnections;
     bool                                useTlsSni;
+    size_t                              minIdleConnections;
+    size_t                              maxIdleConnections;
+    bool                                validateIdle;
+    int                                 pipelineDepth;
+    bool                                http2;
+    bool                                http2PriorKnowledge;
+    int                                 schedPolicy;
+    const std::string&                  hostname;
+};
+
+/* get() 的参数里决定路由的部分, 只在栈上, 不拷贝 */
+typedef struct _RouteKeyRef             RouteKeyRef;
+struct _RouteKeyRef
+{
+    TransportType                       type;
+    const struct addrinfo*              addrInfo;
+    const std::string&                  info;
     const std::string&                  hostname;
+    bool                                sni;            // 带 hostname
+    int                                 flags;          // h2 和多地址时的调度策略
+};
+
+/* 存在路由里的完整 key, 哈希相同时逐项比较 */
+typedef struct _RouteKey                RouteKey;
+struct _RouteKey
+{
+    TransportType                       type;
+    std::string                         info;
+    std::string                         hostname;
+    bool                                sni;
+    int                                 flags;
+    std::vector<std::string>            addrs;          // sockaddr, 排好序
+};
+
+/* 和读多的字段分开, 计数时不让它们的 cache line 失效 */
+typedef struct _RouteCounters           RouteCounters;
+struct alignas(64) _RouteCounters
+{
+    unsigned long                       requests;
+    unsigned long                       rejected;
+    unsigned long                       successes;
+    unsigned long                       failures;
+};
+
+typedef struct _BreakerBucket           BreakerBucket;
+struct _BreakerBucket
+{
+    int64_t                             second;
+    uint32_t                            total;
+    uint32_t                            errors;
+};
+
+/**
+ * 和 RouteResultEntry::mTargets 一一对应, 窗口不加锁更新.
+ * state, openUntil, probeTime 是原子的: select() 不加锁把到期的 OPEN 换成 HALF_OPEN, 抢 probeTime 放探测请求;
+ * 熔断和恢复在 RouteResultEntry::mMutex 里, 先写时间再 release 写 state
+ */
+typedef struct _TargetBreaker           TargetBreaker;
+struct _TargetBreaker
+{
+    CommSchedTarget*                    target;
+    int                                 state;
+    bool                                grouped;        // 在 mGroup 里
+    int                                 ejections;      // 连续熔断的次数
+    int64_t                             openUntil;
+    int64_t                             probeTime;      // 半开时放出探测请求的时间, 0 还没放
+    int64_t                             closedTime;
+    BreakerBucket                       buckets[BREAKER_BUCKETS];
 };
 
 class RouteResultEntry
@@ -111,48 +225,74 @@ class RouteResultEntry
 public:
     RouteResultEntry(): mRequestObject(NULL), mGroup(NULL)
     {
-        INIT_LIST_HEAD(&mBreakerList);
         mNLeft = 0;
         mNBreak = 0;
+        mLatencyCheck = 0;
+        mCounters = { };
     }
 
 public:
     void deInit();
     int init(const struct RouteParams *params);
 
-    void checkBreaker();
+    CommSchedObject *select();
+    bool available();
     void notifyAvailable(CommSchedTarget *target);
     void notifyUnavailable(CommSchedTarget *target);
+    void getPoolStats(std::vector<CommPoolStats>& stats);
+    void getRouteStats(RouteStats *stats);
 
 private:
-    void freeList();
     int addGroupTargets(const struct RouteParams *params);
     CommSchedTarget *createTarget(const struct RouteParams *params, const struct addrinfo *addrInfo);
 
+    TargetBreaker *findBreaker(CommSchedTarget *target);
+    void tripBreaker(TargetBreaker *breaker, int64_t now);
+    void closeBreaker(TargetBreaker *breaker, int64_t now);
+    void checkLatency(int64_t now);
+
 
 public:
-    RBNode                              mRb;
     CommSchedObject*                    mRequestObject;
     CommSchedGroup*                     mGroup;
     std::mutex                          mMutex;
     std::vector<CommSchedTarget*>       mTargets;
-    struct list_head                    mBreakerList;
-    uint64_t                            mMd516;
-    int                                 mNLeft;
-    int                                 mNBreak;
+    std::vector<TargetBreaker>          mBreakers;
+    uint64_t                            mHash;
+    RouteKey                            mKey;
+    std::string                         mHostname;
+    int                                 mNLeft;         // 组里的 target 数
+    int                                 mNBreak;        // 不是 BREAKER_CLOSED 的 target 数
+    int64_t                             mLatencyCheck;  // 下次检查慢 target 的时间
+    RouteCounters                       mCounters;
 };
 
-typedef struct _BreakerNode             BreakerNode;
-struct _BreakerNode
+typedef struct _RouteCacheNode          RouteCacheNode;
+struct _RouteCacheNode
 {
-    CommSchedTarget*                    target;
-    int64_t                             timeout;
-    struct list_head                    breakerList;
+    uint64_t                            hash;
+    RouteResultEntry*                   entry;
+    RouteCacheNode*                     next;           // 发布后不再改
+};
+
+/* 扩容时整个换掉, 旧的等读者都离开 EpochGuard 后释放 */
+typedef struct _RouteCacheTable         RouteCacheTable;
+struct _RouteCacheTable
+{
+    size_t                              size;           // 2 的幂
+    RouteCacheNode**                    buckets;
+};
+
+struct alignas(64) _RouteCacheShard
+{
+    RouteCacheTable*                    table;
+    size_t                              count;
+    std::mutex                          mutex;          // 插入和扩容
 };
 
 CommSchedTarget *RouteResultEntry::createTarget(const struct RouteParams *params, const struct addrinfo *addr)
 {
-    CommSchedTarget *target;
+    RouteManager::RouteTarget *target;
 
     switch (params->transportType) {
         case TT_TCP_SSL:
@@ -180,6 +320,13 @@ CommSchedTarget *RouteResultEntry::createTarget(const struct RouteParams *params
     {
         delete target;
         target = NULL;
+    } else {
+        target->setPoolPolicy(params->minIdleConnections, params->maxIdleConnections, params->validateIdle);
+        target->setPipelineDepth(params->pipelineDepth);
+        if (params->transportType == TT_TCP_SSL)
+            target->setHttp2(params->http2, false);
+        else if (params->transportType == TT_TCP)
+            target->setHttp2(false, params->http2PriorKnowledge);
     }
 
     return target;
@@ -199,8 +346,10 @@ int RouteResultEntry::init(const struct RouteParams *params)
         target = createTarget(params, addr);
         if (target) {
             mTargets.push_back(target);
+            mBreakers.resize(1);
+            mBreakers[0].target = target;
             mRequestObject = target;
-            mMd516 = params->md516;
+            mHash = params->hash;
             return 0;
         }
 
@@ -209,9 +358,15 @@ int RouteResultEntry::init(const struct RouteParams *params)
 
     mGroup = new CommSchedGroup();
     if (mGroup->init() >= 0) {
-        if (addGroupTargets(params) >= 0) {
+        if (mGroup->setPolicy(params->schedPolicy) >= 0 && addGroupTargets(params) >= 0) {
+            mBreakers.resize(mTargets.size());
+            for (size_t i = 0; i < mTargets.size(); i++) {
+                mBreakers[i].target = mTargets[i];
+                mBreakers[i].grouped = true;
+            }
+
             mRequestObject = mGroup;
-            mMd516 = params->md516;
+            mHash = params->hash;
             return 0;
         }
 
@@ -266,211 +421,572 @@ void RouteResultEntry::deInit()
         mGroup->deInit();
         delete mGroup;
     }
+}
+
+void RouteResultEntry::getPoolStats(std::vector<CommPoolStats>& stats)
+{
+    stats.resize(mTargets.size());
+    for (size_t i = 0; i < mTargets.size(); i++)
+        mTargets[i]->getPoolStats(&stats[i]);
+}
 
-    struct list_head *pos, *tmp;
-    BreakerNode *node;
+/* 两个线程同时换格时可能丢掉几次计数, 不影响判断 */
+void RouteResultEntry::getRouteStats(RouteStats *stats)
+{
+    stats->key = mHash;
+    stats->transportType = mKey.type;
+    stats->hostname = mHostname;
+    stats->targets = mTargets.size();
+    stats->breaking = __atomic_load_n(&mNBreak, __ATOMIC_RELAXED);
+    stats->requests = __atomic_load_n(&mCounters.requests, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&mCounters.rejected, __ATOMIC_RELAXED);
+    stats->successes = __atomic_load_n(&mCounters.successes, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&mCounters.failures, __ATOMIC_RELAXED);
+}
 
-    list_for_each_safe(pos, tmp, &mBreakerList) {
-        node = list_entry(pos, BreakerNode, breakerList);
-        list_del(pos);
-        delete node;
+static void __bucket_add(BreakerBucket *bucket, int64_t second, int error)
+{
+    int64_t old = __atomic_load_n(&bucket->second, __ATOMIC_ACQUIRE);
+
+    if (old != second && __atomic_compare_exchange_n(&bucket->second, &old, second, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&bucket->total, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&bucket->errors, 0, __ATOMIC_RELAXED);
     }
+
+    __atomic_add_fetch(&bucket->total, 1, __ATOMIC_RELAXED);
+    if (error)
+        __atomic_add_fetch(&bucket->errors, 1, __ATOMIC_RELAXED);
 }
 
-void RouteResultEntry::notifyUnavailable(CommSchedTarget *target)
+static void __window_record(TargetBreaker *breaker, int64_t now, int error)
 {
-    if (mTargets.size() <= 1) {
-        return;
+    int64_t second = now / 1000;
+
+    __bucket_add(&breaker->buckets[second % BREAKER_BUCKETS], second, error);
+}
+
+static bool __window_tripped(TargetBreaker *breaker, int64_t now)
+{
+    int64_t second = now / 1000;
+    uint32_t total = 0;
+    uint32_t errors = 0;
+
+    for (auto& bucket : breaker->buckets) {
+        if (__atomic_load_n(&bucket.second, __ATOMIC_ACQUIRE) > second - BREAKER_BUCKETS) {
+            total += __atomic_load_n(&bucket.total, __ATOMIC_RELAXED);
+            errors += __atomic_load_n(&bucket.errors, __ATOMIC_RELAXED);
+        }
     }
 
+    return total >= BREAKER_MIN_REQUESTS && errors * 100 >= total * BREAKER_ERROR_PERCENT;
+}
+
+TargetBreaker *RouteResultEntry::findBreaker(CommSchedTarget *target)
+{
+    for (auto& breaker : mBreakers) {
+        if (breaker.target == target)
+            return &breaker;
+    }
+
+    return NULL;
+}
+
+/* 熔断, 时长按连续熔断的次数翻倍. 组里摘掉的不超过 BREAKER_EJECT_PERCENT, 至少留一个 */
+void RouteResultEntry::tripBreaker(TargetBreaker *breaker, int64_t now)
+{
+    int64_t duration = BREAKER_BASE_MS;
     int errno_bak = errno;
-    std::lock_guard<std::mutex> lock(mMutex);
+    int ejected;
 
-    if (mNLeft <= 1) {
-        return;
+    if (__atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE) == BREAKER_CLOSED) {
+        if (now - breaker->closedTime >= BREAKER_MAX_MS)
+            breaker->ejections = 0;
+
+        __atomic_add_fetch(&mNBreak, 1, __ATOMIC_RELAXED);
     }
 
-    if (mGroup->remove(target) < 0) {
-        errno = errno_bak;
-        return;
+    for (int i = 0; i < breaker->ejections && duration < BREAKER_MAX_MS; i++)
+        duration *= 2;
+
+    breaker->ejections++;
+    __atomic_store_n(&breaker->openUntil, now + std::min<int64_t>(duration, BREAKER_MAX_MS), __ATOMIC_RELAXED);
+    __atomic_store_n(&breaker->probeTime, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&breaker->state, BREAKER_OPEN, __ATOMIC_RELEASE);
+    for (auto& bucket : breaker->buckets)
+        __atomic_store_n(&bucket.second, 0, __ATOMIC_RELEASE);
+
+    ejected = (int)mTargets.size() - mNLeft;
+    if (breaker->grouped && mNLeft > 1 && (ejected + 1) * 100 <= (int)mTargets.size() * BREAKER_EJECT_PERCENT) {
+        if (mGroup->remove(breaker->target) >= 0) {
+            breaker->grouped = false;
+            --mNLeft;
+        } else {
+            errno = errno_bak;
+        }
     }
+}
 
-    auto *node = new BreakerNode;
+void RouteResultEntry::closeBreaker(TargetBreaker *breaker, int64_t now)
+{
+    int errno_bak = errno;
 
-    node->target = target;
-    node->timeout = GET_CURRENT_SECOND + MTTR_SECOND;
-    list_add_tail(&node->breakerList, &mBreakerList);
-    ++mNBreak;
-    --mNLeft;
+    breaker->closedTime = now;
+    __atomic_store_n(&breaker->state, BREAKER_CLOSED, __ATOMIC_RELEASE);
+    breaker->target->resetLatency();
+    __atomic_sub_fetch(&mNBreak, 1, __ATOMIC_RELAXED);
+    if (!breaker->grouped && mGroup) {
+        if (mGroup->add(breaker->target) >= 0) {
+            breaker->grouped = true;
+            ++mNLeft;
+        } else {
+            errno = errno_bak;
+        }
+    }
 }
 
-void RouteResultEntry::notifyAvailable(CommSchedTarget *target)
+/* 组里耗时远高于中位数的 target 也摘掉, 至少要有三个才比较 */
+void RouteResultEntry::checkLatency(int64_t now)
 {
-    if (mTargets.size() <= 1 || mNBreak == 0) {
+    std::vector<double> latency;
+    double median;
+
+    for (auto& breaker : mBreakers) {
+        if (__atomic_load_n(&breaker.state, __ATOMIC_ACQUIRE) == BREAKER_CLOSED && breaker.grouped)
+            latency.push_back(breaker.target->getLatency());
+    }
+
+    if (latency.size() < 3)
         return;
+
+    std::nth_element(latency.begin(), latency.begin() + latency.size() / 2, latency.end());
+    median = latency[latency.size() / 2];
+    for (auto& breaker : mBreakers) {
+        if (__atomic_load_n(&breaker.state, __ATOMIC_ACQUIRE) == BREAKER_CLOSED && breaker.grouped) {
+            double value = breaker.target->getLatency();
+            if (value > BREAKER_LATENCY_MIN_US && value > median * BREAKER_LATENCY_TIMES)
+                tripBreaker(&breaker, now);
+        }
     }
+}
+
+void RouteResultEntry::notifyUnavailable(CommSchedTarget *target)
+{
+    TargetBreaker *breaker = findBreaker(target);
+    int64_t now = GET_CURRENT_MS;
+
+    __atomic_add_fetch(&mCounters.failures, 1, __ATOMIC_RELAXED);
+    if (!breaker)
+        return;
+
+    __window_record(breaker, now, 1);
 
-    int errno_bak = errno;
     std::lock_guard<std::mutex> lock(mMutex);
+    int state = __atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE);
 
-    if (mGroup->add(target) == 0)
-        ++mNLeft;
-    else
-        errno = errno_bak;
+    if (state == BREAKER_HALF_OPEN)
+        tripBreaker(breaker, now);
+    else if (state == BREAKER_CLOSED && __window_tripped(breaker, now))
+        tripBreaker(breaker, now);
 }
 
-void RouteResultEntry::checkBreaker()
+void RouteResultEntry::notifyAvailable(CommSchedTarget *target)
 {
-    if (mTargets.size() <= 1 || mNBreak == 0) {
+    TargetBreaker *breaker = findBreaker(target);
+    int64_t now = GET_CURRENT_MS;
+    int64_t check;
+
+    __atomic_add_fetch(&mCounters.successes, 1, __ATOMIC_RELAXED);
+    if (!breaker)
         return;
+
+    __window_record(breaker, now, 0);
+    if (__atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE) == BREAKER_HALF_OPEN) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (__atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE) == BREAKER_HALF_OPEN)
+            closeBreaker(breaker, now);
     }
 
-    struct list_head *pos, *tmp;
-    BreakerNode *node;
-    int errno_bak = errno;
-    int64_t cur_time = GET_CURRENT_SECOND;
-    std::lock_guard<std::mutex> lock(mMutex);
+    /* 每秒最多一个线程检查慢 target */
+    check = __atomic_load_n(&mLatencyCheck, __ATOMIC_RELAXED);
+    if (mGroup && now >= check && __atomic_compare_exchange_n(&mLatencyCheck, &check, now + 1000, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        checkLatency(now);
+    }
+}
 
-    list_for_each_safe(pos, tmp, &mBreakerList) {
-        node = list_entry(pos, BreakerNode, breakerList);
-        if (cur_time >= node->timeout) {
-            if (mGroup->add(node->target) == 0)
-                mNLeft++;
-            else
-                errno = errno_bak;
+/* 到期的 OPEN 换成 HALF_OPEN. 熔断只从 CLOSED 和 HALF_OPEN 开始, 和这里不会同时改 state */
+static int __breaker_state(TargetBreaker *breaker, int64_t now)
+{
+    int state = __atomic_load_n(&breaker->state, __ATOMIC_ACQUIRE);
 
-            list_del(pos);
-            delete node;
-            mNBreak--;
-        }
+    if (state == BREAKER_OPEN && now >= __atomic_load_n(&breaker->openUntil, __ATOMIC_RELAXED)) {
+        if (__atomic_compare_exchange_n(&breaker->state, &state, BREAKER_HALF_OPEN, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            state = BREAKER_HALF_OPEN;
     }
+
+    return state;
 }
 
-static inline int __addr_cmp(const struct addrinfo *x, const struct addrinfo *y)
+static inline bool __probe_due(TargetBreaker *breaker, int64_t now, int64_t *probeTime)
 {
-    //todo ai_protocol
-    if (x->ai_addrlen == y->ai_addrlen)
-        return memcmp(x->ai_addr, y->ai_addr, x->ai_addrlen);
-    else if (x->ai_addrlen < y->ai_addrlen)
-        return -1;
+    *probeTime = __atomic_load_n(&breaker->probeTime, __ATOMIC_RELAXED);
+    return *probeTime == 0 || now - *probeTime >= BREAKER_PROBE_MS;
+}
+
+/**
+ * 不加锁. 半开的 target 轮流放一个探测请求, 同时选择的线程用 CAS 抢 probeTime, 只有一个放出去.
+ * 所有 target 都熔断时返回 NULL. 刚好赶上熔断的线程最多多放一个探测请求
+ */
+CommSchedObject *RouteResultEntry::select()
+{
+    CommSchedObject *object = mRequestObject;
+    bool probe = false;
+    int64_t probeTime;
+
+    if (__atomic_load_n(&mNBreak, __ATOMIC_RELAXED) != 0) {
+        int64_t now = GET_CURRENT_MS;
+
+        for (auto& breaker : mBreakers) {
+            if (__breaker_state(&breaker, now) != BREAKER_HALF_OPEN || !__probe_due(&breaker, now, &probeTime))
+                continue;
+
+            if (__atomic_compare_exchange_n(&breaker.probeTime, &probeTime, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                object = breaker.target;
+                probe = true;
+                break;
+            }
+        }
+
+        /* 单个地址时 mRequestObject 就是 target, 不能靠比较指针判断是不是探测 */
+        if (!probe && __atomic_load_n(&mNBreak, __ATOMIC_RELAXED) == (int)mBreakers.size())
+            object = NULL;
+    }
+
+    if (object)
+        __atomic_add_fetch(&mCounters.requests, 1, __ATOMIC_RELAXED);
     else
-        return 1;
+        __atomic_add_fetch(&mCounters.rejected, 1, __ATOMIC_RELAXED);
+
+    return object;
 }
 
-static inline bool __addr_less(const struct addrinfo *x, const struct addrinfo *y)
+bool RouteResultEntry::available()
 {
-    return __addr_cmp(x, y) < 0;
+    int nbreak = __atomic_load_n(&mNBreak, __ATOMIC_RELAXED);
+    int64_t probeTime;
+    int64_t now;
+
+    if (nbreak < (int)mBreakers.size())
+        return true;
+
+    now = GET_CURRENT_MS;
+    for (auto& breaker : mBreakers) {
+        if (__breaker_state(&breaker, now) == BREAKER_HALF_OPEN && __probe_due(&breaker, now, &probeTime))
+            return true;
+    }
+
+    return false;
 }
 
-static uint64_t __generate_key(TransportType type, const struct addrinfo *addrInfo, const std::string& otherInfo, const EndpointParams *endpointParams, const std::string& hostname)
+#define FNV_OFFSET		0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+static inline uint64_t __fnv_hash(uint64_t hash, const void *buf, size_t size)
 {
-    std::string str(std::to_string(type));
+    const unsigned char *p = (const unsigned char *)buf;
 
-    str += '\n';
-    if (!otherInfo.empty()) {
-        str += otherInfo;
-        str += '\n';
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
     }
 
-    if (type == TT_TCP_SSL && endpointParams->useTlsSni) {
-        str += hostname;
-        str += '\n';
+    return hash;
+}
+
+static inline uint64_t __fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* 不拼字符串, 多个地址的哈希相加, 和顺序无关 */
+static uint64_t __key_hash(const RouteKeyRef *ref)
+{
+    uint64_t hash = FNV_OFFSET;
+    uint64_t addrs = 0;
+    size_t size;
+
+    hash = __fnv_hash(hash, &ref->type, sizeof ref->type);
+    hash = __fnv_hash(hash, &ref->flags, sizeof ref->flags);
+    size = ref->info.size();
+    hash = __fnv_hash(hash, &size, sizeof size);
+    hash = __fnv_hash(hash, ref->info.data(), size);
+    if (ref->sni)
+        hash = __fnv_hash(hash, ref->hostname.data(), ref->hostname.size());
+
+    for (const struct addrinfo *p = ref->addrInfo; p; p = p->ai_next)
+        addrs += __fmix64(__fnv_hash(FNV_OFFSET, p->ai_addr, p->ai_addrlen));
+
+    hash = __fnv_hash(hash, &addrs, sizeof addrs);
+    return __fmix64(hash);
+}
+
+static inline bool __addr_less(const std::string& x, const std::string& y)
+{
+    if (x.size() != y.size())
+        return x.size() < y.size();
+
+    return memcmp(x.data(), y.data(), x.size()) < 0;
+}
+
+static void __key_init(RouteKey *key, const RouteKeyRef *ref)
+{
+    key->type = ref->type;
+    key->info = ref->info;
+    key->sni = ref->sni;
+    key->flags = ref->flags;
+    if (ref->sni)
+        key->hostname = ref->hostname;
+
+    for (const struct addrinfo *p = ref->addrInfo; p; p = p->ai_next)
+        key->addrs.emplace_back((const char *)p->ai_addr, p->ai_addrlen);
+
+    std::sort(key->addrs.begin(), key->addrs.end(), __addr_less);
+}
+
+/* 和 __addr_less 一样的顺序, 用于在排好序的 RouteKey::addrs 里找 addrinfo */
+static inline int __addr_cmp(const std::string& x, const struct addrinfo *y)
+{
+    if (x.size() != y->ai_addrlen)
+        return x.size() < y->ai_addrlen ? -1 : 1;
+
+    return memcmp(x.data(), y->ai_addr, x.size());
+}
+
+static inline bool __addrinfo_equal(const struct addrinfo *x, const struct addrinfo *y)
+{
+    return x->ai_addrlen == y->ai_addrlen && memcmp(x->ai_addr, y->ai_addr, x->ai_addrlen) == 0;
+}
+
+/* 地址按多重集合比较: 每个地址在两边出现的次数一样, 总数也一样. 不分配内存, 地址只有几个, 平方的计数就够了 */
+static bool __key_match(const RouteKey *key, const RouteKeyRef *ref)
+{
+    const struct addrinfo *p, *q;
+    size_t count;
+    size_t n = 0;
+
+    if (key->type != ref->type || key->flags != ref->flags || key->sni != ref->sni || key->info != ref->info)
+        return false;
+
+    if (ref->sni && key->hostname != ref->hostname)
+        return false;
+
+    for (p = ref->addrInfo; p; p = p->ai_next) {
+        auto first = std::lower_bound(key->addrs.begin(), key->addrs.end(), p, [](const std::string& x, const struct addrinfo *y) {
+            return __addr_cmp(x, y) < 0;
+        });
+        auto last = std::upper_bound(first, key->addrs.end(), p, [](const struct addrinfo *y, const std::string& x) {
+            return __addr_cmp(x, y) > 0;
+        });
+
+        if (first == last)
+            return false;
+
+        count = 0;
+        for (q = ref->addrInfo; q; q = q->ai_next) {
+            if (__addrinfo_equal(p, q))
+                count++;
+        }
+
+        if (count != (size_t)(last - first))
+            return false;
+
+        n++;
     }
 
-    if (addrInfo->ai_next) {
-        std::vector<const struct addrinfo *> sorted_addr;
+    return n == key->addrs.size();
+}
+
+static RouteCacheTable *__table_create(size_t size)
+{
+    auto *table = new RouteCacheTable;
+
+    table->size = size;
+    table->buckets = new RouteCacheNode*[size]();
+    return table;
+}
 
-        sorted_addr.push_back(addrInfo);
-        addrInfo = addrInfo->ai_next;
-        do {
-            sorted_addr.push_back(addrInfo);
-            addrInfo = addrInfo->ai_next;
-        } while (addrInfo);
+static void __table_destroy(RouteCacheTable *table)
+{
+    RouteCacheNode *node, *next;
 
-        std::sort(sorted_addr.begin(), sorted_addr.end(), __addr_less);
-        for (const struct addrinfo *p : sorted_addr) {
-            str += std::string((char *)p->ai_addr, p->ai_addrlen);
-            str += '\n';
+    for (size_t i = 0; i < table->size; i++) {
+        for (node = table->buckets[i]; node; node = next) {
+            next = node->next;
+            delete node;
         }
-    } else {
-        str += std::string((char *)addrInfo->ai_addr, addrInfo->ai_addrlen);
     }
 
-    return MD5Util::md5Integer16(str);
+    delete []table->buckets;
+    delete table;
 }
 
-RouteManager::~RouteManager()
+/* 读者在 EpochGuard 里调用, 或者拿着分片的锁 */
+static RouteResultEntry *__table_find(const RouteCacheTable *table, uint64_t hash, const RouteKeyRef *ref)
 {
-    RouteResultEntry *entry;
+    RouteCacheNode *node = __atomic_load_n(&table->buckets[hash & (table->size - 1)], __ATOMIC_ACQUIRE);
 
-    while (mCache.rbNode) {
-        entry = RB_ENTRY(mCache.rbNode, RouteResultEntry, mRb);
-        rb_erase(mCache.rbNode, &mCache);
-        entry->deInit();
-        delete entry;
+    for (; node; node = node->next) {
+        if (node->hash == hash && __key_match(&node->entry->mKey, ref))
+            return node->entry;
     }
+
+    return NULL;
 }
 
-int RouteManager::get(TransportType type, const struct addrinfo *addrInfo, const std::string& otherInfo, const EndpointParams *endpointParams, const std::string& hostname, RouteResult& result)
+static void __table_link(RouteCacheTable *table, uint64_t hash, RouteResultEntry *entry)
 {
-    uint64_t md516 = __generate_key(type, addrInfo, otherInfo, endpointParams, hostname);
-    RBNode** p = &mCache.rbNode;
-    RBNode* parent = NULL;
-    RouteResultEntry *bound = NULL;
-    RouteResultEntry *entry;
-    std::lock_guard<std::mutex> lock(mMutex);
+    RouteCacheNode **bucket = &table->buckets[hash & (table->size - 1)];
+    auto *node = new RouteCacheNode;
 
-    while (*p) {
-        parent = *p;
-        entry = RB_ENTRY(*p, RouteResultEntry, mRb);
-        if (md516 <= entry->mMd516) {
-            bound = entry;
-            p = &(*p)->rbLeft;
-        } else {
-            p = &(*p)->rbRight;
+    node->hash = hash;
+    node->entry = entry;
+    node->next = *bucket;
+    __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+}
+
+/* 拿着分片的锁调用. 扩容时在新表里重建节点, 旧表上的读者不受影响 */
+static void __shard_insert(RouteCacheShard *shard, EpochGuard *epoch, uint64_t hash, RouteResultEntry *entry)
+{
+    RouteCacheTable *table = shard->table;
+    RouteCacheTable *old = NULL;
+
+    if (++shard->count > table->size) {
+        old = table;
+        table = __table_create(old->size * 2);
+        for (size_t i = 0; i < old->size; i++) {
+            for (RouteCacheNode *node = old->buckets[i]; node; node = node->next)
+                __table_link(table, node->hash, node->entry);
         }
     }
 
-    if (bound && bound->mMd516 == md516) {
-        entry = bound;
-        entry->checkBreaker();
-    } else {
-        int ssl_connect_timeout = 0;
-        SSL_CTX *ssl_ctx = NULL;
+    __table_link(table, hash, entry);
+    if (old) {
+        __atomic_store_n(&shard->table, table, __ATOMIC_SEQ_CST);
+        epoch->synchronize();
+        __table_destroy(old);
+    }
+}
 
-        if (type == TT_TCP_SSL || type == TT_SCTP_SSL) {
-            static SSL_CTX *client_ssl_ctx = Global::getSslClientCtx();
-            ssl_ctx = client_ssl_ctx;
-            ssl_connect_timeout = endpointParams->sslConnectTimeout;
-        }
+RouteManager::RouteManager()
+{
+    mShards = new RouteCacheShard[1 << ROUTE_CACHE_SHARD_BITS];
+    for (int i = 0; i < 1 << ROUTE_CACHE_SHARD_BITS; i++) {
+        mShards[i].table = __table_create(ROUTE_CACHE_BUCKETS);
+        mShards[i].count = 0;
+    }
+}
+
+RouteManager::~RouteManager()
+{
+    for (int i = 0; i < 1 << ROUTE_CACHE_SHARD_BITS; i++) {
+        RouteCacheTable *table = mShards[i].table;
 
-        struct RouteParams params = {
-                .transportType          =   type,
-                .addrInfo               =   addrInfo,
-                .md516                  =   md516,
-                .sslCtx                 =   ssl_ctx,
-                .connectTimeout         =   endpointParams->connectTimeout,
-                .sslConnectTimeout      =   ssl_connect_timeout,
-                .responseTimeout        =   endpointParams->responseTimeout,
-                .maxConnections         =   endpointParams->maxConnections,
-                .useTlsSni              =   endpointParams->useTlsSni,
-                .hostname               =   hostname,
-        };
-
-        if (StringUtil::startWith(otherInfo, "?maxconn=")) {
-            int maxconn = atoi(otherInfo.c_str() + 9);
-            if (maxconn > 0) {
-                params.maxConnections = maxconn;
+        for (size_t j = 0; j < table->size; j++) {
+            for (RouteCacheNode *node = table->buckets[j]; node; node = node->next) {
+                node->entry->deInit();
+                delete node->entry;
             }
         }
 
-        entry = new RouteResultEntry;
-        if (entry->init(&params) >= 0) {
-            rb_link_node(&entry->mRb, parent, p);
-            rb_insert_color(&entry->mRb, &mCache);
-        } else {
-            delete entry;
-            return -1;
+        __table_destroy(table);
+    }
+
+    delete []mShards;
+}
+
+int RouteManager::get(TransportType type, const struct addrinfo *addrInfo, const std::string& otherInfo, const EndpointParams *endpointParams, const std::string& hostname, RouteResult& result)
+{
+    int flags = 0;
+
+    if ((type == TT_TCP_SSL && endpointParams->http2) || (type == TT_TCP && endpointParams->http2PriorKnowledge))
+        flags |= 1;
+
+    if (addrInfo && addrInfo->ai_next)
+        flags |= endpointParams->schedPolicy << 1;
+
+    RouteKeyRef ref = {
+            .type                   =   type,
+            .addrInfo               =   addrInfo,
+            .info                   =   otherInfo,
+            .hostname               =   hostname,
+            .sni                    =   type == TT_TCP_SSL && endpointParams->useTlsSni,
+            .flags                  =   flags,
+    };
+    uint64_t hash = __key_hash(&ref);
+    RouteCacheShard *shard = &mShards[hash >> (64 - ROUTE_CACHE_SHARD_BITS)];
+    RouteResultEntry *entry;
+    unsigned int epoch;
+
+    epoch = mEpoch.readLock();
+    entry = __table_find(__atomic_load_n(&shard->table, __ATOMIC_SEQ_CST), hash, &ref);
+    mEpoch.readUnlock(epoch);
+
+    if (!entry) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+
+        entry = __table_find(shard->table, hash, &ref);
+        if (!entry) {
+            int ssl_connect_timeout = 0;
+            SSL_CTX *ssl_ctx = NULL;
+
+            if (type == TT_TCP_SSL || type == TT_SCTP_SSL) {
+                static SSL_CTX *client_ssl_ctx = Global::getSslClientCtx();
+                ssl_ctx = client_ssl_ctx;
+                ssl_connect_timeout = endpointParams->sslConnectTimeout;
+            }
+
+            struct RouteParams params = {
+                    .transportType          =   type,
+                    .addrInfo               =   addrInfo,
+                    .hash                   =   hash,
+                    .sslCtx                 =   ssl_ctx,
+                    .connectTimeout         =   endpointParams->connectTimeout,
+                    .sslConnectTimeout      =   ssl_connect_timeout,
+                    .responseTimeout        =   endpointParams->responseTimeout,
+                    .maxConnections         =   endpointParams->maxConnections,
+                    .useTlsSni              =   endpointParams->useTlsSni,
+                    .minIdleConnections     =   endpointParams->minIdleConnections,
+                    .maxIdleConnections     =   endpointParams->maxIdleConnections,
+                    .validateIdle           =   endpointParams->validateIdle,
+                    .pipelineDepth          =   endpointParams->pipelineDepth,
+                    .http2                  =   endpointParams->http2,
+                    .http2PriorKnowledge    =   endpointParams->http2PriorKnowledge,
+                    .schedPolicy            =   endpointParams->schedPolicy,
+                    .hostname               =   hostname,
+            };
+
+            if (StringUtil::startWith(otherInfo, "?maxconn=")) {
+                int maxconn = atoi(otherInfo.c_str() + 9);
+                if (maxconn > 0) {
+                    params.maxConnections = maxconn;
+                }
+            }
+
+            entry = new RouteResultEntry;
+            if (entry->init(&params) < 0) {
+                delete entry;
+                return -1;
+            }
+
+            __key_init(&entry->mKey, &ref);
+            entry->mHostname = hostname;
+            __shard_insert(shard, &mEpoch, hash, entry);
         }
     }
 
@@ -494,3 +1010,47 @@ void RouteManager::notifyAvailable(void *cookie, CommTarget *target)
     }
 }
 
+CommSchedObject *RouteManager::select(const RouteResult& result)
+{
+    if (result.mCookie)
+        return ((RouteResultEntry *)result.mCookie)->select();
+
+    return result.mRequestObject;
+}
+
+bool RouteManager::available(const RouteResult& result)
+{
+    if (result.mCookie)
+        return ((RouteResultEntry *)result.mCookie)->available();
+
+    return result.mRequestObject != NULL;
+}
+
+void RouteManager::getPoolStats(void *cookie, std::vector<CommPoolStats>& stats)
+{
+    stats.clear();
+    if (cookie)
+        ((RouteResultEntry *)cookie)->getPoolStats(stats);
+}
+
+void RouteManager::getRouteStats(void *cookie, RouteStats *stats)
+{
+    if (cookie)
+        ((RouteResultEntry *)cookie)->getRouteStats(stats);
+}
+
+void RouteManager::getRouteStats(std::vector<RouteStats>& stats)
+{
+    stats.clear();
+    for (int i = 0; i < 1 << ROUTE_CACHE_SHARD_BITS; i++) {
+        std::lock_guard<std::mutex> lock(mShards[i].mutex);
+        RouteCacheTable *table = mShards[i].table;
+
+        for (size_t j = 0; j < table->size; j++) {
+            for (RouteCacheNode *node = table->buckets[j]; node; node = node->next) {
+                stats.emplace_back();
+                node->entry->getRouteStats(&stats.back());
+            }
+        }
+    }
+}
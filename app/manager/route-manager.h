@@ -6,17 +6,36 @@
 #define JARVIS_ROUTE_MANAGER_H
 
 #include <netdb.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include "endpoint-params.h"
-#include "../core/rb-tree.h"
+#include "../utils/epoch-guard.h"
 #include "../factory/connection.h"
 #include "../core/common-scheduler.h"
 
+typedef struct _RouteStats              RouteStats;
+typedef struct _RouteCacheShard         RouteCacheShard;
+
+/* RouteManager 里一条路由 (同一组地址和参数) 的统计 */
+struct _RouteStats
+{
+    uint64_t                            key;            // 路由 key 的哈希
+    int                                 transportType;
+    std::string                         hostname;       // 第一次用到这条路由的 host
+    size_t                              targets;        // 地址数
+    size_t                              breaking;       // 熔断中和半开的地址数
+    unsigned long                       requests;       // select() 分出去的请求
+    unsigned long                       rejected;       // 所有地址都熔断时直接失败的请求
+    unsigned long                       successes;
+    unsigned long                       failures;
+};
+
 class RouteManager
 {
 public:
@@ -35,37 +54,65 @@ public:
     class RouteTarget : public CommSchedTarget
     {
     public:
-        RouteTarget () : mState(0)
+        RouteTarget () : mState(0), mHttp2(false), mHttp2PriorKnowledge(false)
         {
 
         }
+
+        void setHttp2 (bool http2, bool priorKnowledge)
+        {
+            mHttp2 = http2;
+            mHttp2PriorKnowledge = priorKnowledge;
+        }
+
+    protected:
+        virtual int initSSL (SSL* ssl);
+
     private:
         virtual Connection* newConnection(int connectFd)
         {
             return new Connection;
         }
 
+        virtual CommMux* newMux (SSL* ssl);
+
     public:
         int                     mState;
+
+    private:
+        bool                    mHttp2;
+        bool                    mHttp2PriorKnowledge;
     };
 
 
 public:
+    /* 按 key 的哈希分片, 命中时只在 EpochGuard 里不加锁地查, 没有时才加分片的锁创建 */
     int get (TransportType type, const struct addrinfo* addrInfo, const std::string& otherInfo, const EndpointParams* endpointParams, const std::string& hostname, RouteResult& result);
-    RouteManager ()
-    {
-
-    }
-
+    RouteManager ();
     ~RouteManager();
 
+    /* 按窗口内的错误率和耗时熔断 target, 熔断一段时间后放探测请求, 恢复失败时熔断时长翻倍 */
     static void notifyAvailable (void* cookie, CommTarget* target);
     static void notifyUnavailable (void* cookie, CommTarget* target);
 
-private:
-    std::mutex                  mMutex;
-    RBRoot                      mCache;
+    /* 本次请求用的对象: 通常是 result.mRequestObject, 半开时可能是单个探测的 target, 所有 target 都熔断时返回 NULL */
+    static CommSchedObject* select (const RouteResult& result);
 
+    /* select() 是否会返回非空, 不占用半开 target 的探测机会 */
+    static bool available (const RouteResult& result);
+
+    /* RouteResult 里各个地址的连接池统计, 顺序和解析出的地址相同 */
+    static void getPoolStats (void* cookie, std::vector<CommPoolStats>& stats);
+
+    /* 一条路由的请求统计, cookie 是 RouteResult::mCookie */
+    static void getRouteStats (void* cookie, RouteStats* stats);
+
+    /* 所有路由的请求统计 */
+    void getRouteStats (std::vector<RouteStats>& stats);
+
+private:
+    RouteCacheShard*            mShards;
+    EpochGuard                  mEpoch;
 };
 
 
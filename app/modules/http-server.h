@@ -5,10 +5,12 @@
 #ifndef JARVIS_HTTP_SERVER_H
 #define JARVIS_HTTP_SERVER_H
 
+#include <string.h>
 #include <utility>
 
 #include "server.h"
 #include "../factory/task-factory.h"
+#include "../protocol/http/http2-mux.h"
 #include "../protocol/http/http-message.h"
 
 
@@ -23,6 +25,9 @@ static constexpr ServerParams HTTP_SERVER_PARAMS_DEFAULT =
                 .keepAliveTimeout       =   60 * 1000,
                 .requestSizeLimit       =   (size_t)-1,
                 .sslAcceptTimeout       =   10 * 1000,
+                .reusePort              =   false,
+                .reusePortCBPF          =   false,
+                .http2                  =   false,
         };
 
 template<>
@@ -47,5 +52,20 @@ inline CommSession *HttpServer::newSession(long long seq, CommConnection *conn)
     return task;
 }
 
+template<>
+inline CommMux *HttpServer::newMux(SSL *ssl)
+{
+    const unsigned char *alpn;
+    unsigned int len;
+
+    if (ssl) {
+        SSL_get0_alpn_selected(ssl, &alpn, &len);
+        if (len != strlen(HTTP2_ALPN_ID) || memcmp(alpn, HTTP2_ALPN_ID, len) != 0)
+            return nullptr;
+    }
+
+    return new protocol::Http2Mux(true, ssl != nullptr);
+}
+
 
 #endif //JARVIS_HTTP_SERVER_H
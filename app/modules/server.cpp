@@ -17,6 +17,7 @@
 #include "../manager/global.h"
 #include "../factory/connection.h"
 #include "../core/common-scheduler.h"
+#include "../protocol/http/http2-mux.h"
 
 #define PORT_STR_MAX	5
 
@@ -55,6 +56,22 @@ int ServerBase::sslCtxCallback(SSL *ssl, int *al, void *arg)
     return SSL_TLSEXT_ERR_OK;
 }
 
+/* 客户端提供 h2 时选 h2, 否则不协商, 按 HTTP/1.1 处理 */
+int ServerBase::alpnCallback(SSL *ssl, const unsigned char **out, unsigned char *outLen,
+                             const unsigned char *in, unsigned int inLen, void *arg)
+{
+    static const unsigned char protos[] = "\x02" HTTP2_ALPN_ID;
+
+    if (SSL_select_next_proto((unsigned char **)out, outLen, protos, sizeof (protos) - 1, in, inLen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+
+    /* h2 的记录层由 CommMux 在用户态处理, 不能交给 kTLS */
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_clear_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+    return SSL_TLSEXT_ERR_OK;
+}
+
 int ServerBase::initSslCtx(const char *certFile, const char *keyFile)
 {
     logv("");
@@ -68,6 +85,9 @@ int ServerBase::initSslCtx(const char *certFile, const char *keyFile)
         && SSL_CTX_use_PrivateKey_file(ssl_ctx, keyFile, SSL_FILETYPE_PEM) > 0
         && SSL_CTX_set_tlsext_servername_callback(ssl_ctx, sslCtxCallback) > 0
         && SSL_CTX_set_tlsext_servername_arg(ssl_ctx, this) > 0) {
+        if (mParams.http2)
+            SSL_CTX_set_alpn_select_cb(ssl_ctx, alpnCallback, NULL);
+
         setSSL(ssl_ctx, mParams.sslAcceptTimeout);
         return 0;
     }
@@ -93,6 +113,10 @@ int ServerBase::init(const struct sockaddr *bindAddr, socklen_t addrLen, const c
         return -1;
     }
 
+    setReusePort(mParams.reusePort, mParams.reusePortCBPF);
+    if (mParams.http2)
+        setMux(HTTP2_CLIENT_PREFACE, HTTP2_CLIENT_PREFACE_LEN);
+
     if (keyFile && certFile) {
         logv("init ssl context...");
         if (this->initSslCtx(certFile, keyFile) < 0) {
@@ -27,6 +27,9 @@ struct _ServerParams
     int                         keepAliveTimeout;
     size_t                      requestSizeLimit;
     int                         sslAcceptTimeout;
+    bool                        reusePort;                  // 每个 poll 线程一个 SO_REUSEPORT 监听 fd
+    bool                        reusePortCBPF;              // reusePort 时由内核按 CPU 选择监听 fd
+    bool                        http2;                      // SSL 用 ALPN 协商 h2, 明文接受直接以 h2c 开始的连接
 };
 
 static constexpr ServerParams SERVER_PARAMS_DEFAULT =
@@ -37,6 +40,9 @@ static constexpr ServerParams SERVER_PARAMS_DEFAULT =
             .keepAliveTimeout       = 60 * 1000,
             .requestSizeLimit       = (size_t) -1,
             .sslAcceptTimeout       = 10 * 1000,
+            .reusePort              = false,
+            .reusePortCBPF          = false,
+            .http2                  = false,
         };
 
 class ServerBase : protected CommService
@@ -163,6 +169,8 @@ private:
     int init(const struct sockaddr *bindAddr, socklen_t addrLen, const char *certFile, const char *keyFile);
     int initSslCtx(const char *certFile, const char *keyFile);
     static int sslCtxCallback(SSL *ssl, int *al, void *arg);
+    static int alpnCallback(SSL *ssl, const unsigned char **out, unsigned char *outLen,
+                            const unsigned char *in, unsigned int inLen, void *arg);
     virtual int createListenFd();
     virtual void handleUnbound();
 
@@ -200,6 +208,7 @@ public:
 
 protected:
     CommSession *newSession(long long seq, CommConnection *conn) override ;
+    CommMux *newMux(SSL *ssl) override { return nullptr; }
 
 protected:
     std::function<void (NetworkTask<REQ, RESP>*)>               mProcess;
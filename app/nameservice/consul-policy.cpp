@@ -0,0 +1,607 @@
+//
+// Created by dingjing on 8/31/22.
+//
+
+#include "consul-policy.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "../modules/server.h"
+#include "../utils/json-parser.h"
+#include "../utils/string-util.h"
+#include "../manager/facilities.h"
+#include "../factory/task-error.h"
+#include "../factory/task-factory.h"
+#include "../protocol/http/http-util.h"
+
+#define CONSUL_RETRY_MIN_MS         1000        // 查询失败后的重试间隔, 每次翻倍
+#define CONSUL_RETRY_MAX_MS         30000
+#define CONSUL_WAIT_MARGIN_MS       5000        // Consul 会在 wait 上再加最多 1/16 的随机时间
+
+class ConsulWatch
+{
+public:
+    ConsulWatch(int selection, const protocol::ConsulConfig& config)
+        : config(config), upstream(selection), index(0), retry(0), stopped(false)
+    {
+    }
+
+public:
+    std::string                             url;            // 不带 index 和 wait 的查询地址
+    protocol::ConsulConfig                  config;
+    UpstreamPolicy                          upstream;
+    long long                               index;          // 上次回复的 X-Consul-Index
+    int                                     retry;
+    bool                                    stopped;
+};
+
+class ConsulRouterTask : public RouterTask
+{
+public:
+    ConsulRouterTask(const NSParams *params, ConsulPolicy *policy, RouterCallback&& cb)
+        : RouterTask(std::move(cb)), mParams(*params), mPolicy(policy)
+    {
+    }
+
+protected:
+    void dispatch() override
+    {
+        if (mPolicy->route(&mParams, &mResult) >= 0) {
+            this->mState = TASK_STATE_SUCCESS;
+        } else {
+            this->mState = TASK_STATE_TASK_ERROR;
+            this->mError = TASK_ERROR_UPSTREAM_UNAVAILABLE;
+        }
+
+        this->subTaskDone();
+    }
+
+private:
+    NSParams                                mParams;
+    ConsulPolicy*                           mPolicy;
+};
+
+static void __json_quote(std::string& out, const std::string& str)
+{
+    char buf[8];
+
+    out += '"';
+    for (unsigned char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            out += buf;
+        } else {
+            out += (char)c;
+        }
+    }
+
+    out += '"';
+}
+
+static const char *__json_string(const json_object_t *obj, const char *name)
+{
+    const json_value_t *val = json_object_find(name, obj);
+
+    if (val && json_value_type(val) == JSON_VALUE_STRING)
+        return json_value_string(val);
+
+    return NULL;
+}
+
+static double __json_number(const json_object_t *obj, const char *name, double def)
+{
+    const json_value_t *val = json_object_find(name, obj);
+
+    if (val && json_value_type(val) == JSON_VALUE_NUMBER)
+        return json_value_number(val);
+
+    return def;
+}
+
+static const json_object_t *__json_object(const json_object_t *obj, const char *name)
+{
+    const json_value_t *val = json_object_find(name, obj);
+
+    if (val && json_value_type(val) == JSON_VALUE_OBJECT)
+        return json_value_object(val);
+
+    return NULL;
+}
+
+static std::string __health_url(const std::string& base, const std::string& name, const protocol::ConsulConfig& config)
+{
+    std::string url = base + "/v1/health/service/" + StringUtil::urlEncodeComponent(name);
+    char sep = '?';
+
+    auto append = [&url, &sep](const char *key, const std::string& value) {
+        url += sep;
+        url += key;
+        url += '=';
+        url += StringUtil::urlEncodeComponent(value);
+        sep = '&';
+    };
+
+    if (config.getPassing())
+        append("passing", "true");
+
+    if (!config.getDataCenter().empty())
+        append("dc", config.getDataCenter());
+
+    if (!config.getNearNode().empty())
+        append("near", config.getNearNode());
+
+    if (!config.getFilterExpr().empty())
+        append("filter", config.getFilterExpr());
+
+    return url;
+}
+
+static void __add_token(HttpTask *task, const protocol::ConsulConfig& config)
+{
+    std::string token = config.getToken();
+
+    if (!token.empty())
+        task->getReq()->addHeaderPair("X-Consul-Token", token);
+}
+
+/* 健康检查有 critical 的不要, 有 warning 的用 Weights.Warning 作权重 */
+static void __parse_entry(const json_value_t *entry, std::map<std::string, UpstreamServerParams>& servers)
+{
+    const json_object_t *obj, *service, *node, *weights;
+    const json_value_t *checks, *check;
+    UpstreamServerParams params;
+    const char *address;
+    const char *status;
+    bool warning = false;
+    std::string key;
+    double weight;
+    double port;
+
+    if (json_value_type(entry) != JSON_VALUE_OBJECT)
+        return;
+
+    obj = json_value_object(entry);
+    service = __json_object(obj, "Service");
+    if (!service)
+        return;
+
+    address = __json_string(service, "Address");
+    if (!address || *address == '\0') {
+        node = __json_object(obj, "Node");
+        address = node ? __json_string(node, "Address") : NULL;
+    }
+
+    port = __json_number(service, "Port", 0);
+    if (!address || *address == '\0' || port <= 0 || port > 65535)
+        return;
+
+    checks = json_object_find("Checks", obj);
+    if (checks && json_value_type(checks) == JSON_VALUE_ARRAY) {
+        json_array_for_each(check, json_value_array(checks)) {
+            if (json_value_type(check) != JSON_VALUE_OBJECT)
+                continue;
+
+            status = __json_string(json_value_object(check), "Status");
+            if (status && strcmp(status, "critical") == 0)
+                return;
+
+            if (status && strcmp(status, "warning") == 0)
+                warning = true;
+        }
+    }
+
+    weights = __json_object(service, "Weights");
+    weight = weights ? __json_number(weights, warning ? "Warning" : "Passing", 1) : 1;
+    if (weight < 1)
+        return;
+
+    params = UPSTREAM_SERVER_PARAMS_DEFAULT;
+    params.weight = (unsigned short)std::min(weight, 65535.0);
+    if (strchr(address, ':'))
+        key = std::string("[") + address + "]:" + std::to_string((int)port);
+    else
+        key = std::string(address) + ":" + std::to_string((int)port);
+
+    servers[key] = params;
+}
+
+/* 回复没变化时返回 0 不动快照, 出错返回 -1 */
+static int __parse_health(HttpTask *task, ConsulWatch *watch)
+{
+    protocol::HttpResponse *resp = task->getResp();
+    protocol::HttpHeaderCursor cursor(resp);
+    std::map<std::string, UpstreamServerParams> servers;
+    const char *code = resp->getStatusCode();
+    const json_value_t *entry;
+    json_value_t *root;
+    std::string value;
+    long long index;
+
+    if (!code || strcmp(code, "200") != 0 || !cursor.find("X-Consul-Index", value))
+        return -1;
+
+    index = strtoll(value.c_str(), NULL, 10);
+    if (index == watch->index)
+        return 0;
+
+    root = json_value_parse(protocol::HttpUtil::decodeChunkedBody(resp).c_str());
+    if (!root)
+        return -1;
+
+    if (json_value_type(root) != JSON_VALUE_ARRAY) {
+        json_value_destroy(root);
+        return -1;
+    }
+
+    json_array_for_each(entry, json_value_array(root))
+        __parse_entry(entry, servers);
+
+    json_value_destroy(root);
+    watch->upstream.setServers(servers);
+
+    /* index 变小说明 Consul 的数据重建过, 下次不带 index 从头查; 也不能是 0, 否则成了不阻塞的查询 */
+    if (index < watch->index)
+        watch->index = 0;
+    else
+        watch->index = index > 0 ? index : 1;
+
+    return 1;
+}
+
+static HttpTask *__create_watch_task(const std::shared_ptr<ConsulWatch>& watch);
+
+static void __watch_delay(const std::shared_ptr<ConsulWatch>& watch, SeriesWork *series, int delay)
+{
+    TimerTask *timer = TaskFactory::createTimerTask(delay / 1000, delay % 1000 * 1000000L, [watch](TimerTask *timer) {
+        if (!__atomic_load_n(&watch->stopped, __ATOMIC_ACQUIRE))
+            *seriesOf(timer) << __create_watch_task(watch);
+    });
+
+    *series << timer;
+}
+
+static void __watch_callback(HttpTask *task, const std::shared_ptr<ConsulWatch>& watch)
+{
+    int delay;
+
+    if (__atomic_load_n(&watch->stopped, __ATOMIC_ACQUIRE))
+        return;
+
+    if (task->getState() == TASK_STATE_SUCCESS && __parse_health(task, watch.get()) >= 0) {
+        watch->retry = 0;
+        *seriesOf(task) << __create_watch_task(watch);
+        return;
+    }
+
+    /* 出错时保留上次的地址, 退避后重查 */
+    delay = CONSUL_RETRY_MIN_MS << std::min(watch->retry, 5);
+    if (delay > CONSUL_RETRY_MAX_MS)
+        delay = CONSUL_RETRY_MAX_MS;
+
+    watch->retry++;
+    __watch_delay(watch, seriesOf(task), delay);
+}
+
+static HttpTask *__create_watch_task(const std::shared_ptr<ConsulWatch>& watch)
+{
+    int wait = watch->config.getWaitTTL();
+    std::string url = watch->url;
+    HttpTask *task;
+
+    if (watch->index > 0) {
+        url += url.find('?') == std::string::npos ? '?' : '&';
+        url += "index=" + std::to_string(watch->index) + "&wait=" + std::to_string(wait) + "ms";
+    }
+
+    task = TaskFactory::createHttpTask(url, 0, 0, [watch](HttpTask *task, void *) {
+        __watch_callback(task, watch);
+    }, nullptr);
+
+    __add_token(task, watch->config);
+    task->setWatchTimeout(wait + wait / 16 + CONSUL_WAIT_MARGIN_MS);
+    return task;
+}
+
+/* 同步发一个 PUT, 回复 200 才算成功 */
+static int __consul_put(const std::string& url, const protocol::ConsulConfig& config, const std::string& body)
+{
+    Facilities::WaitGroup wg(1);
+    std::string code;
+    int state = TASK_STATE_UNDEFINED;
+    int error = 0;
+    HttpTask *task;
+
+    task = TaskFactory::createHttpTask(url, 0, 0, [&](HttpTask *task, void *) {
+        state = task->getState();
+        error = task->getError();
+        if (state == TASK_STATE_SUCCESS)
+            task->getResp()->getStatusCode(code);
+
+        wg.done();
+    }, nullptr);
+
+    task->getReq()->setMethod("PUT");
+    task->getReq()->addHeaderPair("Content-Type", "application/json");
+    __add_token(task, config);
+    if (!body.empty())
+        task->getReq()->appendOutputBody(body);
+
+    task->start();
+    wg.wait();
+
+    if (state != TASK_STATE_SUCCESS) {
+        errno = state == TASK_STATE_SYS_ERROR ? error : EIO;
+        return -1;
+    }
+
+    if (code != "200") {
+        errno = code == "403" ? EACCES : EPROTO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static std::string __register_body(const protocol::ConsulService& service, const std::string& address, unsigned short port,
+                                   const protocol::ConsulConfig& config)
+{
+    const std::pair<const char*, const protocol::ConsulAddress*> tagged[] = {
+            { "lan",        &service.lan },
+            { "lan_ipv4",   &service.lanIpv4 },
+            { "lan_ipv6",   &service.lanIpv6 },
+            { "virtual",    &service.virtualAddress },
+            { "wan",        &service.wan },
+            { "wan_ipv4",   &service.wanIpv4 },
+            { "wan_ipv6",   &service.wanIpv6 },
+    };
+    std::string body = "{\"ID\":";
+    const char *sep;
+
+    __json_quote(body, service.serviceID.empty() ? service.serviceName : service.serviceID);
+    body += ",\"Name\":";
+    __json_quote(body, service.serviceName);
+    if (!service.serviceNameSpace.empty()) {
+        body += ",\"Namespace\":";
+        __json_quote(body, service.serviceNameSpace);
+    }
+
+    body += ",\"Tags\":[";
+    sep = "";
+    for (auto& tag : service.tags) {
+        body += sep;
+        __json_quote(body, tag);
+        sep = ",";
+    }
+
+    body += "]";
+    if (!address.empty()) {
+        body += ",\"Address\":";
+        __json_quote(body, address);
+    }
+
+    body += ",\"Port\":" + std::to_string(port);
+    body += ",\"TaggedAddresses\":{";
+    sep = "";
+    for (auto& t : tagged) {
+        if (t.second->first.empty())
+            continue;
+
+        body += sep;
+        __json_quote(body, t.first);
+        body += ":{\"Address\":";
+        __json_quote(body, t.second->first);
+        body += ",\"Port\":" + std::to_string(t.second->second) + "}";
+        sep = ",";
+    }
+
+    body += "},\"Meta\":{";
+    sep = "";
+    for (auto& kv : service.meta) {
+        body += sep;
+        __json_quote(body, kv.first);
+        body += ':';
+        __json_quote(body, kv.second);
+        sep = ",";
+    }
+
+    body += "},\"EnableTagOverride\":";
+    body += service.tagOverride ? "true" : "false";
+
+    if (config.getHealthCheck()) {
+        body += ",\"Check\":{\"Name\":";
+        __json_quote(body, config.getCheckName().empty() ? "service:" + service.serviceName : config.getCheckName());
+        body += ",\"Notes\":";
+        __json_quote(body, config.getCheckNotes());
+        if (!config.getCheckHttpURL().empty()) {
+            body += ",\"HTTP\":";
+            __json_quote(body, config.getCheckHttpURL());
+            body += ",\"Method\":";
+            __json_quote(body, config.getCheckHttpMethod());
+            body += ",\"Body\":";
+            __json_quote(body, config.getHttpBody());
+            body += ",\"Header\":{";
+            sep = "";
+            for (auto& kv : *config.getHttpHeaders()) {
+                body += sep;
+                __json_quote(body, kv.first);
+                body += ":[";
+                for (size_t i = 0; i < kv.second.size(); i++) {
+                    if (i > 0)
+                        body += ',';
+
+                    __json_quote(body, kv.second[i]);
+                }
+
+                body += ']';
+                sep = ",";
+            }
+
+            body += '}';
+        } else if (!config.getCheckTcp().empty()) {
+            body += ",\"TCP\":";
+            __json_quote(body, config.getCheckTcp());
+        }
+
+        body += ",\"Interval\":\"" + std::to_string(config.getCheckInterval()) + "ms\"";
+        body += ",\"Timeout\":\"" + std::to_string(config.getCheckTimeout()) + "ms\"";
+        body += ",\"DeregisterCriticalServiceAfter\":\"" + std::to_string(config.getAutoDeregisterTime()) + "ms\"";
+        body += ",\"Status\":";
+        __json_quote(body, config.getInitialStatus());
+        body += ",\"SuccessBeforePassing\":" + std::to_string(config.getSuccessTimes());
+        body += ",\"FailuresBeforeCritical\":" + std::to_string(config.getFailureTimes());
+        body += '}';
+    }
+
+    body += '}';
+    return body;
+}
+
+ConsulPolicy::ConsulPolicy(const std::string& url, const protocol::ConsulConfig& config)
+    : mUrl(url), mConfig(config), mServices(new std::map<std::string, std::shared_ptr<ConsulWatch>>)
+{
+    while (!mUrl.empty() && mUrl.back() == '/')
+        mUrl.pop_back();
+}
+
+/* 正在等回复的查询回来时看到 stopped 就结束, 不再用到 policy */
+ConsulPolicy::~ConsulPolicy()
+{
+    for (auto& kv : *mServices)
+        __atomic_store_n(&kv.second->stopped, true, __ATOMIC_RELEASE);
+
+    delete mServices;
+}
+
+int ConsulPolicy::update(std::map<std::string, std::shared_ptr<ConsulWatch>> *services)
+{
+    auto *old = mServices;
+
+    __atomic_store_n(&mServices, services, __ATOMIC_SEQ_CST);
+    mEpoch.synchronize();
+    delete old;
+    return 0;
+}
+
+int ConsulPolicy::watchService(const std::string& serviceName, int selection)
+{
+    auto watch = std::make_shared<ConsulWatch>(selection, mConfig);
+
+    watch->url = __health_url(mUrl, serviceName, mConfig);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mServices->count(serviceName)) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    auto *services = new std::map<std::string, std::shared_ptr<ConsulWatch>>(*mServices);
+
+    services->emplace(serviceName, watch);
+    update(services);
+    __create_watch_task(watch)->start();
+    return 0;
+}
+
+int ConsulPolicy::unwatchService(const std::string& serviceName)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mServices->find(serviceName);
+
+    if (it == mServices->end()) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    std::shared_ptr<ConsulWatch> watch = it->second;
+    auto *services = new std::map<std::string, std::shared_ptr<ConsulWatch>>(*mServices);
+
+    services->erase(serviceName);
+    update(services);
+    __atomic_store_n(&watch->stopped, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int ConsulPolicy::registerServer(const ServerBase *server, const protocol::ConsulService& service)
+{
+    std::string address = service.serviceAddress.first;
+    unsigned short port = service.serviceAddress.second;
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof ss;
+    char buf[INET6_ADDRSTRLEN];
+    std::string url;
+
+    if (port == 0 || address.empty()) {
+        if (server->get_listen_addr((struct sockaddr *)&ss, &len) < 0)
+            return -1;
+
+        /* 监听在任意地址上时不填, Consul 用 agent 所在节点的地址 */
+        if (ss.ss_family == AF_INET) {
+            auto *sin = (struct sockaddr_in *)&ss;
+
+            if (port == 0)
+                port = ntohs(sin->sin_port);
+
+            if (address.empty() && sin->sin_addr.s_addr != htonl(INADDR_ANY))
+                address = inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof buf);
+        } else if (ss.ss_family == AF_INET6) {
+            auto *sin6 = (struct sockaddr_in6 *)&ss;
+
+            if (port == 0)
+                port = ntohs(sin6->sin6_port);
+
+            if (address.empty() && !IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr))
+                address = inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof buf);
+        }
+    }
+
+    if (port == 0 || service.serviceName.empty()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    url = mUrl + "/v1/agent/service/register";
+    if (mConfig.getReplaceChecks())
+        url += "?replace-existing-checks=true";
+
+    return __consul_put(url, mConfig, __register_body(service, address, port, mConfig));
+}
+
+int ConsulPolicy::deregisterServer(const std::string& serviceId)
+{
+    return __consul_put(mUrl + "/v1/agent/service/deregister/" + StringUtil::urlEncodeComponent(serviceId), mConfig, "");
+}
+
+int ConsulPolicy::route(const NSParams *params, RouteManager::RouteResult *result)
+{
+    const char *host = params->mUri.host;
+    unsigned int epoch;
+    int ret = -1;
+
+    epoch = mEpoch.readLock();
+    auto *services = __atomic_load_n(&mServices, __ATOMIC_SEQ_CST);
+    auto it = services->find(host ? host : "");
+
+    if (it != services->end())
+        ret = it->second->upstream.route(params, result);
+
+    mEpoch.readUnlock(epoch);
+    return ret;
+}
+
+RouterTask *ConsulPolicy::createRouterTask(const NSParams *params, RouterCallback callback, void *udata)
+{
+    return new ConsulRouterTask(params, this, std::move(callback));
+}
@@ -0,0 +1,60 @@
+//
+// Created by dingjing on 8/31/22.
+//
+
+#ifndef JARVIS_CONSUL_POLICY_H
+#define JARVIS_CONSUL_POLICY_H
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+
+#include "name-service.h"
+#include "upstream-policy.h"
+#include "../utils/epoch-guard.h"
+#include "../protocol/consul-data-types.h"
+
+class ServerBase;
+class ConsulWatch;
+
+/**
+ * @brief
+ *  用 Consul 做服务发现: watchService(name) 之后后台一直对 /v1/health/service/<name> 做阻塞查询
+ *  (带上次的 X-Consul-Index), 结果有变化时换掉这个服务的地址快照. 再用
+ *  Global::getNameService()->addPolicy(name, policy) 注册后, host 为 name 的请求只读内存里的快照,
+ *  选择和熔断同 UpstreamPolicy. 查询失败时退避重试, 一直用最后一次拿到的地址.
+ *  registerServer()/deregisterServer() 把本进程的 HttpServer 注册到 Consul agent 上, 是阻塞调用,
+ *  不要在任务的回调里用
+ */
+class ConsulPolicy : public NSPolicy
+{
+public:
+    /* url: Consul agent 的地址, 如 "http://127.0.0.1:8500" */
+    ConsulPolicy(const std::string& url, const protocol::ConsulConfig& config);
+    ~ConsulPolicy() override;
+
+    /* 第一次查询回来之前, 这个服务的请求以 TASK_ERROR_UPSTREAM_UNAVAILABLE 失败 */
+    int watchService(const std::string& serviceName, int selection);
+    int unwatchService(const std::string& serviceName);
+
+    /* service 里端口为 0 时用 server 监听的端口, 健康检查按 config 里的 check 配置 */
+    int registerServer(const ServerBase* server, const protocol::ConsulService& service);
+    int deregisterServer(const std::string& serviceId);
+
+    RouterTask* createRouterTask(const NSParams* params, RouterCallback callback, void* udata) override;
+
+private:
+    int route(const NSParams* params, RouteManager::RouteResult* result);
+    int update(std::map<std::string, std::shared_ptr<ConsulWatch>>* services);
+
+private:
+    std::string                                             mUrl;
+    protocol::ConsulConfig                                  mConfig;
+    std::map<std::string, std::shared_ptr<ConsulWatch>>*    mServices;
+    EpochGuard                                              mEpoch;
+    std::mutex                                              mMutex;
+
+    friend class ConsulRouterTask;
+};
+
+#endif //JARVIS_CONSUL_POLICY_H
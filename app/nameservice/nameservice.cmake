@@ -5,4 +5,10 @@ file(GLOB NAME_SERVICE_SRC
         ${CMAKE_SOURCE_DIR}/app/nameservice/dns-resolver.h
         ${CMAKE_SOURCE_DIR}/app/nameservice/dns-resolver.cpp
 
+        ${CMAKE_SOURCE_DIR}/app/nameservice/upstream-policy.h
+        ${CMAKE_SOURCE_DIR}/app/nameservice/upstream-policy.cpp
+
+        ${CMAKE_SOURCE_DIR}/app/nameservice/consul-policy.h
+        ${CMAKE_SOURCE_DIR}/app/nameservice/consul-policy.cpp
+
         )
\ No newline at end of file
@@ -0,0 +1,485 @@
+//
+// Created by dingjing on 8/30/22.
+//
+
+#include "upstream-policy.h"
+
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "../manager/global.h"
+#include "../utils/md5-util.h"
+#include "../factory/task-error.h"
+
+#define UPSTREAM_SCHEDULE_MAX       4096        // 平滑加权轮询预先排好的顺序的最大长度, 总权重更大时按权重区间轮询
+#define UPSTREAM_KETAMA_POINTS      160         // 一致性哈希里每个地址平均的虚拟节点数
+
+typedef struct _UpstreamServer              UpstreamServer;
+typedef struct _UpstreamGroup               UpstreamGroup;
+
+struct _UpstreamServer
+{
+    std::string                             address;
+    std::string                             host;
+    UpstreamServerParams                    params;
+    struct addrinfo*                        addrInfo;
+
+    ~_UpstreamServer()
+    {
+        if (addrInfo)
+            freeaddrinfo(addrInfo);
+    }
+};
+
+struct _UpstreamGroup
+{
+    std::vector<UpstreamServer*>            servers;
+    std::vector<unsigned int>               weights;        // 权重的前缀和
+    std::vector<unsigned short>             schedule;       // 平滑加权轮询的顺序
+    std::vector<std::pair<uint32_t, unsigned int>> ring;    // 一致性哈希环, 按哈希值排序
+};
+
+/* 创建后不再修改, 读者在 EpochGuard 的保护下使用 */
+struct _UpstreamSnapshot
+{
+    std::vector<std::shared_ptr<UpstreamServer>>    all;
+    UpstreamGroup                           main;
+    UpstreamGroup                           backup;
+};
+
+class UpstreamRouterTask : public RouterTask
+{
+public:
+    UpstreamRouterTask(const NSParams *params, UpstreamPolicy *policy, RouterCallback&& cb)
+        : RouterTask(std::move(cb)), mParams(*params), mPolicy(policy)
+    {
+    }
+
+protected:
+    void dispatch() override
+    {
+        if (mPolicy->route(&mParams, &mResult) >= 0) {
+            this->mState = TASK_STATE_SUCCESS;
+        } else {
+            this->mState = TASK_STATE_TASK_ERROR;
+            this->mError = TASK_ERROR_UPSTREAM_UNAVAILABLE;
+        }
+
+        this->subTaskDone();
+    }
+
+private:
+    NSParams                                mParams;
+    UpstreamPolicy*                         mPolicy;
+};
+
+static inline uint32_t __upstream_rand()
+{
+    static thread_local uint64_t seed;
+    uint64_t x = seed;
+
+    if (x == 0) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        x = ((uint64_t)(uintptr_t)&seed ^ (uint64_t)ts.tv_nsec) | 1;
+    }
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    seed = x;
+    return (uint32_t)(x >> 32);
+}
+
+/* FNV-1a, 再打散一下, 让 key 在环上分布均匀 */
+static unsigned int __default_hash(const char *path, const char *query, const char *fragment)
+{
+    uint32_t h = 2166136261u;
+    const char *p;
+
+    for (p = path ? path : ""; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+
+    if (query) {
+        h = (h ^ '?') * 16777619u;
+        for (p = query; *p; p++)
+            h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int __parse_address(const std::string& address, std::string& host, std::string& port)
+{
+    size_t pos;
+
+    if (!address.empty() && address[0] == '[') {
+        pos = address.find(']');
+        if (pos == std::string::npos || pos + 1 >= address.size() || address[pos + 1] != ':')
+            return -1;
+
+        host = address.substr(1, pos - 1);
+        port = address.substr(pos + 2);
+    } else {
+        pos = address.rfind(':');
+        if (pos == std::string::npos)
+            return -1;
+
+        host = address.substr(0, pos);
+        port = address.substr(pos + 1);
+    }
+
+    return host.empty() || port.empty() ? -1 : 0;
+}
+
+static unsigned int __gcd(unsigned int a, unsigned int b)
+{
+    while (b) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/* 按平滑加权轮询排出一轮的顺序, 权重先约掉公约数 */
+static void __build_schedule(UpstreamGroup *group)
+{
+    size_t n = group->servers.size();
+    std::vector<long> current(n, 0);
+    std::vector<unsigned int> weight(n);
+    unsigned int divisor = 0;
+    unsigned int total = 0;
+    size_t i, best;
+
+    for (i = 0; i < n; i++)
+        divisor = __gcd(divisor, group->servers[i]->params.weight);
+
+    for (i = 0; i < n; i++) {
+        weight[i] = group->servers[i]->params.weight / divisor;
+        total += weight[i];
+    }
+
+    if (total > UPSTREAM_SCHEDULE_MAX)
+        return;
+
+    group->schedule.reserve(total);
+    while (group->schedule.size() < total) {
+        best = 0;
+        for (i = 0; i < n; i++) {
+            current[i] += weight[i];
+            if (current[i] > current[best])
+                best = i;
+        }
+
+        current[best] -= total;
+        group->schedule.push_back((unsigned short)best);
+    }
+}
+
+/* ketama: 每个地址按权重分到虚拟节点, 每个 md5 出四个点 */
+static void __build_ring(UpstreamGroup *group)
+{
+    size_t n = group->servers.size();
+    unsigned int total = group->weights.back();
+    std::pair<uint64_t, uint64_t> digest;
+    size_t i, j, points;
+
+    for (i = 0; i < n; i++) {
+        points = (size_t)UPSTREAM_KETAMA_POINTS * n * group->servers[i]->params.weight / total;
+        points = std::max<size_t>(points / 4, 1);
+        for (j = 0; j < points; j++) {
+            digest = MD5Util::md5Integer32(group->servers[i]->address + "-" + std::to_string(j));
+            group->ring.emplace_back((uint32_t)digest.first, i);
+            group->ring.emplace_back((uint32_t)(digest.first >> 32), i);
+            group->ring.emplace_back((uint32_t)digest.second, i);
+            group->ring.emplace_back((uint32_t)(digest.second >> 32), i);
+        }
+    }
+
+    std::sort(group->ring.begin(), group->ring.end());
+}
+
+static void __build_group(UpstreamGroup *group, int selection)
+{
+    unsigned int total = 0;
+
+    if (group->servers.empty())
+        return;
+
+    for (auto *server : group->servers) {
+        total += server->params.weight;
+        group->weights.push_back(total);
+    }
+
+    if (selection == UPSTREAM_WEIGHTED_ROUND_ROBIN)
+        __build_schedule(group);
+    else if (selection == UPSTREAM_CONSISTENT_HASH)
+        __build_ring(group);
+}
+
+static size_t __weighted_index(const UpstreamGroup *group, unsigned int key)
+{
+    unsigned int value = key % group->weights.back();
+
+    return std::upper_bound(group->weights.begin(), group->weights.end(), value) - group->weights.begin();
+}
+
+static size_t __ring_position(const UpstreamGroup *group, unsigned int key)
+{
+    auto it = std::lower_bound(group->ring.begin(), group->ring.end(), std::make_pair((uint32_t)key, 0u));
+
+    return it == group->ring.end() ? 0 : it - group->ring.begin();
+}
+
+static int __server_route(UpstreamServer *server, const NSParams *params, RouteManager::RouteResult *result)
+{
+    RouteManager *route_manager = Global::getRouteManager();
+
+    if (route_manager->get(params->mType, server->addrInfo, params->mInfo, &server->params.endpointParams, server->host, *result) < 0)
+        return -1;
+
+    return RouteManager::available(*result) ? 0 : -1;
+}
+
+/* 先按策略选一个, 不可用时轮询依次试其余的, 一致性哈希沿环往后找 */
+static int __group_route(const UpstreamGroup *group, int selection, unsigned int key, const NSParams *params, RouteManager::RouteResult *result)
+{
+    size_t n = group->servers.size();
+    std::vector<bool> tried;
+    size_t first, index, pos, i;
+
+    if (n == 0)
+        return -1;
+
+    if (selection == UPSTREAM_CONSISTENT_HASH) {
+        pos = __ring_position(group, key);
+        first = group->ring[pos].second;
+        if (__server_route(group->servers[first], params, result) >= 0)
+            return 0;
+
+        tried.resize(n);
+        tried[first] = true;
+        for (i = 1; i < group->ring.size(); i++) {
+            index = group->ring[(pos + i) % group->ring.size()].second;
+            if (!tried[index]) {
+                tried[index] = true;
+                if (__server_route(group->servers[index], params, result) >= 0)
+                    return 0;
+            }
+        }
+
+        return -1;
+    }
+
+    if (selection == UPSTREAM_WEIGHTED_ROUND_ROBIN && !group->schedule.empty())
+        first = group->schedule[key % group->schedule.size()];
+    else
+        first = __weighted_index(group, key);
+
+    for (i = 0; i < n; i++) {
+        if (__server_route(group->servers[(first + i) % n], params, result) >= 0)
+            return 0;
+    }
+
+    return -1;
+}
+
+static bool __params_equal(const UpstreamServerParams *a, const UpstreamServerParams *b)
+{
+    return a->weight == b->weight && a->backup == b->backup &&
+           endpoint_params_equal(&a->endpointParams, &b->endpointParams);
+}
+
+static std::shared_ptr<UpstreamServer> __create_server(const std::string& address, const UpstreamServerParams *params)
+{
+    struct addrinfo hints = { };
+    struct addrinfo *addrInfo;
+    std::string host, port;
+    int ret;
+
+    if (params->weight == 0 || __parse_address(address, host, port) < 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    hints.ai_flags = AI_NUMERICSERV;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrInfo);
+    if (ret != 0) {
+        if (ret != EAI_SYSTEM)
+            errno = ENOENT;
+
+        return nullptr;
+    }
+
+    auto server = std::make_shared<UpstreamServer>();
+
+    server->address = address;
+    server->host = host;
+    server->params = *params;
+    server->addrInfo = addrInfo;
+    return server;
+}
+
+UpstreamPolicy::UpstreamPolicy(int selection) : UpstreamPolicy(selection, nullptr)
+{
+}
+
+UpstreamPolicy::UpstreamPolicy(int selection, UpstreamHashFunction hash)
+    : mSelection(selection), mHash(std::move(hash)), mSeq(0), mSnapshot(NULL)
+{
+}
+
+UpstreamPolicy::~UpstreamPolicy()
+{
+    delete mSnapshot;
+}
+
+int UpstreamPolicy::update(UpstreamSnapshot *snapshot)
+{
+    UpstreamSnapshot *old = mSnapshot;
+
+    for (auto& server : snapshot->all) {
+        if (server->params.backup)
+            snapshot->backup.servers.push_back(server.get());
+        else
+            snapshot->main.servers.push_back(server.get());
+    }
+
+    __build_group(&snapshot->main, mSelection);
+    __build_group(&snapshot->backup, mSelection);
+    __atomic_store_n(&mSnapshot, snapshot, __ATOMIC_SEQ_CST);
+    mEpoch.synchronize();
+    delete old;
+    return 0;
+}
+
+int UpstreamPolicy::addServer(const std::string& address, const UpstreamServerParams *params)
+{
+    std::shared_ptr<UpstreamServer> server = __create_server(address, params);
+
+    if (!server)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto *snapshot = new UpstreamSnapshot;
+
+    if (mSnapshot)
+        snapshot->all = mSnapshot->all;
+
+    snapshot->all.push_back(std::move(server));
+    return update(snapshot);
+}
+
+int UpstreamPolicy::removeServer(const std::string& address)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto *snapshot = new UpstreamSnapshot;
+
+    if (mSnapshot) {
+        for (auto& server : mSnapshot->all) {
+            if (server->address != address)
+                snapshot->all.push_back(server);
+        }
+    }
+
+    if (!mSnapshot || snapshot->all.size() == mSnapshot->all.size()) {
+        delete snapshot;
+        errno = ENOENT;
+        return -1;
+    }
+
+    return update(snapshot);
+}
+
+int UpstreamPolicy::setServers(const std::map<std::string, UpstreamServerParams>& servers)
+{
+    std::vector<std::shared_ptr<UpstreamServer>> all;
+    std::map<std::string, std::shared_ptr<UpstreamServer>> old;
+    int ret = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if (mSnapshot) {
+            for (auto& server : mSnapshot->all)
+                old.emplace(server->address, server);
+        }
+    }
+
+    /* 解析不占着锁, 没变的地址直接共用旧的对象 */
+    for (auto& kv : servers) {
+        auto it = old.find(kv.first);
+
+        if (it != old.end() && __params_equal(&it->second->params, &kv.second)) {
+            all.push_back(it->second);
+            continue;
+        }
+
+        std::shared_ptr<UpstreamServer> server = __create_server(kv.first, &kv.second);
+
+        if (!server) {
+            ret = -1;
+            continue;
+        }
+
+        all.push_back(std::move(server));
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto *snapshot = new UpstreamSnapshot;
+
+    snapshot->all = std::move(all);
+    update(snapshot);
+    return ret;
+}
+
+int UpstreamPolicy::route(const NSParams *params, RouteManager::RouteResult *result)
+{
+    const ParsedURI& uri = params->mUri;
+    UpstreamSnapshot *snapshot;
+    unsigned int epoch;
+    unsigned int key;
+    int ret = -1;
+
+    if (mSelection == UPSTREAM_CONSISTENT_HASH)
+        key = mHash ? mHash(uri.path, uri.query, uri.fragment) : __default_hash(uri.path, uri.query, uri.fragment);
+    else if (mSelection == UPSTREAM_WEIGHTED_ROUND_ROBIN)
+        key = __atomic_fetch_add(&mSeq, 1, __ATOMIC_RELAXED);
+    else
+        key = __upstream_rand();
+
+    epoch = mEpoch.readLock();
+    snapshot = __atomic_load_n(&mSnapshot, __ATOMIC_SEQ_CST);
+    if (snapshot) {
+        ret = __group_route(&snapshot->main, mSelection, key, params, result);
+        if (ret < 0)
+            ret = __group_route(&snapshot->backup, mSelection, key, params, result);
+    }
+
+    mEpoch.readUnlock(epoch);
+    return ret;
+}
+
+RouterTask *UpstreamPolicy::createRouterTask(const NSParams *params, RouterCallback callback, void *udata)
+{
+    return new UpstreamRouterTask(params, this, std::move(callback));
+}
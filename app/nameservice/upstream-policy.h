@@ -0,0 +1,78 @@
+//
+// Created by dingjing on 8/30/22.
+//
+
+#ifndef JARVIS_UPSTREAM_POLICY_H
+#define JARVIS_UPSTREAM_POLICY_H
+#include <map>
+#include <mutex>
+#include <string>
+#include <functional>
+
+#include "name-service.h"
+#include "../utils/epoch-guard.h"
+#include "../manager/endpoint-params.h"
+
+#define UPSTREAM_WEIGHTED_ROUND_ROBIN       0       /* 平滑加权轮询 */
+#define UPSTREAM_WEIGHTED_RANDOM            1       /* 加权随机 */
+#define UPSTREAM_CONSISTENT_HASH            2       /* ketama 一致性哈希, 按请求的 key 选 */
+
+typedef struct _UpstreamServerParams        UpstreamServerParams;
+typedef struct _UpstreamSnapshot            UpstreamSnapshot;
+
+struct _UpstreamServerParams
+{
+    EndpointParams                  endpointParams;
+    unsigned short                  weight;             // 大于 0
+    bool                            backup;             // 主地址都熔断时才用
+};
+
+static constexpr UpstreamServerParams UPSTREAM_SERVER_PARAMS_DEFAULT =
+        {
+            .endpointParams         = ENDPOINT_PARAMS_DEFAULT,
+            .weight                 = 1,
+            .backup                 = false,
+        };
+
+/* 一致性哈希的请求 key, 默认用 URI 的 path 和 query */
+using UpstreamHashFunction = std::function<unsigned int (const char* path, const char* query, const char* fragment)>;
+
+/**
+ * @brief
+ *  命名的 upstream: 用 Global::getNameService()->addPolicy(name, policy) 注册后, host 为 name 的请求
+ *  (如 http://prices-api/v1/...) 在这里的地址中选择, 不查 DNS. 选中的地址仍按 RouteManager 熔断,
+ *  主地址都熔断时用备用地址, 都不可用时请求以 TASK_ERROR_UPSTREAM_UNAVAILABLE 失败.
+ *  地址列表是不可变的快照, 请求不加锁读, 增删地址时换新快照. 删除 policy 时不能还有它的请求
+ */
+class UpstreamPolicy : public NSPolicy
+{
+public:
+    explicit UpstreamPolicy(int selection);
+    UpstreamPolicy(int selection, UpstreamHashFunction hash);
+    ~UpstreamPolicy() override;
+
+    /* address: "host:port" 或 "[ipv6]:port", host 在添加时解析一次 */
+    int addServer(const std::string& address, const UpstreamServerParams* params);
+    int removeServer(const std::string& address);
+    /* 整体换掉地址列表, 只换一次快照. 地址和参数都没变的不重新解析, 解析失败的跳过并返回 -1 */
+    int setServers(const std::map<std::string, UpstreamServerParams>& servers);
+
+    RouterTask* createRouterTask(const NSParams* params, RouterCallback callback, void* udata) override;
+
+private:
+    int route(const NSParams* params, RouteManager::RouteResult* result);
+    int update(UpstreamSnapshot* snapshot);
+
+private:
+    int                             mSelection;
+    UpstreamHashFunction            mHash;
+    unsigned int                    mSeq;
+    UpstreamSnapshot*               mSnapshot;
+    EpochGuard                      mEpoch;
+    std::mutex                      mMutex;
+
+    friend class UpstreamRouterTask;
+    friend class ConsulPolicy;
+};
+
+#endif //JARVIS_UPSTREAM_POLICY_H
@@ -24,7 +24,7 @@ protocol::ConsulConfig::ConsulConfig()
 
 protocol::ConsulConfig::~ConsulConfig()
 {
-    if (--mRef == 0) {
+    if (--*mRef == 0) {
         delete mPtr;
         delete mRef;
     }
@@ -44,7 +44,7 @@ protocol::ConsulConfig::ConsulConfig(const protocol::ConsulConfig &copy)
 {
     mPtr = copy.mPtr;
     mRef = copy.mRef;
-    ++mRef;
+    ++*mRef;
 }
 
 protocol::ConsulConfig &protocol::ConsulConfig::operator=(protocol::ConsulConfig &&move)
@@ -67,7 +67,7 @@ protocol::ConsulConfig &protocol::ConsulConfig::operator=(protocol::ConsulConfig
         this->~ConsulConfig();
         mPtr = copy.mPtr;
         mRef = copy.mRef;
-        ++mRef;
+        ++*mRef;
     }
 
     return *this;
@@ -242,7 +242,7 @@ void protocol::ConsulConfig::setCheckTcp(const std::string &tcpAddr)
 
 std::string protocol::ConsulConfig::getCheckTcp() const
 {
-    return mPtr->checkCfg.notes;
+    return mPtr->checkCfg.tcpAddress;
 }
 
 void protocol::ConsulConfig::setInitialStatus(const std::string& initialStatus)
@@ -0,0 +1,557 @@
+//
+// Created by dingjing on 8/27/22.
+//
+
+#include "hpack.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+struct _HpackEntry
+{
+    size_t                      nameLen;
+    size_t                      valueLen;
+    char                        data[];                 // 名字后面紧跟着值
+};
+
+typedef struct _HpackStaticEntry        HpackStaticEntry;
+struct _HpackStaticEntry
+{
+    const char*                 name;
+    const char*                 value;
+};
+
+#define HPACK_STATIC_COUNT      61
+#define HPACK_ENTRY_OVERHEAD    32
+
+static const HpackStaticEntry _hpack_static_table[HPACK_STATIC_COUNT] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/* RFC 7541 附录 B, 最后一个是 EOS */
+static const uint32_t _hpack_huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t _hpack_huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* 范式 Huffman 码: 长度为 n 的码从 first[n] 开始连续分配, 对应 symbols[offset[n]] 开始的 count[n] 个符号 */
+static const uint32_t _hpack_huffman_first[31] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c, 0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+    0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8, 0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc,
+};
+
+static const uint16_t _hpack_huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t _hpack_huffman_offset[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253,
+};
+
+static const uint16_t _hpack_huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+#define HPACK_EOS               256
+#define HPACK_HUFFMAN_LEN_MAX   30
+
+void hpack_decoder_init(size_t maxTableSize, HpackDecoder *decoder)
+{
+    decoder->entries = NULL;
+    decoder->capacity = 0;
+    decoder->first = 0;
+    decoder->count = 0;
+    decoder->tableSize = 0;
+    decoder->maxTableSize = maxTableSize;
+    decoder->settingsTableSize = maxTableSize;
+    decoder->buf = NULL;
+    decoder->bufSize = 0;
+}
+
+void hpack_decoder_deinit(HpackDecoder *decoder)
+{
+    size_t i;
+
+    for (i = 0; i < decoder->count; i++)
+        free(decoder->entries[(decoder->first + i) % decoder->capacity]);
+
+    free(decoder->entries);
+    free(decoder->buf);
+}
+
+static void _hpack_evict(size_t size, HpackDecoder *decoder)
+{
+    HpackEntry *entry;
+
+    while (decoder->count > 0 && decoder->tableSize + size > decoder->maxTableSize) {
+        decoder->count--;
+        entry = decoder->entries[(decoder->first + decoder->count) % decoder->capacity];
+        decoder->tableSize -= HPACK_ENTRY_OVERHEAD + entry->nameLen + entry->valueLen;
+        free(entry);
+    }
+}
+
+/* 比整个表还大的条目使表变空, 不是错误 (RFC 7541 4.4) */
+static int _hpack_add_entry(const char *name, size_t nameLen, const char *value, size_t valueLen, HpackDecoder *decoder)
+{
+    size_t size = HPACK_ENTRY_OVERHEAD + nameLen + valueLen;
+    HpackEntry **entries;
+    HpackEntry *entry;
+    size_t capacity;
+    size_t i;
+
+    _hpack_evict(size, decoder);
+    if (size > decoder->maxTableSize)
+        return 0;
+
+    if (decoder->count == decoder->capacity) {
+        capacity = decoder->capacity ? 2 * decoder->capacity : 16;
+        entries = (HpackEntry **)malloc(capacity * sizeof (HpackEntry *));
+        if (!entries)
+            return -1;
+
+        for (i = 0; i < decoder->count; i++)
+            entries[i] = decoder->entries[(decoder->first + i) % decoder->capacity];
+
+        free(decoder->entries);
+        decoder->entries = entries;
+        decoder->capacity = capacity;
+        decoder->first = 0;
+    }
+
+    entry = (HpackEntry *)malloc(sizeof (HpackEntry) + nameLen + valueLen);
+    if (!entry)
+        return -1;
+
+    entry->nameLen = nameLen;
+    entry->valueLen = valueLen;
+    memcpy(entry->data, name, nameLen);
+    memcpy(entry->data + nameLen, value, valueLen);
+    decoder->first = (decoder->first + decoder->capacity - 1) % decoder->capacity;
+    decoder->entries[decoder->first] = entry;
+    decoder->count++;
+    decoder->tableSize += size;
+    return 0;
+}
+
+static int _hpack_get_entry(size_t index, const char **name, size_t *nameLen, const char **value, size_t *valueLen, const HpackDecoder *decoder)
+{
+    const HpackEntry *entry;
+
+    if (index == 0)
+        return -1;
+
+    if (index <= HPACK_STATIC_COUNT) {
+        *name = _hpack_static_table[index - 1].name;
+        *nameLen = strlen(*name);
+        *value = _hpack_static_table[index - 1].value;
+        *valueLen = strlen(*value);
+        return 0;
+    }
+
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= decoder->count)
+        return -1;
+
+    entry = decoder->entries[(decoder->first + index) % decoder->capacity];
+    *name = entry->data;
+    *nameLen = entry->nameLen;
+    *value = entry->data + entry->nameLen;
+    *valueLen = entry->valueLen;
+    return 0;
+}
+
+static int _hpack_decode_int(const uint8_t **pp, const uint8_t *end, int prefix, size_t *value)
+{
+    const uint8_t *p = *pp;
+    size_t max = (1 << prefix) - 1;
+    int shift = 0;
+    size_t n;
+
+    n = *p++ & max;
+    if (n == max) {
+        do {
+            if (p == end || shift > 28)
+                return -1;
+
+            n += (size_t)(*p & 0x7f) << shift;
+            shift += 7;
+        } while (*p++ & 0x80);
+    }
+
+    *pp = p;
+    *value = n;
+    return 0;
+}
+
+static ssize_t _hpack_huffman_decode(const uint8_t *p, size_t len, char *out)
+{
+    uint32_t code = 0;
+    char *q = out;
+    uint32_t idx;
+    int bits = 0;
+    int sym;
+    int i;
+
+    while (len-- > 0) {
+        for (i = 7; i >= 0; i--) {
+            code = (code << 1) | ((*p >> i) & 1);
+            bits++;
+            idx = code - _hpack_huffman_first[bits];
+            if (code >= _hpack_huffman_first[bits] && idx < _hpack_huffman_count[bits]) {
+                sym = _hpack_huffman_symbols[_hpack_huffman_offset[bits] + idx];
+                if (sym == HPACK_EOS)
+                    return -1;
+
+                *q++ = (char)sym;
+                code = 0;
+                bits = 0;
+            } else if (bits == HPACK_HUFFMAN_LEN_MAX)
+                return -1;
+        }
+
+        p++;
+    }
+
+    /* 剩下的填充必须是 EOS 的前缀, 即全 1 且不超过 7 位 (RFC 7541 5.2) */
+    if (bits > 7 || code != (1U << bits) - 1)
+        return -1;
+
+    return q - out;
+}
+
+/* 解出的字符串放在 decoder->buf 的 offset 处 */
+static int _hpack_decode_string(const uint8_t **pp, const uint8_t *end, size_t offset, size_t *len, HpackDecoder *decoder)
+{
+    const uint8_t *p = *pp;
+    int huffman = *p & 0x80;
+    size_t need;
+    ssize_t n;
+    char *buf;
+
+    if (_hpack_decode_int(&p, end, 7, len) < 0 || *len > (size_t)(end - p))
+        return -1;
+
+    need = offset + (huffman ? *len * 8 / 5 + 1 : *len);
+    if (need > decoder->bufSize) {
+        buf = (char *)realloc(decoder->buf, need);
+        if (!buf)
+            return -2;
+
+        decoder->buf = buf;
+        decoder->bufSize = need;
+    }
+
+    if (huffman) {
+        n = _hpack_huffman_decode(p, *len, decoder->buf + offset);
+        if (n < 0)
+            return -1;
+
+        p += *len;
+        *len = n;
+    } else {
+        memcpy(decoder->buf + offset, p, *len);
+        p += *len;
+    }
+
+    *pp = p;
+    return 0;
+}
+
+int hpack_decode(const void *block, size_t size, HpackHeaderCallback cb, void *context, HpackDecoder *decoder)
+{
+    const uint8_t *p = (const uint8_t *)block;
+    const uint8_t *end = p + size;
+    const char *name, *value;
+    size_t nameLen, valueLen;
+    int headers = 0;
+    size_t index;
+    int prefix;
+    int ret;
+
+    while (p < end) {
+        if (*p & 0x80) {
+            /* 索引的头部 */
+            if (_hpack_decode_int(&p, end, 7, &index) < 0 ||
+                _hpack_get_entry(index, &name, &nameLen, &value, &valueLen, decoder) < 0)
+                goto error;
+        } else if ((*p & 0xe0) == 0x20) {
+            /* 动态表大小更新, 只能在头部块的开头 */
+            if (headers > 0 || _hpack_decode_int(&p, end, 5, &index) < 0 || index > decoder->settingsTableSize)
+                goto error;
+
+            decoder->maxTableSize = index;
+            _hpack_evict(0, decoder);
+            continue;
+        } else {
+            /* 字面量: 01 加入索引, 0000 不加入索引, 0001 永不索引 */
+            prefix = (*p & 0x40) ? 6 : 4;
+            if (_hpack_decode_int(&p, end, prefix, &index) < 0 || p == end)
+                goto error;
+
+            if (index > 0) {
+                if (_hpack_get_entry(index, &name, &nameLen, &value, &valueLen, decoder) < 0)
+                    goto error;
+
+                if (nameLen > decoder->bufSize) {
+                    char *buf = (char *)realloc(decoder->buf, nameLen);
+                    if (!buf)
+                        return -1;
+
+                    decoder->buf = buf;
+                    decoder->bufSize = nameLen;
+                }
+
+                memcpy(decoder->buf, name, nameLen);
+            } else {
+                ret = _hpack_decode_string(&p, end, 0, &nameLen, decoder);
+                if (ret == -2)
+                    return -1;
+                if (ret < 0 || p == end)
+                    goto error;
+            }
+
+            ret = _hpack_decode_string(&p, end, nameLen, &valueLen, decoder);
+            if (ret == -2)
+                return -1;
+            if (ret < 0)
+                goto error;
+
+            name = decoder->buf;
+            value = decoder->buf + nameLen;
+            if (prefix == 6 && _hpack_add_entry(name, nameLen, value, valueLen, decoder) < 0)
+                return -1;
+        }
+
+        headers++;
+        if (cb(name, nameLen, value, valueLen, context) < 0)
+            return -1;
+    }
+
+    return 0;
+
+error:
+    errno = EBADMSG;
+    return -1;
+}
+
+size_t hpack_huffman_encoded_size(const void *str, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)str;
+    size_t bits = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        bits += _hpack_huffman_lens[p[i]];
+
+    return (bits + 7) / 8;
+}
+
+static size_t _hpack_encode_int(size_t value, int prefix, uint8_t first, uint8_t *out)
+{
+    size_t max = (1 << prefix) - 1;
+    uint8_t *q = out;
+
+    if (value < max) {
+        *q++ = first | (uint8_t)value;
+        return 1;
+    }
+
+    *q++ = first | (uint8_t)max;
+    value -= max;
+    while (value >= 0x80) {
+        *q++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    *q++ = (uint8_t)value;
+    return q - out;
+}
+
+static size_t _hpack_encode_string(const char *str, size_t len, uint8_t *out)
+{
+    size_t huffmanLen = hpack_huffman_encoded_size(str, len);
+    const uint8_t *p = (const uint8_t *)str;
+    uint64_t acc = 0;
+    uint8_t *q;
+    int bits = 0;
+    size_t i;
+
+    if (huffmanLen >= len) {
+        q = out + _hpack_encode_int(len, 7, 0, out);
+        memcpy(q, str, len);
+        return q + len - out;
+    }
+
+    q = out + _hpack_encode_int(huffmanLen, 7, 0x80, out);
+    for (i = 0; i < len; i++) {
+        acc = (acc << _hpack_huffman_lens[p[i]]) | _hpack_huffman_codes[p[i]];
+        bits += _hpack_huffman_lens[p[i]];
+        while (bits >= 8) {
+            bits -= 8;
+            *q++ = (uint8_t)(acc >> bits);
+        }
+    }
+
+    /* 用 EOS 的高位补齐最后一个字节 */
+    if (bits > 0)
+        *q++ = (uint8_t)((acc << (8 - bits)) | (0xff >> bits));
+
+    return q - out;
+}
+
+size_t hpack_encode_header(const char *name, size_t nameLen, const char *value, size_t valueLen, void *buf)
+{
+    uint8_t *q = (uint8_t *)buf;
+    size_t index = 0;
+    int i;
+
+    for (i = 0; i < HPACK_STATIC_COUNT; i++) {
+        if (strncmp(_hpack_static_table[i].name, name, nameLen) != 0 || _hpack_static_table[i].name[nameLen] != '\0')
+            continue;
+
+        if (strncmp(_hpack_static_table[i].value, value, valueLen) == 0 && _hpack_static_table[i].value[valueLen] == '\0')
+            return _hpack_encode_int(i + 1, 7, 0x80, q);
+
+        if (index == 0)
+            index = i + 1;
+    }
+
+    /* 不加入索引的字面量 (RFC 7541 6.2.2) */
+    q += _hpack_encode_int(index, 4, 0, q);
+    if (index == 0)
+        q += _hpack_encode_string(name, nameLen, q);
+
+    q += _hpack_encode_string(value, valueLen, q);
+    return q - (uint8_t *)buf;
+}
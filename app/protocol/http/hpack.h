@@ -0,0 +1,63 @@
+//
+// Created by dingjing on 8/27/22.
+//
+
+#ifndef JARVIS_HPACK_H
+#define JARVIS_HPACK_H
+#include <stddef.h>
+
+#define HPACK_TABLE_SIZE_DEFAULT        4096
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct _HpackEntry              HpackEntry;
+typedef struct _HpackDecoder            HpackDecoder;
+
+/* 返回值小于 0 时停止解码 */
+typedef int (*HpackHeaderCallback) (const char* name, size_t nameLen, const char* value, size_t valueLen, void* context);
+
+/**
+ * @brief
+ *  HPACK (RFC 7541) 头部块的解码. 动态表随连接存在, 一个连接上的头部块必须按收到的顺序解码.
+ *  maxTableSize 是本端在 SETTINGS_HEADER_TABLE_SIZE 里通告的大小, 对端用动态表大小更新指令调整的值不能超过它
+ */
+struct _HpackDecoder
+{
+    HpackEntry**                entries;                // 环形数组, first 是最新加入的
+    size_t                      capacity;
+    size_t                      first;
+    size_t                      count;
+    size_t                      tableSize;              // 表中条目按 RFC 7541 4.1 计算的大小
+    size_t                      maxTableSize;           // 当前生效的上限
+    size_t                      settingsTableSize;
+    char*                       buf;                    // 解出的名字和值, Huffman 解码用
+    size_t                      bufSize;
+};
+
+void hpack_decoder_init (size_t maxTableSize, HpackDecoder* decoder);
+void hpack_decoder_deinit (HpackDecoder* decoder);
+
+/* 解码一个完整的头部块, 每个头部调用一次 cb. 出错返回 -1, errno 为 EBADMSG 时是压缩错误, 连接不能再用 */
+int hpack_decode (const void* block, size_t size, HpackHeaderCallback cb, void* context, HpackDecoder* decoder);
+
+/**
+ * @brief
+ *  编码不使用动态表: 名字和值都在静态表中时用索引, 否则用不加入索引的字面量, Huffman 编码更短时用 Huffman.
+ *  名字必须已经是小写. buf 至少要有 hpack_encode_bound() 字节, 返回写入的字节数
+ */
+size_t hpack_encode_header (const char* name, size_t nameLen, const char* value, size_t valueLen, void* buf);
+
+static inline size_t hpack_encode_bound (size_t nameLen, size_t valueLen)
+{
+    return nameLen + valueLen + 16;
+}
+
+size_t hpack_huffman_encoded_size (const void* str, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+#endif //JARVIS_HPACK_H
@@ -4,6 +4,10 @@
 
 #include "http-message.h"
 
+#include <unistd.h>
+
+#include "app/core/c-poll.h"
+
 namespace protocol
 {
     typedef struct _HttpMessageBlock        HttpMessageBlock;
@@ -11,8 +15,10 @@ namespace protocol
     struct _HttpMessageBlock
     {
         struct list_head        list;
-        const void*             ptr;
+        const void*             ptr;                // 文件段时指向块后面的 CPollFileSegment
         size_t                  size;
+        int                     file;
+        int                     closeFd;            // 释放块时关闭的 fd, 没有为 -1
     };
 }
 
@@ -26,6 +32,8 @@ bool protocol::HttpMessage::appendOutputBody(const void *buf, size_t size)
         memcpy(block + 1, buf, size);
         block->ptr = block + 1;
         block->size = size;
+        block->file = 0;
+        block->closeFd = -1;
         list_add_tail(&block->list, &mOutputBody);
         mOutputBodySize += size;
         return true;
@@ -43,6 +51,32 @@ bool protocol::HttpMessage::appendOutputBodyNocopy(const void *buf, size_t size)
     if (block) {
         block->ptr = buf;
         block->size = size;
+        block->file = 0;
+        block->closeFd = -1;
+        list_add_tail(&block->list, &mOutputBody);
+        mOutputBodySize += size;
+        return true;
+    }
+
+    return false;
+}
+
+bool protocol::HttpMessage::appendOutputBodyFile(int fd, off_t offset, size_t size, bool closeFd)
+{
+    size_t n = sizeof (HttpMessageBlock) + sizeof (CPollFileSegment);
+    HttpMessageBlock *block = (HttpMessageBlock *)malloc(n);
+    CPollFileSegment *seg;
+
+    logv("");
+    if (block) {
+        seg = (CPollFileSegment *)(block + 1);
+        seg->fd = fd;
+        seg->offset = offset;
+        seg->size = size;
+        block->ptr = seg;
+        block->size = size;
+        block->file = 1;
+        block->closeFd = closeFd ? fd : -1;
         list_add_tail(&block->list, &mOutputBody);
         mOutputBodySize += size;
         return true;
@@ -60,6 +94,8 @@ void protocol::HttpMessage::clearOutputBody()
     list_for_each_safe(pos, tmp, &mOutputBody) {
         block = list_entry(pos, HttpMessageBlock, list);
         list_del(pos);
+        if (block->closeFd >= 0)
+            close(block->closeFd);
         free(block);
     }
 
@@ -99,7 +135,7 @@ int protocol::HttpMessage::encode(struct iovec *vectors, int max)
     HttpMessageHeader           header;
     HttpMessageBlock*           block;
     struct list_head*           pos;
-    size_t                      size;
+    int                         n;
 
     logv("");
     startLine[0] = http_parser_get_method(mParser);
@@ -153,51 +189,90 @@ int protocol::HttpMessage::encode(struct iovec *vectors, int max)
     vectors[i].iov_len = 2;
     i++;
 
-    size = mOutputBodySize;
-    list_for_each(pos, &mOutputBody) {
-        if (i + 1 == max && pos != mOutputBody.prev) {
-            pos = combineFrom(pos, size);
-            if (!pos)
-                return -1;
-        }
+    n = 0;
+    list_for_each(pos, &mOutputBody)
+        n++;
+
+    if (n > max - i && !combineFrom(mOutputBody.next, max - i))
+        return -1;
 
+    list_for_each(pos, &mOutputBody) {
         block = list_entry(pos, HttpMessageBlock, list);
         vectors[i].iov_base = (void *)block->ptr;
-        vectors[i].iov_len = block->size;
-        size -= block->size;
+        vectors[i].iov_len = block->file ? CPOLL_IOV_FILE | block->size : block->size;
         i++;
     }
 
     return i;
 }
 
-struct list_head *protocol::HttpMessage::combineFrom(struct list_head *pos, size_t size)
+/**
+ * @brief
+ *  块数超过 iovec 上限时, 把 pos 开始的每段相邻内存块合并成一块.
+ *  文件段原样保留, 不读进内存; 合并后仍多于 slots 块时返回 NULL, errno 为 EOVERFLOW
+ */
+struct list_head *protocol::HttpMessage::combineFrom(struct list_head *pos, int slots)
 {
-    size_t n = sizeof (HttpMessageBlock) + size;
-    HttpMessageBlock *block = (HttpMessageBlock *)malloc(n);
+    struct list_head *first = pos->prev;
+    HttpMessageBlock *block;
     HttpMessageBlock *entry;
+    struct list_head *cur;
+    struct list_head *end;
+    size_t size;
+    int n = 0;
     char *ptr;
 
     logv("");
-    if (block) {
+    // 合并后每个文件段一块, 每段连续的内存块一块
+    for (cur = pos; cur != &mOutputBody; cur = cur->next) {
+        entry = list_entry(cur, HttpMessageBlock, list);
+        if (entry->file || cur == pos || list_entry(cur->prev, HttpMessageBlock, list)->file)
+            n++;
+    }
+
+    if (n > slots) {
+        errno = EOVERFLOW;
+        return NULL;
+    }
+
+    for (cur = pos; cur != &mOutputBody; cur = end) {
+        size = 0;
+        for (end = cur; end != &mOutputBody; end = end->next) {
+            entry = list_entry(end, HttpMessageBlock, list);
+            if (entry->file)
+                break;
+
+            size += entry->size;
+        }
+
+        if (end == cur) {
+            end = cur->next;
+            continue;
+        } else if (end == cur->next)
+            continue;
+
+        block = (HttpMessageBlock *)malloc(sizeof (HttpMessageBlock) + size);
+        if (!block)
+            return NULL;
+
         block->ptr = block + 1;
         block->size = size;
+        block->file = 0;
+        block->closeFd = -1;
         ptr = (char *)block->ptr;
-
-        do {
-            entry = list_entry(pos, HttpMessageBlock, list);
-            pos = pos->next;
-            list_del(&entry->list);
+        while (cur != end) {
+            entry = list_entry(cur, HttpMessageBlock, list);
+            cur = cur->next;
             memcpy(ptr, entry->ptr, entry->size);
             ptr += entry->size;
+            list_del(&entry->list);
             free(entry);
-        } while (pos != &mOutputBody);
+        }
 
-        list_add_tail(&block->list, &mOutputBody);
-        return &block->list;
+        list_add_tail(&block->list, end);
     }
 
-    return NULL;
+    return first->next;
 }
 
 protocol::HttpMessage::HttpMessage(protocol::HttpMessage &&msg)
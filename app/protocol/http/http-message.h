@@ -147,6 +147,9 @@ namespace protocol
             return appendOutputBodyNocopy(buf, strlen(static_cast<const char*>(buf)));
         }
 
+        /* 文件内容作为 body, 发送时用 sendfile 直接从文件发出, 不读进内存. closeFd 为 true 时消息析构时关闭 fd */
+        bool appendOutputBodyFile (int fd, off_t offset, size_t size, bool closeFd);
+
         void clearOutputBody();
 
         size_t getOutputBodySize () const;
@@ -206,7 +209,7 @@ namespace protocol
         int encode (struct iovec vectors[], int max) override;
 
     private:
-        struct list_head* combineFrom (struct list_head* pos, size_t size);
+        struct list_head* combineFrom (struct list_head* pos, int slots);
 
     protected:
         HttpParser*                 mParser;
@@ -7,4 +7,10 @@ file(GLOB HTTP_SRC
 
         ${CMAKE_SOURCE_DIR}/app/protocol/http/http-parser.h
         ${CMAKE_SOURCE_DIR}/app/protocol/http/http-parser.c
+
+        ${CMAKE_SOURCE_DIR}/app/protocol/http/hpack.h
+        ${CMAKE_SOURCE_DIR}/app/protocol/http/hpack.c
+
+        ${CMAKE_SOURCE_DIR}/app/protocol/http/http2-mux.h
+        ${CMAKE_SOURCE_DIR}/app/protocol/http/http2-mux.cpp
         )
\ No newline at end of file
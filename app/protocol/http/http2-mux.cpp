@@ -0,0 +1,1308 @@
+//
+// Created by dingjing on 8/27/22.
+//
+
+#include "http2-mux.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#include "app/core/c-poll.h"
+
+#define HTTP2_FRAME_DATA                        0x0
+#define HTTP2_FRAME_HEADERS                     0x1
+#define HTTP2_FRAME_PRIORITY                    0x2
+#define HTTP2_FRAME_RST_STREAM                  0x3
+#define HTTP2_FRAME_SETTINGS                    0x4
+#define HTTP2_FRAME_PUSH_PROMISE                0x5
+#define HTTP2_FRAME_PING                        0x6
+#define HTTP2_FRAME_GOAWAY                      0x7
+#define HTTP2_FRAME_WINDOW_UPDATE               0x8
+#define HTTP2_FRAME_CONTINUATION                0x9
+
+#define HTTP2_FLAG_ACK                          0x1
+#define HTTP2_FLAG_END_STREAM                   0x1
+#define HTTP2_FLAG_END_HEADERS                  0x4
+#define HTTP2_FLAG_PADDED                       0x8
+#define HTTP2_FLAG_PRIORITY                     0x20
+
+#define HTTP2_SETTINGS_ENABLE_PUSH              0x2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS   0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE      0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE           0x5
+
+#define HTTP2_NO_ERROR                          0x0
+#define HTTP2_PROTOCOL_ERROR                    0x1
+#define HTTP2_INTERNAL_ERROR                    0x2
+#define HTTP2_FLOW_CONTROL_ERROR                0x3
+#define HTTP2_STREAM_CLOSED                     0x5
+#define HTTP2_FRAME_SIZE_ERROR                  0x6
+#define HTTP2_REFUSED_STREAM                    0x7
+#define HTTP2_CANCEL                            0x8
+#define HTTP2_COMPRESSION_ERROR                 0x9
+
+#define HTTP2_FRAME_HEADER_SIZE                 9
+#define HTTP2_FRAME_SIZE_DEFAULT                16384
+#define HTTP2_FRAME_SIZE_MAX                    16777215
+#define HTTP2_WINDOW_DEFAULT                    65535
+#define HTTP2_WINDOW_MAX                        0x7fffffff
+#define HTTP2_STREAM_ID_MAX                     0x7fffffff
+
+#define HTTP2_LOCAL_WINDOW                      (1024 * 1024)       // 本端通告的流和连接的接收窗口
+#define HTTP2_LOCAL_MAX_STREAMS                 100
+#define HTTP2_HEADER_BLOCK_MAX                  (256 * 1024)
+#define HTTP2_PENDING_MAX                       (64 * 1024)         // 发送缓冲超过时 pull() 不再生成 DATA
+#define HTTP2_ENCODE_IOV_MAX                    1024
+
+namespace protocol
+{
+    struct _Http2Stream
+    {
+        struct list_head                list;               // 在 mSendList 里时不为空
+        CommSession*                    session;
+        uint32_t                        id;
+#define HTTP2_STREAM_RECEIVING          0                   // 服务端收请求; 客户端发请求收回复
+#define HTTP2_STREAM_PROCESSING         1                   // 服务端: 请求已交给 handler, 等回复
+#define HTTP2_STREAM_SENDING            2                   // 服务端: 发回复
+        int                             state;
+        int                             receiving;          // 消息还没收完, 计入 mReceiving
+        int                             headReceived;
+        int                             remoteClosed;       // 收到了 END_STREAM 或 RST_STREAM
+        int                             reset;              // 服务端: 等回复时对端 RST_STREAM
+        int                             buffered;           // 没有 Content-Length, 收完再交给消息
+        int                             headRequest;        // 服务端: HEAD 请求, 回复不带 body
+        int64_t                         sendWindow;
+        int64_t                         recvWindow;         // 本端通告的还剩多少, 小于 0 时对端超出了窗口
+        uint32_t                        recvConsumed;
+        std::string                     head;               // buffered 时的头部文本
+        std::string                     body;               // buffered 时收到的 body, 或发送时解开 chunked 的 body
+        std::vector<struct iovec>       iov;                // 要发送的 body, 指向会话的消息
+        size_t                          iovIdx;
+        size_t                          iovOff;
+        size_t                          left;
+    };
+}
+
+using namespace protocol;
+
+typedef struct _Http2HeaderContext      Http2HeaderContext;
+
+struct _Http2HeaderContext
+{
+    std::string                         method;
+    std::string                         scheme;
+    std::string                         authority;
+    std::string                         path;
+    std::string                         status;
+    std::string                         headers;            // "name: value\r\n"
+    std::string                         cookie;
+    int                                 hasHost;
+    int                                 hasContentLength;
+    int                                 malformed;
+};
+
+static inline uint32_t _get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void _put32(uint32_t n, uint8_t *p)
+{
+    p[0] = n >> 24;
+    p[1] = n >> 16;
+    p[2] = n >> 8;
+    p[3] = n;
+}
+
+static inline void _put_setting(uint16_t id, uint32_t value, uint8_t *p)
+{
+    p[0] = id >> 8;
+    p[1] = id;
+    _put32(value, p + 2);
+}
+
+/* 连接相关的头部在 HTTP/2 里没有意义 (RFC 9113 8.2.2) */
+static bool _connection_header(const char *name, size_t len)
+{
+    switch (len) {
+        case 7:
+            return strncasecmp(name, "upgrade", 7) == 0;
+        case 10:
+            return strncasecmp(name, "connection", 10) == 0 || strncasecmp(name, "keep-alive", 10) == 0;
+        case 16:
+            return strncasecmp(name, "proxy-connection", 16) == 0;
+        case 17:
+            return strncasecmp(name, "transfer-encoding", 17) == 0;
+    }
+
+    return false;
+}
+
+/* HTTP/1 解析器能接受的头部: 名字不超过 64 字节, 值里没有控制字符和非 ASCII 字节 */
+static bool _valid_header(const char *name, size_t nameLen, const char *value, size_t valueLen)
+{
+    size_t i;
+
+    if (nameLen == 0 || nameLen >= 64)
+        return false;
+
+    for (i = 0; i < nameLen; i++) {
+        if ((signed char)name[i] <= ' ' || name[i] == ':')
+            return false;
+    }
+
+    for (i = 0; i < valueLen; i++) {
+        if ((signed char)value[i] <= 0 || value[i] == '\r' || value[i] == '\n')
+            return false;
+    }
+
+    return true;
+}
+
+static int _header_callback(const char *name, size_t nameLen, const char *value, size_t valueLen, void *context)
+{
+    Http2HeaderContext *ctx = (Http2HeaderContext *)context;
+    std::string *pseudo = NULL;
+
+    if (nameLen > 0 && name[0] == ':') {
+        if (nameLen == 7 && memcmp(name, ":method", 7) == 0)
+            pseudo = &ctx->method;
+        else if (nameLen == 7 && memcmp(name, ":scheme", 7) == 0)
+            pseudo = &ctx->scheme;
+        else if (nameLen == 10 && memcmp(name, ":authority", 10) == 0)
+            pseudo = &ctx->authority;
+        else if (nameLen == 5 && memcmp(name, ":path", 5) == 0)
+            pseudo = &ctx->path;
+        else if (nameLen == 7 && memcmp(name, ":status", 7) == 0)
+            pseudo = &ctx->status;
+
+        if (!pseudo || !_valid_header("x", 1, value, valueLen))
+            ctx->malformed = 1;
+        else
+            pseudo->assign(value, valueLen);
+
+        return 0;
+    }
+
+    if (_connection_header(name, nameLen) || !_valid_header(name, nameLen, value, valueLen))
+        return 0;
+
+    /* 多个 cookie 头部合成一个 (RFC 9113 8.2.3) */
+    if (nameLen == 6 && strncasecmp(name, "cookie", 6) == 0) {
+        if (!ctx->cookie.empty())
+            ctx->cookie.append("; ");
+
+        ctx->cookie.append(value, valueLen);
+        return 0;
+    }
+
+    /* 100-continue 由 HTTP/2 的流控代替 */
+    if (nameLen == 6 && strncasecmp(name, "expect", 6) == 0)
+        return 0;
+
+    if (nameLen == 4 && strncasecmp(name, "host", 4) == 0)
+        ctx->hasHost = 1;
+    else if (nameLen == 14 && strncasecmp(name, "content-length", 14) == 0)
+        ctx->hasContentLength = 1;
+
+    ctx->headers.append(name, nameLen);
+    ctx->headers.append(": ");
+    ctx->headers.append(value, valueLen);
+    ctx->headers.append("\r\n");
+    return 0;
+}
+
+/* 发送 chunked 的消息时解开 chunk, 只留数据 */
+static int _dechunk(const std::string& in, std::string& out)
+{
+    size_t pos = 0;
+    size_t end;
+    size_t size;
+    char *p;
+
+    while (1) {
+        end = in.find("\r\n", pos);
+        if (end == std::string::npos)
+            break;
+
+        size = strtoul(in.c_str() + pos, &p, 16);
+        if (p == in.c_str() + pos)
+            break;
+
+        pos = end + 2;
+        if (size == 0)
+            return 0;
+
+        if (in.size() - pos < size + 2)
+            break;
+
+        out.append(in, pos, size);
+        pos += size + 2;
+    }
+
+    errno = EBADMSG;
+    return -1;
+}
+
+Http2Mux::Http2Mux(bool server, bool ssl)
+{
+    mServer = server;
+    mSSL = ssl;
+    mGoaway = false;
+    mPrefaceLeft = server ? HTTP2_CLIENT_PREFACE_LEN : 0;
+    mHeaderStream = 0;
+    mHeaderEnd = 0;
+    hpack_decoder_init(HPACK_TABLE_SIZE_DEFAULT, &mDecoder);
+
+    mNextStreamId = 1;
+    mLastStreamId = 0;
+    mPeerMaxStreams = UINT32_MAX;
+    mPeerMaxFrame = HTTP2_FRAME_SIZE_DEFAULT;
+    mPeerInitialWindow = HTTP2_WINDOW_DEFAULT;
+    mSendWindow = HTTP2_WINDOW_DEFAULT;
+    mRecvWindow = HTTP2_WINDOW_DEFAULT;
+    mRecvConsumed = 0;
+    INIT_LIST_HEAD(&mSendList);
+}
+
+Http2Mux::~Http2Mux()
+{
+    for (auto& it : mStreams)
+        delete it.second;
+
+    hpack_decoder_deinit(&mDecoder);
+}
+
+int Http2Mux::frame(uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len)
+{
+    uint8_t header[HTTP2_FRAME_HEADER_SIZE];
+
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    _put32(id, header + 5);
+    if (this->output(header, HTTP2_FRAME_HEADER_SIZE) < 0)
+        return -1;
+
+    /* payload 为 NULL 时只写帧头, 负载由调用者接着写 */
+    if (payload && len > 0)
+        return this->output(payload, len);
+
+    return 0;
+}
+
+int Http2Mux::windowUpdate(uint32_t id, uint32_t increment)
+{
+    uint8_t payload[4];
+
+    _put32(increment, payload);
+    return this->frame(HTTP2_FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+/* 连接错误: 发出 GOAWAY 后返回 -1, 连接将被关闭 */
+int Http2Mux::goaway(uint32_t code)
+{
+    uint8_t payload[8];
+
+    _put32(mLastStreamId, payload);
+    _put32(code, payload + 4);
+    this->frame(HTTP2_FRAME_GOAWAY, 0, 0, payload, 8);
+    mGoaway = true;
+    errno = code == HTTP2_COMPRESSION_ERROR ? EBADMSG : EPROTO;
+    return -1;
+}
+
+void Http2Mux::resetStream(uint32_t id, uint32_t code)
+{
+    uint8_t payload[4];
+
+    _put32(code, payload);
+    this->frame(HTTP2_FRAME_RST_STREAM, 0, id, payload, 4);
+}
+
+void Http2Mux::resetStream(Http2Stream *stream, uint32_t code)
+{
+    this->resetStream(stream->id, code);
+}
+
+/* 还没有开始的流: 对端的编号大于见过的, 本端的编号还没用到; 偶数的流 (推送) 都没有开始 */
+bool Http2Mux::idleStream(uint32_t id) const
+{
+    if (id % 2 == 0)
+        return true;
+
+    return mServer ? id > mLastStreamId : id >= mNextStreamId;
+}
+
+/* 收到的数据已经交给消息或丢弃, 窗口用掉一半以上时补上. 流结束后不再补流的窗口 */
+int Http2Mux::replenish(Http2Stream *stream, size_t n)
+{
+    mRecvConsumed += n;
+    if (mRecvConsumed >= HTTP2_LOCAL_WINDOW / 2) {
+        if (this->windowUpdate(0, mRecvConsumed) < 0)
+            return -1;
+
+        mRecvWindow += mRecvConsumed;
+        mRecvConsumed = 0;
+    }
+
+    if (!stream || !stream->receiving || stream->remoteClosed)
+        return 0;
+
+    stream->recvConsumed += n;
+    if (stream->recvConsumed >= HTTP2_LOCAL_WINDOW / 2) {
+        if (this->windowUpdate(stream->id, stream->recvConsumed) < 0)
+            return -1;
+
+        stream->recvWindow += stream->recvConsumed;
+        stream->recvConsumed = 0;
+    }
+
+    return 0;
+}
+
+Http2Stream *Http2Mux::findStream(uint32_t id)
+{
+    auto it = mStreams.find(id);
+
+    return it != mStreams.end() ? it->second : NULL;
+}
+
+void Http2Mux::removeStream(Http2Stream *stream)
+{
+    if (!list_empty(&stream->list))
+        list_del(&stream->list);
+
+    if (stream->receiving)
+        mReceiving--;
+
+    setStreamId(stream->session, 0);
+    mActive--;
+    mStreams.erase(stream->id);
+    delete stream;
+}
+
+int Http2Mux::open()
+{
+    uint8_t settings[12];
+
+    if (!mServer) {
+        if (this->output(HTTP2_CLIENT_PREFACE, HTTP2_CLIENT_PREFACE_LEN) < 0)
+            return -1;
+
+        _put_setting(HTTP2_SETTINGS_ENABLE_PUSH, 0, settings);
+    } else {
+        _put_setting(HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_LOCAL_MAX_STREAMS, settings);
+    }
+
+    _put_setting(HTTP2_SETTINGS_INITIAL_WINDOW_SIZE, HTTP2_LOCAL_WINDOW, settings + 6);
+    if (this->frame(HTTP2_FRAME_SETTINGS, 0, 0, settings, 12) < 0)
+        return -1;
+
+    if (this->windowUpdate(0, HTTP2_LOCAL_WINDOW - HTTP2_WINDOW_DEFAULT) < 0)
+        return -1;
+
+    mRecvWindow = HTTP2_LOCAL_WINDOW;
+    return 0;
+}
+
+int Http2Mux::available()
+{
+    return !mGoaway && mNextStreamId < HTTP2_STREAM_ID_MAX && (uint32_t)mActive < mPeerMaxStreams;
+}
+
+int Http2Mux::input(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    size_t len = size;
+    size_t frameLen;
+    size_t n;
+    int ret = 0;
+
+    if (mPrefaceLeft > 0) {
+        n = size < mPrefaceLeft ? size : mPrefaceLeft;
+        if (memcmp(p, HTTP2_CLIENT_PREFACE + HTTP2_CLIENT_PREFACE_LEN - mPrefaceLeft, n) != 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        mPrefaceLeft -= n;
+        p += n;
+        len -= n;
+    }
+
+    /* 有不完整的帧时拼在后面再解析 */
+    if (!mInput.empty()) {
+        mInput.append((const char *)p, len);
+        p = (const uint8_t *)mInput.data();
+        len = mInput.size();
+    }
+
+    while (len >= HTTP2_FRAME_HEADER_SIZE) {
+        frameLen = ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+        if (frameLen > HTTP2_FRAME_SIZE_DEFAULT)
+            return this->goaway(HTTP2_FRAME_SIZE_ERROR);
+
+        if (len < HTTP2_FRAME_HEADER_SIZE + frameLen)
+            break;
+
+        ret = this->handleFrame(p[3], p[4], _get32(p + 5) & HTTP2_STREAM_ID_MAX, p + HTTP2_FRAME_HEADER_SIZE, frameLen);
+        if (ret < 0)
+            return -1;
+
+        p += HTTP2_FRAME_HEADER_SIZE + frameLen;
+        len -= HTTP2_FRAME_HEADER_SIZE + frameLen;
+    }
+
+    if (mInput.empty())
+        mInput.assign((const char *)p, len);
+    else
+        mInput.erase(0, mInput.size() - len);
+
+    return 0;
+}
+
+int Http2Mux::handleFrame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len)
+{
+    Http2Stream *stream;
+    uint32_t increment;
+    size_t frameLen = len;
+    size_t pad = 0;
+
+    if (mHeaderStream != 0 && type != HTTP2_FRAME_CONTINUATION)
+        return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+    if ((type == HTTP2_FRAME_DATA || type == HTTP2_FRAME_HEADERS) && (flags & HTTP2_FLAG_PADDED)) {
+        if (len < 1 || payload[0] >= len)
+            return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+        pad = payload[0];
+        payload++;
+        len -= 1 + pad;
+    }
+
+    switch (type) {
+        case HTTP2_FRAME_DATA:
+            if (id == 0 || this->idleStream(id))
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            /* 整个帧 (包括填充) 都计入窗口, 不管流还在不在. 超出连接的窗口是连接错误 */
+            mRecvWindow -= frameLen;
+            if (mRecvWindow < 0)
+                return this->goaway(HTTP2_FLOW_CONTROL_ERROR);
+
+            stream = this->findStream(id);
+            if (!stream || stream->remoteClosed) {
+                this->resetStream(id, HTTP2_STREAM_CLOSED);
+                if (stream && this->handleRstStream(stream, HTTP2_STREAM_CLOSED) < 0)
+                    return -1;
+
+                return this->replenish(NULL, frameLen);
+            }
+
+            /* 超出流的窗口只结束这个流 */
+            stream->recvWindow -= frameLen;
+            if (stream->recvWindow < 0) {
+                this->resetStream(stream, HTTP2_FLOW_CONTROL_ERROR);
+                if (this->handleRstStream(stream, HTTP2_FLOW_CONTROL_ERROR) < 0)
+                    return -1;
+
+                return this->replenish(NULL, frameLen);
+            }
+
+            if (this->handleData(stream, payload, len, flags & HTTP2_FLAG_END_STREAM) < 0)
+                return -1;
+
+            /* 数据交给消息之后再补窗口, 流可能已经结束 */
+            return this->replenish(this->findStream(id), frameLen);
+
+        case HTTP2_FRAME_HEADERS:
+            if (id == 0)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            if (flags & HTTP2_FLAG_PRIORITY) {
+                if (len < 5)
+                    return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+                payload += 5;
+                len -= 5;
+            }
+
+            mHeaderBlock.assign((const char *)payload, len);
+            mHeaderEnd = flags & HTTP2_FLAG_END_STREAM;
+            if (flags & HTTP2_FLAG_END_HEADERS)
+                return this->handleHeaders(id, mHeaderEnd);
+
+            mHeaderStream = id;
+            return 0;
+
+        case HTTP2_FRAME_CONTINUATION:
+            if (mHeaderStream == 0 || id != mHeaderStream)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            mHeaderBlock.append((const char *)payload, len);
+            if (mHeaderBlock.size() > HTTP2_HEADER_BLOCK_MAX)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            if (!(flags & HTTP2_FLAG_END_HEADERS))
+                return 0;
+
+            mHeaderStream = 0;
+            return this->handleHeaders(id, mHeaderEnd);
+
+        case HTTP2_FRAME_RST_STREAM:
+            if (id == 0)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            if (len != 4)
+                return this->goaway(HTTP2_FRAME_SIZE_ERROR);
+
+            stream = this->findStream(id);
+            if (stream)
+                return this->handleRstStream(stream, _get32(payload));
+
+            return 0;
+
+        case HTTP2_FRAME_SETTINGS:
+            if (id != 0)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            if (len % 6 != 0 || ((flags & HTTP2_FLAG_ACK) && len != 0))
+                return this->goaway(HTTP2_FRAME_SIZE_ERROR);
+
+            if (flags & HTTP2_FLAG_ACK)
+                return 0;
+
+            return this->handleSettings(payload, len);
+
+        case HTTP2_FRAME_PUSH_PROMISE:
+            /* 客户端关闭了推送, 服务端不会收到 */
+            return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+        case HTTP2_FRAME_PING:
+            if (id != 0)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            if (len != 8)
+                return this->goaway(HTTP2_FRAME_SIZE_ERROR);
+
+            if (!(flags & HTTP2_FLAG_ACK))
+                return this->frame(HTTP2_FRAME_PING, HTTP2_FLAG_ACK, 0, payload, 8);
+
+            return 0;
+
+        case HTTP2_FRAME_GOAWAY:
+            if (id != 0 || len < 8)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            return this->handleGoaway(_get32(payload) & HTTP2_STREAM_ID_MAX);
+
+        case HTTP2_FRAME_WINDOW_UPDATE:
+            if (len != 4)
+                return this->goaway(HTTP2_FRAME_SIZE_ERROR);
+
+            increment = _get32(payload) & HTTP2_WINDOW_MAX;
+            if (id == 0) {
+                if (increment == 0)
+                    return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+                mSendWindow += increment;
+                if (mSendWindow > HTTP2_WINDOW_MAX)
+                    return this->goaway(HTTP2_FLOW_CONTROL_ERROR);
+
+                return 0;
+            }
+
+            stream = this->findStream(id);
+            if (!stream)
+                return 0;
+
+            stream->sendWindow += increment;
+            if (increment == 0 || stream->sendWindow > HTTP2_WINDOW_MAX) {
+                this->resetStream(stream, increment == 0 ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR);
+                return this->handleRstStream(stream, HTTP2_CANCEL);
+            }
+
+            if (stream->left > 0 && stream->sendWindow > 0 && list_empty(&stream->list))
+                list_add_tail(&stream->list, &mSendList);
+
+            return 0;
+
+        default:
+            /* PRIORITY 和未知的帧都忽略 */
+            return 0;
+    }
+}
+
+int Http2Mux::handleSettings(const uint8_t *payload, size_t len)
+{
+    Http2Stream *stream;
+    uint32_t value;
+    int64_t delta;
+    size_t i;
+
+    for (i = 0; i < len; i += 6) {
+        value = _get32(payload + i + 2);
+        switch ((payload[i] << 8) | payload[i + 1]) {
+            case HTTP2_SETTINGS_ENABLE_PUSH:
+                if (value > 1)
+                    return this->goaway(HTTP2_PROTOCOL_ERROR);
+                break;
+
+            case HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS:
+                mPeerMaxStreams = value;
+                break;
+
+            case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > HTTP2_WINDOW_MAX)
+                    return this->goaway(HTTP2_FLOW_CONTROL_ERROR);
+
+                /* 已经开始的流按差值调整窗口 */
+                delta = (int64_t)value - mPeerInitialWindow;
+                mPeerInitialWindow = value;
+                for (auto& it : mStreams) {
+                    stream = it.second;
+                    stream->sendWindow += delta;
+                    if (stream->left > 0 && stream->sendWindow > 0 && list_empty(&stream->list))
+                        list_add_tail(&stream->list, &mSendList);
+                }
+
+                break;
+
+            case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < HTTP2_FRAME_SIZE_DEFAULT || value > HTTP2_FRAME_SIZE_MAX)
+                    return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+                mPeerMaxFrame = value;
+                break;
+        }
+    }
+
+    return this->frame(HTTP2_FRAME_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+}
+
+int Http2Mux::handleHeaders(uint32_t id, int endStream)
+{
+    Http2HeaderContext ctx = { };
+    CommSession *session;
+    Http2Stream *stream;
+    std::string text;
+
+    /* 不管流还在不在都要解码, 动态表随连接变化 */
+    if (hpack_decode(mHeaderBlock.data(), mHeaderBlock.size(), _header_callback, &ctx, &mDecoder) < 0)
+        return this->goaway(HTTP2_COMPRESSION_ERROR);
+
+    stream = this->findStream(id);
+    if (mServer && !stream) {
+        if (id % 2 == 0 || id <= mLastStreamId) {
+            if (id % 2 == 0)
+                return this->goaway(HTTP2_PROTOCOL_ERROR);
+
+            return 0;
+        }
+
+        mLastStreamId = id;
+        stream = new Http2Stream;
+        stream->id = id;
+        INIT_LIST_HEAD(&stream->list);
+        if (mGoaway || mStreams.size() >= HTTP2_LOCAL_MAX_STREAMS) {
+            this->resetStream(stream, HTTP2_REFUSED_STREAM);
+            delete stream;
+            return 0;
+        }
+
+        if (ctx.malformed || ctx.method.empty() || ctx.path.empty()) {
+            this->resetStream(stream, HTTP2_PROTOCOL_ERROR);
+            delete stream;
+            return 0;
+        }
+
+        session = this->newSession();
+        if (!session) {
+            this->resetStream(stream, HTTP2_REFUSED_STREAM);
+            delete stream;
+            return 0;
+        }
+
+        stream->session = session;
+        stream->state = HTTP2_STREAM_RECEIVING;
+        stream->receiving = 1;
+        stream->headReceived = 0;
+        stream->remoteClosed = 0;
+        stream->reset = 0;
+        stream->buffered = 0;
+        stream->headRequest = ctx.method == "HEAD";
+        stream->sendWindow = mPeerInitialWindow;
+        stream->recvWindow = HTTP2_LOCAL_WINDOW;
+        stream->recvConsumed = 0;
+        stream->iovIdx = 0;
+        stream->iovOff = 0;
+        stream->left = 0;
+        setStreamId(session, id);
+        mStreams[id] = stream;
+        mActive++;
+        mReceiving++;
+    }
+
+    if (!stream || !stream->receiving)
+        return 0;
+
+    /* trailers 忽略, 只看是否结束 */
+    if (stream->headReceived)
+        return this->handleData(stream, NULL, 0, endStream);
+
+    if (mServer) {
+        text = ctx.method + " " + ctx.path + " HTTP/2.0\r\n";
+        if (!ctx.hasHost && !ctx.authority.empty())
+            text += "Host: " + ctx.authority + "\r\n";
+    } else {
+        if (ctx.malformed || ctx.status.size() != 3) {
+            this->resetStream(stream, HTTP2_PROTOCOL_ERROR);
+            errno = EBADMSG;
+            return this->handleRstStream(stream, HTTP2_PROTOCOL_ERROR);
+        }
+
+        /* 1xx 不交给消息, 等最终的回复 */
+        if (ctx.status[0] == '1')
+            return 0;
+
+        text = "HTTP/2.0 " + ctx.status + " \r\n";
+    }
+
+    text += ctx.headers;
+    if (!ctx.cookie.empty())
+        text += "Cookie: " + ctx.cookie + "\r\n";
+
+    stream->headReceived = 1;
+    if (!endStream && !ctx.hasContentLength) {
+        /* 不知道长度的 body 收完再交给消息, 那时补上 Content-Length */
+        stream->buffered = 1;
+        stream->head = std::move(text);
+        return 0;
+    }
+
+    if (endStream && !ctx.hasContentLength && !mServer)
+        text += "Content-Length: 0\r\n";
+
+    text += "\r\n";
+    return this->feedMessage(stream, text.data(), text.size(), endStream);
+}
+
+int Http2Mux::handleData(Http2Stream *stream, const uint8_t *data, size_t len, int endStream)
+{
+    char buf[64];
+    int ret;
+
+    if (endStream)
+        stream->remoteClosed = 1;
+
+    if (!stream->receiving)
+        return 0;
+
+    if (!stream->buffered)
+        return this->feedMessage(stream, data, len, endStream);
+
+    stream->body.append((const char *)data, len);
+    if (!endStream)
+        return 0;
+
+    stream->head.append(buf, snprintf(buf, sizeof (buf), "Content-Length: %zu\r\n\r\n", stream->body.size()));
+    ret = this->feedMessage(stream, stream->head.data(), stream->head.size(), stream->body.empty());
+    if (ret < 0 || !stream->receiving || stream->body.empty())
+        return ret;
+
+    return this->feedMessage(stream, stream->body.data(), stream->body.size(), 1);
+}
+
+/* 交给会话的消息解析, 消息收完或出错时结束接收 */
+int Http2Mux::feedMessage(Http2Stream *stream, const void *buf, size_t size, int endStream)
+{
+    CommSession *session = stream->session;
+    size_t n = size;
+    int ret = 0;
+
+    if (size > 0)
+        ret = this->appendMessage(buf, &n, session);
+
+    if (ret == 0) {
+        if (!endStream)
+            return 0;
+
+        errno = EBADMSG;
+        ret = -1;
+    } else if (ret > 0 && n < size) {
+        errno = EBADMSG;
+        ret = -1;
+    }
+
+    stream->receiving = 0;
+    mReceiving--;
+    if (ret < 0) {
+        this->resetStream(stream, HTTP2_PROTOCOL_ERROR);
+        this->done(session, CS_STATE_ERROR, errno);
+        this->removeStream(stream);
+    } else if (mServer) {
+        stream->state = HTTP2_STREAM_PROCESSING;
+        this->done(session, CS_STATE_TOREPLY, 0);
+    } else {
+        /* 回复已经收完, 请求还没发完的不再发 */
+        if (stream->left > 0)
+            this->resetStream(stream, HTTP2_CANCEL);
+
+        this->done(session, CS_STATE_SUCCESS, 0);
+        this->removeStream(stream);
+    }
+
+    return 0;
+}
+
+int Http2Mux::handleRstStream(Http2Stream *stream, uint32_t code)
+{
+    CommSession *session = stream->session;
+
+    stream->remoteClosed = 1;
+    if (mServer && stream->state == HTTP2_STREAM_PROCESSING) {
+        /* 会话已经交出去, 回复或删除时再结束 */
+        stream->reset = 1;
+        return 0;
+    }
+
+    if (!mServer && code == HTTP2_REFUSED_STREAM && !stream->headReceived)
+        this->replay(session, 1);
+    else
+        this->done(session, CS_STATE_ERROR, ECONNRESET);
+
+    this->removeStream(stream);
+    return 0;
+}
+
+int Http2Mux::handleGoaway(uint32_t lastId)
+{
+    std::vector<Http2Stream *> streams;
+
+    mGoaway = true;
+    if (mServer)
+        return 0;
+
+    /* 编号大于 lastId 的流对端没有处理, 可以换连接重发 */
+    for (auto it = mStreams.upper_bound(lastId); it != mStreams.end(); ++it)
+        streams.push_back(it->second);
+
+    for (Http2Stream *stream : streams) {
+        this->replay(stream->session, 1);
+        this->removeStream(stream);
+    }
+
+    return 0;
+}
+
+void Http2Mux::abort(int state, int error)
+{
+    Http2Stream *stream;
+
+    for (auto& it : mStreams) {
+        stream = it.second;
+        if (mServer && stream->state == HTTP2_STREAM_PROCESSING)
+            setStreamId(stream->session, 0);
+        else if (!mServer && !stream->headReceived)
+            this->replay(stream->session, 0);
+        else
+            this->done(stream->session, state, error);
+
+        delete stream;
+    }
+
+    mStreams.clear();
+    INIT_LIST_HEAD(&mSendList);
+    mActive = 0;
+    mReceiving = 0;
+}
+
+/**
+ * 把会话 encode() 出的 HTTP/1.1 消息的头部转成 HEADERS 帧发出, body 留给 pull() 按窗口发送.
+ * 头部都在内存段里, 以空行结束, 之后是 body
+ */
+int Http2Mux::encodeHeaders(CommSession *session, Http2Stream *stream)
+{
+    struct iovec vectors[HTTP2_ENCODE_IOV_MAX];
+    std::string head;
+    std::string block;
+    std::string name;
+    std::string authority;
+    const char *uri;
+    const char *p;
+    size_t pos = std::string::npos;
+    size_t bodyOff = 0;
+    size_t start;
+    size_t end;
+    size_t colon;
+    size_t n;
+    bool chunked = false;
+    char buf[1024];
+    int cnt;
+    int i;
+
+    cnt = this->encodeMessage(vectors, HTTP2_ENCODE_IOV_MAX, session);
+    if (cnt < 0)
+        return -1;
+
+    if (cnt > HTTP2_ENCODE_IOV_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        if (vectors[i].iov_len & CPOLL_IOV_FILE)
+            break;
+
+        start = head.size() > 3 ? head.size() - 3 : 0;
+        head.append((const char *)vectors[i].iov_base, vectors[i].iov_len);
+        pos = head.find("\r\n\r\n", start);
+        if (pos != std::string::npos) {
+            bodyOff = vectors[i].iov_len - (head.size() - pos - 4);
+            break;
+        }
+    }
+
+    if (pos == std::string::npos) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    head.resize(pos + 2);
+    end = head.find("\r\n");
+    start = head.find(' ');
+    colon = start == std::string::npos ? std::string::npos : head.find(' ', start + 1);
+    if (colon == std::string::npos || colon > end) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (mServer) {
+        n = hpack_encode_header(":status", 7, head.data() + start + 1, colon - start - 1, buf);
+        block.append(buf, n);
+    } else {
+        name.assign(head, start + 1, colon - start - 1);
+        uri = name.c_str();
+        /* 代理形式的 URI 拆出 authority 和 path */
+        p = strstr(uri, "://");
+        if (p && p < strchr(uri, '/')) {
+            p += 3;
+            uri = strchr(p, '/');
+            authority.assign(p, uri ? uri - p : strlen(p));
+            if (!uri)
+                uri = "/";
+        }
+
+        n = hpack_encode_header(":method", 7, head.data(), start, buf);
+        block.append(buf, n);
+        p = mSSL ? "https" : "http";
+        n = hpack_encode_header(":scheme", 7, p, strlen(p), buf);
+        block.append(buf, n);
+        n = strlen(uri);
+        if (hpack_encode_bound(5, n) > sizeof (buf)) {
+            std::vector<char> big(hpack_encode_bound(5, n));
+            block.append(big.data(), hpack_encode_header(":path", 5, uri, n, big.data()));
+        } else {
+            block.append(buf, hpack_encode_header(":path", 5, uri, n, buf));
+        }
+    }
+
+    /* 头部: 名字改成小写, 去掉连接相关的, Host 改成 :authority */
+    for (start = end + 2; start < head.size(); start = end + 2) {
+        end = head.find("\r\n", start);
+        colon = head.find(':', start);
+        if (colon == std::string::npos || colon > end)
+            continue;
+
+        name.assign(head, start, colon - start);
+        for (char& c : name)
+            c = tolower((unsigned char)c);
+
+        for (colon++; colon < end && (head[colon] == ' ' || head[colon] == '\t'); colon++) { }
+        if (name == "transfer-encoding") {
+            chunked = strcasestr(head.c_str() + colon, "chunked") != NULL;
+            continue;
+        }
+
+        if (_connection_header(name.c_str(), name.size()))
+            continue;
+
+        if (name == "host" && !mServer) {
+            if (authority.empty())
+                authority.assign(head, colon, end - colon);
+            continue;
+        }
+
+        if (name == "te" && strncasecmp(head.c_str() + colon, "trailers", 8) != 0)
+            continue;
+
+        n = hpack_encode_bound(name.size(), end - colon);
+        if (n > sizeof (buf)) {
+            std::vector<char> big(n);
+            block.append(big.data(), hpack_encode_header(name.data(), name.size(), head.data() + colon, end - colon, big.data()));
+        } else {
+            block.append(buf, hpack_encode_header(name.data(), name.size(), head.data() + colon, end - colon, buf));
+        }
+    }
+
+    if (!mServer && !authority.empty()) {
+        /* :authority 要在普通头部之前, 放到伪头部的最后 */
+        std::vector<char> big(hpack_encode_bound(10, authority.size()));
+        n = hpack_encode_header(":authority", 10, authority.data(), authority.size(), big.data());
+        block.insert(0, big.data(), n);
+    }
+
+    /* body */
+    stream->iov.clear();
+    stream->body.clear();
+    stream->left = 0;
+    if (bodyOff < vectors[i].iov_len) {
+        stream->iov.push_back({(char *)vectors[i].iov_base + bodyOff, vectors[i].iov_len - bodyOff});
+        stream->left += vectors[i].iov_len - bodyOff;
+    }
+
+    for (i++; i < cnt; i++) {
+        stream->iov.push_back(vectors[i]);
+        stream->left += CPOLL_IOV_LEN(&vectors[i]);
+    }
+
+    stream->iovIdx = 0;
+    stream->iovOff = 0;
+    if (stream->headRequest) {
+        stream->iov.clear();
+        stream->left = 0;
+    }
+
+    if (chunked && stream->left > 0) {
+        std::string raw;
+
+        for (auto& iov : stream->iov) {
+            if (iov.iov_len & CPOLL_IOV_FILE) {
+                const CPollFileSegment *seg = (const CPollFileSegment *)iov.iov_base;
+                n = raw.size();
+                raw.resize(n + seg->size);
+                if (pread(seg->fd, &raw[n], seg->size, seg->offset) != (ssize_t)seg->size) {
+                    errno = EIO;
+                    return -1;
+                }
+            } else
+                raw.append((const char *)iov.iov_base, iov.iov_len);
+        }
+
+        if (_dechunk(raw, stream->body) < 0)
+            return -1;
+
+        stream->iov.clear();
+        stream->left = stream->body.size();
+        if (stream->left > 0)
+            stream->iov.push_back({&stream->body[0], stream->left});
+    }
+
+    /* 头部块超过对端的帧大小时分成 HEADERS 和 CONTINUATION */
+    p = block.data();
+    n = block.size();
+    i = HTTP2_FRAME_HEADERS;
+    do {
+        size_t len = n > mPeerMaxFrame ? mPeerMaxFrame : n;
+        uint8_t flags = len == n ? HTTP2_FLAG_END_HEADERS : 0;
+
+        if (i == HTTP2_FRAME_HEADERS && stream->left == 0)
+            flags |= HTTP2_FLAG_END_STREAM;
+
+        if (this->frame(i, flags, stream->id, p, len) < 0)
+            return -1;
+
+        p += len;
+        n -= len;
+        i = HTTP2_FRAME_CONTINUATION;
+    } while (n > 0);
+
+    return 0;
+}
+
+int Http2Mux::request(CommSession *session)
+{
+    Http2Stream *stream;
+
+    if (!this->available()) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    stream = new Http2Stream;
+    stream->id = mNextStreamId;
+    stream->headRequest = 0;
+    INIT_LIST_HEAD(&stream->list);
+    if (this->encodeHeaders(session, stream) < 0) {
+        delete stream;
+        return -1;
+    }
+
+    mNextStreamId += 2;
+    stream->session = session;
+    stream->state = HTTP2_STREAM_RECEIVING;
+    stream->receiving = 1;
+    stream->headReceived = 0;
+    stream->remoteClosed = 0;
+    stream->reset = 0;
+    stream->buffered = 0;
+    stream->sendWindow = mPeerInitialWindow;
+    stream->recvWindow = HTTP2_LOCAL_WINDOW;
+    stream->recvConsumed = 0;
+    setStreamId(session, stream->id);
+    mStreams[stream->id] = stream;
+    mActive++;
+    mReceiving++;
+    if (stream->left > 0)
+        list_add_tail(&stream->list, &mSendList);
+
+    return 0;
+}
+
+int Http2Mux::reply(CommSession *session)
+{
+    Http2Stream *stream = this->findStream(getStreamId(session));
+
+    if (!stream || stream->session != session || stream->state != HTTP2_STREAM_PROCESSING) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (stream->reset) {
+        this->removeStream(stream);
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (this->encodeHeaders(session, stream) < 0) {
+        this->resetStream(stream, HTTP2_INTERNAL_ERROR);
+        this->removeStream(stream);
+        return -1;
+    }
+
+    stream->state = HTTP2_STREAM_SENDING;
+    if (stream->left == 0) {
+        this->done(session, CS_STATE_SUCCESS, 0);
+        this->removeStream(stream);
+    } else if (stream->sendWindow > 0) {
+        list_add_tail(&stream->list, &mSendList);
+    }
+
+    return 0;
+}
+
+void Http2Mux::cancel(CommSession *session)
+{
+    Http2Stream *stream = this->findStream(getStreamId(session));
+
+    if (stream && stream->session == session) {
+        if (!stream->reset)
+            this->resetStream(stream, HTTP2_CANCEL);
+
+        this->removeStream(stream);
+    }
+}
+
+/* 从会话的 body 里取 n 字节作为一个 DATA 帧 */
+int Http2Mux::sendData(Http2Stream *stream, size_t n)
+{
+    uint8_t flags = n == stream->left ? HTTP2_FLAG_END_STREAM : 0;
+    const CPollFileSegment *seg;
+    struct iovec *iov;
+    char buf[HTTP2_FRAME_SIZE_DEFAULT];
+    size_t len;
+    ssize_t ret;
+
+    if (this->frame(HTTP2_FRAME_DATA, flags, stream->id, NULL, n) < 0)
+        return -1;
+
+    stream->left -= n;
+    while (n > 0) {
+        iov = &stream->iov[stream->iovIdx];
+        len = CPOLL_IOV_LEN(iov) - stream->iovOff;
+        if (len > n)
+            len = n;
+
+        if (iov->iov_len & CPOLL_IOV_FILE) {
+            seg = (const CPollFileSegment *)iov->iov_base;
+            if (len > sizeof (buf))
+                len = sizeof (buf);
+
+            ret = pread(seg->fd, buf, len, seg->offset + stream->iovOff);
+            if (ret <= 0) {
+                errno = ret < 0 ? errno : EIO;
+                return -1;
+            }
+
+            len = ret;
+            if (this->output(buf, len) < 0)
+                return -1;
+        } else if (this->output((const char *)iov->iov_base + stream->iovOff, len) < 0)
+            return -1;
+
+        n -= len;
+        stream->iovOff += len;
+        if (stream->iovOff == CPOLL_IOV_LEN(iov)) {
+            stream->iovIdx++;
+            stream->iovOff = 0;
+        }
+    }
+
+    return 0;
+}
+
+void Http2Mux::pull()
+{
+    Http2Stream *stream;
+    size_t n;
+
+    while (!list_empty(&mSendList) && mSendWindow > 0 && this->pending() < HTTP2_PENDING_MAX) {
+        stream = list_entry(mSendList.next, Http2Stream, list);
+        n = stream->left;
+        if (n > mPeerMaxFrame)
+            n = mPeerMaxFrame;
+
+        if ((int64_t)n > stream->sendWindow)
+            n = stream->sendWindow > 0 ? stream->sendWindow : 0;
+
+        if ((int64_t)n > mSendWindow)
+            n = mSendWindow;
+
+        /* 流的窗口用完了, 等它的 WINDOW_UPDATE */
+        if (n == 0) {
+            list_del(&stream->list);
+            INIT_LIST_HEAD(&stream->list);
+            continue;
+        }
+
+        if (this->sendData(stream, n) < 0) {
+            this->resetStream(stream, HTTP2_INTERNAL_ERROR);
+            this->done(stream->session, CS_STATE_ERROR, errno);
+            this->removeStream(stream);
+            continue;
+        }
+
+        stream->sendWindow -= n;
+        mSendWindow -= n;
+        if (stream->left > 0) {
+            list_move_tail(&stream->list, &mSendList);
+            continue;
+        }
+
+        list_del(&stream->list);
+        INIT_LIST_HEAD(&stream->list);
+        if (mServer) {
+            this->done(stream->session, CS_STATE_SUCCESS, 0);
+            this->removeStream(stream);
+        }
+    }
+}
@@ -0,0 +1,91 @@
+//
+// Created by dingjing on 8/27/22.
+//
+
+#ifndef JARVIS_HTTP2_MUX_H
+#define JARVIS_HTTP2_MUX_H
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#include "hpack.h"
+#include "app/core/c-list.h"
+#include "app/core/communicator.h"
+
+#define HTTP2_CLIENT_PREFACE            "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_CLIENT_PREFACE_LEN        24
+#define HTTP2_ALPN_ID                   "h2"
+
+namespace protocol
+{
+    typedef struct _Http2Stream             Http2Stream;
+
+    /**
+     * @brief
+     *  HTTP/2 (RFC 9113) 连接. 会话的消息仍是 HttpRequest/HttpResponse: 发送时把 encode() 出的 HTTP/1.1 消息
+     *  转成 HEADERS 和 DATA 帧, 收到的帧拼成 HTTP/2.0 版本的 HTTP/1.1 文本交给会话的消息解析.
+     *  不支持服务端推送和优先级, 头部压缩不使用动态表
+     */
+    class Http2Mux : public CommMux
+    {
+    public:
+        Http2Mux(bool server, bool ssl);
+        ~Http2Mux() override;
+
+    private:
+        int input(const void* buf, size_t size) override;
+        int open() override;
+        int request(CommSession* session) override;
+        int reply(CommSession* session) override;
+        void cancel(CommSession* session) override;
+        void abort(int state, int error) override;
+        int available() override;
+        void pull() override;
+
+    private:
+        int handleFrame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, size_t len);
+        int handleHeaders(uint32_t id, int endStream);
+        int handleData(Http2Stream* stream, const uint8_t* data, size_t len, int endStream);
+        int handleSettings(const uint8_t* payload, size_t len);
+        int handleRstStream(Http2Stream* stream, uint32_t code);
+        int handleGoaway(uint32_t lastId);
+        int feedMessage(Http2Stream* stream, const void* buf, size_t size, int endStream);
+
+        int encodeHeaders(CommSession* session, Http2Stream* stream);
+        int sendData(Http2Stream* stream, size_t n);
+        void resetStream(uint32_t id, uint32_t code);
+        void resetStream(Http2Stream* stream, uint32_t code);
+        bool idleStream(uint32_t id) const;
+        int replenish(Http2Stream* stream, size_t n);
+        void removeStream(Http2Stream* stream);
+        Http2Stream* findStream(uint32_t id);
+
+        int frame(uint8_t type, uint8_t flags, uint32_t id, const void* payload, size_t len);
+        int windowUpdate(uint32_t id, uint32_t increment);
+        int goaway(uint32_t code);
+
+    private:
+        bool                                    mServer;
+        bool                                    mSSL;
+        bool                                    mGoaway;            // 收到或发出了 GOAWAY, 不再开始新的流
+        size_t                                  mPrefaceLeft;       // 服务端还要收的客户端开头字节数
+        std::string                             mInput;             // 不完整的帧
+        std::string                             mHeaderBlock;       // HEADERS 和 CONTINUATION 拼成的头部块
+        uint32_t                                mHeaderStream;      // 正在收头部块的流, 0 没有
+        int                                     mHeaderEnd;         // 头部块所在的 HEADERS 带 END_STREAM
+        HpackDecoder                            mDecoder;
+
+        uint32_t                                mNextStreamId;
+        uint32_t                                mLastStreamId;      // 对端开始的最大的流
+        uint32_t                                mPeerMaxStreams;
+        uint32_t                                mPeerMaxFrame;
+        int64_t                                 mPeerInitialWindow;
+        int64_t                                 mSendWindow;
+        int64_t                                 mRecvWindow;        // 本端通告的连接窗口还剩多少
+        uint32_t                                mRecvConsumed;      // 连接上收到还没有 WINDOW_UPDATE 的字节数
+        std::map<uint32_t, Http2Stream*>        mStreams;
+        struct list_head                        mSendList;          // 有数据要发并且窗口不为 0 的流
+    };
+}
+
+#endif //JARVIS_HTTP2_MUX_H
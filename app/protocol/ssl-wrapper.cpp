@@ -9,6 +9,8 @@
 #include <openssl/err.h>
 #include <openssl/bio.h>
 
+#include "../core/c-poll.h"
+
 namespace protocol
 {
 
@@ -129,6 +131,8 @@ namespace protocol
         return -1;
     }
 
+#define SSL_FILE_BUFSIZE	16384
+
     int SSLWrapper::encode(struct iovec vectors[], int max)
     {
         BIO *wbio = SSL_get_wbio(this->ssl);
@@ -152,7 +156,33 @@ namespace protocol
         max = ret;
         for (iov = vectors; iov < vectors + max; iov++)
         {
-            if (iov->iov_len > 0)
+            // 文件段分块读出后加密
+            while (iov->iov_len & CPOLL_IOV_FILE)
+            {
+                char buf[SSL_FILE_BUFSIZE];
+                ssize_t n;
+
+                if (CPOLL_IOV_LEN(iov) == 0)
+                    break;
+
+                n = poll_read_file(iov, buf, SSL_FILE_BUFSIZE);
+                if (n < 0)
+                    return -1;
+
+                ret = SSL_write(this->ssl, buf, (int)n);
+                if (ret <= 0)
+                {
+                    ret = SSL_get_error(this->ssl, ret);
+                    if (ret != SSL_ERROR_SYSCALL)
+                        errno = -ret;
+
+                    return -1;
+                }
+
+                poll_iov_advance(iov, 1, n);
+            }
+
+            if (!(iov->iov_len & CPOLL_IOV_FILE) && iov->iov_len > 0)
             {
                 ret = SSL_write(this->ssl, iov->iov_base, iov->iov_len);
                 if (ret <= 0)
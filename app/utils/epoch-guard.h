@@ -0,0 +1,79 @@
+//
+// Created by dingjing on 8/30/22.
+//
+
+#ifndef JARVIS_EPOCH_GUARD_H
+#define JARVIS_EPOCH_GUARD_H
+#include <sched.h>
+#include <stdint.h>
+
+#include <mutex>
+
+#define EPOCH_GUARD_SLOTS           64
+
+/**
+ * @brief
+ *  读多写少的数据的 epoch 回收: 读者只在 readLock()/readUnlock() 之间用读到的指针, 不加锁;
+ *  写者换掉指针后调用 synchronize(), 返回时换之前进来的读者都已离开, 可以释放旧数据.
+ *  读者计数按线程分槽, 两组计数轮换, 一直有新读者时写者也不会一直等. 多个写者的 synchronize() 串行执行
+ */
+class EpochGuard
+{
+public:
+    EpochGuard() : mEpoch(0)
+    {
+        for (auto& slot : mSlots)
+            slot.readers[0] = slot.readers[1] = 0;
+    }
+
+    unsigned int readLock()
+    {
+        unsigned int epoch = __atomic_load_n(&mEpoch, __ATOMIC_SEQ_CST) & 1;
+
+        __atomic_add_fetch(&mSlots[EpochGuard::slot()].readers[epoch], 1, __ATOMIC_SEQ_CST);
+        return epoch;
+    }
+
+    void readUnlock(unsigned int epoch)
+    {
+        __atomic_sub_fetch(&mSlots[EpochGuard::slot()].readers[epoch], 1, __ATOMIC_RELEASE);
+    }
+
+    /* 轮换两次: 读到旧 epoch 后才加计数的读者, 可能记在刚换上的那组里, 第二轮等的就是它们 */
+    void synchronize()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        unsigned int epoch;
+
+        /* 换指针的写入要在看读者计数之前 */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (int i = 0; i < 2; i++) {
+            epoch = __atomic_fetch_add(&mEpoch, 1, __ATOMIC_SEQ_CST) & 1;
+            for (auto& slot : mSlots) {
+                while (__atomic_load_n(&slot.readers[epoch], __ATOMIC_ACQUIRE) != 0)
+                    sched_yield();
+            }
+        }
+    }
+
+private:
+    static unsigned int slot()
+    {
+        static unsigned int next;
+        static thread_local unsigned int index = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % EPOCH_GUARD_SLOTS;
+
+        return index;
+    }
+
+private:
+    struct alignas(64) Slot
+    {
+        long                        readers[2];
+    };
+
+    unsigned int                    mEpoch;
+    Slot                            mSlots[EPOCH_GUARD_SLOTS];
+    std::mutex                      mMutex;
+};
+
+#endif //JARVIS_EPOCH_GUARD_H
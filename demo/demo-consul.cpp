@@ -0,0 +1,239 @@
+//
+// Created by dingjing on 8/31/22.
+//
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "../app/manager/global.h"
+#include "../app/modules/server.h"
+#include "../app/manager/facilities.h"
+#include "../app/utils/json-parser.h"
+#include "../app/modules/http-server.h"
+#include "../app/factory/task-factory.h"
+#include "../app/nameservice/consul-policy.h"
+#include "../app/protocol/http/http-util.h"
+
+// The example runs a tiny fake Consul agent, registers two HttpServer
+// instances into it and reaches them by service name through ConsulPolicy.
+
+/* Only the 3 apis used by ConsulPolicy. Blocking health queries are
+ * answered when the index moves past the client's one or 'wait' expires. */
+struct FakeInstance
+{
+    std::string service;
+    std::string address;
+    int port;
+};
+
+static std::mutex fakeMutex;
+static long long fakeIndex = 1;
+static std::map<std::string, FakeInstance> fakeInstances;
+
+static std::string query_param(const std::string& uri, const char *name)
+{
+    std::string key = std::string(name) + "=";
+    size_t pos = uri.find('?');
+
+    while (pos != std::string::npos) {
+        pos++;
+        if (uri.compare(pos, key.size(), key) == 0) {
+            size_t end = uri.find('&', pos);
+            return uri.substr(pos + key.size(), end == std::string::npos ? std::string::npos : end - pos - key.size());
+        }
+
+        pos = uri.find('&', pos);
+    }
+
+    return "";
+}
+
+static void health_reply(HttpTask *task, const std::string& service)
+{
+    protocol::HttpResponse *resp = task->getResp();
+    std::string body = "[";
+
+    std::lock_guard<std::mutex> lock(fakeMutex);
+    for (auto& kv : fakeInstances) {
+        if (kv.second.service != service)
+            continue;
+
+        if (body.size() > 1)
+            body += ",";
+
+        body += "{\"Node\":{\"Address\":\"127.0.0.1\"},\"Service\":{\"ID\":\"" + kv.first +
+                "\",\"Service\":\"" + service + "\",\"Address\":\"" + kv.second.address +
+                "\",\"Port\":" + std::to_string(kv.second.port) + "},\"Checks\":[]}";
+    }
+
+    body += "]";
+    resp->setStatusCode("200");
+    resp->addHeaderPair("Content-Type", "application/json");
+    resp->addHeaderPair("X-Consul-Index", std::to_string(fakeIndex));
+    resp->appendOutputBody(body);
+}
+
+/* Check every 50ms until something changes, without holding a handler thread. */
+static void health_wait(HttpTask *task, const std::string& service, long long index, int left)
+{
+    bool changed;
+
+    {
+        std::lock_guard<std::mutex> lock(fakeMutex);
+        changed = fakeIndex > index;
+    }
+
+    if (changed || left <= 0) {
+        health_reply(task, service);
+        return;
+    }
+
+    *seriesOf(task) << TaskFactory::createTimerTask(50 * 1000, [task, service, index, left](TimerTask *) {
+        health_wait(task, service, index, left - 50);
+    });
+}
+
+static void fake_consul(HttpTask *task)
+{
+    protocol::HttpRequest *req = task->getReq();
+    std::string uri = req->getRequestUri();
+    std::string path = uri.substr(0, uri.find('?'));
+    const char *prefix;
+    const void *body;
+    size_t size;
+
+    prefix = "/v1/health/service/";
+    if (path.compare(0, strlen(prefix), prefix) == 0) {
+        std::string index = query_param(uri, "index");
+        std::string wait = query_param(uri, "wait");
+
+        health_wait(task, path.substr(strlen(prefix)), atoll(index.c_str()), index.empty() ? 0 : atoi(wait.c_str()));
+        return;
+    }
+
+    prefix = "/v1/agent/service/deregister/";
+    if (path.compare(0, strlen(prefix), prefix) == 0) {
+        std::lock_guard<std::mutex> lock(fakeMutex);
+        fakeInstances.erase(path.substr(strlen(prefix)));
+        fakeIndex++;
+        task->getResp()->setStatusCode("200");
+        return;
+    }
+
+    if (path == "/v1/agent/service/register" && req->getParsedBody(&body, &size)) {
+        json_value_t *root = json_value_parse(std::string((const char *)body, size).c_str());
+        const json_object_t *obj = root ? json_value_object(root) : NULL;
+        const json_value_t *id = obj ? json_object_find("ID", obj) : NULL;
+        const json_value_t *name = obj ? json_object_find("Name", obj) : NULL;
+        const json_value_t *addr = obj ? json_object_find("Address", obj) : NULL;
+        const json_value_t *port = obj ? json_object_find("Port", obj) : NULL;
+
+        if (id && name && port) {
+            std::lock_guard<std::mutex> lock(fakeMutex);
+            fakeInstances[json_value_string(id)] = {
+                    json_value_string(name),
+                    addr ? json_value_string(addr) : "127.0.0.1",
+                    (int)json_value_number(port),
+            };
+            fakeIndex++;
+            task->getResp()->setStatusCode("200");
+        } else {
+            task->getResp()->setStatusCode("400");
+        }
+
+        if (root)
+            json_value_destroy(root);
+
+        return;
+    }
+
+    task->getResp()->setStatusCode("404");
+}
+
+static unsigned short listen_port(const ServerBase& server)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof sin;
+
+    server.get_listen_addr((struct sockaddr *)&sin, &len);
+    return ntohs(sin.sin_port);
+}
+
+static void fetch(const char *url, int n)
+{
+    std::map<std::string, int> counts;
+
+    for (int i = 0; i < n; i++) {
+        Facilities::WaitGroup wg(1);
+
+        TaskFactory::createHttpTask(url, 0, 0, [&](HttpTask *task, void *) {
+            if (task->getState() == TASK_STATE_SUCCESS)
+                counts[protocol::HttpUtil::decodeChunkedBody(task->getResp())]++;
+            else
+                counts[Global::getErrorString(task->getState(), task->getError())]++;
+
+            wg.done();
+        }, nullptr)->start();
+
+        wg.wait();
+    }
+
+    for (auto& kv : counts)
+        printf("  %-32s %d\n", kv.first.c_str(), kv.second);
+}
+
+int main()
+{
+    HttpServer consul(fake_consul);
+    HttpServer a([](HttpTask *task) { task->getResp()->appendOutputBody("echo-a"); });
+    HttpServer b([](HttpTask *task) { task->getResp()->appendOutputBody("echo-b"); });
+
+    if (consul.start("127.0.0.1", 0) < 0 || a.start("127.0.0.1", 0) < 0 || b.start("127.0.0.1", 0) < 0) {
+        perror("start server");
+        exit(1);
+    }
+
+    protocol::ConsulConfig config;
+    config.setWaitTTL(2000);
+
+    ConsulPolicy *policy = new ConsulPolicy("http://127.0.0.1:" + std::to_string(listen_port(consul)), config);
+    protocol::ConsulService service = { };
+
+    /* Port 0 means the port the server is listening on. */
+    service.serviceName = "echo";
+    service.serviceID = "echo-a";
+    service.serviceAddress = { "127.0.0.1", 0 };
+    if (policy->registerServer(&a, service) < 0)
+        perror("register echo-a");
+
+    service.serviceID = "echo-b";
+    if (policy->registerServer(&b, service) < 0)
+        perror("register echo-b");
+
+    policy->watchService("echo", UPSTREAM_WEIGHTED_ROUND_ROBIN);
+    Global::getNameService()->addPolicy("echo", policy);
+    usleep(200 * 1000);
+
+    printf("two instances:\n");
+    fetch("http://echo/", 10);
+
+    policy->deregisterServer("echo-b");
+    usleep(200 * 1000);
+    printf("after deregistering echo-b:\n");
+    fetch("http://echo/", 10);
+
+    Global::getNameService()->delPolicy("echo");
+    delete policy;
+    a.stop();
+    b.stop();
+    consul.stop();
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+//
+// Created by dingjing on 9/1/22.
+//
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include "../app/manager/global.h"
+#include "../app/manager/route-manager.h"
+
+// Microbenchmark of RouteManager::get(): threads look up random routes
+// that already exist, which is what every outgoing request does.
+//
+// USAGE: demo-route-cache [threads] [routes] [seconds]
+
+static double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 64;
+    int routes = argc > 2 ? atoi(argv[2]) : 1000;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    std::vector<struct sockaddr_in> addrs(routes);
+    std::vector<struct addrinfo> infos(routes);
+    RouteManager *manager = Global::getRouteManager();
+    EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+    std::atomic<unsigned long> total(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> workers;
+    RouteManager::RouteResult result;
+    std::string info, host;
+
+    /* 127.0.x.y:80, one route each */
+    for (int i = 0; i < routes; i++) {
+        memset(&addrs[i], 0, sizeof addrs[i]);
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_port = htons(80);
+        addrs[i].sin_addr.s_addr = htonl(0x7f000000 | (i + 1));
+
+        memset(&infos[i], 0, sizeof infos[i]);
+        infos[i].ai_family = AF_INET;
+        infos[i].ai_socktype = SOCK_STREAM;
+        infos[i].ai_addr = (struct sockaddr *)&addrs[i];
+        infos[i].ai_addrlen = sizeof addrs[i];
+
+        if (manager->get(TT_TCP, &infos[i], info, &params, host, result) < 0) {
+            perror("RouteManager::get");
+            exit(1);
+        }
+    }
+
+    double start = now_seconds();
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            RouteManager::RouteResult result;
+            unsigned int seed = t * 2654435761U + 1;
+            unsigned long n = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 1000; i++) {
+                    seed ^= seed << 13;
+                    seed ^= seed >> 17;
+                    seed ^= seed << 5;
+                    manager->get(TT_TCP, &infos[seed % routes], info, &params, host, result);
+                }
+
+                n += 1000;
+            }
+
+            total += n;
+        });
+    }
+
+    while (now_seconds() - start < seconds)
+        usleep(10 * 1000);
+
+    stop = true;
+    for (auto& worker : workers)
+        worker.join();
+
+    double elapsed = now_seconds() - start;
+
+    printf("%d threads, %d routes: %.2f M lookups/s\n", threads, routes, total / elapsed / 1e6);
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#ifndef JARVIS_FILE_TEST_H
+#define JARVIS_FILE_TEST_H
+#include "../app/manager/global.h"
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+/**
+ * @brief
+ *  文件任务测试的公共夹具: 每个用例一个空的临时文件 mPath, 用例结束时删掉.
+ *  全局设置只能在第一个任务之前改, 子类在 SetUpTestSuite() 里调用 setUpSettings()
+ */
+class FileTest : public ::testing::Test
+{
+protected:
+    template <typename Modify>
+    static void setUpSettings(Modify modify)
+    {
+        GlobalSettings settings = GLOBAL_SETTINGS_DEFAULT;
+
+        modify(settings);
+        Global::setGlobalSettings(&settings);
+    }
+
+    void SetUp() override
+    {
+        char path[] = "/tmp/test-file-XXXXXX";
+        int fd = mkstemp(path);
+
+        ASSERT_GE(fd, 0);
+        close(fd);
+        mPath = path;
+    }
+
+    void TearDown() override
+    {
+        unlink(mPath.c_str());
+    }
+
+    std::string                 mPath;
+};
+
+#endif //JARVIS_FILE_TEST_H
@@ -0,0 +1,65 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#ifndef JARVIS_PARAMS_POLICY_H
+#define JARVIS_PARAMS_POLICY_H
+#include "../app/manager/global.h"
+#include "../app/factory/workflow.h"
+#include "../app/utils/uri-parser.h"
+#include "../app/manager/route-manager.h"
+#include "../app/nameservice/dns-resolver.h"
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief
+ *  和默认的 DnsResolver 一样解析, 只是目标用自己的 EndpointParams, 不用改全局设置.
+ *  以 host 为名字加到 NameService 里, 只对这个 host 生效
+ */
+class ParamsPolicy : public DnsResolver
+{
+public:
+    explicit ParamsPolicy(const EndpointParams& params) : mParams(params) { }
+
+    RouterTask *createRouterTask(const NSParams *params, RouterCallback callback, void *udata) override
+    {
+        const GlobalSettings *settings = Global::getGlobalSettings();
+
+        return new ResolverTask(params, settings->dns_ttl_default, settings->dns_ttl_min, &mParams,
+                                std::move(callback), udata);
+    }
+
+    /* 和请求 url 同一条路由, 只有一个地址 */
+    CommPoolStats poolStats(const std::string& url)
+    {
+        std::vector<CommPoolStats> stats;
+        ParsedURI uri;
+        void *cookie = nullptr;
+
+        URIParser::parse(url, uri);
+        NSParams params = {
+                .mType          = TT_TCP,
+                .mUri           = uri,
+                .mInfo          = "",
+                .mFixedAddr     = true,
+                .mRetryTimes    = 0,
+                .mTracing       = nullptr,
+        };
+
+        Workflow::startSeriesWork(this->createRouterTask(&params, [&](RouterTask *task) {
+            cookie = task->get_result()->mCookie;
+        }, nullptr), nullptr);
+
+        RouteManager::getPoolStats(cookie, stats);
+        EXPECT_EQ(stats.size(), 1);
+        return stats.empty() ? CommPoolStats() : stats[0];
+    }
+
+private:
+    EndpointParams              mParams;
+};
+
+#endif //JARVIS_PARAMS_POLICY_H
@@ -0,0 +1,164 @@
+//
+// Created by dingjing on 8/26/22.
+//
+
+#include "../app/core/buffer-pool.h"
+#include "../app/core/communicator.h"
+#include "../app/core/io-service.h"
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+TEST(BUFFER_POOL, GET_PUT) {
+    BufferPool* pool = buffer_pool_create(5000, 4);
+    std::vector<void*> bufs;
+
+    ASSERT_TRUE(pool);
+    EXPECT_EQ(buffer_pool_buf_size(pool) % 4096, 0);
+    EXPECT_GE(buffer_pool_buf_size(pool), 5000);
+    EXPECT_EQ(buffer_pool_count(pool), 4);
+
+    for (int i = 0; i < 4; ++i) {
+        void* buf = buffer_pool_get(pool);
+        ASSERT_TRUE(buf);
+        EXPECT_EQ((uintptr_t) buf % 4096, 0);
+        memset(buf, i, buffer_pool_buf_size(pool));
+        bufs.push_back(buf);
+    }
+
+    // 取空后不等待
+    EXPECT_EQ(buffer_pool_get(pool), nullptr);
+    EXPECT_EQ(errno, ENOBUFS);
+    EXPECT_EQ(buffer_pool_free_count(pool), 0);
+
+    // 不是池里的缓冲区不收
+    char other[16];
+    buffer_pool_put(other, pool);
+    buffer_pool_put((char*) bufs[0] + 1, pool);
+    EXPECT_EQ(buffer_pool_free_count(pool), 0);
+
+    buffer_pool_put(bufs[2], pool);
+    EXPECT_EQ(buffer_pool_get(pool), bufs[2]);
+    for (void* buf : bufs) {
+        buffer_pool_put(buf, pool);
+    }
+
+    EXPECT_EQ(buffer_pool_free_count(pool), 4);
+    buffer_pool_destroy(pool);
+
+    EXPECT_EQ(buffer_pool_create(0, 4), nullptr);
+    EXPECT_EQ(errno, EINVAL);
+};
+
+class TestIOService : public IOService
+{
+public:
+    std::atomic<int>            unbound{0};
+
+private:
+    void handleUnbound() override
+    {
+        unbound = 1;
+    }
+};
+
+class TestSession : public IOSession
+{
+public:
+    bool                        write = false;
+    int                         fd = -1;
+    void*                       buf = nullptr;
+    size_t                      count = 0;
+    long                        res = 0;
+    int                         state = -1;
+    std::atomic<int>            done{0};
+
+private:
+    int prepare() override
+    {
+        if (write) {
+            prepPWrite(fd, buf, count, 0);
+        } else {
+            prepPRead(fd, buf, count, 0);
+        }
+
+        return 0;
+    }
+
+    void handle(int state, int error) override
+    {
+        this->state = state;
+        this->res = getRes();
+        ++done;
+    }
+};
+
+/**
+ * @brief
+ *  注册为固定缓冲区后, 池里的缓冲区读写结果不变 (io_uring 下走 READ_FIXED/WRITE_FIXED)
+ */
+TEST(BUFFER_POOL, REGISTERED_IO) {
+    char name[] = "/tmp/test-buffer-pool-XXXXXX";
+    int fd = mkstemp(name);
+    Communicator comm;
+    TestIOService service;
+    BufferPool* pool = buffer_pool_create(8192, 4);
+
+    ASSERT_GE(fd, 0);
+    ASSERT_TRUE(pool);
+    ASSERT_EQ(comm.init(1, 2), 0);
+    ASSERT_EQ(service.init(64), 0);
+    ASSERT_EQ(comm.ioBind(&service), 0);
+
+    // 注册失败 (如 RLIMIT_MEMLOCK 太小) 时普通读写照样可用
+    int ret = service.registerBuffers(buffer_pool_base(pool), buffer_pool_buf_size(pool), (int) buffer_pool_count(pool));
+    printf("engine: %s, registered: %d\n", service.getEngine() == IOS_ENGINE_URING ? "io_uring" : "libaio", ret);
+    if (ret == 0 && service.getEngine() == IOS_ENGINE_URING) {
+        EXPECT_EQ(service.registerBuffers(buffer_pool_base(pool), buffer_pool_buf_size(pool), 1), -1);
+        EXPECT_EQ(errno, EBUSY);
+    }
+
+    void* wbuf = buffer_pool_get(pool);
+    void* rbuf = buffer_pool_get(pool);
+    memset(wbuf, 'x', 8192);
+    memset(rbuf, 0, 8192);
+
+    TestSession w;
+    w.write = true;
+    w.fd = fd;
+    w.buf = wbuf;
+    w.count = 8192;
+    ASSERT_EQ(service.request(&w), 0);
+    for (int i = 0; i < 5000 && w.done == 0; ++i)
+        usleep(1000);
+    EXPECT_EQ(w.state, IOS_STATE_SUCCESS);
+    EXPECT_EQ(w.res, 8192);
+
+    TestSession r;
+    r.fd = fd;
+    r.buf = rbuf;
+    r.count = 8192;
+    ASSERT_EQ(service.request(&r), 0);
+    for (int i = 0; i < 5000 && r.done == 0; ++i)
+        usleep(1000);
+    EXPECT_EQ(r.state, IOS_STATE_SUCCESS);
+    EXPECT_EQ(r.res, 8192);
+    EXPECT_EQ(memcmp(wbuf, rbuf, 8192), 0);
+
+    comm.ioUnbind(&service);
+    for (int i = 0; i < 5000 && service.unbound == 0; ++i)
+        usleep(1000);
+    service.deInit();
+    comm.deInit();
+    buffer_pool_destroy(pool);
+    close(fd);
+    unlink(name);
+};
@@ -4,6 +4,188 @@
 #include "../app/core/c-poll.h"
 #include <gtest/gtest.h>
 
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ECHO_MSG_SIZE           64
+
+typedef struct _EchoMessage     EchoMessage;
+typedef struct _EchoContext     EchoContext;
+
+struct _EchoMessage
+{
+    CPollMessage                base;
+    size_t                      received;
+};
+
+struct _EchoContext
+{
+    std::atomic<long>           requests;
+    std::atomic<long>           finished;
+    std::atomic<int>            lastError;
+};
+
+static int echo_append(const void* buf, size_t* size, CPollMessage* msg)
+{
+    auto m = (EchoMessage*) msg;
+    size_t need = ECHO_MSG_SIZE - m->received;
+
+    if (*size >= need) {
+        *size = need;
+        m->received = ECHO_MSG_SIZE;
+        return 1;
+    }
+
+    m->received += *size;
+    return 0;
+}
+
+static CPollMessage* echo_create_message(void* context)
+{
+    auto m = (EchoMessage*) malloc (sizeof (EchoMessage));
+    if (m) {
+        m->base.append = echo_append;
+        m->received = 0;
+    }
+
+    return (CPollMessage*) m;
+}
+
+static void echo_callback(CPollResult* res, void* context)
+{
+    auto ctx = (EchoContext*) context;
+    char reply[ECHO_MSG_SIZE] = {0};
+
+    if (res->state == PR_ST_SUCCESS) {
+        // 收到完整请求, 直接在 poll 线程里回应
+        ctx->requests++;
+        (void) !write(res->data.fd, reply, sizeof (reply));
+    } else {
+        ctx->lastError = res->error;
+        ctx->finished++;
+    }
+
+    free(res->data.message);
+    poll_free_result(res);
+}
+
+static CPollParams echo_params(EchoContext* ctx, int engine)
+{
+    CPollParams params = {
+            .maxOpenFiles = 4096,
+            .createMessage = echo_create_message,
+            .partialWritten = NULL,
+            .callback = echo_callback,
+            .context = ctx,
+            .engine = engine,
+    };
+
+    return params;
+}
+
+static void wait_for(const std::atomic<long>& value, long expect, int ms)
+{
+    for (int i = 0; i < ms && value < expect; ++i) {
+        usleep(1000);
+    }
+}
+
+/**
+ * @brief
+ *  pairs 个连接各做 rounds 次 64 字节的请求/应答, 返回每次往返的平均纳秒数
+ */
+static double echo_bench(int engine, int pairs, int rounds, const CPollSpin* spin = nullptr, CPollStats* stats = nullptr)
+{
+    EchoContext ctx;
+    ctx.requests = 0;
+    ctx.finished = 0;
+    ctx.lastError = 0;
+
+    CPollParams params = echo_params(&ctx, engine);
+    CPoll* poll = poll_create(&params);
+    EXPECT_TRUE(poll);
+    if (spin) {
+        EXPECT_EQ(poll_set_spin(spin, poll), 0);
+    }
+
+    EXPECT_EQ(poll_start(poll), 0);
+
+    std::vector<int> clients;
+    for (int i = 0; i < pairs; ++i) {
+        int sv[2];
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+        CPollData data = {};
+        data.operation = PD_OP_READ;
+        data.fd = sv[0];
+        data.ssl = NULL;
+        data.context = NULL;
+        data.message = NULL;
+        EXPECT_EQ(poll_add(&data, -1, poll), 0);
+        clients.push_back(sv[1]);
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    std::vector<std::thread> threads;
+    for (int fd : clients) {
+        threads.emplace_back([fd, rounds]() {
+            char buf[ECHO_MSG_SIZE] = {0};
+            for (int r = 0; r < rounds; ++r) {
+                if (write(fd, buf, sizeof (buf)) != sizeof (buf))
+                    return;
+
+                size_t n = 0;
+                while (n < sizeof (buf)) {
+                    ssize_t ret = read(fd, buf + n, sizeof (buf) - n);
+                    if (ret <= 0)
+                        return;
+                    n += ret;
+                }
+            }
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    EXPECT_EQ(ctx.requests, (long)pairs * rounds);
+
+    // 客户端关闭后服务端读到 EOF
+    for (int fd : clients) {
+        close(fd);
+    }
+
+    wait_for(ctx.finished, pairs, 2000);
+    EXPECT_EQ(ctx.finished, pairs);
+
+    if (stats)
+        poll_get_stats(stats, poll);
+    poll_stop(poll);
+    poll_destroy(poll);
+
+    double ns = (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+    return ns / ((double)pairs * rounds);
+}
+
 TEST(CPOLL, CREATE) {
     CPollParams param = {
             .maxOpenFiles = 100,
@@ -34,3 +216,444 @@ TEST(CPOLL, RUN) {
 
     poll_destroy(poll);
 };
+
+TEST(CPOLL, URING_RUN) {
+    CPollParams param = {
+            .maxOpenFiles = 100,
+            .createMessage = NULL,
+            .partialWritten = NULL,
+            .callback = NULL,
+            .context = NULL,
+            .engine = CPOLL_ENGINE_URING,
+    };
+    CPoll* poll = poll_create(&param);
+
+    ASSERT_TRUE(poll);
+    printf("engine: %s\n", poll_get_engine(poll) == CPOLL_ENGINE_URING ? "io_uring" : "epoll");
+    ASSERT_TRUE(!poll_start(poll));
+
+    poll_stop(poll);
+    poll_destroy(poll);
+};
+
+TEST(CPOLL, TIMEOUT) {
+    for (int engine : {CPOLL_ENGINE_EPOLL, CPOLL_ENGINE_URING}) {
+        EchoContext ctx;
+        ctx.requests = 0;
+        ctx.finished = 0;
+        ctx.lastError = 0;
+
+        CPollParams params = echo_params(&ctx, engine);
+        CPoll* poll = poll_create(&params);
+        ASSERT_TRUE(poll);
+        ASSERT_EQ(poll_start(poll), 0);
+
+        int sv[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+        CPollData data = {};
+        data.operation = PD_OP_READ;
+        data.fd = sv[0];
+        ASSERT_EQ(poll_add(&data, 50, poll), 0);
+
+        // 延长超时后, 50ms 时不应触发
+        ASSERT_EQ(poll_set_timeout(sv[0], 200, poll), 0);
+        usleep(100 * 1000);
+        EXPECT_EQ(ctx.finished, 0) << "engine " << engine;
+
+        wait_for(ctx.finished, 1, 1000);
+        EXPECT_EQ(ctx.finished, 1);
+        EXPECT_EQ(ctx.lastError, ETIMEDOUT);
+
+        poll_stop(poll);
+        poll_destroy(poll);
+        close(sv[0]);
+        close(sv[1]);
+    }
+};
+
+TEST(CPOLL, TIMER) {
+    EchoContext ctx;
+    ctx.requests = 0;
+    ctx.finished = 0;
+    ctx.lastError = 0;
+
+    CPollParams params = echo_params(&ctx, CPOLL_ENGINE_EPOLL);
+    CPoll* poll = poll_create(&params);
+    ASSERT_TRUE(poll);
+    ASSERT_EQ(poll_start(poll), 0);
+
+    // 定时器不经过时间轮, 不应提前触发
+    struct timespec value = {0, 30 * 1000000 + 500000};
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    ASSERT_EQ(poll_add_timer(&value, NULL, poll), 0);
+    while (ctx.finished < 1) {
+        usleep(100);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long ns = (end.tv_sec - begin.tv_sec) * 1000000000L + (end.tv_nsec - begin.tv_nsec);
+    EXPECT_GE(ns, value.tv_nsec);
+    EXPECT_LT(ns, 1000000000L);
+
+    poll_stop(poll);
+    poll_destroy(poll);
+};
+
+TEST(CPOLL, ENGINE_AB) {
+    const int pairs = 8;
+    const int rounds = 5000;
+
+    double epoll = echo_bench(CPOLL_ENGINE_EPOLL, pairs, rounds);
+    double uring = echo_bench(CPOLL_ENGINE_URING, pairs, rounds);
+
+    printf("ping-pong %d x %d: epoll %.0f ns/req, io_uring %.0f ns/req\n", pairs, rounds, epoll, uring);
+};
+
+TEST(CPOLL, SPIN) {
+    CPollSpin spin = {.spinBudget = 50, .sockBusyPoll = 0};
+    CPollStats stats;
+
+    EchoContext ctx;
+    CPollParams params = echo_params(&ctx, CPOLL_ENGINE_EPOLL);
+    CPoll* poll = poll_create(&params);
+    ASSERT_TRUE(poll);
+
+    CPollSpin bad = {.spinBudget = -1, .sockBusyPoll = 0};
+    EXPECT_EQ(poll_set_spin(&bad, poll), -1);
+    EXPECT_EQ(errno, EINVAL);
+    poll_destroy(poll);
+
+    for (int engine : {CPOLL_ENGINE_EPOLL, CPOLL_ENGINE_URING}) {
+        // 不开空转时只有阻塞等待
+        double blocking = echo_bench(engine, 1, 5000, nullptr, &stats);
+        EXPECT_EQ(stats.spinHits + stats.spinMisses, 0);
+        EXPECT_GT(stats.waits, 0);
+
+        // 一问一答的连接事件很密, 应该开始空转
+        double spinning = echo_bench(engine, 1, 5000, &spin, &stats);
+        EXPECT_GT(stats.spinHits + stats.spinMisses, 0);
+
+        printf("%s ping-pong: blocking %.0f ns/req, spin %dus %.0f ns/req, %lu hits %lu misses %lu waits\n",
+               engine == CPOLL_ENGINE_URING ? "io_uring" : "epoll", blocking, spin.spinBudget, spinning,
+               stats.spinHits, stats.spinMisses, stats.waits);
+    }
+};
+
+static int file_partial_written(size_t n, void* context)
+{
+    return 0;
+}
+
+static void file_callback(CPollResult* res, void* context)
+{
+    auto ctx = (EchoContext*) context;
+
+    ctx->lastError = res->state == PR_ST_FINISHED ? 0 : res->error;
+    ctx->finished++;
+    poll_free_result(res);
+}
+
+/**
+ * @brief
+ *  内存段和文件段混合发送, 文件段从中间偏移开始; 接收端慢读, 让写多次在 EAGAIN 后继续
+ */
+TEST(CPOLL, FILE_SEGMENT) {
+    const size_t fileSize = 3 * 1024 * 1024 + 17;
+    char name[] = "/tmp/test-c-poll-XXXXXX";
+    int fileFd = mkstemp(name);
+    std::vector<char> content(fileSize);
+
+    ASSERT_GE(fileFd, 0);
+    for (size_t i = 0; i < fileSize; ++i)
+        content[i] = (char) (i * 31 >> 7);
+    ASSERT_EQ(write(fileFd, content.data(), fileSize), (ssize_t) fileSize);
+
+    for (int engine : {CPOLL_ENGINE_EPOLL, CPOLL_ENGINE_URING}) {
+        EchoContext ctx;
+        ctx.finished = 0;
+        ctx.lastError = 0;
+
+        CPollParams params = {
+                .maxOpenFiles = 100,
+                .createMessage = NULL,
+                .partialWritten = file_partial_written,
+                .callback = file_callback,
+                .context = &ctx,
+                .engine = engine,
+        };
+        CPoll* poll = poll_create(&params);
+        ASSERT_TRUE(poll);
+        ASSERT_EQ(poll_start(poll), 0);
+
+        int sv[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+        CPollFileSegment seg = {fileFd, 1000, fileSize - 1000};
+        CPollFileSegment empty = {fileFd, 0, 0};
+        struct iovec iov[4];
+        iov[0] = {(void*) "head", 4};
+        iov[1] = {&seg, CPOLL_IOV_FILE | seg.size};
+        iov[2] = {&empty, CPOLL_IOV_FILE};
+        iov[3] = {(void*) "tail", 4};
+
+        CPollData data = {};
+        data.operation = PD_OP_WRITE;
+        data.fd = sv[0];
+        data.ssl = NULL;
+        data.context = NULL;
+        data.writeIov = iov;
+        data.iovec = 4;
+        ASSERT_EQ(poll_add(&data, -1, poll), 0);
+
+        std::string received;
+        char buf[4096];
+        size_t expect = 8 + seg.size;
+        while (received.size() < expect) {
+            ssize_t n = read(sv[1], buf, sizeof (buf));
+            ASSERT_GT(n, 0);
+            received.append(buf, n);
+        }
+
+        wait_for(ctx.finished, 1, 2000);
+        EXPECT_EQ(ctx.finished, 1);
+        EXPECT_EQ(ctx.lastError, 0);
+        ASSERT_EQ(received.size(), expect);
+        EXPECT_EQ(received.substr(0, 4), "head");
+        EXPECT_EQ(memcmp(received.data() + 4, content.data() + 1000, seg.size), 0);
+        EXPECT_EQ(received.substr(expect - 4), "tail");
+
+        poll_stop(poll);
+        poll_destroy(poll);
+        close(sv[0]);
+        close(sv[1]);
+    }
+
+    close(fileFd);
+    unlink(name);
+};
+
+static int tcp_pair(int sv[2])
+{
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof (addr);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lfd < 0 || bind(lfd, (struct sockaddr*) &addr, len) < 0 || listen(lfd, 1) < 0
+        || getsockname(lfd, (struct sockaddr*) &addr, &len) < 0)
+        return -1;
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sv[0], (struct sockaddr*) &addr, len) < 0)
+        return -1;
+
+    sv[1] = accept(lfd, NULL, NULL);
+    close(lfd);
+    return sv[1] < 0 ? -1 : 0;
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * @brief
+ *  同一块内存反复发送 rounds 次, 每次回调 PR_ST_FINISHED 后立刻改写内存再发.
+ *  MSG_ZEROCOPY 下内核还在引用时就回调, 接收端会读到改写后的数据. 返回每 GB 用掉的进程 CPU 秒数
+ */
+static double zerocopy_bench(int engine, size_t threshold, int rounds, CPollStats* stats)
+{
+    const size_t chunk = 1024 * 1024;
+    const int chunks = 8;
+    std::vector<char> buf(chunk * chunks);
+    std::atomic<long> bad{0};
+    std::atomic<long> received{0};
+    EchoContext ctx;
+    int sv[2];
+
+    ctx.finished = 0;
+    ctx.lastError = 0;
+    CPollParams params = {
+            .maxOpenFiles = 4096,
+            .createMessage = NULL,
+            .partialWritten = file_partial_written,
+            .callback = file_callback,
+            .context = &ctx,
+            .engine = engine,
+    };
+    CPoll* poll = poll_create(&params);
+    if (!poll || poll_start(poll) < 0 || poll_set_zerocopy(threshold, poll) < 0 || tcp_pair(sv) < 0)
+        return -1;
+
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    const long total = (long) buf.size() * rounds;
+    std::thread reader([&]() {
+        std::vector<char> in(256 * 1024);
+        long offset = 0;
+        while (offset < total) {
+            ssize_t n = read(sv[1], in.data(), in.size());
+            if (n <= 0)
+                break;
+
+            // 每页抽查一个字节, 逐字节比较的开销会盖过发送端的差别
+            for (ssize_t i = (4096 - offset % 4096) % 4096; i < n; i += 4096) {
+                if (in[i] != (char) ((offset + i) / (long) buf.size()))
+                    ++bad;
+            }
+            offset += n;
+            received = offset;
+        }
+    });
+
+    double begin = cpu_seconds();
+    for (int r = 0; r < rounds; ++r) {
+        struct iovec iov[chunks];
+        memset(buf.data(), r, buf.size());
+        for (int i = 0; i < chunks; ++i)
+            iov[i] = {buf.data() + i * chunk, chunk};
+
+        CPollData data = {};
+        data.operation = PD_OP_WRITE;
+        data.fd = sv[0];
+        data.ssl = NULL;
+        data.context = NULL;
+        data.writeIov = iov;
+        data.iovec = chunks;
+        if (poll_add(&data, -1, poll) < 0)
+            break;
+
+        wait_for(ctx.finished, r + 1, 10000);
+        if (ctx.finished != r + 1 || ctx.lastError != 0)
+            break;
+    }
+
+    reader.join();
+    double cpu = cpu_seconds() - begin;
+    poll_get_stats(stats, poll);
+    poll_stop(poll);
+    poll_destroy(poll);
+    close(sv[0]);
+    close(sv[1]);
+
+    if (received != total || bad != 0)
+        return -1;
+
+    return cpu / ((double) total / (1 << 30));
+}
+
+TEST(CPOLL, ZEROCOPY) {
+    CPollStats stats;
+
+    for (int engine : {CPOLL_ENGINE_EPOLL, CPOLL_ENGINE_URING}) {
+        double copy = zerocopy_bench(engine, 0, 64, &stats);
+        ASSERT_GT(copy, 0);
+        EXPECT_EQ(stats.zerocopySends, 0);
+
+        double zerocopy = zerocopy_bench(engine, 64 * 1024, 64, &stats);
+        ASSERT_GT(zerocopy, 0);
+        EXPECT_GT(stats.zerocopySends, 0);
+
+        // 回环连接上内核仍会拷贝, 真实网卡上才能省掉发送端的拷贝
+        printf("%s 512MB over loopback: writev %.3f cpu-s/GB, MSG_ZEROCOPY %.3f cpu-s/GB, %lu sends %lu copied\n",
+               engine == CPOLL_ENGINE_URING ? "io_uring" : "epoll", copy, zerocopy,
+               stats.zerocopySends, stats.zerocopyCopied);
+    }
+};
+
+struct ZerocopyErrorContext
+{
+    std::atomic<long>           finished;
+    int                         error;
+    int                         leftover;
+    int                         fd;
+};
+
+/* 回调时看错误队列里还有没有没取走的完成通知 */
+static void zerocopy_error_callback(CPollResult* res, void* context)
+{
+    auto ctx = (ZerocopyErrorContext*) context;
+    char control[256];
+    struct msghdr msg = {};
+
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    ctx->leftover = recvmsg(ctx->fd, &msg, MSG_ERRQUEUE) >= 0;
+    ctx->error = res->state == PR_ST_FINISHED ? 0 : res->error;
+    ctx->finished++;
+    poll_free_result(res);
+}
+
+/**
+ * @brief
+ *  对端读了一部分后 RST, 发送出错. 回调 PR_ST_ERROR 前完成通知已经取完, 内核不再引用发送的内存
+ */
+TEST(CPOLL, ZEROCOPY_ERROR) {
+    const size_t chunk = 1024 * 1024;
+    const int chunks = 32;
+    std::vector<char> buf(chunk * chunks, 'z');
+    std::vector<char> in(chunk);
+    struct linger lg = {1, 0};
+
+    signal(SIGPIPE, SIG_IGN);
+    for (int engine : {CPOLL_ENGINE_EPOLL, CPOLL_ENGINE_URING}) {
+        ZerocopyErrorContext ctx;
+        struct iovec iov[chunks];
+        CPollParams params = {
+                .maxOpenFiles = 4096,
+                .createMessage = NULL,
+                .partialWritten = file_partial_written,
+                .callback = zerocopy_error_callback,
+                .context = &ctx,
+                .engine = engine,
+        };
+        CPoll* poll = poll_create(&params);
+        int sv[2];
+
+        ctx.finished = 0;
+        ctx.error = 0;
+        ctx.leftover = 0;
+        ASSERT_TRUE(poll);
+        ASSERT_EQ(poll_start(poll), 0);
+        ASSERT_EQ(poll_set_zerocopy(64 * 1024, poll), 0);
+        ASSERT_EQ(tcp_pair(sv), 0);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        ctx.fd = sv[0];
+
+        for (int i = 0; i < chunks; ++i)
+            iov[i] = {buf.data() + i * chunk, chunk};
+
+        CPollData data = {};
+        data.operation = PD_OP_WRITE;
+        data.fd = sv[0];
+        data.writeIov = iov;
+        data.iovec = chunks;
+        ASSERT_EQ(poll_add(&data, -1, poll), 0);
+
+        for (size_t got = 0; got < 4 * chunk; ) {
+            ssize_t n = read(sv[1], in.data(), in.size());
+            ASSERT_GT(n, 0);
+            got += n;
+        }
+
+        setsockopt(sv[1], SOL_SOCKET, SO_LINGER, &lg, sizeof (lg));
+        close(sv[1]);
+        wait_for(ctx.finished, 1, 10000);
+
+        EXPECT_EQ(ctx.finished, 1);
+        EXPECT_NE(ctx.error, 0);
+        EXPECT_EQ(ctx.leftover, 0);
+
+        poll_stop(poll);
+        poll_destroy(poll);
+        close(sv[0]);
+    }
+};
@@ -0,0 +1,211 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/core/common-scheduler.h"
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <map>
+
+#define TARGETS             3
+#define MAX_LOAD            100
+#define PICKS               3000
+
+/* 峰值 EWMA 的衰减时间, 纳秒, 和 common-scheduler.cpp 一样 */
+#define EWMA_DECAY          10000000000.0
+
+/* 组和 target 都不连接, 只看怎么选 */
+class CommSchedTest : public ::testing::TestWithParam<int>
+{
+protected:
+    void SetUp() override
+    {
+        struct sockaddr_in sin = { };
+
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_EQ(mGroup.init(), 0);
+        ASSERT_EQ(mGroup.setPolicy(GetParam()), 0);
+        for (int i = 0; i < TARGETS; i++) {
+            sin.sin_port = htons(10000 + i);
+            ASSERT_EQ(mTargets[i].init((struct sockaddr *)&sin, sizeof sin, 1000, 1000, MAX_LOAD), 0);
+            ASSERT_EQ(mGroup.add(&mTargets[i]), 0);
+        }
+    }
+
+    void TearDown() override
+    {
+        for (int i = 0; i < TARGETS; i++) {
+            mGroup.remove(&mTargets[i]);
+            mTargets[i].deInit();
+        }
+
+        mGroup.deInit();
+    }
+
+    bool tryAcquire(int index)
+    {
+        return mGroup.tryAcquire(&mTargets[index]);
+    }
+
+    /* 占用 target n 次 */
+    void load(int index, int n)
+    {
+        for (int i = 0; i < n; i++)
+            ASSERT_TRUE(tryAcquire(index));
+    }
+
+    CommSchedTarget *pickTwo(CommSchedTarget **other)
+    {
+        return mGroup.pickTwo(other);
+    }
+
+    /* 每个 target 被 pickTwo() 选中的次数 */
+    std::map<CommSchedTarget *, int> pick()
+    {
+        std::map<CommSchedTarget *, int> picked;
+        CommSchedTarget *other;
+        CommSchedTarget *target;
+
+        for (int i = 0; i < PICKS; i++) {
+            target = pickTwo(&other);
+            EXPECT_NE(target, other);
+            picked[target]++;
+        }
+
+        return picked;
+    }
+
+    static int64_t monotonic()
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    static void updateEwma(CommSchedTarget *target, long long latency, int64_t now)
+    {
+        target->updateEwma(latency, now);
+    }
+
+    static double ewma(CommSchedTarget *target, int64_t now)
+    {
+        return target->decayedEwma(now);
+    }
+
+    CommSchedGroup              mGroup;
+    CommSchedTarget             mTargets[TARGETS];
+};
+
+/**
+ * 三个里随机取两个, 负载最大的永远不会被选中, 最小的只要被取到就选它 (约 2/3).
+ * PEAK_EWMA 没有耗时的时候也按负载选
+ */
+TEST_P(CommSchedTest, PickTwoPrefersLessLoaded)
+{
+    std::map<CommSchedTarget *, int> picked;
+
+    load(1, 10);
+    load(2, 50);
+    picked = pick();
+
+    EXPECT_EQ(picked[&mTargets[2]], 0);
+    EXPECT_GT(picked[&mTargets[0]], PICKS / 2);
+    EXPECT_GT(picked[&mTargets[1]], PICKS / 5);
+    EXPECT_EQ(picked[&mTargets[0]] + picked[&mTargets[1]], PICKS);
+}
+
+/* 只剩一个 target 时不用比较, other 为空 */
+TEST_P(CommSchedTest, PickTwoSingleTarget)
+{
+    CommSchedTarget *other = &mTargets[0];
+
+    ASSERT_EQ(mGroup.remove(&mTargets[1]), 0);
+    ASSERT_EQ(mGroup.remove(&mTargets[2]), 0);
+    EXPECT_EQ(pickTwo(&other), &mTargets[0]);
+    EXPECT_EQ(other, nullptr);
+
+    ASSERT_EQ(mGroup.remove(&mTargets[0]), 0);
+    EXPECT_EQ(pickTwo(&other), nullptr);
+    EXPECT_EQ(other, nullptr);
+}
+
+/* 占满为止, 组的负载跟着加; 移出组的 target 不再能占用 */
+TEST_P(CommSchedTest, TryAcquire)
+{
+    load(0, MAX_LOAD);
+    EXPECT_FALSE(tryAcquire(0));
+    EXPECT_EQ(mTargets[0].getCurLoad(), MAX_LOAD);
+    EXPECT_EQ(mGroup.getCurLoad(), MAX_LOAD);
+
+    ASSERT_EQ(mGroup.remove(&mTargets[1]), 0);
+    EXPECT_FALSE(tryAcquire(1));
+    EXPECT_EQ(mTargets[1].getCurLoad(), 0);
+    EXPECT_EQ(mGroup.getCurLoad(), MAX_LOAD);
+
+    EXPECT_TRUE(tryAcquire(2));
+    EXPECT_EQ(mGroup.getCurLoad(), MAX_LOAD + 1);
+}
+
+INSTANTIATE_TEST_SUITE_P(Policies, CommSchedTest, ::testing::Values(COMM_SCHED_P2C, COMM_SCHED_PEAK_EWMA));
+
+class CommSchedEwmaTest : public CommSchedTest { };
+
+/* 耗时变大时马上取新值, 变小时按离上次更新的时间慢慢降 */
+TEST_P(CommSchedEwmaTest, PeakAndDecay)
+{
+    CommSchedTarget *target = &mTargets[0];
+    int64_t now = monotonic();
+    double w;
+
+    updateEwma(target, 1000, now);
+    EXPECT_DOUBLE_EQ(ewma(target, now), 1000);
+
+    updateEwma(target, 5000, now + 1);
+    EXPECT_DOUBLE_EQ(ewma(target, now + 1), 5000);
+
+    /* 同一时刻更小的耗时不降 */
+    updateEwma(target, 100, now + 1);
+    EXPECT_DOUBLE_EQ(ewma(target, now + 1), 5000);
+
+    /* 过了一个衰减时间, 新值占 1 - 1/e */
+    w = exp(-1.0);
+    updateEwma(target, 100, now + 1 + (int64_t)EWMA_DECAY);
+    EXPECT_NEAR(ewma(target, now + 1 + (int64_t)EWMA_DECAY), 5000 * w + 100 * (1 - w), 1e-6);
+
+    /* 一直没有新的耗时, 读的时候按 0 衰减 */
+    now += 1 + (int64_t)EWMA_DECAY;
+    EXPECT_LT(ewma(target, now + 5 * (int64_t)EWMA_DECAY), 20);
+
+    target->resetLatency();
+    EXPECT_DOUBLE_EQ(ewma(target, now), 0);
+}
+
+/* 负载一样时选耗时小的; 耗时小的负载上去以后让给耗时稍大的 */
+TEST_P(CommSchedEwmaTest, PickTwoPrefersFaster)
+{
+    std::map<CommSchedTarget *, int> picked;
+    int64_t now = monotonic();
+
+    updateEwma(&mTargets[0], 1000, now);
+    updateEwma(&mTargets[1], 2000, now);
+    updateEwma(&mTargets[2], 100000, now);
+    picked = pick();
+    EXPECT_EQ(picked[&mTargets[2]], 0);
+    EXPECT_GT(picked[&mTargets[0]], PICKS / 2);
+
+    /* (1000 + 1) x 51 比 (2000 + 1) x 1 大, 比 (100000 + 1) x 1 小 */
+    load(0, 50);
+    picked = pick();
+    EXPECT_EQ(picked[&mTargets[2]], 0);
+    EXPECT_GT(picked[&mTargets[1]], PICKS / 2);
+    EXPECT_GT(picked[&mTargets[0]], 0);
+}
+
+INSTANTIATE_TEST_SUITE_P(Ewma, CommSchedEwmaTest, ::testing::Values(COMM_SCHED_PEAK_EWMA));
@@ -0,0 +1,290 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "params-policy.h"
+#include "../app/manager/facilities.h"
+#include "../app/modules/http-server.h"
+#include "../app/factory/task-factory.h"
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* 一个 handler 线程: 回调里发出的请求一定在同一连接的关闭结果之前处理 */
+class ConnectionPoolTest : public ::testing::Test
+{
+protected:
+    static void SetUpTestSuite()
+    {
+        GlobalSettings settings = GLOBAL_SETTINGS_DEFAULT;
+
+        settings.handler_threads = 1;
+        Global::setGlobalSettings(&settings);
+    }
+
+    void TearDown() override
+    {
+        if (mPolicy)
+            Global::getNameService()->delPolicy("127.0.0.1");
+
+        delete mPolicy;
+    }
+
+    /* 之后发到 mUrl 的请求都用 params 的连接池参数 */
+    void addPolicy(unsigned short port, const EndpointParams& params)
+    {
+        mUrl = "http://127.0.0.1:" + std::to_string(port);
+        mPolicy = new ParamsPolicy(params);
+        ASSERT_EQ(Global::getNameService()->addPolicy("127.0.0.1", mPolicy), 0);
+    }
+
+    CommPoolStats poolStats()
+    {
+        return mPolicy->poolStats(mUrl + "/");
+    }
+
+    std::string                 mUrl;
+    ParamsPolicy*               mPolicy = nullptr;
+};
+
+static unsigned short listen_port(const ServerBase& server)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof sin;
+
+    server.get_listen_addr((struct sockaddr *)&sin, &len);
+    return ntohs(sin.sin_port);
+}
+
+/* 同步请求, 返回任务状态 */
+static int fetch(const std::string& url)
+{
+    Facilities::WaitGroup wg(1);
+    int state = -1;
+
+    TaskFactory::createHttpTask(url, 0, 0, [&](HttpTask *task, void *) {
+        state = task->getState();
+        wg.done();
+    }, nullptr)->start();
+
+    wg.wait();
+    return state;
+}
+
+/* 预热到 minIdle, 请求自己的连接和预热的连接加起来也不超过 maxIdle */
+TEST_F(ConnectionPoolTest, WarmUpToMinIdle)
+{
+    ServerParams serverParams = HTTP_SERVER_PARAMS_DEFAULT;
+    EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+    CommPoolStats stats;
+    size_t maxIdle = 0;
+
+    /* 预热的连接上一直没有请求, 停止时服务端等它们这么久 */
+    serverParams.peerResponseTimeout = 2000;
+    HttpServer server(&serverParams, [](HttpTask *task) { task->getResp()->appendOutputBody("ok"); });
+
+    ASSERT_EQ(server.start("127.0.0.1", 0), 0);
+    params.minIdleConnections = 4;
+    params.maxIdleConnections = 4;
+    addPolicy(listen_port(server), params);
+
+    ASSERT_EQ(fetch(mUrl + "/"), TASK_STATE_SUCCESS);
+    for (int i = 0; i < 2000; i++) {
+        stats = poolStats();
+        maxIdle = std::max(maxIdle, stats.idle);
+        if (stats.warming == 0 && stats.idle == 4)
+            break;
+
+        usleep(1000);
+    }
+
+    EXPECT_EQ(stats.idle, 4);
+    EXPECT_EQ(stats.warming, 0);
+    EXPECT_LE(maxIdle, 4);
+    EXPECT_GE(stats.warmConnects, 3);
+    EXPECT_EQ(stats.warmFailures, 0);
+
+    /* 之后的请求都用预热好的连接, 不再新建 */
+    for (int i = 0; i < 8; i++)
+        ASSERT_EQ(fetch(mUrl + "/"), TASK_STATE_SUCCESS);
+
+    usleep(50 * 1000);
+    CommPoolStats after = poolStats();
+
+    EXPECT_EQ(after.idle, 4);
+    EXPECT_EQ(after.reused - stats.reused, 8);
+    EXPECT_EQ(after.warmConnects, stats.warmConnects);
+    server.stop();
+}
+
+/* 归还的连接超过 maxIdle 时关掉最久未用的: 留下的是最后归还的两个 */
+TEST_F(ConnectionPoolTest, EvictLeastRecentlyUsed)
+{
+    std::mutex mutex;
+    std::map<int, unsigned short> peers;
+    HttpServer server([&](HttpTask *task) {
+        const char *uri = task->getReq()->getRequestUri();
+        int delay = atoi(strchr(uri, '=') + 1);
+        struct sockaddr_in sin;
+        socklen_t len = sizeof sin;
+
+        task->getPeerAddr((struct sockaddr *)&sin, &len);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            peers[delay] = ntohs(sin.sin_port);
+        }
+
+        task->getResp()->appendOutputBody("ok");
+        if (delay > 0)
+            *seriesOf(task) << TaskFactory::createTimerTask(delay * 1000, nullptr);
+    });
+    EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+    std::atomic<int> success(0);
+
+    ASSERT_EQ(server.start("127.0.0.1", 0), 0);
+    params.maxIdleConnections = 2;
+    addPolicy(listen_port(server), params);
+
+    /* 四个连接, 按 50/100/150/200ms 的顺序归还 */
+    {
+        Facilities::WaitGroup wg(4);
+
+        for (int delay : {50, 100, 150, 200}) {
+            TaskFactory::createHttpTask(mUrl + "/?delay=" + std::to_string(delay), 0, 0, [&](HttpTask *task, void *) {
+                if (task->getState() == TASK_STATE_SUCCESS)
+                    success++;
+
+                wg.done();
+            }, nullptr)->start();
+        }
+
+        wg.wait();
+    }
+
+    ASSERT_EQ(success, 4);
+    ASSERT_EQ(peers.size(), 4);
+    EXPECT_EQ(std::set<unsigned short>({peers[50], peers[100], peers[150], peers[200]}).size(), 4);
+
+    CommPoolStats stats = poolStats();
+
+    EXPECT_EQ(stats.idle, 2);
+    EXPECT_EQ(stats.evictions, 2);
+
+    /* 同时发两个, 各占一个空闲连接 */
+    {
+        Facilities::WaitGroup wg(2);
+
+        for (int delay : {1, 2}) {
+            TaskFactory::createHttpTask(mUrl + "/?delay=" + std::to_string(delay), 0, 0, [&](HttpTask *task, void *) {
+                if (task->getState() == TASK_STATE_SUCCESS)
+                    success++;
+
+                wg.done();
+            }, nullptr)->start();
+        }
+
+        wg.wait();
+    }
+
+    EXPECT_EQ(success, 6);
+    EXPECT_EQ(std::set<unsigned short>({peers[1], peers[2]}), std::set<unsigned short>({peers[150], peers[200]}));
+    EXPECT_EQ(poolStats().reused, 2);
+    server.stop();
+}
+
+/* 回复和 FIN 一起发出, 回复里却说 keep-alive: 放回池里的连接对端已经关了 */
+static void close_after_reply(int listenFd, std::atomic<bool> *stop)
+{
+    static const char reply[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: keep-alive\r\n\r\nok";
+    struct pollfd pfd = { listenFd, POLLIN, 0 };
+    std::string request;
+    char buf[4096];
+    int on = 1;
+    int fd;
+
+    while (!*stop) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        request.clear();
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = read(fd, buf, sizeof buf);
+
+            if (n <= 0)
+                break;
+
+            request.append(buf, n);
+        }
+
+        /* cork 住, 关闭时回复和 FIN 在同一个包里 */
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+        if (write(fd, reply, sizeof reply - 1) < 0)
+            perror("write");
+
+        close(fd);
+    }
+}
+
+/* 第二个请求在第一个的回调里发出, 这时连接还在空闲列表里, 检查后换新连接 */
+TEST_F(ConnectionPoolTest, ValidateIdle)
+{
+    struct sockaddr_in sin = { };
+    socklen_t len = sizeof sin;
+    std::atomic<bool> stop(false);
+    EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+    Facilities::WaitGroup wg(1);
+    int states[2] = { -1, -1 };
+    int listenFd;
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(listenFd, 0);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(listenFd, (struct sockaddr *)&sin, sizeof sin), 0);
+    ASSERT_EQ(listen(listenFd, 16), 0);
+    ASSERT_EQ(getsockname(listenFd, (struct sockaddr *)&sin, &len), 0);
+
+    std::thread thread(close_after_reply, listenFd, &stop);
+
+    params.validateIdle = true;
+    addPolicy(ntohs(sin.sin_port), params);
+
+    TaskFactory::createHttpTask(mUrl + "/", 0, 0, [&](HttpTask *task, void *) {
+        states[0] = task->getState();
+        *seriesOf(task) << TaskFactory::createHttpTask(mUrl + "/", 0, 0, [&](HttpTask *task, void *) {
+            states[1] = task->getState();
+            wg.done();
+        }, nullptr);
+    }, nullptr)->start();
+
+    wg.wait();
+    EXPECT_EQ(states[0], TASK_STATE_SUCCESS);
+    EXPECT_EQ(states[1], TASK_STATE_SUCCESS);
+
+    CommPoolStats stats = poolStats();
+
+    EXPECT_EQ(stats.invalid, 1);
+    EXPECT_EQ(stats.reused, 0);
+
+    stop = true;
+    thread.join();
+    close(listenFd);
+}
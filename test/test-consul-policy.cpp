@@ -0,0 +1,354 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/factory/workflow.h"
+#include "../app/utils/uri-parser.h"
+#include "../app/utils/json-parser.h"
+#include "../app/manager/facilities.h"
+#include "../app/modules/http-server.h"
+#include "../app/factory/task-factory.h"
+#include "../app/nameservice/consul-policy.h"
+#include <gtest/gtest.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/* 阻塞查询等这么久没有变化就按原 index 回复 */
+#define WAIT_MS             500
+
+static int64_t __now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * 假的 Consul agent: /v1/health/service/<name> 带 index 时等到数据变化或 wait 到期再回复, 都带 X-Consul-Index;
+ * /v1/agent/service/register 和 /deregister/<id> 记下注册的服务
+ */
+class FakeConsul
+{
+public:
+    FakeConsul() : mServer([this](HttpTask *task) { this->process(task); })
+    {
+    }
+
+    int start()
+    {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof sin;
+
+        if (mServer.start("127.0.0.1", 0) < 0)
+            return -1;
+
+        mServer.get_listen_addr((struct sockaddr *)&sin, &len);
+        return ntohs(sin.sin_port);
+    }
+
+    void stop()
+    {
+        mServer.stop();
+    }
+
+    /* 换掉服务的地址, index 加一 */
+    void setInstances(const std::vector<std::string>& instances)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mInstances = instances;
+        mIndex++;
+    }
+
+    /* 收到过带这个 index 的阻塞查询 */
+    bool waitBlocking(long long index, int count = 1)
+    {
+        for (int i = 0; i < 500; i++) {
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+
+                if (mBlocking[index] >= count)
+                    return true;
+            }
+
+            usleep(10 * 1000);
+        }
+
+        return false;
+    }
+
+    long long index()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mIndex;
+    }
+
+    std::map<std::string, std::string> registered()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mRegistered;
+    }
+
+private:
+    void process(HttpTask *task)
+    {
+        std::string uri = task->getReq()->getRequestUri();
+        std::string method = task->getReq()->getMethod();
+        std::string path = uri.substr(0, uri.find('?'));
+        std::string query = uri.find('?') == std::string::npos ? "" : uri.substr(uri.find('?') + 1);
+        auto args = URIParser::split_query(query);
+        long long index = args.count("index") ? atoll(args["index"].c_str()) : 0;
+        const std::string deregister = "/v1/agent/service/deregister/";
+
+        if (method == "GET" && path == "/v1/health/service/web") {
+            if (index > 0) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mBlocking[index]++;
+            }
+
+            this->reply(task, index, __now_ms() + (args.count("wait") ? atoi(args["wait"].c_str()) : 0));
+        } else if (method == "PUT" && path == "/v1/agent/service/register") {
+            this->registerService(task);
+        } else if (method == "PUT" && path.compare(0, deregister.size(), deregister) == 0) {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            if (mRegistered.erase(path.substr(deregister.size())) == 0)
+                task->getResp()->setStatusCode("404");
+        } else {
+            task->getResp()->setStatusCode("404");
+        }
+    }
+
+    /* 数据没变并且 wait 没到期时, 在服务端的 series 里等一会儿再看 */
+    void reply(HttpTask *task, long long index, int64_t deadline)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::string body = "[";
+
+        if (index == mIndex && __now_ms() < deadline) {
+            *seriesOf(task) << TaskFactory::createTimerTask(10 * 1000, [this, task, index, deadline](TimerTask *) {
+                this->reply(task, index, deadline);
+            });
+
+            return;
+        }
+
+        for (size_t i = 0; i < mInstances.size(); i++) {
+            std::string host = mInstances[i].substr(0, mInstances[i].find(':'));
+            std::string port = mInstances[i].substr(mInstances[i].find(':') + 1);
+
+            body += i > 0 ? "," : "";
+            body += "{\"Node\":{\"Address\":\"127.0.0.1\"},\"Service\":{\"Address\":\"" + host + "\",\"Port\":" + port +
+                    "},\"Checks\":[{\"Status\":\"passing\"}]}";
+        }
+
+        body += "]";
+        task->getResp()->setStatusCode("200");
+        task->getResp()->addHeaderPair("X-Consul-Index", std::to_string(mIndex));
+        task->getResp()->appendOutputBody(body);
+    }
+
+    void registerService(HttpTask *task)
+    {
+        const void *body;
+        size_t size;
+        json_value_t *root;
+        const char *id = NULL;
+
+        if (!task->getReq()->getParsedBody(&body, &size)) {
+            task->getResp()->setStatusCode("400");
+            return;
+        }
+
+        std::string text((const char *)body, size);
+        root = json_value_parse(text.c_str());
+        if (root && json_value_type(root) == JSON_VALUE_OBJECT) {
+            const json_value_t *val = json_object_find("ID", json_value_object(root));
+
+            if (val && json_value_type(val) == JSON_VALUE_STRING)
+                id = json_value_string(val);
+        }
+
+        if (id) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mRegistered[id] = text;
+        } else {
+            task->getResp()->setStatusCode("400");
+        }
+
+        if (root)
+            json_value_destroy(root);
+    }
+
+    HttpServer                              mServer;
+    std::mutex                              mMutex;
+    long long                               mIndex = 10;
+    std::vector<std::string>                mInstances;
+    std::map<long long, int>                mBlocking;          // 每个 index 收到的阻塞查询数
+    std::map<std::string, std::string>      mRegistered;
+};
+
+class ConsulPolicyTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        protocol::ConsulConfig config;
+        int port = mConsul.start();
+
+        ASSERT_GT(port, 0);
+        config.setWaitTTL(WAIT_MS);
+        mPolicy = new ConsulPolicy("http://127.0.0.1:" + std::to_string(port) + "/", config);
+    }
+
+    void TearDown() override
+    {
+        delete mPolicy;
+        mConsul.stop();
+    }
+
+    /* 路由是同步的: 返回选中地址的 host, 没有可用地址时为空 */
+    std::string route()
+    {
+        ParsedURI uri;
+        std::string host;
+
+        EXPECT_EQ(URIParser::parse("http://web/", uri), 0);
+
+        NSParams params = {
+                .mType          = TT_TCP,
+                .mUri           = uri,
+                .mInfo          = "",
+                .mFixedAddr     = true,
+                .mRetryTimes    = 0,
+                .mTracing       = nullptr,
+        };
+
+        Workflow::startSeriesWork(mPolicy->createRouterTask(&params, [&](RouterTask *task) {
+            const struct sockaddr *addr;
+            socklen_t len;
+            char buf[INET_ADDRSTRLEN];
+
+            if (task->getState() != TASK_STATE_SUCCESS)
+                return;
+
+            ((CommSchedTarget *)task->get_result()->mRequestObject)->getAddr(&addr, &len);
+            host = inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, sizeof buf);
+        }, nullptr), nullptr);
+
+        return host;
+    }
+
+    /* 轮询选到的地址集合 */
+    std::set<std::string> hosts()
+    {
+        std::set<std::string> hosts;
+
+        for (int i = 0; i < 20; i++)
+            hosts.insert(route());
+
+        return hosts;
+    }
+
+    /* 快照换掉是异步的, 等到选到的地址集合就是 expect */
+    bool waitHosts(const std::set<std::string>& expect)
+    {
+        for (int i = 0; i < 300; i++) {
+            if (hosts() == expect)
+                return true;
+
+            usleep(10 * 1000);
+        }
+
+        return false;
+    }
+
+    FakeConsul                  mConsul;
+    ConsulPolicy*               mPolicy = nullptr;
+};
+
+/**
+ * 第一次查询不带 index, 之后都带上次回复的 X-Consul-Index 阻塞等待.
+ * 数据变化时阻塞的查询马上回来, 换掉地址后以新的 index 再阻塞; wait 到期没有变化时以原 index 再阻塞
+ */
+TEST_F(ConsulPolicyTest, BlockingQueryReArms)
+{
+    long long index;
+
+    EXPECT_EQ(route(), "");
+    mConsul.setInstances({ "127.0.1.1:8001" });
+    index = mConsul.index();
+    ASSERT_EQ(mPolicy->watchService("web", UPSTREAM_WEIGHTED_ROUND_ROBIN), 0);
+    EXPECT_EQ(mPolicy->watchService("web", UPSTREAM_WEIGHTED_ROUND_ROBIN), -1);
+    EXPECT_EQ(errno, EEXIST);
+
+    ASSERT_TRUE(waitHosts({ "127.0.1.1" }));
+    ASSERT_TRUE(mConsul.waitBlocking(index));
+
+    /* 没有变化, wait 到期后同一个 index 再来一次 */
+    ASSERT_TRUE(mConsul.waitBlocking(index, 2));
+    EXPECT_TRUE(waitHosts({ "127.0.1.1" }));
+
+    /* 加一个地址 */
+    mConsul.setInstances({ "127.0.1.1:8001", "127.0.1.2:8001" });
+    index = mConsul.index();
+    ASSERT_TRUE(waitHosts({ "127.0.1.1", "127.0.1.2" }));
+    ASSERT_TRUE(mConsul.waitBlocking(index));
+
+    /* 去掉一个地址 */
+    mConsul.setInstances({ "127.0.1.2:8001" });
+    index = mConsul.index();
+    ASSERT_TRUE(waitHosts({ "127.0.1.2" }));
+    ASSERT_TRUE(mConsul.waitBlocking(index));
+
+    /* 不再 watch 后这个服务没有路由 */
+    ASSERT_EQ(mPolicy->unwatchService("web"), 0);
+    EXPECT_EQ(route(), "");
+    EXPECT_EQ(mPolicy->unwatchService("web"), -1);
+    EXPECT_EQ(errno, ENOENT);
+}
+
+/* 注册时端口和地址取 server 监听的, 注销后 agent 上没有这个服务; 再注销 agent 回复 404 */
+TEST_F(ConsulPolicyTest, RegisterDeregister)
+{
+    HttpServer server([](HttpTask *) { });
+    protocol::ConsulService service = { };
+    struct sockaddr_in sin;
+    socklen_t len = sizeof sin;
+    std::map<std::string, std::string> registered;
+
+    ASSERT_EQ(server.start("127.0.0.1", 0), 0);
+    server.get_listen_addr((struct sockaddr *)&sin, &len);
+
+    service.serviceName = "web";
+    service.serviceID = "web-1";
+    service.tags = { "v1" };
+    ASSERT_EQ(mPolicy->registerServer(&server, service), 0);
+
+    registered = mConsul.registered();
+    ASSERT_EQ(registered.size(), 1);
+    ASSERT_EQ(registered.count("web-1"), 1);
+    EXPECT_NE(registered["web-1"].find("\"Name\":\"web\""), std::string::npos);
+    EXPECT_NE(registered["web-1"].find("\"Address\":\"127.0.0.1\""), std::string::npos);
+    EXPECT_NE(registered["web-1"].find("\"Port\":" + std::to_string(ntohs(sin.sin_port))), std::string::npos);
+    EXPECT_NE(registered["web-1"].find("\"Tags\":[\"v1\"]"), std::string::npos);
+
+    ASSERT_EQ(mPolicy->deregisterServer("web-1"), 0);
+    EXPECT_TRUE(mConsul.registered().empty());
+
+    EXPECT_EQ(mPolicy->deregisterServer("web-1"), -1);
+    EXPECT_EQ(errno, EPROTO);
+
+    server.stop();
+}
@@ -0,0 +1,144 @@
+//
+// Created by dingjing on 8/13/22.
+//
+
+#include "../app/core/cpu-affinity.h"
+#include "../app/core/thread-pool.h"
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+
+TEST(CPU_AFFINITY, PARSE) {
+    cpu_set_t set;
+
+    ASSERT_EQ(cpu_affinity_parse("0-3,8,10-11\n", &set), 0);
+    EXPECT_EQ(CPU_COUNT(&set), 7);
+    EXPECT_TRUE(CPU_ISSET(0, &set));
+    EXPECT_TRUE(CPU_ISSET(3, &set));
+    EXPECT_FALSE(CPU_ISSET(4, &set));
+    EXPECT_TRUE(CPU_ISSET(8, &set));
+    EXPECT_TRUE(CPU_ISSET(11, &set));
+
+    ASSERT_EQ(cpu_affinity_parse("", &set), 0);
+    EXPECT_EQ(CPU_COUNT(&set), 0);
+
+    EXPECT_EQ(cpu_affinity_parse("3-1", &set), -1);
+    EXPECT_EQ(errno, EINVAL);
+    EXPECT_EQ(cpu_affinity_parse("a", &set), -1);
+    EXPECT_EQ(cpu_affinity_parse("1;2", &set), -1);
+    EXPECT_EQ(cpu_affinity_parse("100000", &set), -1);
+};
+
+TEST(CPU_AFFINITY, PLAN) {
+    CpuAffinity affinity;
+    cpu_set_t avail;
+
+    ASSERT_EQ(sched_getaffinity(0, sizeof (cpu_set_t), &avail), 0);
+    ASSERT_EQ(cpu_affinity_plan(nullptr, 4, &affinity), 0);
+    EXPECT_EQ(affinity.nPollers, 4);
+
+    // poller 在可用的核上, 核够用时互不相同, 计算线程不和 poller 共用核
+    int n = CPU_COUNT(&avail);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(CPU_ISSET(affinity.pollerCpus[i], &avail));
+        for (int j = 0; j < i && j < n; ++j) {
+            if (i < n) {
+                EXPECT_NE(affinity.pollerCpus[i], affinity.pollerCpus[j]);
+            }
+        }
+    }
+
+    EXPECT_GT(CPU_COUNT(&affinity.computeCpus), 0);
+    EXPECT_GT(CPU_COUNT(&affinity.handlerCpus), 0);
+    if (n > 4) {
+        for (int i = 0; i < 4; ++i)
+            EXPECT_FALSE(CPU_ISSET(affinity.pollerCpus[i], &affinity.computeCpus));
+    }
+
+    // 只给一个核时所有线程都在这个核上
+    int first = 0;
+    while (!CPU_ISSET(first, &avail))
+        ++first;
+
+    ASSERT_EQ(cpu_affinity_plan(std::to_string(first).c_str(), 2, &affinity), 0);
+    EXPECT_EQ(affinity.pollerCpus[0], first);
+    EXPECT_EQ(affinity.pollerCpus[1], first);
+    EXPECT_EQ(CPU_COUNT(&affinity.computeCpus), 1);
+    EXPECT_TRUE(CPU_ISSET(first, &affinity.handlerCpus));
+    EXPECT_EQ(cpu_affinity_node(first), cpu_affinity_node(first));
+
+    // 不在进程可用范围内的核
+    EXPECT_EQ(cpu_affinity_plan("1023", 1, &affinity), -1);
+};
+
+TEST(CPU_AFFINITY, POLLER_GROUP) {
+    CpuAffinity affinity;
+    cpu_set_t group;
+
+    ASSERT_EQ(cpu_affinity_plan(nullptr, 2, &affinity), 0);
+
+    // 组里有 poller 自己的核, 其它核都是同节点的 handler 核
+    for (int i = 0; i < 4; ++i) {
+        int cpu = affinity.pollerCpus[i % 2];
+        cpu_affinity_poller_group(&affinity, i, &group);
+        EXPECT_TRUE(CPU_ISSET(cpu, &group));
+        for (int j = 0; j < CPU_SETSIZE; ++j) {
+            if (j != cpu && CPU_ISSET(j, &group)) {
+                EXPECT_TRUE(CPU_ISSET(j, &affinity.handlerCpus));
+                EXPECT_EQ(cpu_affinity_node(j), cpu_affinity_node(cpu));
+            }
+        }
+    }
+};
+
+struct PinContext
+{
+    cpu_set_t               expect;
+    std::atomic<int>        done;
+    std::atomic<int>        pinned;
+};
+
+static void pin_routine(void* context)
+{
+    auto ctx = (PinContext*) context;
+    cpu_set_t set;
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof (cpu_set_t), &set) == 0 && CPU_EQUAL(&set, &ctx->expect))
+        ++ctx->pinned;
+    ++ctx->done;
+}
+
+TEST(CPU_AFFINITY, THREAD_POOL) {
+    PinContext ctx;
+    cpu_set_t avail;
+
+    ASSERT_EQ(sched_getaffinity(0, sizeof (cpu_set_t), &avail), 0);
+    CPU_ZERO(&ctx.expect);
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &avail)) {
+            CPU_SET(i, &ctx.expect);
+            break;
+        }
+    }
+
+    ctx.done = 0;
+    ctx.pinned = 0;
+    ThreadPool* pool = thread_pool_create_affinity(2, 0, THREAD_POOL_SHARED_QUEUE, &ctx.expect);
+    ASSERT_TRUE(pool);
+    ASSERT_EQ(thread_pool_increase(pool), 0);
+
+    for (int i = 0; i < 100; ++i) {
+        ThreadPoolTask task = {pin_routine, &ctx};
+        ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+    }
+
+    for (int i = 0; i < 5000 && ctx.done < 100; ++i)
+        usleep(1000);
+
+    EXPECT_EQ(ctx.done, 100);
+    EXPECT_EQ(ctx.pinned, 100);
+    thread_pool_destroy(nullptr, pool);
+};
@@ -0,0 +1,99 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/utils/epoch-guard.h"
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define ALIVE               0x5a5a5a5a
+#define POISON              0xdeaddead
+
+struct Object
+{
+    unsigned int            magic;
+};
+
+/* synchronize() 要等已经在 readLock() 里的读者离开才返回 */
+TEST(EpochGuardTest, SynchronizeWaitsForReader)
+{
+    EpochGuard guard;
+    std::atomic<bool> locked(false);
+    std::atomic<bool> unlocked(false);
+
+    std::thread reader([&]() {
+        unsigned int epoch = guard.readLock();
+
+        locked = true;
+        usleep(200 * 1000);
+        unlocked = true;
+        guard.readUnlock(epoch);
+    });
+
+    while (!locked)
+        std::this_thread::yield();
+
+    guard.synchronize();
+    EXPECT_TRUE(unlocked);
+    reader.join();
+
+    /* 没有读者时马上返回 */
+    guard.synchronize();
+}
+
+/* 读者和写者换着来: 每次 synchronize() 后把换下来的对象标成已释放, 读者在锁里不应该看到已释放的对象 */
+TEST(EpochGuardTest, ReclaimAfterSynchronize)
+{
+    EpochGuard guard;
+    std::vector<Object *> retired;
+    std::vector<std::thread> readers;
+    std::atomic<bool> stop(false);
+    std::atomic<long> violations(0);
+    std::atomic<long> reads(0);
+    Object *current = new Object { ALIVE };
+
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&]() {
+            while (!stop) {
+                unsigned int epoch = guard.readLock();
+                Object *object = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+
+                for (int j = 0; j < 16; j++) {
+                    if (__atomic_load_n(&object->magic, __ATOMIC_RELAXED) != ALIVE)
+                        violations++;
+                }
+
+                guard.readUnlock(epoch);
+                reads++;
+            }
+        });
+    }
+
+    for (int i = 0; i < 2000; i++) {
+        Object *old = __atomic_exchange_n(&current, new Object { ALIVE }, __ATOMIC_SEQ_CST);
+
+        guard.synchronize();
+        __atomic_store_n(&old->magic, POISON, __ATOMIC_RELAXED);
+        retired.push_back(old);
+
+        if (i % 100 == 0)
+            std::this_thread::yield();
+    }
+
+    stop = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    EXPECT_EQ(violations, 0);
+    EXPECT_GT(reads, 0);
+
+    for (auto *object : retired)
+        delete object;
+
+    delete current;
+}
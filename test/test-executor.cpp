@@ -3,5 +3,139 @@
 //
 #include "../app/core/executor.h"
 #include "../app/core/exec-request.h"
+#include <gtest/gtest.h>
 
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
+class OrderSession : public ExecSession
+{
+public:
+    OrderSession(int id, std::vector<int>* order, std::atomic<int>* handled)
+    {
+        mId = id;
+        mOrder = order;
+        mHandled = handled;
+    }
+
+private:
+    void execute() override
+    {
+        mOrder->push_back(mId);
+    }
+
+    void handle(int state, int error) override
+    {
+        EXPECT_EQ(state, ES_STATE_FINISHED);
+        ++*mHandled;
+        delete this;
+    }
+
+private:
+    int                         mId;
+    std::vector<int>*           mOrder;
+    std::atomic<int>*           mHandled;
+};
+
+/* 在池内线程里向两个队列提交, 本地队列是 LIFO, 但同一个 ExecQueue 内仍然按提交顺序执行 */
+class SpawnSession : public ExecSession
+{
+public:
+    SpawnSession(Executor* executor, ExecQueue* q1, ExecQueue* q2, std::vector<int>* order, std::atomic<int>* handled)
+    {
+        mExecutor = executor;
+        mQueue1 = q1;
+        mQueue2 = q2;
+        mOrder = order;
+        mHandled = handled;
+    }
+
+private:
+    void execute() override
+    {
+        for (int i = 0; i < 100; ++i) {
+            EXPECT_EQ(mExecutor->request(new OrderSession(i, mOrder, mHandled), mQueue1), 0);
+            EXPECT_EQ(mExecutor->request(new OrderSession(-1, &mOther, mHandled), mQueue2), 0);
+        }
+    }
+
+    void handle(int state, int error) override
+    {
+        ++*mHandled;
+    }
+
+private:
+    Executor*                   mExecutor;
+    ExecQueue*                  mQueue1;
+    ExecQueue*                  mQueue2;
+    std::vector<int>*           mOrder;
+    std::vector<int>            mOther;
+    std::atomic<int>*           mHandled;
+};
+
+TEST(EXECUTOR, WORK_STEALING_FIFO) {
+    Executor executor;
+    ExecQueue q1, q2;
+    std::vector<int> order;
+    std::atomic<int> handled(0);
+
+    ASSERT_EQ(executor.init(1, THREAD_POOL_WORK_STEALING), 0);
+    ASSERT_EQ(q1.init(), 0);
+    ASSERT_EQ(q2.init(), 0);
+
+    SpawnSession spawn(&executor, &q1, &q2, &order, &handled);
+    ASSERT_EQ(executor.request(&spawn, &q2), 0);
+
+    for (int i = 0; i < 5000 && handled < 201; ++i)
+        usleep(1000);
+
+    ASSERT_EQ(handled, 201);
+    ASSERT_EQ(order.size(), 100);
+    for (int i = 0; i < 100; ++i)
+        EXPECT_EQ(order[i], i);
+
+    executor.deInit();
+    q1.deInit();
+    q2.deInit();
+};
+
+class CountSession : public ExecSession
+{
+public:
+    CountSession(std::atomic<int>* count) { mCount = count; }
+
+private:
+    void execute() override { }
+
+    void handle(int state, int error) override
+    {
+        ++*mCount;
+        delete this;
+    }
+
+private:
+    std::atomic<int>*           mCount;
+};
+
+TEST(EXECUTOR, WORK_STEALING_QUEUES) {
+    Executor executor;
+    std::vector<ExecQueue> queues(16);
+    std::atomic<int> count(0);
+
+    ASSERT_EQ(executor.init(4, THREAD_POOL_WORK_STEALING), 0);
+    for (auto& q : queues)
+        ASSERT_EQ(q.init(), 0);
+
+    for (int i = 0; i < 10000; ++i)
+        ASSERT_EQ(executor.request(new CountSession(&count), &queues[i % queues.size()]), 0);
+
+    for (int i = 0; i < 10000 && count < 10000; ++i)
+        usleep(1000);
+
+    EXPECT_EQ(count, 10000);
+    executor.deInit();
+    for (auto& q : queues)
+        q.deInit();
+};
@@ -0,0 +1,192 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "file-test.h"
+#include "../app/manager/facilities.h"
+#include "../app/factory/task-factory.h"
+#include "../app/factory/file-stream-task.h"
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <future>
+#include <string>
+#include <thread>
+
+#define CHUNK_SIZE          4096
+
+/* 一个 handler 线程: 占住它, IO 完成就交不回来 */
+class FileStreamTest : public FileTest
+{
+protected:
+    static void SetUpTestSuite()
+    {
+        setUpSettings([](GlobalSettings& settings) { settings.handler_threads = 1; });
+    }
+
+    /* 每块内容都不一样, 顺序错了能看出来 */
+    static std::string pattern(size_t size)
+    {
+        std::string data(size, 0);
+
+        for (size_t i = 0; i < size; i++)
+            data[i] = (char)(i * 7 + i / CHUNK_SIZE);
+
+        return data;
+    }
+
+    void writeFile(const std::string& data)
+    {
+        int fd = open(mPath.c_str(), O_WRONLY | O_TRUNC);
+
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(::write(fd, data.data(), data.size()), (ssize_t)data.size());
+        close(fd);
+    }
+
+    std::string readFile()
+    {
+        std::string data;
+        char buf[4096];
+        ssize_t n;
+        int fd = open(mPath.c_str(), O_RDONLY);
+
+        while (fd >= 0 && (n = read(fd, buf, sizeof buf)) > 0)
+            data.append(buf, n);
+
+        if (fd >= 0)
+            close(fd);
+
+        return data;
+    }
+
+    /* 读整个文件, 检查每块都按偏移顺序交付. 消费者慢一些, 后面的块都已经预读好 */
+    void readInOrder(const std::string& queueName)
+    {
+        std::string data = pattern(64 * CHUNK_SIZE + 100);
+        Facilities::WaitGroup wg(1);
+        std::string got;
+        off_t expect = 0;
+        int state = -1;
+        long long bytes = -1;
+        int chunks = 0;
+        FileStreamConsumer consumer = [&](FileStreamTask *, const void *buf, size_t size, off_t offset) {
+            EXPECT_EQ(offset, expect);
+            expect = offset + size;
+            got.append((const char *)buf, size);
+            if (++chunks % 8 == 1)
+                usleep(5 * 1000);
+
+            return 0;
+        };
+        FileStreamCallback callback = [&](FileStreamTask *task) {
+            state = task->getState();
+            bytes = task->getBytes();
+            wg.done();
+        };
+        FileStreamTask *task;
+
+        writeFile(data);
+        if (queueName.empty())
+            task = TaskFactory::createFileReadStream(mPath, CHUNK_SIZE, 8, consumer, callback);
+        else
+            task = TaskFactory::createFileReadStream(mPath, CHUNK_SIZE, 8, queueName, consumer, callback);
+
+        task->start();
+        wg.wait();
+
+        EXPECT_EQ(state, TASK_STATE_SUCCESS);
+        EXPECT_EQ(bytes, (long long)data.size());
+        EXPECT_EQ(chunks, 65);
+        EXPECT_TRUE(got == data);
+    }
+};
+
+TEST_F(FileStreamTest, ReadInOrder)
+{
+    readInOrder("");
+}
+
+TEST_F(FileStreamTest, ReadInOrderOnQueue)
+{
+    readInOrder("file-stream-test");
+}
+
+/* 消费者返回负数后不再交付 */
+TEST_F(FileStreamTest, ConsumerStops)
+{
+    Facilities::WaitGroup wg(1);
+    long long bytes = -1;
+    int chunks = 0;
+
+    writeFile(pattern(16 * CHUNK_SIZE));
+    TaskFactory::createFileReadStream(mPath, CHUNK_SIZE, 4, [&](FileStreamTask *, const void *, size_t, off_t) {
+        return ++chunks == 3 ? -1 : 0;
+    }, [&](FileStreamTask *task) {
+        bytes = task->getBytes();
+        wg.done();
+    })->start();
+
+    wg.wait();
+    EXPECT_EQ(chunks, 3);
+    EXPECT_EQ(bytes, 3 * CHUNK_SIZE);
+}
+
+/* depth 块都在写时 write() 阻塞, 有块写完才返回; finish() 写出不满一块的尾巴后才回调 */
+TEST_F(FileStreamTest, WriteBlocksAtDepth)
+{
+    std::string data = pattern(3 * CHUNK_SIZE + 100);
+    std::promise<void> release;
+    std::shared_future<void> gate = release.get_future().share();
+    std::atomic<bool> blocked(false);
+    std::atomic<bool> written(false);
+    std::atomic<int> callbacks(0);
+    Facilities::WaitGroup wg(1);
+    int state = -1;
+    long long bytes = -1;
+    int ret = -1;
+
+    /* 占住唯一的 handler 线程 */
+    TaskFactory::createTimerTask(0, [&blocked, gate](TimerTask *) {
+        blocked = true;
+        gate.wait();
+    })->start();
+
+    while (!blocked)
+        usleep(1000);
+
+    FileStreamTask *task = TaskFactory::createFileWriteStream(mPath, CHUNK_SIZE, 2, [&](FileStreamTask *task) {
+        callbacks++;
+        state = task->getState();
+        bytes = task->getBytes();
+        wg.done();
+    });
+
+    task->start();
+    std::thread writer([&]() {
+        ret = task->write(data.data(), data.size());
+        written = true;
+    });
+
+    /* 两块都提交了, 写不完成就拿不到第三块 */
+    usleep(100 * 1000);
+    EXPECT_FALSE(written);
+
+    release.set_value();
+    writer.join();
+    EXPECT_EQ(ret, 0);
+    EXPECT_EQ(callbacks, 0);
+
+    /* 尾巴还在块里, finish() 之后才写出去 */
+    task->finish();
+    wg.wait();
+
+    EXPECT_EQ(callbacks, 1);
+    EXPECT_EQ(state, TASK_STATE_SUCCESS);
+    EXPECT_EQ(bytes, (long long)data.size());
+    EXPECT_TRUE(readFile() == data);
+}
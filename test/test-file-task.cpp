@@ -0,0 +1,105 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "file-test.h"
+#include "../app/factory/workflow.h"
+#include "../app/core/buffer-pool.h"
+#include "../app/manager/facilities.h"
+#include "../app/factory/task-factory.h"
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+/* 池里只有两块 4096 字节的缓冲区, 容易取空 */
+class FileTaskTest : public FileTest
+{
+protected:
+    static void SetUpTestSuite()
+    {
+        setUpSettings([](GlobalSettings& settings) {
+            settings.io_buffer_size = 4096;
+            settings.io_buffers = 2;
+        });
+    }
+
+    /* 同步执行, 返回 retval, data 不为空时带回读到的数据. 返回时任务已经销毁 */
+    static long run(FileIOTask *task, std::string *data = nullptr)
+    {
+        Facilities::WaitGroup wg(1);
+        long ret = 0;
+
+        task->setCallback([&](FileIOTask *task) {
+            ret = task->getRetVal();
+            if (data && ret > 0)
+                data->assign((const char *)task->getArgs()->buf, ret);
+        });
+
+        Workflow::startSeriesWork(task, [&](const SeriesWork *) { wg.done(); });
+        wg.wait();
+        return ret;
+    }
+};
+
+/* buf 为 NULL 时用池里的缓冲区读写, 任务结束后还回去 */
+TEST_F(FileTaskTest, LeasedBuffer)
+{
+    BufferPool *pool = Global::getBufferPool();
+    FileIOTask *task;
+
+    ASSERT_NE(pool, nullptr);
+    task = TaskFactory::createPWriteTask(mPath, NULL, 4096, 0, FILE_IO_DIRECT, nullptr);
+    ASSERT_NE(task, nullptr);
+    ASSERT_NE(task->getArgs()->buf, nullptr);
+    EXPECT_EQ(buffer_pool_free_count(pool), 1);
+    memset(task->getArgs()->buf, 'x', 4096);
+    EXPECT_EQ(run(task), 4096);
+    EXPECT_EQ(buffer_pool_free_count(pool), 2);
+
+    std::string data;
+
+    task = TaskFactory::createPReadTask(mPath, NULL, 4096, 0, FILE_IO_DIRECT, nullptr);
+    ASSERT_NE(task, nullptr);
+    EXPECT_EQ(run(task, &data), 4096);
+    EXPECT_EQ(data, std::string(4096, 'x'));
+    EXPECT_EQ(buffer_pool_free_count(pool), 2);
+}
+
+/* 取不到缓冲区时工厂返回 NULL, 不会创建出没有缓冲区的任务 */
+TEST_F(FileTaskTest, LeaseFailure)
+{
+    BufferPool *pool = Global::getBufferPool();
+    std::vector<void *> bufs;
+    void *buf;
+
+    ASSERT_NE(pool, nullptr);
+    while ((buf = buffer_pool_get(pool)) != NULL)
+        bufs.push_back(buf);
+
+    errno = 0;
+    EXPECT_EQ(TaskFactory::createPWriteTask(mPath, NULL, 4096, 0, FILE_IO_DIRECT, nullptr), nullptr);
+    EXPECT_EQ(errno, ENOBUFS);
+    EXPECT_EQ(TaskFactory::createPReadTask(mPath, NULL, 4096, 0, nullptr), nullptr);
+    EXPECT_EQ(errno, ENOBUFS);
+
+    for (void *b : bufs)
+        buffer_pool_put(b, pool);
+
+    /* 比池里的缓冲区大 */
+    errno = 0;
+    EXPECT_EQ(TaskFactory::createPWriteTask(mPath, NULL, 8192, 0, 0, nullptr), nullptr);
+    EXPECT_EQ(errno, EINVAL);
+    EXPECT_EQ(buffer_pool_free_count(pool), 2);
+
+    /* 自己的缓冲区不用租 */
+    char data[16] = "hello";
+    FileIOTask *task = TaskFactory::createPWriteTask(mPath, data, 5, 0, 0, nullptr);
+
+    ASSERT_NE(task, nullptr);
+    EXPECT_EQ(run(task), 5);
+    EXPECT_EQ(buffer_pool_free_count(pool), 2);
+}
@@ -0,0 +1,213 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/core/communicator.h"
+#include "../app/core/io-service.h"
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+
+/* 结果按 fd 分到 fd % 组数 的组: 让 eventfd 的奇偶固定, 决定完成结果归哪个组 */
+class GroupIOService : public IOService
+{
+public:
+    explicit GroupIOService(int group) : mGroup(group) { }
+
+    std::atomic<int>            unbound{0};
+
+private:
+    int createEventFd() override
+    {
+        int fd = eventfd(0, 0);
+        int ret;
+
+        if (fd < 0)
+            return -1;
+
+        ret = fcntl(fd, F_DUPFD, 1000 + mGroup);
+        close(fd);
+        return ret;
+    }
+
+    void handleUnbound() override
+    {
+        unbound = 1;
+    }
+
+    int                         mGroup;
+};
+
+/* 记下在哪个线程处理; gate 不为空时在这里等到放行 */
+class GroupSession : public IOSession
+{
+public:
+    int                         fd = -1;
+    char                        buf[1];
+    pthread_t                   thread = 0;
+    std::atomic<int>            done{0};
+    std::atomic<int>*           blocked = nullptr;
+    std::atomic<bool>*          gate = nullptr;
+
+private:
+    int prepare() override
+    {
+        prepPRead(fd, buf, sizeof buf, 0);
+        return 0;
+    }
+
+    void handle(int state, int error) override
+    {
+        thread = pthread_self();
+        if (gate) {
+            ++*blocked;
+            while (!*gate)
+                usleep(1000);
+        }
+
+        done = 1;
+    }
+};
+
+static void wait_for(const std::atomic<int>& value, int expect)
+{
+    for (int i = 0; i < 5000 && value < expect; ++i)
+        usleep(1000);
+}
+
+/* 两个 poller, 每组两个 handler 线程 */
+class HandlerGroupTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        char name[] = "/tmp/test-handler-group-XXXXXX";
+
+        fd = mkstemp(name);
+        ASSERT_GE(fd, 0);
+        path = name;
+        ASSERT_EQ(comm.init(2, 4, CPOLL_ENGINE_EPOLL, NULL, COMM_HANDLER_PER_POLLER), 0);
+        for (auto *service : services) {
+            ASSERT_EQ(service->init(256), 0);
+            ASSERT_EQ(comm.ioBind(service), 0);
+        }
+    }
+
+    void TearDown() override
+    {
+        for (auto *service : services) {
+            comm.ioUnbind(service);
+            wait_for(service->unbound, 1);
+            service->deInit();
+        }
+
+        comm.deInit();
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    /* 一个一个地做, 组里没有积压 */
+    pthread_t run(int group)
+    {
+        GroupSession session;
+
+        session.fd = fd;
+        EXPECT_EQ(services[group]->request(&session), 0);
+        wait_for(session.done, 1);
+        EXPECT_EQ(session.done, 1);
+        return session.thread;
+    }
+
+    Communicator                comm;
+    GroupIOService              service0{0};
+    GroupIOService              service1{1};
+    GroupIOService*             services[2] = { &service0, &service1 };
+    std::string                 path;
+    int                         fd;
+};
+
+/* 没有积压时每个结果都在自己的组里处理, 两组的线程不重叠 */
+TEST_F(HandlerGroupTest, RouteByFd)
+{
+    std::set<pthread_t> threads[2];
+
+    for (int i = 0; i < 100; i++) {
+        threads[0].insert(run(0));
+        threads[1].insert(run(1));
+    }
+
+    EXPECT_LE(threads[0].size(), 2);
+    EXPECT_LE(threads[1].size(), 2);
+    for (pthread_t t : threads[0])
+        EXPECT_EQ(threads[1].count(t), 0);
+
+    EXPECT_EQ(comm.getHandlerOverflows(), 0);
+}
+
+/* 组 0 的两个线程都卡住, 再积压两个后, 之后的结果交给组 1 处理 */
+TEST_F(HandlerGroupTest, OverflowToIdleGroup)
+{
+    std::atomic<bool> gate(false);
+    std::atomic<int> blocked(0);
+    GroupSession stuck[2], queued[2], overflow[2];
+    std::set<pthread_t> group0;
+    std::set<pthread_t> group0Before;
+
+    for (int i = 0; i < 20; i++)
+        group0Before.insert(run(0));
+
+    for (auto& session : stuck) {
+        session.fd = fd;
+        session.gate = &gate;
+        session.blocked = &blocked;
+        ASSERT_EQ(services[0]->request(&session), 0);
+    }
+
+    wait_for(blocked, 2);
+    ASSERT_EQ(blocked, 2);
+    group0 = { stuck[0].thread, stuck[1].thread };
+    EXPECT_EQ(group0.size(), 2);
+    for (pthread_t t : group0Before)
+        EXPECT_EQ(group0.count(t), 1);
+
+    /* 组 0 的队列里积压两个, 还没到它的线程数, 不交出去 */
+    for (auto& session : queued) {
+        session.fd = fd;
+        ASSERT_EQ(services[0]->request(&session), 0);
+        usleep(20 * 1000);
+    }
+
+    EXPECT_EQ(comm.getHandlerOverflows(), 0);
+    EXPECT_EQ(queued[0].done + queued[1].done, 0);
+
+    /* 积压满了, 交给组 1, 组 0 还卡着也能处理完 */
+    for (auto& session : overflow) {
+        session.fd = fd;
+        ASSERT_EQ(services[0]->request(&session), 0);
+        wait_for(session.done, 1);
+        EXPECT_EQ(session.done, 1);
+        EXPECT_EQ(group0.count(session.thread), 0);
+    }
+
+    EXPECT_EQ(comm.getHandlerOverflows(), 2);
+    EXPECT_EQ(queued[0].done + queued[1].done, 0);
+
+    gate = true;
+    for (auto& session : queued) {
+        wait_for(session.done, 1);
+        EXPECT_EQ(session.done, 1);
+        EXPECT_EQ(group0.count(session.thread), 1);
+    }
+
+    wait_for(stuck[1].done, 1);
+    wait_for(stuck[0].done, 1);
+}
@@ -0,0 +1,224 @@
+//
+// Created by dingjing on 8/27/22.
+//
+
+#include "../app/protocol/http/hpack.h"
+#include <gtest/gtest.h>
+
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+using Headers = std::vector<std::pair<std::string, std::string>>;
+
+static std::string hex(const char* str)
+{
+    std::string out;
+
+    for (const char* p = str; *p; ) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+
+        out.push_back((char) strtol(std::string(p, 2).c_str(), nullptr, 16));
+        p += 2;
+    }
+
+    return out;
+}
+
+static int collect(const char* name, size_t nameLen, const char* value, size_t valueLen, void* context)
+{
+    ((Headers*) context)->emplace_back(std::string(name, nameLen), std::string(value, valueLen));
+    return 0;
+}
+
+static Headers decode(const char* block, HpackDecoder* decoder)
+{
+    std::string buf = hex(block);
+    Headers headers;
+
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, decoder), 0);
+    return headers;
+}
+
+// RFC 7541 C.2
+TEST(HPACK, LITERAL) {
+    HpackDecoder decoder;
+
+    hpack_decoder_init(HPACK_TABLE_SIZE_DEFAULT, &decoder);
+    EXPECT_EQ(decode("400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", &decoder),
+              Headers({{"custom-key", "custom-header"}}));
+    EXPECT_EQ(decoder.tableSize, 55);
+
+    EXPECT_EQ(decode("040c 2f73 616d 706c 652f 7061 7468", &decoder), Headers({{":path", "/sample/path"}}));
+    EXPECT_EQ(decode("1008 7061 7373 776f 7264 0673 6563 7265 74", &decoder), Headers({{"password", "secret"}}));
+    EXPECT_EQ(decode("82", &decoder), Headers({{":method", "GET"}}));
+    EXPECT_EQ(decoder.count, 1);
+    hpack_decoder_deinit(&decoder);
+}
+
+// RFC 7541 C.3 和 C.4: 同一个连接上的三个请求, 不用和用 Huffman 编码结果相同
+TEST(HPACK, REQUESTS) {
+    const char* blocks[2][3] = {
+            {
+                "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+                "8286 84be 5808 6e6f 2d63 6163 6865",
+                "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+            },
+            {
+                "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+                "8286 84be 5886 a8eb 1064 9cbf",
+                "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+            },
+    };
+
+    for (auto& block : blocks) {
+        HpackDecoder decoder;
+
+        hpack_decoder_init(HPACK_TABLE_SIZE_DEFAULT, &decoder);
+        EXPECT_EQ(decode(block[0], &decoder), Headers({{":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+                                                       {":authority", "www.example.com"}}));
+        EXPECT_EQ(decoder.tableSize, 57);
+
+        EXPECT_EQ(decode(block[1], &decoder), Headers({{":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+                                                       {":authority", "www.example.com"}, {"cache-control", "no-cache"}}));
+        EXPECT_EQ(decoder.tableSize, 110);
+
+        EXPECT_EQ(decode(block[2], &decoder), Headers({{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+                                                       {":authority", "www.example.com"}, {"custom-key", "custom-value"}}));
+        EXPECT_EQ(decoder.tableSize, 164);
+        EXPECT_EQ(decoder.count, 3);
+        hpack_decoder_deinit(&decoder);
+    }
+}
+
+// RFC 7541 C.5 和 C.6: 动态表只有 256 字节, 后面的响应会淘汰前面的条目
+TEST(HPACK, RESPONSES_EVICTION) {
+    const char* blocks[2][3] = {
+            {
+                "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 "
+                "3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+                "4803 3330 37c1 c0bf",
+                "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 "
+                "7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 "
+                "6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31",
+            },
+            {
+                "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad "
+                "1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+                "4883 640e ffc1 c0bf",
+                "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 "
+                "e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+            },
+    };
+
+    for (auto& block : blocks) {
+        HpackDecoder decoder;
+
+        hpack_decoder_init(256, &decoder);
+        EXPECT_EQ(decode(block[0], &decoder), Headers({{":status", "302"}, {"cache-control", "private"},
+                                                       {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+                                                       {"location", "https://www.example.com"}}));
+        EXPECT_EQ(decoder.tableSize, 222);
+
+        EXPECT_EQ(decode(block[1], &decoder), Headers({{":status", "307"}, {"cache-control", "private"},
+                                                       {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+                                                       {"location", "https://www.example.com"}}));
+        EXPECT_EQ(decoder.tableSize, 222);
+
+        EXPECT_EQ(decode(block[2], &decoder), Headers({{":status", "200"}, {"cache-control", "private"},
+                                                       {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+                                                       {"location", "https://www.example.com"},
+                                                       {"content-encoding", "gzip"},
+                                                       {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}}));
+        EXPECT_EQ(decoder.tableSize, 215);
+        EXPECT_EQ(decoder.count, 3);
+        hpack_decoder_deinit(&decoder);
+    }
+}
+
+TEST(HPACK, TABLE_SIZE_UPDATE) {
+    HpackDecoder decoder;
+    Headers headers;
+    std::string buf;
+
+    hpack_decoder_init(HPACK_TABLE_SIZE_DEFAULT, &decoder);
+    decode("400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", &decoder);
+
+    // 大小改为 0 清空动态表, 之后引用 62 是错误
+    EXPECT_EQ(decode("20", &decoder), Headers());
+    EXPECT_EQ(decoder.count, 0);
+    buf = hex("be");
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, &decoder), -1);
+    EXPECT_EQ(errno, EBADMSG);
+
+    // 不能超过 SETTINGS 里通告的大小, 也不能出现在头部之后
+    buf = hex("3fe2 1f");
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, &decoder), -1);
+    buf = hex("823f e11e");
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, &decoder), -1);
+    hpack_decoder_deinit(&decoder);
+}
+
+TEST(HPACK, BAD_HUFFMAN) {
+    HpackDecoder decoder;
+    Headers headers;
+    std::string buf;
+
+    hpack_decoder_init(HPACK_TABLE_SIZE_DEFAULT, &decoder);
+
+    // 填充超过 7 位
+    buf = hex("0081 ff81 ff");
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, &decoder), -1);
+
+    // 填充不全是 1
+    buf = hex("0081 0081 00");
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, &decoder), -1);
+
+    // 长度超出头部块
+    buf = hex("0005 6162");
+    EXPECT_EQ(hpack_decode(buf.data(), buf.size(), collect, &headers, &decoder), -1);
+    EXPECT_TRUE(headers.empty());
+    hpack_decoder_deinit(&decoder);
+}
+
+TEST(HPACK, ENCODE_ROUND_TRIP) {
+    Headers input = {
+            {":method", "GET"},
+            {":path", "/index.html"},
+            {":authority", "www.example.com"},
+            {"content-type", "text/html; charset=utf-8"},
+            {"x-empty", ""},
+            {"x-binary", std::string("\x00\x01\xff\x7f", 4)},
+            {"x-long", std::string(300, 'a')},
+    };
+    HpackDecoder decoder;
+    Headers output;
+    std::string block;
+    char buf[1024];
+
+    for (auto& h : input) {
+        ASSERT_LE(hpack_encode_bound(h.first.size(), h.second.size()), sizeof (buf));
+        size_t n = hpack_encode_header(h.first.data(), h.first.size(), h.second.data(), h.second.size(), buf);
+        ASSERT_LE(n, hpack_encode_bound(h.first.size(), h.second.size()));
+        block.append(buf, n);
+    }
+
+    // 静态表中的名字和值只用一个字节
+    EXPECT_EQ((unsigned char) block[0], 0x82);
+    EXPECT_EQ((unsigned char) block[1], 0x85);
+
+    hpack_decoder_init(HPACK_TABLE_SIZE_DEFAULT, &decoder);
+    EXPECT_EQ(hpack_decode(block.data(), block.size(), collect, &output, &decoder), 0);
+    EXPECT_EQ(output, input);
+
+    // 编码不使用动态表
+    EXPECT_EQ(decoder.count, 0);
+    hpack_decoder_deinit(&decoder);
+
+    EXPECT_EQ(hpack_huffman_encoded_size("www.example.com", 15), 12);
+}
@@ -0,0 +1,108 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "file-test.h"
+#include "../app/manager/facilities.h"
+#include "../app/modules/http-server.h"
+#include "../app/factory/task-factory.h"
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <string>
+
+/* 块数比 Communicator 一次编码的 iovec 上限 (8192) 多 */
+#define SMALL_BLOCKS        9000
+
+class HttpBodyTest : public FileTest
+{
+protected:
+    void writeFile(const std::string& data)
+    {
+        int fd = open(mPath.c_str(), O_WRONLY | O_TRUNC);
+
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(::write(fd, data.data(), data.size()), (ssize_t)data.size());
+        close(fd);
+    }
+
+    /* 同步请求, 返回任务状态, 成功时 body 是响应体 */
+    static int fetch(const ServerBase& server, std::string& body)
+    {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof sin;
+        Facilities::WaitGroup wg(1);
+        int state = -1;
+
+        server.get_listen_addr((struct sockaddr *)&sin, &len);
+        TaskFactory::createHttpTask("http://127.0.0.1:" + std::to_string(ntohs(sin.sin_port)) + "/", 0, 0,
+                                    [&](HttpTask *task, void *) {
+            const void *ptr;
+            size_t size;
+
+            state = task->getState();
+            if (state == TASK_STATE_SUCCESS && task->getResp()->getParsedBody(&ptr, &size))
+                body.assign((const char *)ptr, size);
+
+            wg.done();
+        }, nullptr)->start();
+
+        wg.wait();
+        return state;
+    }
+};
+
+/* 内存块太多时合并成一块, 中间的文件段照样 sendfile, 内容和顺序不变 */
+TEST_F(HttpBodyTest, CombineAroundFileSegment)
+{
+    std::string file(64 * 1024, 'f');
+    std::string expect;
+    std::string body;
+
+    writeFile(file);
+    for (int i = 0; i < SMALL_BLOCKS; i++)
+        expect += (char)('a' + i % 26);
+
+    expect += file;
+    expect += "tail";
+
+    HttpServer server([this](HttpTask *task) {
+        auto *resp = task->getResp();
+
+        for (int i = 0; i < SMALL_BLOCKS; i++) {
+            char c = (char)('a' + i % 26);
+            resp->appendOutputBody(&c, 1);
+        }
+
+        resp->appendOutputBodyFile(open(mPath.c_str(), O_RDONLY | O_CLOEXEC), 0, 64 * 1024, true);
+        resp->appendOutputBody("tail", 4);
+    });
+
+    ASSERT_EQ(server.start("127.0.0.1", 0), 0);
+    ASSERT_EQ(fetch(server, body), TASK_STATE_SUCCESS);
+    EXPECT_EQ(body.size(), expect.size());
+    EXPECT_TRUE(body == expect);
+    server.stop();
+}
+
+/* 文件段不读进内存合并, 文件段本身就放不下时响应发送失败 */
+TEST_F(HttpBodyTest, TooManyFileSegments)
+{
+    std::string body;
+
+    writeFile("x");
+    HttpServer server([this](HttpTask *task) {
+        int fd = open(mPath.c_str(), O_RDONLY | O_CLOEXEC);
+
+        for (int i = 0; i < SMALL_BLOCKS; i++)
+            task->getResp()->appendOutputBodyFile(fd, 0, 1, i == SMALL_BLOCKS - 1);
+    });
+
+    ASSERT_EQ(server.start("127.0.0.1", 0), 0);
+    EXPECT_NE(fetch(server, body), TASK_STATE_SUCCESS);
+    server.stop();
+}
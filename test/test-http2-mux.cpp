@@ -0,0 +1,732 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "params-policy.h"
+#include "../app/manager/facilities.h"
+#include "../app/modules/http-server.h"
+#include "../app/factory/task-factory.h"
+#include "../app/protocol/http/hpack.h"
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/ec.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <future>
+#include <string>
+#include <vector>
+
+#define FRAME_DATA              0x0
+#define FRAME_HEADERS           0x1
+#define FRAME_RST_STREAM        0x3
+#define FRAME_SETTINGS          0x4
+#define FRAME_PING              0x6
+#define FRAME_GOAWAY            0x7
+#define FRAME_WINDOW_UPDATE     0x8
+#define FRAME_CONTINUATION      0x9
+
+#define FLAG_ACK                0x1
+#define FLAG_END_STREAM         0x1
+#define FLAG_END_HEADERS        0x4
+
+#define PROTOCOL_ERROR          0x1
+#define FLOW_CONTROL_ERROR      0x3
+#define STREAM_CLOSED           0x5
+#define FRAME_SIZE_ERROR        0x6
+#define REFUSED_STREAM          0x7
+
+/* 服务端通告的流和连接窗口 */
+#define LOCAL_WINDOW            (1024 * 1024)
+#define FRAME_SIZE              16384
+
+struct Frame
+{
+    uint8_t                     type;
+    uint8_t                     flags;
+    uint32_t                    id;
+    std::string                 payload;
+
+    uint32_t code() const
+    {
+        const uint8_t *p = (const uint8_t *)payload.data() + (type == FRAME_GOAWAY ? 4 : 0);
+
+        return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+};
+
+/* 直接写帧的客户端, 帧都是手工拼的 */
+class Http2Peer
+{
+public:
+    explicit Http2Peer(unsigned short port)
+    {
+        struct sockaddr_in sin = { };
+
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        mFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(mFd, (struct sockaddr *)&sin, sizeof sin) < 0) {
+            close(mFd);
+            mFd = -1;
+        }
+    }
+
+    ~Http2Peer()
+    {
+        if (mFd >= 0)
+            close(mFd);
+    }
+
+    bool connected() const
+    {
+        return mFd >= 0;
+    }
+
+    int fd() const
+    {
+        return mFd;
+    }
+
+    /* 客户端开头和空的 SETTINGS */
+    void start()
+    {
+        send(HTTP2_CLIENT_PREFACE);
+        sendFrame(FRAME_SETTINGS, 0, 0);
+    }
+
+    void send(const std::string& data)
+    {
+        size_t off = 0;
+        ssize_t n;
+
+        while (off < data.size()) {
+            n = ::write(mFd, data.data() + off, data.size() - off);
+            if (n <= 0)
+                break;
+
+            off += n;
+        }
+    }
+
+    void sendFrame(uint8_t type, uint8_t flags, uint32_t id, const std::string& payload = "")
+    {
+        std::string frame;
+
+        frame += (char)(payload.size() >> 16);
+        frame += (char)(payload.size() >> 8);
+        frame += (char)payload.size();
+        frame += (char)type;
+        frame += (char)flags;
+        frame += (char)(id >> 24);
+        frame += (char)(id >> 16);
+        frame += (char)(id >> 8);
+        frame += (char)id;
+        send(frame + payload);
+    }
+
+    /* 请求的头部块, 不用动态表 */
+    static std::string headers(const char *method, const std::string& extra = "")
+    {
+        std::string block;
+
+        addHeader(block, ":method", method);
+        addHeader(block, ":scheme", "http");
+        addHeader(block, ":path", "/");
+        addHeader(block, ":authority", "127.0.0.1");
+        return block + extra;
+    }
+
+    static void addHeader(std::string& block, const char *name, const char *value)
+    {
+        char buf[256];
+
+        block.append(buf, hpack_encode_header(name, strlen(name), value, strlen(value), buf));
+    }
+
+    /* 读一帧, 超时或连接关闭返回 false */
+    bool readFrame(Frame& frame, int timeout = 3000)
+    {
+        uint8_t header[9];
+        size_t len;
+
+        if (!readFull(header, sizeof header, timeout))
+            return false;
+
+        len = ((size_t)header[0] << 16) | (header[1] << 8) | header[2];
+        frame.type = header[3];
+        frame.flags = header[4];
+        frame.id = (((uint32_t)header[5] << 24) | (header[6] << 16) | (header[7] << 8) | header[8]) & 0x7fffffff;
+        frame.payload.resize(len);
+        return readFull(&frame.payload[0], len, timeout);
+    }
+
+    /* 跳过别的帧, 等到这个类型的帧 */
+    bool waitFrame(uint8_t type, Frame& frame)
+    {
+        while (readFrame(frame)) {
+            if (frame.type == type)
+                return true;
+        }
+
+        return false;
+    }
+
+    /* 连接还能用: PING 有回应 */
+    bool alive()
+    {
+        Frame frame;
+
+        sendFrame(FRAME_PING, 0, 0, "12345678");
+        while (waitFrame(FRAME_PING, frame)) {
+            if (frame.flags & FLAG_ACK)
+                return frame.payload == "12345678";
+        }
+
+        return false;
+    }
+
+    /* 读到连接关闭为止, 返回所有内容 */
+    std::string readAll(int timeout = 3000)
+    {
+        std::string data;
+        char buf[4096];
+
+        while (readFull(buf, 1, timeout)) {
+            data += buf[0];
+            ssize_t n = ::read(mFd, buf, sizeof buf);
+            if (n > 0)
+                data.append(buf, n);
+        }
+
+        return data;
+    }
+
+private:
+    bool readFull(void *buf, size_t size, int timeout)
+    {
+        struct pollfd pfd = { mFd, POLLIN, 0 };
+        size_t off = 0;
+        ssize_t n;
+
+        while (off < size) {
+            if (poll(&pfd, 1, timeout) <= 0)
+                return false;
+
+            n = ::read(mFd, (char *)buf + off, size - off);
+            if (n <= 0)
+                return false;
+
+            off += n;
+        }
+
+        return true;
+    }
+
+    int                         mFd;
+};
+
+class Http2MuxTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        ServerParams params = HTTP_SERVER_PARAMS_DEFAULT;
+
+        params.http2 = true;
+        mServer = new HttpServer(&params, [this](HttpTask *task) {
+            const void *body;
+            size_t size;
+
+            if (mBlock)
+                mGate.wait();
+
+            mVersion = task->getReq()->getHttpVersion();
+            if (task->getReq()->getParsedBody(&body, &size) && size > 0)
+                task->getResp()->appendOutputBody(body, size);
+            else
+                task->getResp()->appendOutputBody("ok");
+        });
+
+        mGate = mRelease.get_future().share();
+    }
+
+    void TearDown() override
+    {
+        if (mBlock)
+            mRelease.set_value();
+
+        if (mPolicy)
+            Global::getNameService()->delPolicy("127.0.0.1");
+
+        mServer->stop();
+        delete mServer;
+        delete mPolicy;
+        unlink(mCert.c_str());
+        unlink(mKey.c_str());
+    }
+
+    unsigned short start(bool ssl = false)
+    {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof sin;
+
+        if (ssl) {
+            newCert();
+            EXPECT_EQ(mServer->start("127.0.0.1", 0, mCert.c_str(), mKey.c_str()), 0);
+        } else {
+            EXPECT_EQ(mServer->start("127.0.0.1", 0), 0);
+        }
+
+        mServer->get_listen_addr((struct sockaddr *)&sin, &len);
+        return ntohs(sin.sin_port);
+    }
+
+    /* 临时的自签名证书 */
+    void newCert()
+    {
+        char cert[] = "/tmp/test-h2-cert-XXXXXX";
+        char key[] = "/tmp/test-h2-key-XXXXXX";
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+        EVP_PKEY *pkey = NULL;
+        X509 *x509 = X509_new();
+        FILE *fp;
+
+        mCert = mkstemp(cert) >= 0 ? cert : "";
+        mKey = mkstemp(key) >= 0 ? key : "";
+        EVP_PKEY_keygen_init(pctx);
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1);
+        EVP_PKEY_keygen(pctx, &pkey);
+
+        ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+        X509_set_pubkey(x509, pkey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"127.0.0.1", -1, -1, 0);
+        X509_set_issuer_name(x509, X509_get_subject_name(x509));
+        X509_sign(x509, pkey, EVP_sha256());
+
+        fp = fopen(cert, "w");
+        PEM_write_X509(fp, x509);
+        fclose(fp);
+        fp = fopen(key, "w");
+        PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+        fclose(fp);
+
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+        EVP_PKEY_CTX_free(pctx);
+    }
+
+    /* 之后发到 127.0.0.1 的请求都用 h2 (TLS 用 ALPN, 明文直接 h2c) */
+    void addPolicy()
+    {
+        EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+
+        params.http2 = true;
+        params.http2PriorKnowledge = true;
+        mPolicy = new ParamsPolicy(params);
+        ASSERT_EQ(Global::getNameService()->addPolicy("127.0.0.1", mPolicy), 0);
+    }
+
+    /* 并发的 POST, 每个回复都是自己的 body */
+    void roundTrip(const std::string& url)
+    {
+        Facilities::WaitGroup wg(8);
+        std::atomic<int> success(0);
+
+        for (int i = 0; i < 8; i++) {
+            std::string body = "body-" + std::to_string(i) + std::string(i * 10000, 'x');
+            HttpTask *task = TaskFactory::createHttpTask(url, 0, 0, [&, body](HttpTask *task, void *) {
+                const void *ptr;
+                size_t size;
+
+                if (task->getState() == TASK_STATE_SUCCESS && task->getResp()->getParsedBody(&ptr, &size) &&
+                    std::string((const char *)ptr, size) == body)
+                    success++;
+
+                wg.done();
+            }, nullptr);
+
+            task->getReq()->setMethod("POST");
+            task->getReq()->appendOutputBody(body);
+            task->start();
+        }
+
+        wg.wait();
+        EXPECT_EQ(success, 8);
+        EXPECT_EQ(mVersion, "HTTP/2.0");
+    }
+
+    /* 让 handler 停住, 请求的流一直在处理中 */
+    void blockHandler()
+    {
+        mBlock = true;
+    }
+
+    HttpServer*                 mServer = nullptr;
+    ParamsPolicy*               mPolicy = nullptr;
+    std::atomic<bool>           mBlock{false};
+    std::promise<void>          mRelease;
+    std::shared_future<void>    mGate;
+    std::string                 mVersion;
+    std::string                 mCert;
+    std::string                 mKey;
+};
+
+/* 客户端 h2c 直接开始, 多个请求在同一连接上来回 */
+TEST_F(Http2MuxTest, RoundTrip)
+{
+    unsigned short port = start();
+
+    addPolicy();
+    roundTrip("http://127.0.0.1:" + std::to_string(port) + "/");
+}
+
+/* TLS 上 ALPN 协商 h2 */
+TEST_F(Http2MuxTest, RoundTripSSL)
+{
+    unsigned short port = start(true);
+
+    addPolicy();
+    roundTrip("https://127.0.0.1:" + std::to_string(port) + "/");
+}
+
+/* 服务端先发 SETTINGS, 收到的 SETTINGS 要回 ACK */
+TEST_F(Http2MuxTest, SettingsAck)
+{
+    Http2Peer peer(start());
+    Frame frame;
+
+    ASSERT_TRUE(peer.connected());
+    peer.start();
+    ASSERT_TRUE(peer.readFrame(frame));
+    EXPECT_EQ(frame.type, FRAME_SETTINGS);
+    EXPECT_EQ(frame.flags & FLAG_ACK, 0);
+
+    while (peer.waitFrame(FRAME_SETTINGS, frame) && !(frame.flags & FLAG_ACK)) { }
+    EXPECT_EQ(frame.type, FRAME_SETTINGS);
+    EXPECT_EQ(frame.flags & FLAG_ACK, FLAG_ACK);
+    EXPECT_TRUE(frame.payload.empty());
+    EXPECT_TRUE(peer.alive());
+}
+
+/* 带负载的 SETTINGS ACK, 长度不是 6 的倍数都是 FRAME_SIZE_ERROR */
+TEST_F(Http2MuxTest, BadSettings)
+{
+    unsigned short port = start();
+    Frame frame;
+
+    Http2Peer ack(port);
+    ack.start();
+    ack.sendFrame(FRAME_SETTINGS, FLAG_ACK, 0, std::string(6, '\0'));
+    ASSERT_TRUE(ack.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), FRAME_SIZE_ERROR);
+
+    Http2Peer length(port);
+    length.start();
+    length.sendFrame(FRAME_SETTINGS, 0, 0, std::string(5, '\0'));
+    ASSERT_TRUE(length.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), FRAME_SIZE_ERROR);
+
+    Http2Peer stream(port);
+    stream.start();
+    stream.sendFrame(FRAME_SETTINGS, 0, 1);
+    ASSERT_TRUE(stream.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), PROTOCOL_ERROR);
+}
+
+/* 超过 SETTINGS_MAX_FRAME_SIZE 的帧, 长度不对的 PING 都是连接错误 */
+TEST_F(Http2MuxTest, FrameParsing)
+{
+    unsigned short port = start();
+    Frame frame;
+
+    Http2Peer large(port);
+    large.start();
+    large.sendFrame(FRAME_DATA, 0, 1, std::string(FRAME_SIZE + 1, 'x'));
+    ASSERT_TRUE(large.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), FRAME_SIZE_ERROR);
+
+    Http2Peer ping(port);
+    ping.start();
+    ping.sendFrame(FRAME_PING, 0, 0, "1234");
+    ASSERT_TRUE(ping.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), FRAME_SIZE_ERROR);
+
+    /* 帧分几次到达也能拼起来 */
+    Http2Peer split(port);
+    split.start();
+    split.send(std::string("\0\0\x08\x06\0\0\0\0", 8));
+    usleep(50 * 1000);
+    split.send(std::string("\0" "87654321", 9));
+    ASSERT_TRUE(split.waitFrame(FRAME_PING, frame));
+    EXPECT_EQ(frame.payload, "87654321");
+}
+
+/* 还没开始的流上的 DATA 是连接错误 */
+TEST_F(Http2MuxTest, DataOnIdleStream)
+{
+    Http2Peer peer(start());
+    Frame frame;
+
+    peer.start();
+    peer.sendFrame(FRAME_DATA, 0, 3, "x");
+    ASSERT_TRUE(peer.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), PROTOCOL_ERROR);
+}
+
+/* 已经关闭的流上的 DATA 回 RST_STREAM(STREAM_CLOSED), 连接照常 */
+TEST_F(Http2MuxTest, DataOnClosedStream)
+{
+    Http2Peer peer(start());
+    Frame frame;
+
+    peer.start();
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 1, Http2Peer::headers("GET"));
+    ASSERT_TRUE(peer.waitFrame(FRAME_DATA, frame));
+    EXPECT_EQ(frame.payload, "ok");
+    EXPECT_EQ(frame.flags & FLAG_END_STREAM, FLAG_END_STREAM);
+
+    peer.sendFrame(FRAME_DATA, 0, 1, "late");
+    ASSERT_TRUE(peer.waitFrame(FRAME_RST_STREAM, frame));
+    EXPECT_EQ(frame.id, 1);
+    EXPECT_EQ(frame.code(), STREAM_CLOSED);
+    EXPECT_TRUE(peer.alive());
+}
+
+/**
+ * 请求已经收完 (Content-Length: 0) 但流没有结束, 之后的 DATA 不再补流的窗口:
+ * 超出流的窗口时只重置这个流. 连接的窗口照样补, 连接还能用
+ */
+TEST_F(Http2MuxTest, StreamFlowControl)
+{
+    Http2Peer peer(start());
+    std::string block = Http2Peer::headers("POST");
+    std::string chunk(FRAME_SIZE, 'x');
+    uint32_t updated = 0;
+    Frame frame;
+
+    blockHandler();
+    Http2Peer::addHeader(block, "content-length", "0");
+    peer.start();
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS, 1, block);
+    for (int i = 0; i <= LOCAL_WINDOW / FRAME_SIZE; i++)
+        peer.sendFrame(FRAME_DATA, 0, 1, chunk);
+
+    while (peer.readFrame(frame) && frame.type != FRAME_RST_STREAM) {
+        if (frame.type == FRAME_WINDOW_UPDATE) {
+            EXPECT_EQ(frame.id, 0);
+            updated += frame.code();
+        }
+    }
+
+    ASSERT_EQ(frame.type, FRAME_RST_STREAM);
+    EXPECT_EQ(frame.id, 1);
+    EXPECT_EQ(frame.code(), FLOW_CONTROL_ERROR);
+    EXPECT_GE(updated, LOCAL_WINDOW / 2);
+    EXPECT_TRUE(peer.alive());
+}
+
+/* 收的数据交给消息之后补上流和连接的窗口, 超过窗口的 body 也能收完 */
+TEST_F(Http2MuxTest, WindowReplenished)
+{
+    Http2Peer peer(start());
+    std::string block = Http2Peer::headers("POST");
+    std::string chunk(FRAME_SIZE, 'x');
+    int chunks = 2 * LOCAL_WINDOW / FRAME_SIZE;
+    uint32_t stream = 0;
+    size_t body = 0;
+    Frame frame;
+
+    Http2Peer::addHeader(block, "content-length", std::to_string(chunks * FRAME_SIZE).c_str());
+    peer.start();
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS, 1, block);
+    for (int i = 0; i < chunks; i++)
+        peer.sendFrame(FRAME_DATA, i == chunks - 1 ? FLAG_END_STREAM : 0, 1, chunk);
+
+    while (peer.readFrame(frame)) {
+        if (frame.type == FRAME_WINDOW_UPDATE && frame.id == 1)
+            stream += frame.code();
+        else if (frame.type == FRAME_DATA)
+            body += frame.payload.size();
+        else if (frame.type == FRAME_RST_STREAM || frame.type == FRAME_GOAWAY)
+            break;
+
+        /* 回复比服务端的初始窗口 (65535) 大, 要给它补窗口 */
+        if (frame.type == FRAME_DATA) {
+            std::string increment("\0\0\0\0", 4);
+
+            increment[2] = (char)(frame.payload.size() >> 8);
+            increment[3] = (char)frame.payload.size();
+            peer.sendFrame(FRAME_WINDOW_UPDATE, 0, 0, increment);
+            peer.sendFrame(FRAME_WINDOW_UPDATE, 0, 1, increment);
+        }
+
+        if (frame.type == FRAME_DATA && (frame.flags & FLAG_END_STREAM))
+            break;
+    }
+
+    EXPECT_NE(frame.type, FRAME_RST_STREAM);
+    EXPECT_NE(frame.type, FRAME_GOAWAY);
+    EXPECT_EQ(body, (size_t)chunks * FRAME_SIZE);
+    EXPECT_GE(stream, LOCAL_WINDOW);
+}
+
+/* 对端重置处理中的流, 不再回复这个流, 连接照常 */
+TEST_F(Http2MuxTest, RstStream)
+{
+    unsigned short port = start();
+    Frame frame;
+
+    blockHandler();
+    Http2Peer peer(port);
+    peer.start();
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 1, Http2Peer::headers("GET"));
+    peer.sendFrame(FRAME_RST_STREAM, 0, 1, std::string("\0\0\0\x08", 4));
+    EXPECT_TRUE(peer.alive());
+    mBlock = false;
+    mRelease.set_value();
+    EXPECT_FALSE(peer.waitFrame(FRAME_HEADERS, frame));
+
+    Http2Peer zero(port);
+    zero.start();
+    zero.sendFrame(FRAME_RST_STREAM, 0, 0, std::string(4, '\0'));
+    ASSERT_TRUE(zero.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), PROTOCOL_ERROR);
+
+    Http2Peer length(port);
+    length.start();
+    length.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 1, Http2Peer::headers("GET"));
+    length.sendFrame(FRAME_RST_STREAM, 0, 1, std::string(3, '\0'));
+    ASSERT_TRUE(length.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), FRAME_SIZE_ERROR);
+}
+
+/* 收到 GOAWAY 后不再开始新的流, 已经开始的照常回复 */
+TEST_F(Http2MuxTest, Goaway)
+{
+    Http2Peer peer(start());
+    Frame frame;
+
+    peer.start();
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 1, Http2Peer::headers("GET"));
+    ASSERT_TRUE(peer.waitFrame(FRAME_DATA, frame));
+    EXPECT_EQ(frame.id, 1);
+
+    peer.sendFrame(FRAME_GOAWAY, 0, 0, std::string(8, '\0'));
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, 3, Http2Peer::headers("GET"));
+    ASSERT_TRUE(peer.waitFrame(FRAME_RST_STREAM, frame));
+    EXPECT_EQ(frame.id, 3);
+    EXPECT_EQ(frame.code(), REFUSED_STREAM);
+}
+
+/* 头部块分在 HEADERS 和 CONTINUATION 里; 中间插进别的帧或别的流是连接错误 */
+TEST_F(Http2MuxTest, Continuation)
+{
+    unsigned short port = start();
+    std::string block = Http2Peer::headers("GET");
+    size_t half = block.size() / 2;
+    Frame frame;
+
+    Http2Peer peer(port);
+    peer.start();
+    peer.sendFrame(FRAME_HEADERS, FLAG_END_STREAM, 1, block.substr(0, half));
+    peer.sendFrame(FRAME_CONTINUATION, FLAG_END_HEADERS, 1, block.substr(half));
+    ASSERT_TRUE(peer.waitFrame(FRAME_DATA, frame));
+    EXPECT_EQ(frame.payload, "ok");
+
+    Http2Peer interleaved(port);
+    interleaved.start();
+    interleaved.sendFrame(FRAME_HEADERS, FLAG_END_STREAM, 1, block.substr(0, half));
+    interleaved.sendFrame(FRAME_PING, 0, 0, "12345678");
+    ASSERT_TRUE(interleaved.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), PROTOCOL_ERROR);
+
+    Http2Peer other(port);
+    other.start();
+    other.sendFrame(FRAME_HEADERS, FLAG_END_STREAM, 1, block.substr(0, half));
+    other.sendFrame(FRAME_CONTINUATION, FLAG_END_HEADERS, 3, block.substr(half));
+    ASSERT_TRUE(other.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), PROTOCOL_ERROR);
+
+    Http2Peer orphan(port);
+    orphan.start();
+    orphan.sendFrame(FRAME_CONTINUATION, FLAG_END_HEADERS, 1, block);
+    ASSERT_TRUE(orphan.waitFrame(FRAME_GOAWAY, frame));
+    EXPECT_EQ(frame.code(), PROTOCOL_ERROR);
+}
+
+/* 明文连接不以客户端开头开始时按 HTTP/1.1 处理; Upgrade: h2c 不支持, 照常用 HTTP/1.1 回复 */
+TEST_F(Http2MuxTest, PrefaceAndUpgrade)
+{
+    unsigned short port = start();
+    std::string data;
+
+    Http2Peer upgrade(port);
+    upgrade.send("GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: Upgrade, HTTP2-Settings\r\n"
+                 "Upgrade: h2c\r\nHTTP2-Settings: AAMAAABkAAQAoAAAAAIAAAAA\r\nConnection: close\r\n\r\n");
+    data = upgrade.readAll(1000);
+    EXPECT_EQ(data.compare(0, 12, "HTTP/1.1 200"), 0) << data;
+    EXPECT_EQ(data.find("101"), std::string::npos);
+
+    /* 开头对上一部分后不一样, 不是 h2 连接, 对上的字节还给 HTTP/1.1 的消息 */
+    Http2Peer preface(port);
+    preface.send("PRI * HTTP/2.0\r\n\r\nXX\r\n\r\n");
+    data = preface.readAll(1000);
+    EXPECT_TRUE(data.empty() || data.compare(0, 5, "HTTP/") == 0) << data;
+}
+
+/* TLS 客户端 ALPN 提供 h2 时用 h2, 只提供 http/1.1 时用 HTTP/1.1 */
+TEST_F(Http2MuxTest, Alpn)
+{
+    unsigned short port = start(true);
+    /* 握手后发出 data, 返回协商的协议和读到的开头 */
+    auto exchange = [port](const char *protos, const std::string& data, std::string& selected) {
+        SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+        Http2Peer peer(port);
+        const unsigned char *alpn = NULL;
+        unsigned int len = 0;
+        char buf[256];
+        int n = 0;
+        SSL *ssl;
+
+        SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)protos, strlen(protos));
+        ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, peer.fd());
+        if (SSL_connect(ssl) == 1) {
+            SSL_get0_alpn_selected(ssl, &alpn, &len);
+            SSL_write(ssl, data.data(), (int)data.size());
+            n = SSL_read(ssl, buf, sizeof buf);
+        }
+
+        selected.assign((const char *)alpn, len);
+        SSL_free(ssl);
+        SSL_CTX_free(ctx);
+        return n > 0 ? std::string(buf, n) : std::string();
+    };
+    std::string settings("\0\0\0\x04\0\0\0\0\0", 9);
+    std::string selected;
+    std::string data;
+
+    /* 服务端的第一帧是 SETTINGS */
+    data = exchange("\x02h2\x08http/1.1", HTTP2_CLIENT_PREFACE + settings, selected);
+    EXPECT_EQ(selected, "h2");
+    ASSERT_GE(data.size(), 9);
+    EXPECT_EQ(data[3], FRAME_SETTINGS);
+
+    data = exchange("\x08http/1.1", "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", selected);
+    EXPECT_EQ(selected, "");
+    EXPECT_EQ(data.compare(0, 12, "HTTP/1.1 200"), 0) << data;
+}
@@ -0,0 +1,268 @@
+//
+// Created by dingjing on 8/14/22.
+//
+
+#include "../app/core/communicator.h"
+#include "../app/core/io-service.h"
+#include <gtest/gtest.h>
+
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define TEST_FILE_SIZE          (4 * 1024 * 1024)
+#define TEST_BLOCK_SIZE         4096
+
+class TestIOService : public IOService
+{
+public:
+    std::atomic<int>            unbound{0};
+
+private:
+    void handleUnbound() override
+    {
+        unbound = 1;
+    }
+};
+
+class TestSession : public IOSession
+{
+public:
+    enum Kind { READ, WRITEV, READV, FDSYNC, OPEN, STATX, CLOSE };
+
+    Kind                        kind;
+    int                         fd = -1;
+    char*                       buf = nullptr;
+    size_t                      count = 0;
+    long long                   offset = 0;
+    struct iovec                iov[2];
+    const char*                 path = nullptr;
+    struct statx                stx;
+
+    int                         state = -1;
+    int                         error = 0;
+    long                        res = 0;
+    std::atomic<int>*           done = nullptr;
+
+private:
+    int prepare() override
+    {
+        switch (kind) {
+            case READ:      prepPRead(fd, buf, count, offset);                  break;
+            case WRITEV:    prepPWritev(fd, iov, 2, offset);                    break;
+            case READV:     prepPReadv(fd, iov, 2, offset);                     break;
+            case FDSYNC:    prepFdSync(fd);                                     break;
+            case OPEN:      prepOpenAt(AT_FDCWD, path, O_RDONLY, 0);            break;
+            case STATX:     prepStatx(AT_FDCWD, path, 0, STATX_SIZE, &stx);     break;
+            case CLOSE:     prepClose(fd);                                      break;
+        }
+
+        return 0;
+    }
+
+    void handle(int state, int error) override
+    {
+        this->state = state;
+        this->error = error;
+        this->res = getRes();
+        ++*done;
+    }
+};
+
+static void wait_for(const std::atomic<int>& value, int expect)
+{
+    for (int i = 0; i < 5000 && value < expect; ++i)
+        usleep(1000);
+}
+
+class IOServiceTest : public ::testing::TestWithParam<int>
+{
+protected:
+    void SetUp() override
+    {
+        char name[] = "/tmp/test-io-service-XXXXXX";
+
+        fd = mkstemp(name);
+        ASSERT_GE(fd, 0);
+        path = name;
+        ASSERT_EQ(comm.init(1, 2), 0);
+        ASSERT_EQ(service.init(256, GetParam()), 0);
+        ASSERT_EQ(comm.ioBind(&service), 0);
+        printf("engine: %s\n", service.getEngine() == IOS_ENGINE_URING ? "io_uring" : "libaio");
+    }
+
+    void TearDown() override
+    {
+        comm.ioUnbind(&service);
+        wait_for(service.unbound, 1);
+        EXPECT_EQ(service.unbound, 1);
+        service.deInit();
+        comm.deInit();
+        close(fd);
+        unlink(path.c_str());
+    }
+
+    int run(TestSession& session)
+    {
+        std::atomic<int> done{0};
+
+        session.done = &done;
+        if (service.request(&session) < 0)
+            return -1;
+
+        wait_for(done, 1);
+        return done == 1 ? 0 : -1;
+    }
+
+    Communicator                comm;
+    TestIOService               service;
+    std::string                 path;
+    int                         fd;
+};
+
+TEST_P(IOServiceTest, READ_WRITE) {
+    char head[100], tail[200], back[300];
+    TestSession s;
+
+    memset(head, 'a', sizeof (head));
+    memset(tail, 'b', sizeof (tail));
+    s.kind = TestSession::WRITEV;
+    s.fd = fd;
+    s.iov[0] = {head, sizeof (head)};
+    s.iov[1] = {tail, sizeof (tail)};
+    s.offset = 1000;
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.state, IOS_STATE_SUCCESS);
+    EXPECT_EQ(s.res, 300);
+
+    // libaio 在多数文件系统上不支持 fsync
+    s.kind = TestSession::FDSYNC;
+    if (service.getEngine() == IOS_ENGINE_URING) {
+        ASSERT_EQ(run(s), 0);
+        EXPECT_EQ(s.state, IOS_STATE_SUCCESS);
+    }
+
+    s.kind = TestSession::READ;
+    s.buf = back;
+    s.count = sizeof (back);
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.res, 300);
+    EXPECT_EQ(memcmp(back, head, 100), 0);
+    EXPECT_EQ(memcmp(back + 100, tail, 200), 0);
+
+    // 读到文件尾之后返回 0
+    s.offset = 2000;
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.res, 0);
+
+    s.kind = TestSession::READV;
+    s.offset = 1000;
+    s.iov[0] = {back, 50};
+    s.iov[1] = {back + 50, 250};
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.res, 300);
+
+    // io_uring 的错误经 handle() 返回, libaio 提交时就会失败
+    s.kind = TestSession::READ;
+    s.fd = 100000;
+    if (service.getEngine() == IOS_ENGINE_URING) {
+        ASSERT_EQ(run(s), 0);
+        EXPECT_EQ(s.state, IOS_STATE_ERROR);
+        EXPECT_EQ(s.error, EBADF);
+    } else {
+        EXPECT_EQ(run(s), -1);
+        EXPECT_EQ(errno, EBADF);
+    }
+};
+
+TEST_P(IOServiceTest, OPEN_STATX_CLOSE) {
+    char buf[123] = {0};
+    TestSession s;
+
+    ASSERT_EQ(pwrite(fd, buf, sizeof (buf), 0), (ssize_t) sizeof (buf));
+    s.kind = TestSession::OPEN;
+    s.path = path.c_str();
+    ASSERT_EQ(run(s), 0);
+    ASSERT_EQ(s.state, IOS_STATE_SUCCESS);
+    ASSERT_GE(s.res, 0);
+    int newFd = (int) s.res;
+
+    s.kind = TestSession::STATX;
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.state, IOS_STATE_SUCCESS);
+    EXPECT_EQ(s.stx.stx_size, sizeof (buf));
+
+    s.kind = TestSession::CLOSE;
+    s.fd = newFd;
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.state, IOS_STATE_SUCCESS);
+    EXPECT_EQ(fcntl(newFd, F_GETFD), -1);
+
+    s.kind = TestSession::OPEN;
+    s.path = "/nonexistent/test-io-service";
+    ASSERT_EQ(run(s), 0);
+    EXPECT_EQ(s.state, IOS_STATE_ERROR);
+    EXPECT_EQ(s.error, ENOENT);
+};
+
+/**
+ * @brief
+ *  多个线程同时提交 4K 随机读, 请求合并提交
+ */
+TEST_P(IOServiceTest, CONCURRENT_READ) {
+    const int threads = 8;
+    const int perThread = 500;
+    std::vector<char> data(TEST_FILE_SIZE);
+    std::atomic<int> done{0};
+
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (char) (i * 131 >> 12);
+    ASSERT_EQ(pwrite(fd, data.data(), data.size(), 0), (ssize_t) data.size());
+
+    std::vector<TestSession> sessions(threads * perThread);
+    std::vector<char> bufs(sessions.size() * TEST_BLOCK_SIZE);
+    struct timespec begin, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            unsigned seed = t;
+            for (int i = t * perThread; i < (t + 1) * perThread; ++i) {
+                TestSession& s = sessions[i];
+                s.kind = TestSession::READ;
+                s.fd = fd;
+                s.buf = &bufs[(size_t) i * TEST_BLOCK_SIZE];
+                s.count = TEST_BLOCK_SIZE;
+                s.offset = (long long) (rand_r(&seed) % (TEST_FILE_SIZE / TEST_BLOCK_SIZE)) * TEST_BLOCK_SIZE;
+                s.done = &done;
+                while (service.request(&s) < 0 && errno == EAGAIN)
+                    usleep(100);
+            }
+        });
+    }
+
+    for (auto& w : workers)
+        w.join();
+
+    wait_for(done, (int) sessions.size());
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT_EQ(done, (int) sessions.size());
+
+    for (auto& s : sessions) {
+        ASSERT_EQ(s.res, TEST_BLOCK_SIZE);
+        ASSERT_EQ(memcmp(s.buf, &data[s.offset], TEST_BLOCK_SIZE), 0);
+    }
+
+    double us = (end.tv_sec - begin.tv_sec) * 1e6 + (end.tv_nsec - begin.tv_nsec) / 1e3;
+    printf("%d threads x %d 4K preads: %.0f us, %.0f reads/s\n", threads, perThread, us, sessions.size() / us * 1e6);
+};
+
+INSTANTIATE_TEST_SUITE_P(ENGINE, IOServiceTest, ::testing::Values(IOS_ENGINE_AIO, IOS_ENGINE_URING));
@@ -0,0 +1,170 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/core/communicator.h"
+#include <gtest/gtest.h>
+
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <set>
+#include <mutex>
+#include <atomic>
+
+#define POLLERS             4
+
+/* 记下每个分片的 socket 由谁创建, 以及每个连接的 fd 落在哪个 poll 线程 (fd % POLLERS) */
+class ShardService : public CommService
+{
+public:
+    int start(Communicator *comm, bool cbpf)
+    {
+        struct sockaddr_in sin = { };
+        socklen_t len = sizeof sin;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        /* 每个分片各自 bind, 端口不能是 0: 先找一个空闲端口 */
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || ::bind(fd, (struct sockaddr *)&sin, sizeof sin) < 0 ||
+            getsockname(fd, (struct sockaddr *)&sin, &len) < 0)
+            return -1;
+
+        close(fd);
+        port = sin.sin_port;
+        if (init((struct sockaddr *)&sin, sizeof sin, -1, 1000) < 0)
+            return -1;
+
+        setReusePort(true, cbpf);
+        return comm->bind(this);
+    }
+
+    std::set<int> pollers()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return accepted;
+    }
+
+    in_port_t                   port = 0;
+    std::atomic<int>            listenFds{0};
+    std::atomic<int>            connections{0};
+    std::atomic<int>            unbound{0};
+
+private:
+    CommSession *newSession(long long seq, CommConnection *conn) override
+    {
+        return NULL;
+    }
+
+    void handleUnbound() override
+    {
+        unbound = 1;
+    }
+
+    int createListenFd() override
+    {
+        listenFds++;
+        return socket(AF_INET, SOCK_STREAM, 0);
+    }
+
+    CommConnection *newConnection(int acceptFd) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            accepted.insert(acceptFd % POLLERS);
+        }
+
+        connections++;
+        return new CommConnection;
+    }
+
+    std::mutex                  mutex;
+    std::set<int>               accepted;
+};
+
+static void wait_for(const std::atomic<int>& value, int expect)
+{
+    for (int i = 0; i < 5000 && value < expect; ++i)
+        usleep(1000);
+}
+
+class ListenShardsTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        ASSERT_EQ(comm.init(POLLERS, 1, CPOLL_ENGINE_EPOLL), 0);
+    }
+
+    void TearDown() override
+    {
+        comm.unbind(&service);
+        wait_for(service.unbound, 1);
+        service.deInit();
+        comm.deInit();
+    }
+
+    /* 连上就关, 返回连上的个数 */
+    int connectMany(int n)
+    {
+        struct sockaddr_in sin = { };
+        int connected = 0;
+
+        sin.sin_family = AF_INET;
+        sin.sin_port = service.port;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (int i = 0; i < n; i++) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+            if (fd >= 0 && connect(fd, (struct sockaddr *)&sin, sizeof sin) == 0)
+                connected++;
+
+            close(fd);
+        }
+
+        wait_for(service.connections, connected);
+        return connected;
+    }
+
+    Communicator                comm;
+    ShardService                service;
+};
+
+/* 每个分片都用子类的 createListenFd(), 内核分到各个分片的连接由各自的 poll 线程处理 */
+TEST_F(ListenShardsTest, EveryPollerAccepts)
+{
+    ASSERT_EQ(service.start(&comm, false), 0);
+    EXPECT_EQ(service.listenFds, POLLERS);
+
+    ASSERT_EQ(connectMany(64), 64);
+    EXPECT_EQ(service.connections, 64);
+    EXPECT_EQ(service.pollers(), std::set<int>({0, 1, 2, 3}));
+}
+
+/**
+ * 按 CPU 选分片, 客户端固定在一个 CPU 上时所有连接都进同一个分片,
+ * 连接都留在这个分片的 poll 线程上, 不按 accept 出来的 fd 散开
+ */
+TEST_F(ListenShardsTest, ConnectionStaysOnAcceptingPoller)
+{
+    cpu_set_t cpus, one;
+    int cpu = 0;
+
+    ASSERT_EQ(sched_getaffinity(0, sizeof cpus, &cpus), 0);
+    while (!CPU_ISSET(cpu, &cpus))
+        cpu++;
+
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    ASSERT_EQ(pthread_setaffinity_np(pthread_self(), sizeof one, &one), 0);
+
+    ASSERT_EQ(service.start(&comm, true), 0);
+    ASSERT_EQ(connectMany(64), 64);
+    EXPECT_EQ(service.pollers().size(), 1);
+
+    pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+}
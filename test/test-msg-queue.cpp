@@ -2,4 +2,252 @@
 // Created by dingjing on 8/12/22.
 //
 
-#include "../app/core/msg-queue.h"
\ No newline at end of file
+#include "../app/core/msg-queue.h"
+#include <gtest/gtest.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef struct _TestMsg         TestMsg;
+
+struct _TestMsg
+{
+    long                        value;
+};
+
+TEST(MSG_QUEUE, FIFO) {
+    std::vector<TestMsg> msgs(1000);
+    MsgQueue* queue = msg_queue_create(4096);
+    ASSERT_TRUE(queue);
+
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        msgs[i].value = (long)i;
+        EXPECT_EQ(msg_queue_put(&msgs[i], queue), 0);
+    }
+
+    for (size_t i = 0; i < msgs.size(); ++i) {
+        auto msg = (TestMsg*) msg_queue_get(queue);
+        ASSERT_EQ(msg, &msgs[i]);
+    }
+
+    msg_queue_destroy(queue);
+};
+
+TEST(MSG_QUEUE, NONBLOCK) {
+    TestMsg msg = {1};
+    MsgQueue* queue = msg_queue_create(16);
+    ASSERT_TRUE(queue);
+
+    // 阻塞等待的消费者在 set_nonblock 后返回 NULL
+    std::thread consumer([queue]() {
+        errno = 0;
+        EXPECT_EQ(msg_queue_get(queue), nullptr);
+        EXPECT_EQ(errno, ENOENT);
+    });
+
+    usleep(50 * 1000);
+    msg_queue_set_nonblock(queue);
+    consumer.join();
+
+    // 非阻塞时仍然可以放入和取出
+    EXPECT_EQ(msg_queue_put(&msg, queue), 0);
+    EXPECT_EQ(msg_queue_get(queue), &msg);
+    EXPECT_EQ(msg_queue_get(queue), nullptr);
+
+    msg_queue_set_block(queue);
+    msg_queue_destroy(queue);
+};
+
+TEST(MSG_QUEUE, TIMED_GET) {
+    TestMsg msg = {1};
+    struct timespec begin, end;
+    MsgQueue* queue = msg_queue_create(16);
+    ASSERT_TRUE(queue);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    errno = 0;
+    EXPECT_EQ(msg_queue_timed_get(queue, 50), nullptr);
+    EXPECT_EQ(errno, ETIMEDOUT);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    EXPECT_GE((end.tv_sec - begin.tv_sec) * 1000 + (end.tv_nsec - begin.tv_nsec) / 1000000, 49);
+
+    // 等待中放入的消息能取到
+    std::thread producer([&]() {
+        usleep(20 * 1000);
+        msg_queue_put(&msg, queue);
+    });
+
+    EXPECT_EQ(msg_queue_timed_get(queue, 5000), &msg);
+    producer.join();
+
+    msg_queue_put(&msg, queue);
+    EXPECT_EQ(msg_queue_size(queue), 1);
+    EXPECT_EQ(msg_queue_timed_get(queue, 0), &msg);
+    EXPECT_EQ(msg_queue_size(queue), 0);
+
+    msg_queue_destroy(queue);
+};
+
+TEST(MSG_QUEUE, BOUNDED) {
+    std::vector<TestMsg> msgs(5);
+    std::atomic<int> put(0);
+    MsgQueue* queue = msg_queue_create(4);
+    ASSERT_TRUE(queue);
+
+    for (int i = 0; i < 4; ++i) {
+        msg_queue_put(&msgs[i], queue);
+    }
+
+    // 队列满了, 生产者等到消息取走一半
+    std::thread producer([&]() {
+        msg_queue_put(&msgs[4], queue);
+        put = 1;
+    });
+
+    usleep(50 * 1000);
+    EXPECT_EQ(put, 0);
+
+    EXPECT_EQ(msg_queue_get(queue), &msgs[0]);
+    usleep(50 * 1000);
+    EXPECT_EQ(put, 0);
+
+    EXPECT_EQ(msg_queue_get(queue), &msgs[1]);
+    producer.join();
+    EXPECT_EQ(put, 1);
+
+    for (int i = 2; i < 5; ++i) {
+        EXPECT_EQ(msg_queue_get(queue), &msgs[i]);
+    }
+
+    msg_queue_destroy(queue);
+};
+
+/**
+ * @brief
+ *  消费者可能在生产者计数之前取走消息, 计数短暂为负. 这时放入的生产者不能被挡住,
+ *  否则它剩下的消息没人放, 消费者一直等. 每轮消息很少, 每轮结束时都可能卡住;
+ *  1 秒内没有新消息就算卡住
+ */
+static bool mpmc_run(int n, long total, size_t maxLen)
+{
+    std::vector<TestMsg> msgs(total);
+    std::atomic<long> received(0);
+    std::atomic<bool> stalled(false);
+    MsgQueue* queue = msg_queue_create(maxLen);
+    EXPECT_TRUE(queue);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; ++i) {
+        threads.emplace_back([&, i]() {
+            for (long j = i; j < total; j += n) {
+                msg_queue_put(&msgs[j], queue);
+            }
+        });
+
+        threads.emplace_back([&]() {
+            while (received < total && msg_queue_get(queue)) {
+                if (++received == total) {
+                    msg_queue_set_nonblock(queue);
+                }
+            }
+        });
+    }
+
+    /* 卡住时设成非阻塞, 放走所有线程 */
+    std::thread watchdog([&]() {
+        long last = -1;
+        int idle = 0;
+        while (received < total) {
+            idle = received == last ? idle + 1 : 0;
+            last = received;
+            if (idle >= 1000) {
+                stalled = true;
+                msg_queue_set_nonblock(queue);
+                break;
+            }
+            usleep(1000);
+        }
+    });
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    watchdog.join();
+    msg_queue_destroy(queue);
+
+    return !stalled && received == total;
+}
+
+TEST(MSG_QUEUE, MPMC_NO_STALL) {
+    for (int round = 0; round < 500; ++round) {
+        ASSERT_TRUE(mpmc_run(8, 64, (size_t)-1)) << "unbounded, round " << round;
+        ASSERT_TRUE(mpmc_run(8, 64, 16)) << "bounded, round " << round;
+    }
+};
+
+/**
+ * @brief
+ *  n 个生产者和 n 个消费者, 共传递 total 条消息, 返回每条消息的平均纳秒数
+ */
+static double contention_bench(int n, long total, size_t maxLen)
+{
+    std::vector<TestMsg> msgs(total);
+    std::atomic<long> received(0);
+    std::atomic<long> sum(0);
+    MsgQueue* queue = msg_queue_create(maxLen);
+    EXPECT_TRUE(queue);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; ++i) {
+        threads.emplace_back([&, i]() {
+            for (long j = i; j < total; j += n) {
+                msgs[j].value = j;
+                msg_queue_put(&msgs[j], queue);
+            }
+        });
+
+        threads.emplace_back([&]() {
+            TestMsg* msg;
+            long local = 0;
+            while ((msg = (TestMsg*) msg_queue_get(queue)) != nullptr) {
+                local += msg->value;
+                if (++received == total) {
+                    msg_queue_set_nonblock(queue);
+                }
+            }
+            sum += local;
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    EXPECT_EQ(received, total);
+    EXPECT_EQ(sum, total * (total - 1) / 2);
+    msg_queue_destroy(queue);
+
+    double ns = (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+    return ns / (double)total;
+}
+
+TEST(MSG_QUEUE, CONTENTION_BENCH) {
+    const long total = 1000000;
+
+    for (int n : {1, 4, 16, 64}) {
+        double bounded = contention_bench(n, total, 4096);
+        double unbounded = contention_bench(n, total, (size_t)-1);
+        printf("%2d producers / %2d consumers: bounded(4096) %.1f ns/msg, unbounded %.1f ns/msg\n",
+               n, n, bounded, unbounded);
+    }
+};
@@ -0,0 +1,256 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "params-policy.h"
+#include "../app/manager/facilities.h"
+#include "../app/factory/task-factory.h"
+#include "../app/protocol/http/http-util.h"
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * 回复的 body 是请求的路径. 第一个连接攒够 batch 个请求后才回复, 只回复前 answer 个,
+ * 没回复完就关掉连接; 别的连接来一个回复一个
+ */
+class PipeServer
+{
+public:
+    int start(size_t batch, size_t answer)
+    {
+        struct sockaddr_in sin = { };
+        socklen_t len = sizeof sin;
+
+        mBatch = batch;
+        mAnswer = answer;
+        mListenFd = socket(AF_INET, SOCK_STREAM, 0);
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (mListenFd < 0 || bind(mListenFd, (struct sockaddr *)&sin, sizeof sin) < 0 || listen(mListenFd, 16) < 0 ||
+            getsockname(mListenFd, (struct sockaddr *)&sin, &len) < 0)
+            return -1;
+
+        mPort = ntohs(sin.sin_port);
+        mAccept = std::thread(&PipeServer::accept, this);
+        return 0;
+    }
+
+    void stop()
+    {
+        mStop = true;
+        mAccept.join();
+        for (auto& thread : mThreads)
+            thread.join();
+
+        close(mListenFd);
+    }
+
+    /* 每个连接上按到达顺序收到的请求路径 */
+    std::vector<std::vector<std::string>> connections()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mConns;
+    }
+
+    unsigned short port() const { return mPort; }
+
+private:
+    void accept()
+    {
+        struct pollfd pfd = { mListenFd, POLLIN, 0 };
+        int fd;
+
+        while (!mStop) {
+            if (poll(&pfd, 1, 100) <= 0)
+                continue;
+
+            fd = ::accept(mListenFd, NULL, NULL);
+            if (fd >= 0) {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mThreads.emplace_back(&PipeServer::serve, this, fd, mConns.size());
+                mConns.emplace_back();
+            }
+        }
+    }
+
+    void serve(int fd, size_t index)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        std::vector<std::string> paths;
+        std::string buf;
+        size_t replied = 0;
+        size_t pos;
+        char tmp[4096];
+        ssize_t n;
+
+        while (!mStop) {
+            if (poll(&pfd, 1, 100) <= 0)
+                continue;
+
+            n = read(fd, tmp, sizeof tmp);
+            if (n <= 0)
+                break;
+
+            buf.append(tmp, n);
+            while ((pos = buf.find("\r\n\r\n")) != std::string::npos) {
+                size_t begin = buf.find(' ') + 1;
+
+                paths.push_back(buf.substr(begin, buf.find(' ', begin) - begin));
+                buf.erase(0, pos + 4);
+                std::lock_guard<std::mutex> lock(mMutex);
+                mConns[index].push_back(paths.back());
+            }
+
+            if (index == 0 && paths.size() < mBatch)
+                continue;
+
+            for (; replied < paths.size(); replied++) {
+                std::string reply = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(paths[replied].size()) +
+                                    "\r\n\r\n" + paths[replied];
+
+                if (index == 0 && replied == mAnswer)
+                    break;
+
+                if (write(fd, reply.data(), reply.size()) < 0)
+                    perror("write");
+            }
+
+            if (index == 0 && replied == mAnswer)
+                break;
+        }
+
+        close(fd);
+    }
+
+    int                                     mListenFd = -1;
+    unsigned short                          mPort = 0;
+    size_t                                  mBatch = 0;
+    size_t                                  mAnswer = 0;
+    std::atomic<bool>                       mStop{false};
+    std::mutex                              mMutex;
+    std::thread                             mAccept;
+    std::vector<std::thread>                mThreads;
+    std::vector<std::vector<std::string>>   mConns;
+};
+
+class PipeliningTest : public ::testing::Test
+{
+protected:
+    void TearDown() override
+    {
+        if (mPolicy)
+            Global::getNameService()->delPolicy("127.0.0.1");
+
+        delete mPolicy;
+    }
+
+    /* 发到 mUrl 的请求在一个连接上最多排 4 个 */
+    void addPolicy(unsigned short port)
+    {
+        EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+
+        params.pipelineDepth = 4;
+        mUrl = "http://127.0.0.1:" + std::to_string(port);
+        mPolicy = new ParamsPolicy(params);
+        ASSERT_EQ(Global::getNameService()->addPolicy("127.0.0.1", mPolicy), 0);
+    }
+
+    /* 同时发出 /0 ... /n-1, 返回每个请求收到的 body, 失败的为空 */
+    std::vector<std::string> fetchAll(int n)
+    {
+        std::vector<std::string> bodies(n);
+        Facilities::WaitGroup wg(n);
+
+        for (int i = 0; i < n; i++) {
+            TaskFactory::createHttpTask(mUrl + "/" + std::to_string(i), 0, 0, [&bodies, &wg, i](HttpTask *task, void *) {
+                if (task->getState() == TASK_STATE_SUCCESS)
+                    bodies[i] = protocol::HttpUtil::decodeChunkedBody(task->getResp());
+
+                wg.done();
+            }, nullptr)->start();
+        }
+
+        wg.wait();
+        return bodies;
+    }
+
+    CommPoolStats poolStats()
+    {
+        return mPolicy->poolStats(mUrl + "/");
+    }
+
+    std::string                 mUrl;
+    ParamsPolicy*               mPolicy = nullptr;
+};
+
+/* 四个请求排在一个连接上, 服务端收齐后按顺序回复, 每个请求拿到自己的回复 */
+TEST_F(PipeliningTest, RepliesInOrder)
+{
+    PipeServer server;
+
+    ASSERT_EQ(server.start(4, 4), 0);
+    addPolicy(server.port());
+
+    std::vector<std::string> bodies = fetchAll(4);
+
+    for (int i = 0; i < 4; i++)
+        EXPECT_EQ(bodies[i], "/" + std::to_string(i));
+
+    auto conns = server.connections();
+    CommPoolStats stats = poolStats();
+
+    ASSERT_EQ(conns.size(), 1);
+    EXPECT_EQ(conns[0], std::vector<std::string>({"/0", "/1", "/2", "/3"}));
+    EXPECT_EQ(stats.pipelined, 3);
+    EXPECT_EQ(stats.replayed, 0);
+    server.stop();
+}
+
+/* 第一个连接只回复了一个就断开, 后面三个没收到回复的换新连接重发 */
+TEST_F(PipeliningTest, ReplayOnDrop)
+{
+    PipeServer server;
+
+    ASSERT_EQ(server.start(4, 1), 0);
+    addPolicy(server.port());
+
+    std::vector<std::string> bodies = fetchAll(4);
+
+    for (int i = 0; i < 4; i++)
+        EXPECT_EQ(bodies[i], "/" + std::to_string(i));
+
+    auto conns = server.connections();
+    std::vector<std::string> replayed;
+    CommPoolStats stats;
+
+    /* 重发成功后才计数, 可能晚于重发的请求结束 */
+    for (int i = 0; i < 1000; i++) {
+        stats = poolStats();
+        if (stats.replayed >= 3)
+            break;
+
+        usleep(1000);
+    }
+
+    ASSERT_GE(conns.size(), 2);
+    EXPECT_EQ(conns[0], std::vector<std::string>({"/0", "/1", "/2", "/3"}));
+    for (size_t i = 1; i < conns.size(); i++)
+        replayed.insert(replayed.end(), conns[i].begin(), conns[i].end());
+
+    std::sort(replayed.begin(), replayed.end());
+    EXPECT_EQ(replayed, std::vector<std::string>({"/1", "/2", "/3"}));
+    EXPECT_EQ(stats.pipelined, 3);
+    EXPECT_EQ(stats.replayed, 3);
+    server.stop();
+}
@@ -0,0 +1,211 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/manager/route-manager.h"
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+class RouteManagerTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        /* 只要有路由, 不会真的连接 */
+        memset(&sin, 0, sizeof sin);
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(1);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        memset(&info, 0, sizeof info);
+        info.ai_family = AF_INET;
+        info.ai_socktype = SOCK_STREAM;
+        info.ai_addr = (struct sockaddr *)&sin;
+        info.ai_addrlen = sizeof sin;
+    }
+
+    RouteManager::RouteResult get()
+    {
+        EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+        RouteManager::RouteResult result;
+
+        EXPECT_EQ(manager.get(TT_TCP, &info, "", &params, "127.0.0.1", result), 0);
+        return result;
+    }
+
+    /* 一组地址的路由, 地址按给的顺序串成 addrinfo 链表 */
+    RouteManager::RouteResult get(const std::vector<unsigned short>& ports)
+    {
+        std::vector<struct sockaddr_in> addrs(ports.size());
+        std::vector<struct addrinfo> infos(ports.size());
+        EndpointParams params = ENDPOINT_PARAMS_DEFAULT;
+        RouteManager::RouteResult result;
+
+        for (size_t i = 0; i < ports.size(); i++) {
+            addrs[i] = sin;
+            addrs[i].sin_port = htons(ports[i]);
+            infos[i] = info;
+            infos[i].ai_addr = (struct sockaddr *)&addrs[i];
+            infos[i].ai_next = i + 1 < ports.size() ? &infos[i + 1] : NULL;
+        }
+
+        EXPECT_EQ(manager.get(TT_TCP, &infos[0], "", &params, "127.0.0.1", result), 0);
+        return result;
+    }
+
+    RouteManager                manager;
+    struct sockaddr_in          sin;
+    struct addrinfo             info;
+};
+
+TEST_F(RouteManagerTest, SameKeySameRoute)
+{
+    RouteManager::RouteResult a = get();
+    RouteManager::RouteResult b = get();
+
+    ASSERT_NE(a.mCookie, nullptr);
+    ASSERT_NE(a.mRequestObject, nullptr);
+    EXPECT_EQ(a.mCookie, b.mCookie);
+    EXPECT_EQ(a.mRequestObject, b.mRequestObject);
+}
+
+/* 单个地址时 mRequestObject 就是 target: 熔断 -> 半开 -> 探测成功 -> 恢复 */
+TEST_F(RouteManagerTest, SingleAddressRecovers)
+{
+    RouteManager::RouteResult result = get();
+    CommTarget *target = (CommSchedTarget *)result.mRequestObject;
+    RouteStats stats;
+
+    ASSERT_EQ(RouteManager::select(result), result.mRequestObject);
+    for (int i = 0; i < 5; i++)
+        RouteManager::notifyUnavailable(result.mCookie, target);
+
+    RouteManager::getRouteStats(result.mCookie, &stats);
+    EXPECT_EQ(stats.targets, 1);
+    EXPECT_EQ(stats.breaking, 1);
+    EXPECT_FALSE(RouteManager::available(result));
+    EXPECT_EQ(RouteManager::select(result), nullptr);
+
+    /* 第一次熔断 10 秒 */
+    usleep(10100 * 1000);
+    EXPECT_TRUE(RouteManager::available(result));
+    EXPECT_EQ(RouteManager::select(result), result.mRequestObject);
+
+    /* 探测还没有结果时不再放请求 */
+    EXPECT_FALSE(RouteManager::available(result));
+    EXPECT_EQ(RouteManager::select(result), nullptr);
+
+    RouteManager::notifyAvailable(result.mCookie, target);
+    RouteManager::getRouteStats(result.mCookie, &stats);
+    EXPECT_EQ(stats.breaking, 0);
+    EXPECT_TRUE(RouteManager::available(result));
+    EXPECT_EQ(RouteManager::select(result), result.mRequestObject);
+
+    RouteManager::getRouteStats(result.mCookie, &stats);
+    EXPECT_EQ(stats.requests, 3);
+    EXPECT_EQ(stats.rejected, 2);
+    EXPECT_EQ(stats.successes, 1);
+    EXPECT_EQ(stats.failures, 5);
+}
+
+/* select() 不加锁: 半开时多个线程同时选择, 只有一个拿到探测机会 */
+TEST_F(RouteManagerTest, ConcurrentSelectOneProbe)
+{
+    RouteManager::RouteResult result = get();
+    CommTarget *target = (CommSchedTarget *)result.mRequestObject;
+    std::vector<std::thread> threads;
+    std::atomic<bool> go(false);
+    std::atomic<int> probes(0);
+    RouteStats stats;
+
+    for (int i = 0; i < 5; i++)
+        RouteManager::notifyUnavailable(result.mCookie, target);
+
+    EXPECT_EQ(RouteManager::select(result), nullptr);
+    usleep(10100 * 1000);
+
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&]() {
+            while (!go)
+                std::this_thread::yield();
+
+            for (int j = 0; j < 1000; j++) {
+                if (RouteManager::select(result))
+                    probes++;
+            }
+        });
+    }
+
+    go = true;
+    for (auto& thread : threads)
+        thread.join();
+
+    EXPECT_EQ(probes, 1);
+    RouteManager::getRouteStats(result.mCookie, &stats);
+    EXPECT_EQ(stats.breaking, 1);
+    EXPECT_EQ(stats.requests, 1);
+    EXPECT_EQ(stats.rejected, 8000);
+}
+
+/* 地址按多重集合比较: 顺序无关, 重复的次数要一样 */
+TEST_F(RouteManagerTest, KeyMatchIsExact)
+{
+    RouteManager::RouteResult ab = get({ 1, 2 });
+
+    EXPECT_EQ(get({ 2, 1 }).mCookie, ab.mCookie);
+    EXPECT_NE(get({ 1, 1 }).mCookie, ab.mCookie);
+    EXPECT_NE(get({ 1, 1, 2 }).mCookie, ab.mCookie);
+    EXPECT_NE(get({ 1, 2, 2 }).mCookie, get({ 1, 1, 2 }).mCookie);
+    EXPECT_EQ(get({ 1, 1 }).mCookie, get({ 1, 1 }).mCookie);
+    EXPECT_NE(get({ 1 }).mCookie, get({ 1, 1 }).mCookie);
+}
+
+/* 多个线程按不同顺序同时查找和插入, 分片的表边查边扩容, 同一个地址每个线程拿到的都是同一个路由 */
+TEST_F(RouteManagerTest, ConcurrentInsertFind)
+{
+    const int keys = 2000;
+    std::vector<std::vector<void *>> cookies(8, std::vector<void *>(keys));
+    std::vector<std::thread> threads;
+    std::atomic<bool> go(false);
+
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&, i]() {
+            std::vector<int> order(keys);
+
+            for (int j = 0; j < keys; j++)
+                order[j] = j;
+
+            std::rotate(order.begin(), order.begin() + i * keys / 8, order.end());
+            if (i % 2)
+                std::reverse(order.begin(), order.end());
+
+            while (!go)
+                std::this_thread::yield();
+
+            for (int j : order)
+                cookies[i][j] = get({ (unsigned short)(10000 + j) }).mCookie;
+        });
+    }
+
+    go = true;
+    for (auto& thread : threads)
+        thread.join();
+
+    for (int j = 0; j < keys; j++) {
+        ASSERT_NE(cookies[0][j], nullptr);
+        for (int i = 1; i < 8; i++)
+            ASSERT_EQ(cookies[i][j], cookies[0][j]) << "key " << j << " thread " << i;
+    }
+
+    for (int j = 0; j < keys; j++)
+        EXPECT_EQ(get({ (unsigned short)(10000 + j) }).mCookie, cookies[0][j]);
+}
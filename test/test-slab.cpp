@@ -0,0 +1,155 @@
+//
+// Created by dingjing on 8/12/22.
+//
+
+#include "../app/core/slab.h"
+#include "../app/core/msg-queue.h"
+#include <gtest/gtest.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <algorithm>
+#include <vector>
+
+#define TEST_BENCH_COUNT        2000000
+
+static Slab gLocalSlab = SLAB_INITIALIZER("test local", 40);
+static Slab gRemoteSlab = SLAB_INITIALIZER("test remote", 24);
+static Slab gBenchSlab = SLAB_INITIALIZER("test bench", 32);
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+TEST(SLAB, LOCAL_REUSE) {
+    std::vector<void*> objs;
+    SlabStats before, after;
+
+    slab_get_stats(&gLocalSlab, &before);
+    for (int i = 0; i < 1000; ++i) {
+        void* p = slab_alloc(&gLocalSlab);
+        ASSERT_TRUE(p);
+        ASSERT_EQ((unsigned long) p % 16, 0);
+        memset(p, 0xff, 40);
+        objs.push_back(p);
+    }
+
+    // 本线程释放后再分配, 拿回的是同一批对象
+    for (auto p : objs)
+        slab_free(p);
+    for (int i = 999; i >= 0; --i)
+        ASSERT_EQ(slab_alloc(&gLocalSlab), objs[i]);
+    for (auto p : objs)
+        slab_free(p);
+
+    slab_get_stats(&gLocalSlab, &after);
+    EXPECT_EQ(after.allocs - before.allocs, 2000);
+    EXPECT_EQ(after.reused - before.reused, 1000);
+    EXPECT_EQ(after.remoteFrees - before.remoteFrees, 0);
+};
+
+TEST(SLAB, REMOTE_FREE) {
+    std::vector<void*> objs;
+    SlabStats before, after;
+
+    slab_get_stats(&gRemoteSlab, &before);
+    for (int i = 0; i < 1000; ++i)
+        objs.push_back(slab_alloc(&gRemoteSlab));
+
+    // 其它线程释放, 回到分配线程的 remote 栈
+    std::thread([&]() {
+        for (auto p : objs)
+            slab_free(p);
+    }).join();
+
+    std::vector<void*> again;
+    for (int i = 0; i < 1000; ++i)
+        again.push_back(slab_alloc(&gRemoteSlab));
+
+    std::sort(objs.begin(), objs.end());
+    std::sort(again.begin(), again.end());
+    EXPECT_EQ(objs, again);
+
+    slab_get_stats(&gRemoteSlab, &after);
+    EXPECT_EQ(after.remoteFrees - before.remoteFrees, 1000);
+    EXPECT_EQ(after.reused - before.reused, 1000);
+    for (auto p : again)
+        slab_free(p);
+};
+
+TEST(SLAB, THREAD_EXIT) {
+    SlabStats before, after;
+
+    // 退出线程的缓存由后来的线程接手, 不再申请新的大块
+    std::thread([]() {
+        for (int i = 0; i < 100; ++i)
+            slab_free(slab_alloc(&gRemoteSlab));
+    }).join();
+
+    slab_get_stats(&gRemoteSlab, &before);
+    for (int n = 0; n < 100; ++n) {
+        std::thread([]() {
+            void* p[100];
+            for (auto& x : p)
+                x = slab_alloc(&gRemoteSlab);
+            for (auto x : p)
+                slab_free(x);
+        }).join();
+    }
+
+    slab_get_stats(&gRemoteSlab, &after);
+    EXPECT_EQ(after.chunks, before.chunks);
+
+    SlabStats all[16];
+    size_t n = slab_get_all_stats(all, 16);
+    EXPECT_GE(n, 2);
+};
+
+/**
+ * @brief
+ *  一个线程分配, 另一个线程释放 (线程池任务的典型用法), 对比 malloc/free
+ */
+static double cross_thread_bench(bool useSlab)
+{
+    MsgQueue* queue = msg_queue_create(4096);
+    double begin = now_ns();
+
+    std::thread consumer([&]() {
+        for (int i = 0; i < TEST_BENCH_COUNT; ++i) {
+            void* p = msg_queue_get(queue);
+            if (useSlab)
+                slab_free(p);
+            else
+                free(p);
+        }
+    });
+
+    for (int i = 0; i < TEST_BENCH_COUNT; ++i) {
+        void* p = useSlab ? slab_alloc(&gBenchSlab) : malloc(32);
+        msg_queue_put(p, queue);
+    }
+
+    consumer.join();
+    double ns = now_ns() - begin;
+    msg_queue_destroy(queue);
+
+    return ns / TEST_BENCH_COUNT;
+}
+
+TEST(SLAB, CROSS_THREAD_BENCH) {
+    double mallocNs = cross_thread_bench(false);
+    double slabNs = cross_thread_bench(true);
+    SlabStats stats;
+
+    slab_get_stats(&gBenchSlab, &stats);
+    printf("alloc on one thread, free on another: malloc %.1f ns/op, slab %.1f ns/op\n", mallocNs, slabNs);
+    printf("slab '%s': %lu allocs, %lu reused (malloc avoided), %lu remote frees, %lu chunks\n",
+           stats.name, stats.allocs, stats.reused, stats.remoteFrees, stats.chunks);
+};
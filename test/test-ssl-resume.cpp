@@ -0,0 +1,239 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/manager/global.h"
+#include "../app/manager/facilities.h"
+#include "../app/modules/http-server.h"
+#include "../app/factory/task-factory.h"
+#include "../app/core/common-scheduler.h"
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+/* ticket key 两秒轮换一次, 会话本身一小时内都可以恢复 */
+#define KEY_LIFETIME        2
+
+class SSLResumeTest : public ::testing::Test
+{
+protected:
+    static void SetUpTestSuite()
+    {
+        GlobalSettings settings = GLOBAL_SETTINGS_DEFAULT;
+
+        settings.ssl_ticket_key_lifetime = KEY_LIFETIME;
+        settings.ssl_session_timeout = 3600;
+        Global::setGlobalSettings(&settings);
+    }
+
+    /* 临时的自签名证书 */
+    void SetUp() override
+    {
+        char cert[] = "/tmp/test-ssl-cert-XXXXXX";
+        char key[] = "/tmp/test-ssl-key-XXXXXX";
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+        EVP_PKEY *pkey = NULL;
+        X509 *x509 = X509_new();
+        int certFd = mkstemp(cert);
+        int keyFd = mkstemp(key);
+        FILE *fp;
+
+        ASSERT_GE(certFd, 0);
+        ASSERT_GE(keyFd, 0);
+        mCert = cert;
+        mKey = key;
+        ASSERT_TRUE(pctx && x509);
+        ASSERT_EQ(EVP_PKEY_keygen_init(pctx), 1);
+        ASSERT_EQ(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1), 1);
+        ASSERT_EQ(EVP_PKEY_keygen(pctx, &pkey), 1);
+
+        ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+        X509_set_pubkey(x509, pkey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+                                   (const unsigned char *)"127.0.0.1", -1, -1, 0);
+        X509_set_issuer_name(x509, X509_get_subject_name(x509));
+        ASSERT_GT(X509_sign(x509, pkey, EVP_sha256()), 0);
+
+        fp = fdopen(certFd, "w");
+        PEM_write_X509(fp, x509);
+        fclose(fp);
+        fp = fdopen(keyFd, "w");
+        PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+        fclose(fp);
+
+        X509_free(x509);
+        EVP_PKEY_free(pkey);
+        EVP_PKEY_CTX_free(pctx);
+    }
+
+    void TearDown() override
+    {
+        unlink(mCert.c_str());
+        unlink(mKey.c_str());
+    }
+
+    /* 每次都是新连接: 回复后关闭 */
+    static HttpServer *newServer()
+    {
+        return new HttpServer([](HttpTask *task) {
+            task->getResp()->addHeaderPair("Connection", "close");
+            task->getResp()->appendOutputBody("ok");
+        });
+    }
+
+    int startServer(HttpServer *server, unsigned short port)
+    {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof sin;
+
+        if (server->start("127.0.0.1", port, mCert.c_str(), mKey.c_str()) < 0)
+            return -1;
+
+        server->get_listen_addr((struct sockaddr *)&sin, &len);
+        mUrl = "https://127.0.0.1:" + std::to_string(ntohs(sin.sin_port)) + "/";
+        return ntohs(sin.sin_port);
+    }
+
+    /* 同步请求, 返回任务状态 */
+    int fetch()
+    {
+        Facilities::WaitGroup wg(1);
+        int state = -1;
+
+        TaskFactory::createHttpTask(mUrl, 0, 0, [&](HttpTask *task, void *) {
+            state = task->getState();
+            wg.done();
+        }, nullptr)->start();
+
+        wg.wait();
+        return state;
+    }
+
+    static CommSSLStats stats()
+    {
+        CommSSLStats stats;
+
+        Global::getScheduler()->getSSLStats(&stats);
+        return stats;
+    }
+
+    std::string                 mUrl;
+    std::string                 mCert;
+    std::string                 mKey;
+};
+
+/* 第二个连接用第一个连接拿到的 ticket 恢复会话, 客户端和服务端都算一次恢复 */
+TEST_F(SSLResumeTest, SecondConnectResumes)
+{
+    HttpServer *server = newServer();
+    CommSSLStats before, after;
+
+    ASSERT_GT(startServer(server, 0), 0);
+    before = stats();
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+    after = stats();
+
+    EXPECT_EQ(after.clientHandshakes - before.clientHandshakes, 2);
+    EXPECT_EQ(after.clientResumed - before.clientResumed, 1);
+    EXPECT_EQ(after.serverResumed - before.serverResumed, 1);
+
+    server->stop();
+    delete server;
+}
+
+/**
+ * key 轮换后, 上一个 key 加密的 ticket 在下一个周期内仍然可以恢复 (并换发新 ticket);
+ * 空闲两个周期以上时上一个 key 也不再接受, 做完整握手
+ */
+TEST_F(SSLResumeTest, PreviousKeyResumesDuringOverlap)
+{
+    HttpServer *server = newServer();
+    CommSSLStats before, after;
+
+    ASSERT_GT(startServer(server, 0), 0);
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+
+    usleep(KEY_LIFETIME * 1000 * 1000 + 100 * 1000);
+    before = stats();
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+    after = stats();
+    EXPECT_EQ(after.serverResumed - before.serverResumed, 1);
+
+    usleep(2 * KEY_LIFETIME * 1000 * 1000 + 100 * 1000);
+    before = stats();
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+    after = stats();
+    EXPECT_EQ(after.serverHandshakes - before.serverHandshakes, 1);
+    EXPECT_EQ(after.serverResumed - before.serverResumed, 0);
+
+    server->stop();
+    delete server;
+}
+
+/* 握手失败后丢掉缓存的会话, 同一个地址上的下一个连接不再尝试恢复 */
+TEST_F(SSLResumeTest, HandshakeErrorDropsSession)
+{
+    HttpServer *server = newServer();
+    std::atomic<bool> stop(false);
+    struct sockaddr_in sin = { };
+    CommSSLStats before, after;
+    int on = 1;
+    int port;
+    int fd;
+
+    port = startServer(server, 0);
+    ASSERT_GT(port, 0);
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+    server->stop();
+    delete server;
+
+    /* 同一个端口上换成接受后马上关闭的普通 TCP 服务, 握手失败 */
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    ASSERT_EQ(bind(fd, (struct sockaddr *)&sin, sizeof sin), 0);
+    ASSERT_EQ(listen(fd, 16), 0);
+
+    std::thread closer([&]() {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        while (!stop) {
+            if (poll(&pfd, 1, 100) > 0)
+                close(accept(fd, NULL, NULL));
+        }
+    });
+
+    EXPECT_NE(fetch(), TASK_STATE_SUCCESS);
+    stop = true;
+    closer.join();
+    close(fd);
+
+    /* ticket key 没变, 会话如果还在就能恢复 */
+    server = newServer();
+    ASSERT_EQ(startServer(server, port), port);
+    before = stats();
+    ASSERT_EQ(fetch(), TASK_STATE_SUCCESS);
+    after = stats();
+    EXPECT_EQ(after.clientHandshakes - before.clientHandshakes, 1);
+    EXPECT_EQ(after.clientResumed - before.clientResumed, 0);
+
+    server->stop();
+    delete server;
+}
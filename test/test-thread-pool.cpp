@@ -2,3 +2,243 @@
 // Created by dingjing on 8/12/22.
 //
 
+#include "../app/core/thread-pool.h"
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+#include <atomic>
+
+struct SpawnContext
+{
+    ThreadPool*             pool;
+    std::atomic<long>*      leaves;
+    std::atomic<long>*      inPool;
+    int                     depth;
+};
+
+static void count_routine(void* context)
+{
+    ++*(std::atomic<long>*) context;
+}
+
+/* 在池内线程里递归派生任务, 走本地队列 */
+static void spawn_routine(void* context)
+{
+    auto ctx = (SpawnContext*) context;
+
+    if (thread_pool_in_pool(ctx->pool))
+        ++*ctx->inPool;
+
+    if (ctx->depth == 0) {
+        ++*ctx->leaves;
+        delete ctx;
+        return;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        auto child = new SpawnContext(*ctx);
+        child->depth--;
+        ThreadPoolTask task = {spawn_routine, child};
+        EXPECT_EQ(thread_pool_schedule(&task, ctx->pool), 0);
+    }
+
+    delete ctx;
+}
+
+static void wait_for(std::atomic<long>& value, long expect)
+{
+    for (int i = 0; i < 10000 && value < expect; ++i)
+        usleep(1000);
+}
+
+TEST(THREAD_POOL, SHARED_QUEUE) {
+    std::atomic<long> count(0);
+    ThreadPool* pool = thread_pool_create(4, 0);
+    ASSERT_TRUE(pool);
+
+    for (int i = 0; i < 10000; ++i) {
+        ThreadPoolTask task = {count_routine, &count};
+        ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+    }
+
+    wait_for(count, 10000);
+    EXPECT_EQ(count, 10000);
+    thread_pool_destroy(nullptr, pool);
+};
+
+TEST(THREAD_POOL, WORK_STEALING) {
+    std::atomic<long> count(0);
+    ThreadPool* pool = thread_pool_create_ex(4, 0, THREAD_POOL_WORK_STEALING);
+    ASSERT_TRUE(pool);
+    EXPECT_FALSE(thread_pool_in_pool(pool));
+
+    for (int i = 0; i < 10000; ++i) {
+        ThreadPoolTask task = {count_routine, &count};
+        ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+    }
+
+    wait_for(count, 10000);
+    EXPECT_EQ(count, 10000);
+
+    // 2^14 个叶子, 本地队列需要扩容
+    std::atomic<long> leaves(0);
+    std::atomic<long> inPool(0);
+    ThreadPoolTask task = {spawn_routine, new SpawnContext{pool, &leaves, &inPool, 14}};
+    ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+
+    wait_for(leaves, 1 << 14);
+    EXPECT_EQ(leaves, 1 << 14);
+    EXPECT_EQ(inPool, (2 << 14) - 1);
+
+    ASSERT_EQ(thread_pool_increase(pool), 0);
+    for (int i = 0; i < 1000; ++i) {
+        ThreadPoolTask t = {count_routine, &count};
+        ASSERT_EQ(thread_pool_schedule(&t, pool), 0);
+    }
+
+    wait_for(count, 11000);
+    EXPECT_EQ(count, 11000);
+    thread_pool_destroy(nullptr, pool);
+};
+
+static std::atomic<long> gPending(0);
+
+static void block_routine(void* context)
+{
+    usleep(100 * 1000);
+}
+
+TEST(THREAD_POOL, DESTROY_PENDING) {
+    std::atomic<long> count(0);
+    ThreadPool* pool = thread_pool_create_ex(1, 0, THREAD_POOL_WORK_STEALING);
+    ASSERT_TRUE(pool);
+
+    ThreadPoolTask block = {block_routine, nullptr};
+    ASSERT_EQ(thread_pool_schedule(&block, pool), 0);
+    usleep(20 * 1000);
+
+    for (int i = 0; i < 100; ++i) {
+        ThreadPoolTask task = {count_routine, &count};
+        ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+    }
+
+    // 阻塞的任务结束后线程退出, 没执行的都交给 pending
+    thread_pool_destroy([](const ThreadPoolTask* task) { ++gPending; }, pool);
+    EXPECT_EQ(count + gPending, 100);
+};
+
+static void slow_routine(void* context)
+{
+    usleep(5 * 1000);
+    ++*(std::atomic<long>*) context;
+}
+
+TEST(THREAD_POOL, ELASTIC) {
+    std::atomic<long> count(0);
+    ThreadPoolStats stats;
+    ThreadPool* pool = thread_pool_create(1, 0);
+    ASSERT_TRUE(pool);
+
+    ThreadPoolElastic elastic = {1, 4, 1000, 200, {nullptr, nullptr}};
+    ASSERT_EQ(thread_pool_set_elastic(&elastic, pool), 0);
+
+    // 单线程处理不过来, 消息等待超过 1ms 后逐个加线程, 最多 4 个
+    for (int i = 0; i < 200; ++i) {
+        ThreadPoolTask task = {slow_routine, &count};
+        ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+    }
+
+    wait_for(count, 200);
+    EXPECT_EQ(count, 200);
+
+    thread_pool_get_stats(&stats, pool);
+    EXPECT_GE(stats.grows, 1);
+    EXPECT_GT(stats.peakThreads, 1);
+    EXPECT_LE(stats.peakThreads, 4);
+    EXPECT_EQ(stats.minThreads, 1);
+    EXPECT_EQ(stats.maxThreads, 4);
+
+    // 空闲 200ms 后多出来的线程退出, 只留 minThreads 个
+    for (int i = 0; i < 100; ++i) {
+        thread_pool_get_stats(&stats, pool);
+        if (stats.nThreads == 1)
+            break;
+        usleep(20 * 1000);
+    }
+
+    EXPECT_EQ(stats.nThreads, 1);
+    EXPECT_EQ(stats.shrinks, stats.peakThreads - 1);
+
+    // 收缩后仍然可以正常执行
+    for (int i = 0; i < 100; ++i) {
+        ThreadPoolTask task = {count_routine, &count};
+        ASSERT_EQ(thread_pool_schedule(&task, pool), 0);
+    }
+
+    wait_for(count, 300);
+    EXPECT_EQ(count, 300);
+    thread_pool_destroy(nullptr, pool);
+
+    ThreadPool* stealing = thread_pool_create_ex(1, 0, THREAD_POOL_WORK_STEALING);
+    ASSERT_TRUE(stealing);
+    EXPECT_EQ(thread_pool_set_elastic(&elastic, stealing), -1);
+    thread_pool_destroy(nullptr, stealing);
+};
+
+struct LoopContext
+{
+    MsgQueue*               queue;
+    ThreadPool*             pool;
+    std::atomic<long>*      count;
+};
+
+/* 常驻任务从另一个队列取消息, 和 Communicator 的 handler 线程一样 */
+static void loop_routine(void* context)
+{
+    auto ctx = (LoopContext*) context;
+    void* msg;
+
+    while ((msg = thread_pool_elastic_get(ctx->queue, ctx->pool)) != nullptr) {
+        usleep(5 * 1000);
+        ++*ctx->count;
+    }
+}
+
+TEST(THREAD_POOL, ELASTIC_TASK) {
+    std::atomic<long> count(0);
+    static long msgs[200];
+    ThreadPoolStats stats;
+    MsgQueue* queue = msg_queue_create(4096);
+    ThreadPool* pool = thread_pool_create(1, 0);
+    ASSERT_TRUE(queue);
+    ASSERT_TRUE(pool);
+
+    LoopContext ctx = {queue, pool, &count};
+    ThreadPoolElastic elastic = {1, 3, 1000, 200, {loop_routine, &ctx}};
+    ASSERT_EQ(thread_pool_set_elastic(&elastic, pool), 0);
+    ASSERT_EQ(thread_pool_schedule(&elastic.task, pool), 0);
+
+    for (auto& msg : msgs) {
+        msg_queue_put(&msg, queue);
+        thread_pool_elastic_check(queue, pool);
+    }
+
+    wait_for(count, 200);
+    EXPECT_EQ(count, 200);
+
+    thread_pool_get_stats(&stats, pool);
+    EXPECT_GE(stats.grows, 1);
+    EXPECT_LE(stats.peakThreads, 3);
+
+    for (int i = 0; i < 100; ++i) {
+        thread_pool_get_stats(&stats, pool);
+        if (stats.nThreads == 1)
+            break;
+        usleep(20 * 1000);
+    }
+
+    EXPECT_EQ(stats.nThreads, 1);
+    msg_queue_set_nonblock(queue);
+    thread_pool_destroy(nullptr, pool);
+    msg_queue_destroy(queue);
+};
@@ -0,0 +1,257 @@
+//
+// Created by dingjing on 8/11/22.
+//
+
+#include "../app/core/rb-tree.h"
+#include "../app/core/timer-wheel.h"
+#include <gtest/gtest.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <random>
+
+#define TEST_NODES              100000
+#define TEST_CHURN              1000000
+
+typedef struct _MyWheelNode     MyWheelNode;
+typedef struct _MyTreeNode      MyTreeNode;
+
+struct _MyWheelNode
+{
+    TimerWheelNode  node;
+    int             inWheel;
+};
+
+struct _MyTreeNode
+{
+    RBNode          rb;
+    unsigned long long expire;
+    int             inTree;
+};
+
+/* 与 c-poll 之前的超时树一样, 记录首尾节点, 追加到末尾时不用查找 */
+struct MyTree
+{
+    RBRoot          root;
+    RBNode*         first;
+    RBNode*         last;
+};
+
+static void tree_insert(MyTreeNode* node, MyTree* tree)
+{
+    RBNode** p = &tree->root.rbNode;
+    RBNode* parent = NULL;
+
+    if (!*p) {
+        tree->first = &node->rb;
+        tree->last = &node->rb;
+    } else if (node->expire >= RB_ENTRY(tree->last, MyTreeNode, rb)->expire) {
+        parent = tree->last;
+        p = &parent->rbRight;
+        tree->last = &node->rb;
+    } else {
+        do {
+            parent = *p;
+            if (node->expire < RB_ENTRY(*p, MyTreeNode, rb)->expire)
+                p = &(*p)->rbLeft;
+            else
+                p = &(*p)->rbRight;
+        } while (*p);
+
+        if (p == &tree->first->rbLeft)
+            tree->first = &node->rb;
+    }
+
+    node->inTree = 1;
+    rb_link_node(&node->rb, parent, p);
+    rb_insert_color(&node->rb, &tree->root);
+}
+
+static void tree_erase(MyTreeNode* node, MyTree* tree)
+{
+    if (&node->rb == tree->first)
+        tree->first = rb_next(&node->rb);
+
+    if (&node->rb == tree->last)
+        tree->last = rb_prev(&node->rb);
+
+    rb_erase(&node->rb, &tree->root);
+    node->inTree = 0;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+TEST(TIMER_WHEEL, EXPIRE_ORDER) {
+    std::mt19937_64 rnd(1);
+    std::vector<MyWheelNode> nodes(2000);
+    unsigned long long now = 1000;
+    unsigned long long last = 0;
+    size_t expired = 0;
+    TimerWheel wheel;
+
+    timer_wheel_init(now, &wheel);
+    for (auto& n : nodes) {
+        // 覆盖所有层, 以及超出 2^32 毫秒的
+        int level = rnd() % 6;
+        n.node.expire = now + rnd() % (level == 0 ? 256ULL : 1ULL << (8 + 6 * level));
+        timer_wheel_add(&n.node, &wheel);
+        n.inWheel = 1;
+    }
+
+    while (expired < nodes.size()) {
+        unsigned long long next;
+        ASSERT_TRUE(timer_wheel_next(&next, &wheel));
+
+        // next 不能晚于真实的最早到期时间
+        unsigned long long min = ~0ULL;
+        for (auto& n : nodes) {
+            if (n.inWheel && n.node.expire < min)
+                min = n.node.expire;
+        }
+        ASSERT_LE(next, min > now ? min : now + 1);
+
+        now = next + rnd() % 3;
+        LIST_HEAD(list);
+        timer_wheel_advance(now, &list, &wheel);
+        while (!list_empty(&list)) {
+            auto n = list_entry(list.next, MyWheelNode, node.list);
+            list_del(&n->node.list);
+            ASSERT_LE(n->node.expire, now);
+            ASSERT_GE(n->node.expire, last);
+            last = n->node.expire;
+            n->inWheel = 0;
+            expired++;
+        }
+
+        // 所有到期的都已经取出, 没有推迟
+        for (auto& n : nodes) {
+            ASSERT_TRUE(!n.inWheel || n.node.expire > now);
+        }
+    }
+
+    ASSERT_FALSE(timer_wheel_next(&last, &wheel));
+};
+
+TEST(TIMER_WHEEL, DEL_AND_SPLICE) {
+    std::vector<MyWheelNode> nodes(1000);
+    TimerWheel wheel;
+
+    timer_wheel_init(0, &wheel);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i].node.expire = i * 97;
+        timer_wheel_add(&nodes[i].node, &wheel);
+    }
+
+    for (size_t i = 0; i < nodes.size(); i += 2) {
+        timer_wheel_del(&nodes[i].node, &wheel);
+    }
+
+    LIST_HEAD(list);
+    timer_wheel_advance(nodes.size() * 97 / 2, &list, &wheel);
+
+    size_t n = 0;
+    struct list_head* pos;
+    list_for_each(pos, &list) {
+        auto node = list_entry(pos, MyWheelNode, node.list);
+        ASSERT_EQ((node - &nodes[0]) % 2, 1);
+        n++;
+    }
+    ASSERT_EQ(n, nodes.size() / 4);
+
+    LIST_HEAD(rest);
+    timer_wheel_splice(&rest, &wheel);
+    n = 0;
+    list_for_each(pos, &rest) {
+        n++;
+    }
+    ASSERT_EQ(n, nodes.size() / 4);
+    ASSERT_EQ(wheel.count, 0);
+};
+
+/**
+ * @brief
+ *  100k 个超时, 1M 次改期 (now + 1ms ~ 60s), 每 100 次时间前进 1ms 并取出到期的, 对比红黑树与时间轮
+ */
+TEST(TIMER_WHEEL, CHURN_BENCH) {
+    std::mt19937_64 rnd(2);
+    std::vector<unsigned> pick(TEST_CHURN);
+    std::vector<unsigned> delay(TEST_CHURN);
+    for (int i = 0; i < TEST_CHURN; ++i) {
+        pick[i] = rnd() % TEST_NODES;
+        delay[i] = 1 + rnd() % 60000;
+    }
+
+    // 红黑树
+    std::vector<MyTreeNode> treeNodes(TEST_NODES);
+    MyTree tree = {{NULL}, NULL, NULL};
+    unsigned long long now = 0;
+    long treeExpired = 0;
+
+    double begin = now_ns();
+    for (int i = 0; i < TEST_NODES; ++i) {
+        treeNodes[i].expire = now + delay[i];
+        tree_insert(&treeNodes[i], &tree);
+    }
+    for (int i = 0; i < TEST_CHURN; ++i) {
+        MyTreeNode* n = &treeNodes[pick[i]];
+        if (n->inTree)
+            tree_erase(n, &tree);
+        n->expire = now + delay[i];
+        tree_insert(n, &tree);
+
+        if (i % 100 == 99) {
+            now++;
+            while (tree.first && RB_ENTRY(tree.first, MyTreeNode, rb)->expire <= now) {
+                tree_erase(RB_ENTRY(tree.first, MyTreeNode, rb), &tree);
+                treeExpired++;
+            }
+        }
+    }
+    double treeNs = now_ns() - begin;
+
+    // 时间轮
+    std::vector<MyWheelNode> wheelNodes(TEST_NODES);
+    TimerWheel wheel;
+    long wheelExpired = 0;
+    now = 0;
+
+    begin = now_ns();
+    timer_wheel_init(now, &wheel);
+    for (int i = 0; i < TEST_NODES; ++i) {
+        wheelNodes[i].node.expire = now + delay[i];
+        timer_wheel_add(&wheelNodes[i].node, &wheel);
+        wheelNodes[i].inWheel = 1;
+    }
+    for (int i = 0; i < TEST_CHURN; ++i) {
+        MyWheelNode* n = &wheelNodes[pick[i]];
+        if (n->inWheel)
+            timer_wheel_del(&n->node, &wheel);
+        n->node.expire = now + delay[i];
+        timer_wheel_add(&n->node, &wheel);
+        n->inWheel = 1;
+
+        if (i % 100 == 99) {
+            LIST_HEAD(list);
+            timer_wheel_advance(++now, &list, &wheel);
+            while (!list_empty(&list)) {
+                auto e = list_entry(list.next, MyWheelNode, node.list);
+                list_del(&e->node.list);
+                e->inWheel = 0;
+                wheelExpired++;
+            }
+        }
+    }
+    double wheelNs = now_ns() - begin;
+
+    EXPECT_EQ(treeExpired, wheelExpired);
+    printf("%d timeouts, %d reschedules: rb-tree %.1f ns/op, timer wheel %.1f ns/op\n",
+           TEST_NODES, TEST_CHURN, treeNs / TEST_CHURN, wheelNs / TEST_CHURN);
+};
@@ -0,0 +1,220 @@
+//
+// Created by dingjing on 9/2/22.
+//
+
+#include "../app/factory/workflow.h"
+#include "../app/utils/uri-parser.h"
+#include "../app/nameservice/upstream-policy.h"
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* 每个地址一条路由, mRequestObject 就是 target */
+static std::string target_host(CommSchedObject *object)
+{
+    const struct sockaddr *addr;
+    socklen_t len;
+    char buf[INET_ADDRSTRLEN];
+
+    ((CommSchedTarget *)object)->getAddr(&addr, &len);
+    return inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, sizeof buf);
+}
+
+/* 路由是同步的: 返回选中地址的 host 和路由的 cookie, 没有可用地址时 host 为空 */
+static std::string route(UpstreamPolicy *policy, const std::string& url, void **cookie = nullptr)
+{
+    ParsedURI uri;
+    std::string host;
+
+    EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+    NSParams params = {
+            .mType          = TT_TCP,
+            .mUri           = uri,
+            .mInfo          = "",
+            .mFixedAddr     = true,
+            .mRetryTimes    = 0,
+            .mTracing       = nullptr,
+    };
+
+    RouterTask *task = policy->createRouterTask(&params, [&](RouterTask *task) {
+        if (task->getState() == TASK_STATE_SUCCESS) {
+            host = target_host(task->get_result()->mRequestObject);
+            if (cookie)
+                *cookie = task->get_result()->mCookie;
+        }
+    }, nullptr);
+
+    Workflow::startSeriesWork(task, nullptr);
+    return host;
+}
+
+static void add(UpstreamPolicy *policy, const char *address, unsigned short weight, bool backup = false)
+{
+    UpstreamServerParams params = UPSTREAM_SERVER_PARAMS_DEFAULT;
+
+    params.weight = weight;
+    params.backup = backup;
+    ASSERT_EQ(policy->addServer(address, &params), 0);
+}
+
+TEST(UPSTREAM_POLICY, WEIGHTED_ROUND_ROBIN)
+{
+    UpstreamPolicy policy(UPSTREAM_WEIGHTED_ROUND_ROBIN);
+    std::map<std::string, int> counts;
+    std::string last;
+    int repeat = 0;
+
+    add(&policy, "127.0.1.1:8001", 1);
+    add(&policy, "127.0.1.2:8001", 2);
+    add(&policy, "127.0.1.3:8001", 3);
+
+    for (int i = 0; i < 600; i++) {
+        std::string host = route(&policy, "http://wrr/");
+
+        /* 平滑: 权重最大的也不会连着选中两次以上 */
+        repeat = host == last ? repeat + 1 : 0;
+        EXPECT_LT(repeat, 2);
+        last = host;
+        counts[host]++;
+    }
+
+    EXPECT_EQ(counts.size(), 3);
+    EXPECT_EQ(counts["127.0.1.1"], 100);
+    EXPECT_EQ(counts["127.0.1.2"], 200);
+    EXPECT_EQ(counts["127.0.1.3"], 300);
+}
+
+TEST(UPSTREAM_POLICY, WEIGHTED_RANDOM)
+{
+    UpstreamPolicy policy(UPSTREAM_WEIGHTED_RANDOM);
+    std::map<std::string, int> counts;
+
+    add(&policy, "127.0.2.1:8001", 1);
+    add(&policy, "127.0.2.2:8001", 3);
+
+    for (int i = 0; i < 4000; i++)
+        counts[route(&policy, "http://random/")]++;
+
+    EXPECT_EQ(counts.size(), 2);
+    EXPECT_NEAR(counts["127.0.2.1"], 1000, 150);
+    EXPECT_NEAR(counts["127.0.2.2"], 3000, 150);
+}
+
+TEST(UPSTREAM_POLICY, CONSISTENT_HASH)
+{
+    UpstreamPolicy policy(UPSTREAM_CONSISTENT_HASH);
+    std::map<std::string, int> counts;
+    std::vector<std::string> before(3000);
+
+    add(&policy, "127.0.3.1:8001", 1);
+    add(&policy, "127.0.3.2:8001", 1);
+    add(&policy, "127.0.3.3:8001", 1);
+
+    for (size_t i = 0; i < before.size(); i++) {
+        std::string url = "http://hash/item?id=" + std::to_string(i);
+
+        before[i] = route(&policy, url);
+        EXPECT_EQ(route(&policy, url), before[i]);
+        counts[before[i]]++;
+    }
+
+    EXPECT_EQ(counts.size(), 3);
+    for (auto& kv : counts)
+        EXPECT_NEAR(kv.second, 1000, 250) << kv.first;
+
+    /* 去掉一个地址, 只有原来落在它上面的 key 换地址 */
+    ASSERT_EQ(policy.removeServer("127.0.3.2:8001"), 0);
+    for (size_t i = 0; i < before.size(); i++) {
+        std::string host = route(&policy, "http://hash/item?id=" + std::to_string(i));
+
+        EXPECT_NE(host, "127.0.3.2");
+        if (before[i] != "127.0.3.2")
+            EXPECT_EQ(host, before[i]);
+    }
+}
+
+TEST(UPSTREAM_POLICY, BACKUP)
+{
+    UpstreamPolicy policy(UPSTREAM_WEIGHTED_ROUND_ROBIN);
+
+    add(&policy, "127.0.4.1:8001", 1);
+    add(&policy, "127.0.4.2:8001", 1, true);
+
+    for (int i = 0; i < 10; i++)
+        EXPECT_EQ(route(&policy, "http://backup/"), "127.0.4.1");
+
+    ASSERT_EQ(policy.removeServer("127.0.4.1:8001"), 0);
+    EXPECT_EQ(route(&policy, "http://backup/"), "127.0.4.2");
+
+    ASSERT_EQ(policy.removeServer("127.0.4.2:8001"), 0);
+    EXPECT_EQ(route(&policy, "http://backup/"), "");
+}
+
+/* 参数变了的地址要重新创建, 请求走新参数的路由. h2c 和 HTTP/1.1 是不同的路由 */
+TEST(UPSTREAM_POLICY, SET_SERVERS_PARAMS)
+{
+    UpstreamPolicy policy(UPSTREAM_WEIGHTED_ROUND_ROBIN);
+    UpstreamServerParams params = UPSTREAM_SERVER_PARAMS_DEFAULT;
+    void *first = nullptr;
+    void *cookie = nullptr;
+
+    ASSERT_EQ(policy.setServers({{"127.0.5.1:8001", params}}), 0);
+    EXPECT_EQ(route(&policy, "http://params/", &first), "127.0.5.1");
+
+    ASSERT_EQ(policy.setServers({{"127.0.5.1:8001", params}}), 0);
+    route(&policy, "http://params/", &cookie);
+    EXPECT_EQ(cookie, first);
+
+    params.endpointParams.http2PriorKnowledge = true;
+    ASSERT_EQ(policy.setServers({{"127.0.5.1:8001", params}}), 0);
+    route(&policy, "http://params/", &cookie);
+    EXPECT_NE(cookie, first);
+}
+
+/* 读者一直在选, 写者不停地换快照, 读者只会看到某一个完整的快照 */
+TEST(UPSTREAM_POLICY, SWAP_SNAPSHOT)
+{
+    UpstreamPolicy policy(UPSTREAM_WEIGHTED_ROUND_ROBIN);
+    UpstreamServerParams params = UPSTREAM_SERVER_PARAMS_DEFAULT;
+    std::map<std::string, UpstreamServerParams> a = {{"127.0.6.1:8001", params}, {"127.0.6.2:8001", params}};
+    std::map<std::string, UpstreamServerParams> b = {{"127.0.6.3:8001", params}, {"127.0.6.4:8001", params}};
+    std::atomic<bool> stop(false);
+    std::atomic<long> routed(0);
+    std::atomic<long> bad(0);
+    std::vector<std::thread> readers;
+
+    ASSERT_EQ(policy.setServers(a), 0);
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&]() {
+            while (!stop) {
+                std::string host = route(&policy, "http://swap/");
+
+                if (host.compare(0, 8, "127.0.6.") != 0)
+                    bad++;
+
+                routed++;
+            }
+        });
+    }
+
+    for (int i = 0; i < 200 || routed < 10000; i++) {
+        EXPECT_EQ(policy.setServers(i % 2 ? a : b), 0);
+        EXPECT_EQ(policy.removeServer(i % 2 ? "127.0.6.2:8001" : "127.0.6.4:8001"), 0);
+        add(&policy, i % 2 ? "127.0.6.2:8001" : "127.0.6.4:8001", 1);
+    }
+
+    stop = true;
+    for (auto& reader : readers)
+        reader.join();
+
+    EXPECT_GT(routed, 0);
+    EXPECT_EQ(bad, 0);
+}